@@ -0,0 +1,178 @@
+/* SPDX-License-Identifier: MIT */
+/**
+ * @file v4l2-aligner.c
+ *
+ * Timestamp based grouping of frames from several streams (see v4l2-aligner.h).
+ */
+
+/*===========================================================================*\
+ * system header files
+\*===========================================================================*/
+#include <stdio.h>
+#include <string.h>
+
+/*===========================================================================*\
+ * project header files
+\*===========================================================================*/
+#include "v4l2-aligner.h"
+
+/*===========================================================================*\
+ * preprocessor #define constants and macros
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * local type definitions
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * global object definitions
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * local function declarations
+\*===========================================================================*/
+static void v4l2_aligner_emit_head(struct v4l2_aligner* aligner, unsigned stream);
+static void v4l2_aligner_match(struct v4l2_aligner* aligner);
+
+/*===========================================================================*\
+ * local object definitions
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * inline function definitions
+\*===========================================================================*/
+static inline struct v4l2_aligner_entry* v4l2_aligner_head(struct v4l2_aligner* aligner, unsigned stream)
+{
+    return &aligner->streams[stream].entries[aligner->streams[stream].head];
+}
+
+/*===========================================================================*\
+ * public function definitions
+\*===========================================================================*/
+int v4l2_aligner_init(struct v4l2_aligner* aligner, unsigned nstreams, uint64_t tolerance,
+    unsigned depth, v4l2_aligner_emit_t emit, void* arg)
+{
+    int status;
+
+    if (nstreams == 0 || nstreams > V4L2_ALIGNER_MAX_STREAMS) {
+        fprintf(stderr, "at most %d streams can be aligned\n", V4L2_ALIGNER_MAX_STREAMS);
+        return -1;
+    }
+
+    memset(aligner, 0, sizeof(*aligner));
+    aligner->nstreams = nstreams;
+    aligner->tolerance = tolerance;
+    aligner->emit = emit;
+    aligner->arg = arg;
+
+    if (depth == 0)
+        depth = 1;
+    if (depth > V4L2_ALIGNER_MAX_PENDING)
+        depth = V4L2_ALIGNER_MAX_PENDING;
+    aligner->depth = depth;
+
+    status = pthread_mutex_init(&aligner->lock, NULL);
+    if (status) {
+        fprintf(stderr, "pthread_mutex_init() failed: %s\n", strerror(status));
+        return -1;
+    }
+
+    return 0;
+}
+
+void v4l2_aligner_destroy(struct v4l2_aligner* aligner)
+{
+    pthread_mutex_destroy(&aligner->lock);
+}
+
+void v4l2_aligner_push(struct v4l2_aligner* aligner, unsigned stream, unsigned index, uint64_t timestamp)
+{
+    struct v4l2_aligner_entry* entry;
+    unsigned tail;
+
+    if (stream >= aligner->nstreams)
+        return;
+
+    pthread_mutex_lock(&aligner->lock);
+
+    /* make room first, the oldest frame of the stream gives up on being matched */
+    if (aligner->streams[stream].count == aligner->depth)
+        v4l2_aligner_emit_head(aligner, stream);
+
+    tail = (aligner->streams[stream].head + aligner->streams[stream].count) % V4L2_ALIGNER_MAX_PENDING;
+    entry = &aligner->streams[stream].entries[tail];
+    entry->stream = stream;
+    entry->index = index;
+    entry->timestamp = timestamp;
+    aligner->streams[stream].count++;
+
+    v4l2_aligner_match(aligner);
+
+    pthread_mutex_unlock(&aligner->lock);
+}
+
+void v4l2_aligner_flush(struct v4l2_aligner* aligner)
+{
+    unsigned stream;
+
+    pthread_mutex_lock(&aligner->lock);
+
+    for (stream = 0; stream < aligner->nstreams; ++stream)
+        while (aligner->streams[stream].count > 0)
+            v4l2_aligner_emit_head(aligner, stream);
+
+    pthread_mutex_unlock(&aligner->lock);
+}
+
+/*===========================================================================*\
+ * local function definitions
+\*===========================================================================*/
+static void v4l2_aligner_emit_head(struct v4l2_aligner* aligner, unsigned stream)
+{
+    struct v4l2_aligner_entry entry = *v4l2_aligner_head(aligner, stream);
+
+    aligner->streams[stream].head = (aligner->streams[stream].head + 1) % V4L2_ALIGNER_MAX_PENDING;
+    aligner->streams[stream].count--;
+
+    aligner->emit(aligner->arg, &entry, 1);
+}
+
+static void v4l2_aligner_match(struct v4l2_aligner* aligner)
+{
+    struct v4l2_aligner_entry group[V4L2_ALIGNER_MAX_STREAMS];
+    uint64_t newest;
+    unsigned stream;
+    unsigned stale;
+
+    for (;;) {
+        newest = 0;
+        for (stream = 0; stream < aligner->nstreams; ++stream) {
+            if (aligner->streams[stream].count == 0)
+                return; /* nothing can be decided until every stream has a frame */
+            if (newest < v4l2_aligner_head(aligner, stream)->timestamp)
+                newest = v4l2_aligner_head(aligner, stream)->timestamp;
+        }
+
+        /*
+         * Frames of the stream holding the newest head are not older than it,
+         * so heads outside of the tolerance window can never be matched.
+         */
+        stale = 0;
+        for (stream = 0; stream < aligner->nstreams; ++stream)
+            if (v4l2_aligner_head(aligner, stream)->timestamp + aligner->tolerance < newest) {
+                v4l2_aligner_emit_head(aligner, stream);
+                stale++;
+            }
+
+        if (stale)
+            continue;
+
+        for (stream = 0; stream < aligner->nstreams; ++stream) {
+            group[stream] = *v4l2_aligner_head(aligner, stream);
+            aligner->streams[stream].head = (aligner->streams[stream].head + 1) % V4L2_ALIGNER_MAX_PENDING;
+            aligner->streams[stream].count--;
+        }
+
+        aligner->emit(aligner->arg, group, aligner->nstreams);
+    }
+}
@@ -0,0 +1,89 @@
+/* SPDX-License-Identifier: MIT */
+/**
+ * @file v4l2-aligner.h
+ *
+ * Groups frames coming from several streams (cameras) by their timestamps.
+ * Every stream has a queue of pending frames. As soon as each stream has
+ * at least one pending frame, the oldest frames of all streams are checked:
+ * if they all lie within the tolerance of the newest one, they are emitted
+ * together as a group. Otherwise the frames which are too old to ever match
+ * (i.e. older than the newest head by more than the tolerance) are emitted
+ * alone and the check is repeated. A stream never holds more than 'depth'
+ * pending frames, the oldest one is emitted alone when the limit is exceeded,
+ * so a stalled stream cannot starve the others of buffers.
+ *
+ * All timestamps are expected to come from the same clock.
+ */
+
+#ifndef _V4L2_ALIGNER_H_
+#define _V4L2_ALIGNER_H_
+
+/*===========================================================================*\
+ * system header files
+\*===========================================================================*/
+#include <stdint.h>
+#include <pthread.h>
+
+#include <linux/videodev2.h>
+
+/*===========================================================================*\
+ * project header files
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * preprocessor #define constants and macros
+\*===========================================================================*/
+#define V4L2_ALIGNER_MAX_STREAMS 8
+#define V4L2_ALIGNER_MAX_PENDING VIDEO_MAX_FRAME
+
+/*===========================================================================*\
+ * global type definitions
+\*===========================================================================*/
+struct v4l2_aligner_entry
+{
+    unsigned stream;
+    unsigned index;       /* buffer index, opaque to the aligner */
+    uint64_t timestamp;   /* nanoseconds */
+};
+
+/**
+ * Called with count == number of streams for a group (ordered by stream)
+ * and with count == 1 for a frame which could not be matched.
+ * It is called with the aligner lock held and must not call back into the aligner.
+ */
+typedef void (*v4l2_aligner_emit_t)(void* arg, const struct v4l2_aligner_entry* entries, unsigned count);
+
+struct v4l2_aligner
+{
+    pthread_mutex_t lock;
+    unsigned nstreams;
+    unsigned depth;
+    uint64_t tolerance;   /* nanoseconds */
+    v4l2_aligner_emit_t emit;
+    void* arg;
+
+    struct {
+        struct v4l2_aligner_entry entries[V4L2_ALIGNER_MAX_PENDING];
+        unsigned head;
+        unsigned count;
+    } streams[V4L2_ALIGNER_MAX_STREAMS];
+};
+
+/*===========================================================================*\
+ * global object declarations
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * function forward declarations
+\*===========================================================================*/
+int v4l2_aligner_init(struct v4l2_aligner* aligner, unsigned nstreams, uint64_t tolerance,
+    unsigned depth, v4l2_aligner_emit_t emit, void* arg);
+void v4l2_aligner_destroy(struct v4l2_aligner* aligner);
+
+/** Adds a frame of given stream; may emit any number of groups and single frames */
+void v4l2_aligner_push(struct v4l2_aligner* aligner, unsigned stream, unsigned index, uint64_t timestamp);
+
+/** Emits all pending frames alone */
+void v4l2_aligner_flush(struct v4l2_aligner* aligner);
+
+#endif /* _V4L2_ALIGNER_H_ */
@@ -0,0 +1,277 @@
+/* SPDX-License-Identifier: MIT */
+/**
+ * @file v4l2-caps-cache.c
+ *
+ * On-disk cache of device enumeration results (see v4l2-caps-cache.h).
+ */
+
+/*===========================================================================*\
+ * system header files
+\*===========================================================================*/
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+/*===========================================================================*\
+ * project header files
+\*===========================================================================*/
+#include "v4l2-caps-cache.h"
+
+/*===========================================================================*\
+ * preprocessor #define constants and macros
+\*===========================================================================*/
+#define CAPS_CACHE_MAGIC "V4L2CAPS"
+#define CAPS_CACHE_MAX_RECORDS 65536 /* sanity limit for loaded files */
+
+/*===========================================================================*\
+ * local type definitions
+\*===========================================================================*/
+struct v4l2_caps_cache_header
+{
+    char magic[8];
+    uint32_t layout;
+    uint32_t record_size;
+    uint32_t count;
+    uint32_t reserved;
+    struct v4l2_capability caps;
+};
+
+/*===========================================================================*\
+ * global object definitions
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * local function declarations
+\*===========================================================================*/
+static uint64_t v4l2_caps_cache_key(const struct v4l2_capability* caps);
+static int v4l2_caps_cache_same_device(const struct v4l2_capability* a, const struct v4l2_capability* b);
+
+/*===========================================================================*\
+ * local object definitions
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * inline function definitions
+\*===========================================================================*/
+static inline uint64_t v4l2_caps_cache_fnv1a(uint64_t hash, const void* data, size_t size)
+{
+    const uint8_t* p = data;
+
+    while (size--) {
+        hash ^= *p++;
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+/*===========================================================================*\
+ * public function definitions
+\*===========================================================================*/
+int v4l2_caps_cache_init(struct v4l2_caps_cache* cache, const char* directory, const struct v4l2_capability* caps)
+{
+    int n;
+
+    memset(cache, 0, sizeof(*cache));
+    cache->caps = *caps;
+
+    if (directory == NULL)
+        return 0;
+
+    n = snprintf(cache->filename, sizeof(cache->filename), "%s/v4l2-video-capture-%016llx.caps",
+        directory, (unsigned long long)v4l2_caps_cache_key(caps));
+    if (n < 0 || (size_t)n >= sizeof(cache->filename)) {
+        fprintf(stderr, "capability cache directory name is too long\n");
+        cache->filename[0] = '\0';
+        return -1;
+    }
+
+    if (-1 == mkdir(directory, 0775) && errno != EEXIST) {
+        fprintf(stderr, "cannot create '%s': %s\n", directory, strerror(errno));
+        cache->filename[0] = '\0';
+        return -1;
+    }
+
+    return 0;
+}
+
+void v4l2_caps_cache_destroy(struct v4l2_caps_cache* cache)
+{
+    free(cache->records);
+    cache->records = NULL;
+    cache->count = 0;
+    cache->capacity = 0;
+}
+
+int v4l2_caps_cache_append(struct v4l2_caps_cache* cache, enum v4l2_caps_record_type type,
+    const void* data, size_t size)
+{
+    struct v4l2_caps_record* record;
+
+    if (size > sizeof(record->u))
+        return -1;
+
+    if (cache->count == cache->capacity) {
+        unsigned capacity = cache->capacity ? 2 * cache->capacity : 64;
+
+        record = realloc(cache->records, capacity * sizeof(*record));
+        if (NULL == record) {
+            fprintf(stderr, "realloc(%zu) failed\n", capacity * sizeof(*record));
+            return -1;
+        }
+
+        cache->records = record;
+        cache->capacity = capacity;
+    }
+
+    record = &cache->records[cache->count++];
+    memset(record, 0, sizeof(*record));
+    record->type = type;
+    memcpy(&record->u, data, size);
+
+    return 0;
+}
+
+int v4l2_caps_cache_load(struct v4l2_caps_cache* cache)
+{
+    struct v4l2_caps_cache_header header;
+    struct v4l2_caps_record* records;
+    FILE* file;
+
+    if (cache->filename[0] == '\0')
+        return -1;
+
+    file = fopen(cache->filename, "r");
+    if (NULL == file) {
+        if (errno != ENOENT)
+            fprintf(stderr, "cannot open '%s': %s\n", cache->filename, strerror(errno));
+        return -1;
+    }
+
+    /* anything unexpected is just a miss, the file gets rewritten after enumeration */
+    if (1 != fread(&header, sizeof(header), 1, file) ||
+        memcmp(header.magic, CAPS_CACHE_MAGIC, sizeof(header.magic)) ||
+        header.layout != V4L2_CAPS_CACHE_LAYOUT ||
+        header.record_size != sizeof(struct v4l2_caps_record) ||
+        header.count > CAPS_CACHE_MAX_RECORDS ||
+        !v4l2_caps_cache_same_device(&header.caps, &cache->caps)) {
+        fclose(file);
+        return -1;
+    }
+
+    records = calloc(header.count ? header.count : 1, sizeof(*records));
+    if (NULL == records) {
+        fprintf(stderr, "calloc(%u, %zu) failed\n", header.count, sizeof(*records));
+        fclose(file);
+        return -1;
+    }
+
+    if (header.count != fread(records, sizeof(*records), header.count, file)) {
+        free(records);
+        fclose(file);
+        return -1;
+    }
+
+    fclose(file);
+
+    free(cache->records);
+    cache->records = records;
+    cache->count = header.count;
+    cache->capacity = header.count;
+
+    return 0;
+}
+
+int v4l2_caps_cache_store(const struct v4l2_caps_cache* cache)
+{
+    struct v4l2_caps_cache_header header;
+    char tmpname[PATH_MAX + 16];
+    FILE* file;
+    int status;
+
+    if (cache->filename[0] == '\0')
+        return -1;
+
+    snprintf(tmpname, sizeof(tmpname), "%s.%d", cache->filename, (int)getpid());
+
+    file = fopen(tmpname, "w");
+    if (NULL == file) {
+        fprintf(stderr, "cannot open '%s': %s\n", tmpname, strerror(errno));
+        return -1;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CAPS_CACHE_MAGIC, sizeof(header.magic));
+    header.layout = V4L2_CAPS_CACHE_LAYOUT;
+    header.record_size = sizeof(struct v4l2_caps_record);
+    header.count = cache->count;
+    header.caps = cache->caps;
+
+    status = 1 != fwrite(&header, sizeof(header), 1, file) ||
+        cache->count != fwrite(cache->records, sizeof(*cache->records), cache->count, file);
+    status |= fclose(file);
+
+    if (status) {
+        fprintf(stderr, "cannot write '%s': %s\n", tmpname, strerror(errno));
+        unlink(tmpname);
+        return -1;
+    }
+
+    if (-1 == rename(tmpname, cache->filename)) {
+        fprintf(stderr, "rename('%s', '%s') failed: %s\n", tmpname, cache->filename, strerror(errno));
+        unlink(tmpname);
+        return -1;
+    }
+
+    return 0;
+}
+
+const char* v4l2_caps_cache_default_directory(char* buf, size_t size)
+{
+    const char* dir;
+    int n;
+
+    dir = getenv("XDG_CACHE_HOME");
+    if (dir && dir[0])
+        n = snprintf(buf, size, "%s", dir);
+    else {
+        dir = getenv("HOME");
+        if (NULL == dir || dir[0] == '\0')
+            return NULL;
+        n = snprintf(buf, size, "%s/.cache", dir);
+    }
+
+    if (n < 0 || (size_t)n >= size)
+        return NULL;
+
+    return buf;
+}
+
+/*===========================================================================*\
+ * local function definitions
+\*===========================================================================*/
+static uint64_t v4l2_caps_cache_key(const struct v4l2_capability* caps)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    hash = v4l2_caps_cache_fnv1a(hash, caps->driver, strnlen((const char*)caps->driver, sizeof(caps->driver)));
+    hash = v4l2_caps_cache_fnv1a(hash, caps->card, strnlen((const char*)caps->card, sizeof(caps->card)));
+    hash = v4l2_caps_cache_fnv1a(hash, caps->bus_info, strnlen((const char*)caps->bus_info, sizeof(caps->bus_info)));
+    hash = v4l2_caps_cache_fnv1a(hash, &caps->version, sizeof(caps->version));
+
+    return hash;
+}
+
+static int v4l2_caps_cache_same_device(const struct v4l2_capability* a, const struct v4l2_capability* b)
+{
+    return strncmp((const char*)a->driver, (const char*)b->driver, sizeof(a->driver)) == 0 &&
+        strncmp((const char*)a->card, (const char*)b->card, sizeof(a->card)) == 0 &&
+        strncmp((const char*)a->bus_info, (const char*)b->bus_info, sizeof(a->bus_info)) == 0 &&
+        a->version == b->version;
+}
@@ -0,0 +1,92 @@
+/* SPDX-License-Identifier: MIT */
+/**
+ * @file v4l2-caps-cache.h
+ *
+ * On-disk cache of everything enumerated from a device at startup
+ * (formats, frame sizes, frame intervals, cropping capabilities and controls).
+ * Enumeration results are kept as a list of records holding the very structures
+ * filled by the VIDIOC_ENUM_* / VIDIOC_CROPCAP / VIDIOC_QUERY_EXT_CTRL ioctls,
+ * in the order they were returned. The list is stored in a file named after
+ * a hash of driver, card, bus_info and version reported by VIDIOC_QUERYCAP,
+ * and all four of them are verified again when the file is loaded, so a driver
+ * update or moving the device to another port simply misses the cache.
+ */
+
+#ifndef _V4L2_CAPS_CACHE_H_
+#define _V4L2_CAPS_CACHE_H_
+
+/*===========================================================================*\
+ * system header files
+\*===========================================================================*/
+#include <stdint.h>
+#include <limits.h>
+
+#include <linux/videodev2.h>
+
+/*===========================================================================*\
+ * project header files
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * preprocessor #define constants and macros
+\*===========================================================================*/
+#define V4L2_CAPS_CACHE_LAYOUT 1 /* bump whenever the file layout changes */
+
+/*===========================================================================*\
+ * global type definitions
+\*===========================================================================*/
+enum v4l2_caps_record_type
+{
+    V4L2_CAPS_RECORD_FMTDESC = 1,
+    V4L2_CAPS_RECORD_FRMSIZE,
+    V4L2_CAPS_RECORD_FRMIVAL,
+    V4L2_CAPS_RECORD_CROPCAP,
+    V4L2_CAPS_RECORD_CONTROL,
+};
+
+struct v4l2_caps_record
+{
+    uint32_t type; /* enum v4l2_caps_record_type */
+    union {
+        struct v4l2_fmtdesc fmtdesc;
+        struct v4l2_frmsizeenum frmsize;
+        struct v4l2_frmivalenum frmival;
+        struct v4l2_cropcap cropcap;
+        struct v4l2_query_ext_ctrl control;
+    } u;
+};
+
+struct v4l2_caps_cache
+{
+    char filename[PATH_MAX];    /* empty if there is no cache directory */
+    struct v4l2_capability caps;
+    struct v4l2_caps_record* records;
+    unsigned count;
+    unsigned capacity;
+};
+
+/*===========================================================================*\
+ * global object declarations
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * function forward declarations
+\*===========================================================================*/
+
+/** Prepares an empty cache of a device; directory may be NULL if the cache is used in memory only */
+int v4l2_caps_cache_init(struct v4l2_caps_cache* cache, const char* directory, const struct v4l2_capability* caps);
+void v4l2_caps_cache_destroy(struct v4l2_caps_cache* cache);
+
+int v4l2_caps_cache_append(struct v4l2_caps_cache* cache, enum v4l2_caps_record_type type,
+    const void* data, size_t size);
+
+/** Returns 0 on a cache hit, -1 if there is no valid cache file for the device */
+int v4l2_caps_cache_load(struct v4l2_caps_cache* cache);
+
+/** Replaces the cache file atomically, so concurrently starting processes never see a partial one */
+int v4l2_caps_cache_store(const struct v4l2_caps_cache* cache);
+
+/** $XDG_CACHE_HOME or $HOME/.cache, NULL if neither is set */
+const char* v4l2_caps_cache_default_directory(char* buf, size_t size);
+
+#endif /* _V4L2_CAPS_CACHE_H_ */
@@ -0,0 +1,1097 @@
+/* SPDX-License-Identifier: MIT */
+/**
+ * @file v4l2-capture.c
+ *
+ * Capture from one device with borrowed frames (see v4l2-capture.h).
+ */
+
+/*===========================================================================*\
+ * system header files
+\*===========================================================================*/
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+/*===========================================================================*\
+ * project header files
+\*===========================================================================*/
+#include "v4l2-capture.h"
+#include "v4l2-hugepage.h"
+#include "v4l2-sched.h"
+
+/*===========================================================================*\
+ * preprocessor #define constants and macros
+\*===========================================================================*/
+#define ALIGN(x, a) __ALIGN(x, (a) - 1)
+#define __ALIGN(x, mask) (((x) + (mask)) & ~(mask))
+
+/* Linux 6.10, in case the headers are older */
+#ifndef V4L2_BUF_CAP_SUPPORTS_REMOVE_BUFS
+#define V4L2_BUF_CAP_SUPPORTS_REMOVE_BUFS (1 << 7)
+
+struct v4l2_remove_buffers
+{
+    __u32 index;
+    __u32 count;
+    __u32 type;
+    __u32 reserved[13];
+};
+
+#define VIDIOC_REMOVE_BUFS _IOWR('V', 104, struct v4l2_remove_buffers)
+#endif
+
+/*===========================================================================*\
+ * local type definitions
+\*===========================================================================*/
+struct v4l2_capture_buffer
+{
+    unsigned nplanes;
+    struct v4l2_capture_plane planes[VIDEO_MAX_PLANES]; /* bytesused is not used */
+    bool borrowed;                    /* under lock */
+    bool parked;                      /* under lock */
+    bool removed;                     /* parked by VIDIOC_REMOVE_BUFS, memory freed, under lock */
+    struct v4l2_buffer qbuf;          /* argument of VIDIOC_QBUF, built once */
+    struct v4l2_plane qbuf_planes[VIDEO_MAX_PLANES];
+};
+
+struct v4l2_capture
+{
+    char filename[PATH_MAX];
+    int fd;
+    enum v4l2_buf_type buf_type;
+    enum v4l2_memory memory;
+    struct v4l2_format format;
+    bool export_buffers;
+    bool hugepages;
+    bool bind_memory;
+    bool bind_reported;               /* failure to bind is reported once */
+    int numa_node;
+    struct v4l2_hugepage_stats* hugepage_stats;
+    bool dmabuf_open;
+    struct v4l2_dmabuf_allocator dmabuf; /* used only with V4L2_MEMORY_DMABUF */
+    v4l2_capture_prepare_t prepare;
+    v4l2_capture_hook_t queued;
+    v4l2_capture_hook_t dequeued;
+    void* arg;
+    unsigned number_of_buffers;       /* including the ones added by v4l2_capture_grow() */
+    unsigned initial_buffers;         /* allocated by VIDIOC_REQBUFS */
+    size_t buffer_size;               /* bytes of all planes of one buffer */
+    uint64_t buffer_budget;
+    bool remove_bufs;                 /* driver supports VIDIOC_REMOVE_BUFS, parked buffers can be freed */
+    struct v4l2_capture_buffer buffers[VIDEO_MAX_FRAME];
+    unsigned parked[VIDEO_MAX_FRAME]; /* under lock */
+    unsigned number_of_parked;        /* under lock */
+    unsigned number_of_removed;       /* under lock */
+    struct v4l2_buffer dqbuf;         /* argument of VIDIOC_DQBUF, built once, used by the borrowing thread */
+    struct v4l2_plane dqbuf_planes[VIDEO_MAX_PLANES];
+    pthread_mutex_t lock;             /* frames are returned by any thread */
+    bool streaming;                   /* under lock */
+    unsigned borrowed;                /* under lock */
+};
+
+/*===========================================================================*\
+ * global object definitions
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * local function declarations
+\*===========================================================================*/
+static int v4l2_capture_set_format(struct v4l2_capture* capture, const struct v4l2_capture_config* config);
+static int v4l2_capture_plane_sizes(const struct v4l2_capture* capture, size_t* sizes);
+static int v4l2_capture_alloc_buffers(struct v4l2_capture* capture, unsigned first, unsigned count);
+static int v4l2_capture_map_buffers(struct v4l2_capture* capture, unsigned first, unsigned count);
+static int v4l2_capture_alloc_userptr(struct v4l2_capture* capture, unsigned first, unsigned count);
+static int v4l2_capture_alloc_dmabuf(struct v4l2_capture* capture, unsigned first, unsigned count);
+static void v4l2_capture_bind(struct v4l2_capture* capture, void* addr, size_t size);
+static void v4l2_capture_free_buffer(struct v4l2_capture* capture, unsigned index);
+static void v4l2_capture_free_buffers(struct v4l2_capture* capture);
+static int v4l2_capture_create_buffer(struct v4l2_capture* capture);
+static void v4l2_capture_remove_buffer(struct v4l2_capture* capture, unsigned index);
+static void v4l2_capture_build_template(struct v4l2_capture* capture, unsigned index);
+static void v4l2_capture_build_dqbuf(struct v4l2_capture* capture);
+static int v4l2_capture_queue(struct v4l2_capture* capture, unsigned index);
+
+/*===========================================================================*\
+ * local object definitions
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * inline function definitions
+\*===========================================================================*/
+static inline size_t v4l2_capture_page_size(void)
+{
+    long pagesize = sysconf(_SC_PAGESIZE);
+
+    return pagesize > 0 ? (size_t)pagesize : 0x1000;
+}
+
+/*===========================================================================*\
+ * public function definitions
+\*===========================================================================*/
+struct v4l2_capture* v4l2_capture_open(const struct v4l2_capture_config* config)
+{
+    int fd;
+
+    fd = open(config->filename, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (fd == -1) {
+        fprintf(stderr, "cannot open '%s': %s\n", config->filename, strerror(errno));
+        return NULL;
+    }
+
+    return v4l2_capture_attach(fd, config);
+}
+
+struct v4l2_capture* v4l2_capture_attach(int fd, const struct v4l2_capture_config* config)
+{
+    struct v4l2_capture* capture;
+    struct v4l2_capability caps;
+    struct v4l2_requestbuffers requestbuffers;
+    uint32_t capabilities;
+    unsigned i;
+
+    capture = calloc(1, sizeof(*capture));
+    if (NULL == capture) {
+        fprintf(stderr, "calloc(1, %zu) failed\n", sizeof(*capture));
+        close(fd);
+        return NULL;
+    }
+
+    snprintf(capture->filename, sizeof(capture->filename), "%s", config->filename);
+    capture->fd = fd;
+    capture->memory = config->memory ? config->memory : V4L2_MEMORY_MMAP;
+    capture->export_buffers = config->export_buffers;
+    capture->hugepages = config->hugepages && capture->memory != V4L2_MEMORY_MMAP;
+    capture->bind_memory = config->bind_memory;
+    capture->numa_node = config->numa_node;
+    capture->hugepage_stats = config->hugepage_stats;
+    capture->prepare = capture->memory == V4L2_MEMORY_USERPTR ? config->prepare : NULL;
+    capture->queued = config->queued;
+    capture->dequeued = config->dequeued;
+    capture->arg = config->arg;
+    capture->buffer_budget = config->buffer_budget;
+    pthread_mutex_init(&capture->lock, NULL);
+
+    memset(&caps, 0, sizeof(caps));
+    if (-1 == ioctl(capture->fd, VIDIOC_QUERYCAP, &caps)) {
+        fprintf(stderr, "VIDIOC_QUERYCAP failed: %s\n", strerror(errno));
+        v4l2_capture_close(capture);
+        return NULL;
+    }
+
+    capabilities = caps.capabilities & V4L2_CAP_DEVICE_CAPS ? caps.device_caps : caps.capabilities;
+    if (!(capabilities & V4L2_CAP_STREAMING) ||
+        !(capabilities & (V4L2_CAP_VIDEO_CAPTURE | V4L2_CAP_VIDEO_CAPTURE_MPLANE))) {
+        fprintf(stderr, "%s is not a streaming capture device\n", config->filename);
+        v4l2_capture_close(capture);
+        return NULL;
+    }
+
+    /* multiplanar api is preferred, as it is by the command line tool */
+    capture->buf_type = capabilities & V4L2_CAP_VIDEO_CAPTURE_MPLANE ?
+        V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE : V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+    if (v4l2_capture_set_format(capture, config)) {
+        v4l2_capture_close(capture);
+        return NULL;
+    }
+
+    if (capture->memory == V4L2_MEMORY_DMABUF) {
+        if (v4l2_dmabuf_allocator_open(&capture->dmabuf, config->dmabuf_source, config->dmabuf_heap,
+                capture->hugepages)) {
+            v4l2_capture_close(capture);
+            return NULL;
+        }
+        capture->dmabuf_open = true;
+    }
+
+    memset(&requestbuffers, 0, sizeof(requestbuffers));
+    requestbuffers.count = config->number_of_buffers ? config->number_of_buffers : V4L2_CAPTURE_DEFAULT_BUFFERS;
+    requestbuffers.type = capture->buf_type;
+    requestbuffers.memory = capture->memory;
+
+    if (requestbuffers.count > VIDEO_MAX_FRAME)
+        requestbuffers.count = VIDEO_MAX_FRAME;
+
+    if (-1 == ioctl(capture->fd, VIDIOC_REQBUFS, &requestbuffers)) {
+        fprintf(stderr, "VIDIOC_REQBUFS failed: %s\n", strerror(errno));
+        v4l2_capture_close(capture);
+        return NULL;
+    }
+
+    if (requestbuffers.count == 0 || requestbuffers.count > VIDEO_MAX_FRAME) {
+        fprintf(stderr, "%s committed %u buffer(s)\n", config->filename, requestbuffers.count);
+        v4l2_capture_close(capture);
+        return NULL;
+    }
+
+    capture->number_of_buffers = requestbuffers.count;
+    capture->initial_buffers = requestbuffers.count;
+    capture->remove_bufs = requestbuffers.capabilities & V4L2_BUF_CAP_SUPPORTS_REMOVE_BUFS;
+
+    if (v4l2_capture_alloc_buffers(capture, 0, capture->number_of_buffers)) {
+        v4l2_capture_close(capture);
+        return NULL;
+    }
+
+    for (i = 0; i < capture->number_of_buffers; ++i)
+        v4l2_capture_build_template(capture, i);
+    v4l2_capture_build_dqbuf(capture);
+
+    /* buffers created later are of the same format */
+    for (i = 0; i < capture->buffers[0].nplanes; ++i)
+        capture->buffer_size += capture->buffers[0].planes[i].size;
+
+    return capture;
+}
+
+void v4l2_capture_close(struct v4l2_capture* capture)
+{
+    if (NULL == capture)
+        return;
+
+    if (capture->streaming)
+        v4l2_capture_stop(capture);
+
+    if (capture->fd != -1) {
+        v4l2_capture_free_buffers(capture);
+        close(capture->fd);
+    }
+
+    /* unmaps dmabuf buffers, see v4l2_dmabuf_allocator_close() */
+    if (capture->dmabuf_open)
+        v4l2_dmabuf_allocator_close(&capture->dmabuf);
+
+    pthread_mutex_destroy(&capture->lock);
+    free(capture);
+}
+
+const struct v4l2_format* v4l2_capture_format(const struct v4l2_capture* capture)
+{
+    return &capture->format;
+}
+
+unsigned v4l2_capture_number_of_buffers(const struct v4l2_capture* capture)
+{
+    return capture->number_of_buffers;
+}
+
+unsigned v4l2_capture_buffer(const struct v4l2_capture* capture, unsigned index, struct v4l2_capture_plane* planes)
+{
+    const struct v4l2_capture_buffer* b = capture->buffers + index;
+    unsigned plane;
+
+    if (index >= capture->number_of_buffers)
+        return 0;
+
+    for (plane = 0; plane < b->nplanes; ++plane) {
+        planes[plane] = b->planes[plane];
+        planes[plane].bytesused = 0;
+    }
+
+    return b->nplanes;
+}
+
+const char* v4l2_capture_dmabuf_name(const struct v4l2_capture* capture, char* buf, size_t size)
+{
+    if (!capture->dmabuf_open)
+        return NULL;
+
+    return v4l2_dmabuf_allocator_name(&capture->dmabuf, buf, size);
+}
+
+int v4l2_capture_fd(const struct v4l2_capture* capture)
+{
+    return capture->fd;
+}
+
+int v4l2_capture_start(struct v4l2_capture* capture)
+{
+    int retval = -1;
+    unsigned i;
+
+    pthread_mutex_lock(&capture->lock);
+
+    do {
+        if (capture->streaming) {
+            retval = 0;
+            break;
+        }
+
+        for (i = 0; i < capture->number_of_buffers; ++i)
+            if (!capture->buffers[i].borrowed && !capture->buffers[i].parked && v4l2_capture_queue(capture, i))
+                break;
+        if (i < capture->number_of_buffers)
+            break;
+
+        if (-1 == ioctl(capture->fd, VIDIOC_STREAMON, &capture->buf_type)) {
+            fprintf(stderr, "VIDIOC_STREAMON failed: %s\n", strerror(errno));
+            break;
+        }
+
+        capture->streaming = true;
+        retval = 0;
+    } while (0);
+
+    pthread_mutex_unlock(&capture->lock);
+
+    return retval;
+}
+
+int v4l2_capture_stop(struct v4l2_capture* capture)
+{
+    int retval = 0;
+
+    pthread_mutex_lock(&capture->lock);
+
+    if (capture->streaming) {
+        /* takes back all buffers owned by the driver, filled or not */
+        if (-1 == ioctl(capture->fd, VIDIOC_STREAMOFF, &capture->buf_type)) {
+            fprintf(stderr, "VIDIOC_STREAMOFF failed: %s\n", strerror(errno));
+            retval = -1;
+        }
+        capture->streaming = false;
+    }
+
+    pthread_mutex_unlock(&capture->lock);
+
+    return retval;
+}
+
+int v4l2_capture_borrow(struct v4l2_capture* capture, struct v4l2_capture_frame* frame, int timeout)
+{
+    /* the driver writes back the same type, memory, length and planes */
+    struct v4l2_buffer* buffer = &capture->dqbuf;
+    struct v4l2_capture_buffer* b;
+    unsigned plane;
+    bool waited = false;
+
+    for (;;) {
+        if (0 == ioctl(capture->fd, VIDIOC_DQBUF, buffer))
+            break;
+
+        if (errno != EAGAIN) {
+            fprintf(stderr, "VIDIOC_DQBUF failed: %s\n", strerror(errno));
+            return -1;
+        }
+
+        if (waited || timeout == 0)
+            return 1;
+
+        {
+            struct pollfd pfd = { .fd = capture->fd, .events = POLLIN };
+            int status;
+
+            do {
+                status = poll(&pfd, 1, timeout);
+            } while (status == -1 && errno == EINTR);
+
+            if (status == -1) {
+                fprintf(stderr, "poll() failed: %s\n", strerror(errno));
+                return -1;
+            }
+
+            if (status == 0)
+                return 1;
+        }
+
+        waited = true;
+    }
+
+    if (buffer->index >= capture->number_of_buffers) {
+        fprintf(stderr, "VIDIOC_DQBUF returned unknown buffer %u\n", buffer->index);
+        return -1;
+    }
+
+    if (capture->dequeued)
+        capture->dequeued(capture->arg, buffer);
+
+    b = capture->buffers + buffer->index;
+
+    memset(frame, 0, sizeof(*frame));
+    frame->index = buffer->index;
+    frame->sequence = buffer->sequence;
+    frame->flags = buffer->flags;
+    frame->timestamp = v4l2_timeval_to_ns(&buffer->timestamp);
+    frame->nplanes = b->nplanes;
+
+    for (plane = 0; plane < b->nplanes; ++plane) {
+        frame->planes[plane] = b->planes[plane];
+        frame->planes[plane].bytesused = V4L2_TYPE_IS_MULTIPLANAR(capture->buf_type) ?
+            buffer->m.planes[plane].bytesused : buffer->bytesused;
+
+        /* the device may still be writing through its own mapping */
+        if (capture->memory == V4L2_MEMORY_DMABUF && -1 == v4l2_dmabuf_begin_cpu_access(b->planes[plane].fd))
+            fprintf(stderr, "DMA_BUF_IOCTL_SYNC failed: %s\n", strerror(errno)); /* threat this as non-fatal error */
+    }
+
+    pthread_mutex_lock(&capture->lock);
+    b->borrowed = true;
+    capture->borrowed++;
+    pthread_mutex_unlock(&capture->lock);
+
+    return 0;
+}
+
+int v4l2_capture_return(struct v4l2_capture* capture, const struct v4l2_capture_frame* frame)
+{
+    struct v4l2_capture_buffer* b;
+    unsigned plane;
+    int retval = 0;
+
+    /* checked and cleared at once, so that a frame returned twice is never queued twice */
+    pthread_mutex_lock(&capture->lock);
+
+    /* the number of buffers changes as the pool grows */
+    if (frame->index >= capture->number_of_buffers || !capture->buffers[frame->index].borrowed) {
+        pthread_mutex_unlock(&capture->lock);
+        fprintf(stderr, "buffer %u is not borrowed\n", frame->index);
+        return -1;
+    }
+
+    b = capture->buffers + frame->index;
+
+    b->borrowed = false;
+    capture->borrowed--;
+
+    if (capture->memory == V4L2_MEMORY_DMABUF)
+        for (plane = 0; plane < b->nplanes; ++plane)
+            if (-1 == v4l2_dmabuf_end_cpu_access(b->planes[plane].fd))
+                fprintf(stderr, "DMA_BUF_IOCTL_SYNC failed: %s\n", strerror(errno)); /* threat this as non-fatal error */
+
+    /* otherwise it is queued by the next v4l2_capture_start() */
+    if (capture->streaming)
+        retval = v4l2_capture_queue(capture, frame->index);
+
+    pthread_mutex_unlock(&capture->lock);
+
+    return retval;
+}
+
+unsigned v4l2_capture_borrowed(struct v4l2_capture* capture)
+{
+    unsigned borrowed;
+
+    pthread_mutex_lock(&capture->lock);
+    borrowed = capture->borrowed;
+    pthread_mutex_unlock(&capture->lock);
+
+    return borrowed;
+}
+
+int v4l2_capture_grow(struct v4l2_capture* capture, unsigned* index, bool* created)
+{
+    int retval = -1;
+
+    pthread_mutex_lock(&capture->lock);
+
+    do {
+        unsigned i;
+
+        *created = false;
+
+        /* dmabufs from VIDIOC_REQBUFS keep their memory when parked, so both kinds may be parked at once */
+        for (i = 0; i < capture->number_of_parked; ++i)
+            if (!capture->buffers[capture->parked[i]].removed)
+                break;
+
+        if (i < capture->number_of_parked) {
+            /* buffers put aside earlier are the cheapest ones */
+            *index = capture->parked[i];
+            capture->parked[i] = capture->parked[--capture->number_of_parked];
+            capture->buffers[*index].parked = false;
+        } else {
+            int n;
+
+            /* removed buffers are created again, in place of any of them */
+            if ((capture->number_of_buffers >= VIDEO_MAX_FRAME && capture->number_of_removed == 0) ||
+                (uint64_t)(capture->number_of_buffers - capture->number_of_removed + 1) * capture->buffer_size >
+                    capture->buffer_budget) {
+                retval = 1; /* budget exhausted, the caller has to catch up */
+                break;
+            }
+
+            n = v4l2_capture_create_buffer(capture);
+            if (n < 0) {
+                /* threat this as non-fatal error, capture goes on with the buffers we have */
+                fprintf(stderr, "%s: buffer pool cannot grow, buffer budget is ignored\n", capture->filename);
+                capture->buffer_budget = 0;
+                retval = 1;
+                break;
+            }
+
+            *index = n;
+            *created = true;
+        }
+
+        if (v4l2_capture_queue(capture, *index))
+            break;
+
+        retval = 0;
+    } while (0);
+
+    pthread_mutex_unlock(&capture->lock);
+
+    return retval;
+}
+
+int v4l2_capture_park(struct v4l2_capture* capture, const struct v4l2_capture_frame* frame)
+{
+    struct v4l2_capture_buffer* b;
+    unsigned plane;
+    int retval;
+
+    pthread_mutex_lock(&capture->lock);
+
+    if (frame->index >= capture->number_of_buffers || !capture->buffers[frame->index].borrowed) {
+        pthread_mutex_unlock(&capture->lock);
+        fprintf(stderr, "buffer %u is not borrowed\n", frame->index);
+        return -1;
+    }
+
+    b = capture->buffers + frame->index;
+
+    b->borrowed = false;
+    capture->borrowed--;
+
+    if (capture->memory == V4L2_MEMORY_DMABUF)
+        for (plane = 0; plane < b->nplanes; ++plane)
+            if (-1 == v4l2_dmabuf_end_cpu_access(b->planes[plane].fd))
+                fprintf(stderr, "DMA_BUF_IOCTL_SYNC failed: %s\n", strerror(errno)); /* threat this as non-fatal error */
+
+    v4l2_capture_remove_buffer(capture, frame->index);
+
+    b->parked = true;
+    capture->parked[capture->number_of_parked++] = frame->index;
+    retval = b->removed;
+
+    pthread_mutex_unlock(&capture->lock);
+
+    return retval;
+}
+
+unsigned v4l2_capture_parked(struct v4l2_capture* capture)
+{
+    unsigned parked;
+
+    pthread_mutex_lock(&capture->lock);
+    parked = capture->number_of_parked;
+    pthread_mutex_unlock(&capture->lock);
+
+    return parked;
+}
+
+unsigned v4l2_capture_removed(struct v4l2_capture* capture)
+{
+    unsigned removed;
+
+    pthread_mutex_lock(&capture->lock);
+    removed = capture->number_of_removed;
+    pthread_mutex_unlock(&capture->lock);
+
+    return removed;
+}
+
+/*===========================================================================*\
+ * local function definitions
+\*===========================================================================*/
+static int v4l2_capture_set_format(struct v4l2_capture* capture, const struct v4l2_capture_config* config)
+{
+    struct v4l2_format* format = &capture->format;
+
+    memset(format, 0, sizeof(*format));
+    format->type = capture->buf_type;
+    if (-1 == ioctl(capture->fd, VIDIOC_G_FMT, format)) {
+        fprintf(stderr, "VIDIOC_G_FMT failed: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if (config->pixelformat || config->width || config->height) {
+        if (V4L2_TYPE_IS_MULTIPLANAR(capture->buf_type)) {
+            if (config->pixelformat)
+                format->fmt.pix_mp.pixelformat = config->pixelformat;
+            if (config->width && config->height) {
+                format->fmt.pix_mp.width = config->width;
+                format->fmt.pix_mp.height = config->height;
+            }
+        } else {
+            if (config->pixelformat)
+                format->fmt.pix.pixelformat = config->pixelformat;
+            if (config->width && config->height) {
+                format->fmt.pix.width = config->width;
+                format->fmt.pix.height = config->height;
+            }
+            format->fmt.pix.bytesperline = 0;
+            format->fmt.pix.sizeimage = 0;
+        }
+
+        if (-1 == ioctl(capture->fd, VIDIOC_S_FMT, format)) {
+            fprintf(stderr, "VIDIOC_S_FMT failed: %s\n", strerror(errno));
+            return -1;
+        }
+    }
+
+    if (config->timeperframe.numerator && config->timeperframe.denominator) {
+        struct v4l2_streamparm parm;
+
+        memset(&parm, 0, sizeof(parm));
+        parm.type = capture->buf_type;
+        parm.parm.capture.timeperframe = config->timeperframe;
+        if (-1 == ioctl(capture->fd, VIDIOC_S_PARM, &parm))
+            fprintf(stderr, "VIDIOC_S_PARM failed: %s\n", strerror(errno)); /* threat this as non-fatal error */
+    }
+
+    return 0;
+}
+
+/* sizes of the planes of every buffer, as the driver reports them for the format */
+static int v4l2_capture_plane_sizes(const struct v4l2_capture* capture, size_t* sizes)
+{
+    const struct v4l2_format* format = &capture->format;
+    unsigned plane;
+
+    if (V4L2_TYPE_IS_MULTIPLANAR(capture->buf_type)) {
+        for (plane = 0; plane < format->fmt.pix_mp.num_planes && plane < VIDEO_MAX_PLANES; ++plane) {
+            const struct v4l2_plane_pix_format* p = format->fmt.pix_mp.plane_fmt + plane;
+
+            sizes[plane] = p->sizeimage ? p->sizeimage : (size_t)p->bytesperline * format->fmt.pix_mp.height;
+            if (sizes[plane] == 0)
+                return -1;
+        }
+        return plane;
+    }
+
+    sizes[0] = format->fmt.pix.sizeimage ?
+        format->fmt.pix.sizeimage : (size_t)format->fmt.pix.bytesperline * format->fmt.pix.height;
+
+    return sizes[0] ? 1 : -1;
+}
+
+static int v4l2_capture_alloc_buffers(struct v4l2_capture* capture, unsigned first, unsigned count)
+{
+    switch (capture->memory) {
+        case V4L2_MEMORY_MMAP:
+            return v4l2_capture_map_buffers(capture, first, count);
+
+        case V4L2_MEMORY_USERPTR:
+            return v4l2_capture_alloc_userptr(capture, first, count);
+
+        case V4L2_MEMORY_DMABUF:
+            return v4l2_capture_alloc_dmabuf(capture, first, count);
+
+        default:
+            return -1;
+    }
+}
+
+static int v4l2_capture_map_buffers(struct v4l2_capture* capture, unsigned first, unsigned count)
+{
+    unsigned i;
+    unsigned plane;
+
+    for (i = first; i < first + count; ++i) {
+        struct v4l2_capture_buffer* b = capture->buffers + i;
+        struct v4l2_buffer buffer;
+        struct v4l2_plane planes[VIDEO_MAX_PLANES];
+
+        memset(&buffer, 0, sizeof(buffer));
+        buffer.index = i;
+        buffer.type = capture->buf_type;
+        buffer.memory = V4L2_MEMORY_MMAP;
+        if (V4L2_TYPE_IS_MULTIPLANAR(capture->buf_type)) {
+            memset(&planes, 0, sizeof(planes));
+            buffer.length = VIDEO_MAX_PLANES;
+            buffer.m.planes = planes;
+        }
+
+        if (-1 == ioctl(capture->fd, VIDIOC_QUERYBUF, &buffer)) {
+            fprintf(stderr, "VIDIOC_QUERYBUF[%u] failed: %s\n", i, strerror(errno));
+            return -1;
+        }
+
+        b->nplanes = V4L2_TYPE_IS_MULTIPLANAR(capture->buf_type) ? buffer.length : 1;
+
+        for (plane = 0; plane < b->nplanes; ++plane) {
+            size_t length = V4L2_TYPE_IS_MULTIPLANAR(capture->buf_type) ? planes[plane].length : buffer.length;
+            off_t offset = V4L2_TYPE_IS_MULTIPLANAR(capture->buf_type) ? planes[plane].m.mem_offset : buffer.m.offset;
+            void* addr;
+
+            b->planes[plane].fd = -1;
+
+            addr = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, capture->fd, offset);
+            if (MAP_FAILED == addr) {
+                fprintf(stderr, "mmap() failed: %s\n", strerror(errno));
+                b->nplanes = plane;
+                return -1;
+            }
+
+            b->planes[plane].addr = addr;
+            b->planes[plane].size = length;
+
+            if (capture->export_buffers) {
+                struct v4l2_exportbuffer expbuf;
+
+                memset(&expbuf, 0, sizeof(expbuf));
+                expbuf.type = capture->buf_type;
+                expbuf.index = i;
+                expbuf.plane = plane;
+                expbuf.flags = O_RDONLY | O_CLOEXEC;
+
+                if (-1 == ioctl(capture->fd, VIDIOC_EXPBUF, &expbuf)) {
+                    fprintf(stderr, "VIDIOC_EXPBUF[%u:%u] failed: %s\n", i, plane, strerror(errno));
+                    b->nplanes = plane + 1;
+                    return -1;
+                }
+
+                b->planes[plane].fd = expbuf.fd;
+            }
+        }
+    }
+
+    return 0;
+}
+
+static int v4l2_capture_alloc_userptr(struct v4l2_capture* capture, unsigned first, unsigned count)
+{
+    size_t sizes[VIDEO_MAX_PLANES];
+    size_t pagesize = v4l2_capture_page_size();
+    int nplanes;
+    unsigned i;
+    unsigned plane;
+
+    nplanes = v4l2_capture_plane_sizes(capture, sizes);
+    if (nplanes < 1) {
+        fprintf(stderr, "%s reports no buffer size\n", capture->filename);
+        return -1;
+    }
+
+    for (i = first; i < first + count; ++i) {
+        struct v4l2_capture_buffer* b = capture->buffers + i;
+
+        for (plane = 0; plane < (unsigned)nplanes; ++plane) {
+            void* addr;
+
+            if (capture->prepare) {
+                addr = NULL; /* set before every VIDIOC_QBUF, see v4l2_capture_queue() */
+            } else
+            if (capture->hugepages) {
+                int memfd = v4l2_hugepage_alloc(sizes[plane], &addr, capture->hugepage_stats);
+                if (memfd == -1)
+                    return -1;
+                /* mapping keeps the memory alive */
+                close(memfd);
+            } else {
+                addr = aligned_alloc(pagesize, ALIGN(sizes[plane], pagesize));
+                if (NULL == addr) {
+                    fprintf(stderr, "aligned_alloc(%zu) failed\n", sizes[plane]);
+                    return -1;
+                }
+            }
+
+            if (addr)
+                v4l2_capture_bind(capture, addr, sizes[plane]);
+
+            b->planes[plane].addr = addr;
+            b->planes[plane].size = sizes[plane];
+            b->planes[plane].fd = -1;
+            b->nplanes = plane + 1;
+        }
+    }
+
+    return 0;
+}
+
+static int v4l2_capture_alloc_dmabuf(struct v4l2_capture* capture, unsigned first, unsigned count)
+{
+    size_t sizes[VIDEO_MAX_PLANES];
+    int nplanes;
+    unsigned n;
+    unsigned i;
+    unsigned plane;
+
+    nplanes = v4l2_capture_plane_sizes(capture, sizes);
+    if (nplanes < 1) {
+        fprintf(stderr, "%s reports no buffer size\n", capture->filename);
+        return -1;
+    }
+
+    n = count * nplanes;
+
+    {
+        /* all planes of all buffers are allocated at once, see v4l2_dmabuf_alloc_pool() */
+        size_t pool_sizes[n];
+        int fds[n];
+        void* addrs[n];
+
+        for (i = 0; i < n; ++i)
+            pool_sizes[i] = sizes[i % nplanes];
+
+        if (v4l2_dmabuf_alloc_pool(&capture->dmabuf, pool_sizes, n, fds, addrs, capture->hugepage_stats))
+            return -1;
+
+        /* the pool is one range of addresses, see v4l2_dmabuf_alloc_pool() */
+        v4l2_capture_bind(capture, addrs[0], (char*)addrs[n - 1] + sizes[nplanes - 1] - (char*)addrs[0]);
+
+        for (i = 0; i < count; ++i) {
+            struct v4l2_capture_buffer* b = capture->buffers + first + i;
+
+            b->nplanes = nplanes;
+            for (plane = 0; plane < (unsigned)nplanes; ++plane) {
+                b->planes[plane].addr = addrs[i * nplanes + plane];
+                b->planes[plane].size = sizes[plane];
+                b->planes[plane].fd = fds[i * nplanes + plane];
+            }
+        }
+    }
+
+    return 0;
+}
+
+static void v4l2_capture_bind(struct v4l2_capture* capture, void* addr, size_t size)
+{
+    if (!capture->bind_memory)
+        return;
+
+    /* threat this as non-fatal error, buffers still work wherever their pages are */
+    if (-1 == v4l2_sched_bind_memory(addr, size, capture->numa_node) && !capture->bind_reported) {
+        fprintf(stderr, "%s: buffers cannot be bound to NUMA node %d: %s\n",
+            capture->filename, capture->numa_node, strerror(errno));
+        capture->bind_reported = true;
+    }
+}
+
+/* memory of the buffer, not the buffer itself, which is left to VIDIOC_REQBUFS or VIDIOC_REMOVE_BUFS */
+static void v4l2_capture_free_buffer(struct v4l2_capture* capture, unsigned index)
+{
+    struct v4l2_capture_buffer* b = capture->buffers + index;
+    unsigned plane;
+
+    for (plane = 0; plane < b->nplanes; ++plane) {
+        /* exported by VIDIOC_EXPBUF, or the dmabuf itself */
+        if (b->planes[plane].fd != -1)
+            close(b->planes[plane].fd);
+        b->planes[plane].fd = -1;
+
+        if (capture->memory == V4L2_MEMORY_MMAP && b->planes[plane].addr)
+            munmap(b->planes[plane].addr, b->planes[plane].size);
+        else
+        /* planes set by the prepare hook are not ours */
+        if (capture->memory == V4L2_MEMORY_USERPTR && !capture->prepare && b->planes[plane].addr) {
+            if (capture->hugepages)
+                v4l2_hugepage_free(b->planes[plane].addr, b->planes[plane].size);
+            else
+                free(b->planes[plane].addr);
+        }
+
+        /* dmabuf mappings go with their pool, see v4l2_dmabuf_allocator_close() */
+        b->planes[plane].addr = NULL;
+    }
+}
+
+static void v4l2_capture_free_buffers(struct v4l2_capture* capture)
+{
+    struct v4l2_requestbuffers requestbuffers;
+    unsigned i;
+    unsigned plane;
+
+    for (i = 0; i < capture->number_of_buffers; ++i) {
+        struct v4l2_capture_buffer* b = capture->buffers + i;
+
+        /* removed buffers have been freed already */
+        if (b->removed)
+            continue;
+
+        if (capture->memory == V4L2_MEMORY_DMABUF && b->borrowed)
+            for (plane = 0; plane < b->nplanes; ++plane)
+                v4l2_dmabuf_end_cpu_access(b->planes[plane].fd);
+
+        v4l2_capture_free_buffer(capture, i);
+        b->nplanes = 0;
+    }
+
+    /* buffers are unmapped by now, so that the driver can free them rather than orphan them */
+    memset(&requestbuffers, 0, sizeof(requestbuffers));
+    requestbuffers.count = 0;
+    requestbuffers.type = capture->buf_type;
+    requestbuffers.memory = capture->memory;
+
+    if (capture->number_of_buffers && -1 == ioctl(capture->fd, VIDIOC_REQBUFS, &requestbuffers))
+        fprintf(stderr, "VIDIOC_REQBUFS failed: %s\n", strerror(errno));
+
+    capture->number_of_buffers = 0;
+    capture->number_of_parked = 0;
+    capture->number_of_removed = 0;
+    capture->borrowed = 0;
+}
+
+/* called under lock, returns index of the new buffer, -1 on failure */
+static int v4l2_capture_create_buffer(struct v4l2_capture* capture)
+{
+    struct v4l2_create_buffers create;
+    unsigned i;
+
+    /* buffers are sized for the current format, like the ones from VIDIOC_REQBUFS */
+    memset(&create, 0, sizeof(create));
+    create.count = 1;
+    create.memory = capture->memory;
+    create.format = capture->format;
+
+    if (-1 == ioctl(capture->fd, VIDIOC_CREATE_BUFS, &create)) {
+        fprintf(stderr, "VIDIOC_CREATE_BUFS failed: %s\n", strerror(errno));
+        return -1;
+    }
+
+    /* the lowest index free, which is one of the removed buffers if there are any */
+    if (create.count != 1 || create.index > capture->number_of_buffers ||
+        (create.index < capture->number_of_buffers && !capture->buffers[create.index].removed)) {
+        fprintf(stderr, "VIDIOC_CREATE_BUFS returned %u buffer(s) at index %u, expected 1 at %u or at a removed one\n",
+            create.count, create.index, capture->number_of_buffers);
+        return -1;
+    }
+
+    if (v4l2_capture_alloc_buffers(capture, create.index, 1))
+        return -1;
+
+    v4l2_capture_build_template(capture, create.index);
+
+    if (create.index == capture->number_of_buffers)
+        capture->number_of_buffers++;
+    else {
+        /* parked no more */
+        for (i = 0; i < capture->number_of_parked; ++i)
+            if (capture->parked[i] == create.index)
+                break;
+        capture->parked[i] = capture->parked[--capture->number_of_parked];
+        capture->buffers[create.index].parked = false;
+        capture->buffers[create.index].removed = false;
+        capture->number_of_removed--;
+    }
+
+    return create.index;
+}
+
+/* called under lock */
+static void v4l2_capture_remove_buffer(struct v4l2_capture* capture, unsigned index)
+{
+    struct v4l2_capture_buffer* b = capture->buffers + index;
+    struct v4l2_remove_buffers remove;
+
+    /*
+     * Without VIDIOC_REMOVE_BUFS the buffer keeps its memory: the driver keeps
+     * its own until the end, and pages of userptr ones stay pinned by it anyway.
+     * Dmabufs from VIDIOC_REQBUFS share one pool, which is freed only as a whole.
+     */
+    if (!capture->remove_bufs || (capture->memory == V4L2_MEMORY_DMABUF && index < capture->initial_buffers))
+        return;
+
+    memset(&remove, 0, sizeof(remove));
+    remove.index = index;
+    remove.count = 1;
+    remove.type = capture->buf_type;
+
+    if (-1 == ioctl(capture->fd, VIDIOC_REMOVE_BUFS, &remove)) {
+        /* threat this as non-fatal error, surplus buffers keep their memory from now on */
+        fprintf(stderr, "VIDIOC_REMOVE_BUFS failed: %s\n", strerror(errno));
+        capture->remove_bufs = false;
+        return;
+    }
+
+    if (capture->memory == V4L2_MEMORY_DMABUF)
+        v4l2_dmabuf_free_pool(&capture->dmabuf, b->planes[0].addr);
+    v4l2_capture_free_buffer(capture, index);
+    b->removed = true;
+    capture->number_of_removed++;
+}
+
+static void v4l2_capture_build_template(struct v4l2_capture* capture, unsigned index)
+{
+    struct v4l2_capture_buffer* b = capture->buffers + index;
+    struct v4l2_buffer* buffer = &b->qbuf;
+    unsigned plane;
+
+    memset(buffer, 0, sizeof(*buffer));
+    buffer->index = index;
+    buffer->type = capture->buf_type;
+    buffer->memory = capture->memory;
+
+    if (V4L2_TYPE_IS_MULTIPLANAR(capture->buf_type)) {
+        memset(b->qbuf_planes, 0, sizeof(b->qbuf_planes));
+        for (plane = 0; plane < b->nplanes; ++plane) {
+            if (capture->memory == V4L2_MEMORY_USERPTR) {
+                b->qbuf_planes[plane].m.userptr = (unsigned long)b->planes[plane].addr;
+                b->qbuf_planes[plane].length = b->planes[plane].size;
+            }
+            else
+            if (capture->memory == V4L2_MEMORY_DMABUF)
+                b->qbuf_planes[plane].m.fd = b->planes[plane].fd;
+        }
+        buffer->length = b->nplanes;
+        buffer->m.planes = b->qbuf_planes;
+    } else {
+        if (capture->memory == V4L2_MEMORY_USERPTR) {
+            buffer->m.userptr = (unsigned long)b->planes[0].addr;
+            buffer->length = b->planes[0].size;
+        }
+        else
+        if (capture->memory == V4L2_MEMORY_DMABUF)
+            buffer->m.fd = b->planes[0].fd;
+    }
+}
+
+static void v4l2_capture_build_dqbuf(struct v4l2_capture* capture)
+{
+    memset(&capture->dqbuf, 0, sizeof(capture->dqbuf));
+    capture->dqbuf.type = capture->buf_type;
+    capture->dqbuf.memory = capture->memory;
+    if (V4L2_TYPE_IS_MULTIPLANAR(capture->buf_type)) {
+        /* all buffers are of the same format */
+        memset(capture->dqbuf_planes, 0, sizeof(capture->dqbuf_planes));
+        capture->dqbuf.length = capture->buffers[0].nplanes;
+        capture->dqbuf.m.planes = capture->dqbuf_planes;
+    }
+}
+
+/* called under lock, and so are the prepare and queued hooks, as the slot prepared is the one queued */
+static int v4l2_capture_queue(struct v4l2_capture* capture, unsigned index)
+{
+    struct v4l2_capture_buffer* b = capture->buffers + index;
+    struct v4l2_buffer* buffer = &b->qbuf;
+
+    if (capture->prepare) {
+        void* addrs[VIDEO_MAX_PLANES];
+        unsigned plane;
+
+        if (capture->prepare(capture->arg, index, addrs))
+            return -1;
+
+        for (plane = 0; plane < b->nplanes; ++plane) {
+            b->planes[plane].addr = addrs[plane];
+            if (V4L2_TYPE_IS_MULTIPLANAR(capture->buf_type))
+                b->qbuf_planes[plane].m.userptr = (unsigned long)addrs[plane];
+            else
+                buffer->m.userptr = (unsigned long)addrs[plane];
+        }
+    }
+
+    /* flags are where the driver reports the state of the buffer back, they are not meant as input */
+    buffer->flags = 0;
+
+    if (-1 == ioctl(capture->fd, VIDIOC_QBUF, buffer)) {
+        fprintf(stderr, "VIDIOC_QBUF[%u] failed: %s\n", index, strerror(errno));
+        return -1;
+    }
+
+    if (capture->queued)
+        capture->queued(capture->arg, buffer);
+
+    return 0;
+}
@@ -0,0 +1,186 @@
+/* SPDX-License-Identifier: MIT */
+/**
+ * @file v4l2-capture.h
+ *
+ * Capture from one device for programs embedding libv4l2capture.
+ * A struct v4l2_capture (opaque) owns the device, its format and its buffers.
+ * Frames are borrowed rather than copied: v4l2_capture_borrow() hands out
+ * a dequeued buffer, its planes (mapping, bytes used, dmabuf fd if there is one)
+ * and metadata, and the buffer stays with the caller until v4l2_capture_return()
+ * gives it back to the driver. Frames can be held for as long as needed and
+ * returned in any order, the driver only runs short of buffers meanwhile.
+ * Borrowing is done by one thread at a time, returning by any thread.
+ * The pool of buffers may grow while capturing (VIDIOC_CREATE_BUFS) and surplus
+ * buffers may be parked again, freed by VIDIOC_REMOVE_BUFS where the driver allows it.
+ * Hooks let the caller place userptr frames (e.g. in slots of a mapped file)
+ * and follow every VIDIOC_QBUF and VIDIOC_DQBUF (e.g. for accounting).
+ */
+
+#ifndef _V4L2_CAPTURE_H_
+#define _V4L2_CAPTURE_H_
+
+/*===========================================================================*\
+ * system header files
+\*===========================================================================*/
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include <linux/videodev2.h>
+
+/*===========================================================================*\
+ * project header files
+\*===========================================================================*/
+#include "v4l2-dmabuf.h"
+
+/*===========================================================================*\
+ * preprocessor #define constants and macros
+\*===========================================================================*/
+#define V4L2_CAPTURE_DEFAULT_BUFFERS 4
+
+/*===========================================================================*\
+ * global type definitions
+\*===========================================================================*/
+struct v4l2_capture;
+struct v4l2_hugepage_stats;
+
+/*
+ * Sets addrs to the planes the next frame of userptr buffer index goes to,
+ * called before the buffer is queued. Returns 0 on success, -1 on failure.
+ * Runs under the lock of the context, on whichever thread queues the buffer
+ * (v4l2_capture_start(), v4l2_capture_return() or v4l2_capture_grow()),
+ * so it must not call any v4l2_capture_* function.
+ */
+typedef int (*v4l2_capture_prepare_t)(void* arg, unsigned index, void** addrs);
+
+/*
+ * Called with the argument of every VIDIOC_QBUF and VIDIOC_DQBUF which succeeded.
+ * The queued hook runs as prepare does, under the lock and on the queueing thread,
+ * the dequeued one on the borrowing thread without the lock. Neither may call
+ * any v4l2_capture_* function.
+ */
+typedef void (*v4l2_capture_hook_t)(void* arg, const struct v4l2_buffer* buffer);
+
+struct v4l2_capture_config
+{
+    const char* filename;             /* e.g. /dev/video0 */
+    enum v4l2_memory memory;          /* 0: V4L2_MEMORY_MMAP */
+    unsigned number_of_buffers;       /* 0: V4L2_CAPTURE_DEFAULT_BUFFERS */
+    uint32_t pixelformat;             /* 0: format set on the device is kept */
+    uint32_t width;                   /* 0: ... as well as its size */
+    uint32_t height;
+    struct v4l2_fract timeperframe;   /* 0/0: frame interval is left to the driver */
+    bool export_buffers;              /* mmap buffers come with dmabuf fds (VIDIOC_EXPBUF) */
+    bool hugepages;                   /* userptr and dmabuf buffers are huge page backed */
+    enum v4l2_dmabuf_source dmabuf_source; /* of dmabuf buffers */
+    const char* dmabuf_heap;          /* NULL: V4L2_DMABUF_DEFAULT_HEAP */
+    bool bind_memory;                 /* userptr and dmabuf buffers are bound to numa_node */
+    int numa_node;
+    struct v4l2_hugepage_stats* hugepage_stats; /* NULL: not collected */
+    uint64_t buffer_budget;           /* bytes all buffers may take, 0: the pool never grows */
+    v4l2_capture_prepare_t prepare;   /* userptr only, NULL: frames go to memory allocated by us */
+    v4l2_capture_hook_t queued;       /* may be NULL */
+    v4l2_capture_hook_t dequeued;     /* may be NULL */
+    void* arg;                        /* of prepare, queued and dequeued */
+};
+
+struct v4l2_capture_plane
+{
+    void* addr;                       /* mapping of the plane */
+    size_t bytesused;                 /* by the frame */
+    size_t size;                      /* of the plane */
+    int fd;                           /* dmabuf of the plane, -1 if there is none */
+};
+
+struct v4l2_capture_frame
+{
+    unsigned index;                   /* of the buffer, identifies the frame on return */
+    uint32_t sequence;                /* set by the driver */
+    uint32_t flags;                   /* V4L2_BUF_FLAG_*, V4L2_BUF_FLAG_ERROR frames are handed out too */
+    uint64_t timestamp;               /* set by the driver, nanoseconds */
+    unsigned nplanes;
+    struct v4l2_capture_plane planes[VIDEO_MAX_PLANES];
+};
+
+/*===========================================================================*\
+ * global object declarations
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * function forward declarations
+\*===========================================================================*/
+
+/**
+ * Opens config->filename, sets its format and allocates (or maps) its buffers.
+ * Returns the context, NULL on failure.
+ */
+struct v4l2_capture* v4l2_capture_open(const struct v4l2_capture_config* config);
+
+/**
+ * Same as v4l2_capture_open(), for a device the caller has already opened (with O_NONBLOCK),
+ * e.g. to enumerate its formats. The context owns fd from now on, it is closed on failure as well.
+ */
+struct v4l2_capture* v4l2_capture_attach(int fd, const struct v4l2_capture_config* config);
+
+/** Stops streaming if needed and releases everything, frames still borrowed included */
+void v4l2_capture_close(struct v4l2_capture* capture);
+
+/** Format the driver settled on */
+const struct v4l2_format* v4l2_capture_format(const struct v4l2_capture* capture);
+
+/** Number of buffers, the ones added by v4l2_capture_grow() included (removed ones keep their index) */
+unsigned v4l2_capture_number_of_buffers(const struct v4l2_capture* capture);
+
+/** Stores the planes of buffer index in planes (bytesused is not set). Returns their number */
+unsigned v4l2_capture_buffer(const struct v4l2_capture* capture, unsigned index, struct v4l2_capture_plane* planes);
+
+/** Name of what dmabuf buffers are allocated from (see v4l2_dmabuf_allocator_name()), NULL for other memory */
+const char* v4l2_capture_dmabuf_name(const struct v4l2_capture* capture, char* buf, size_t size);
+
+/** File descriptor of the device, readable when a frame can be borrowed (e.g. for an event loop) */
+int v4l2_capture_fd(const struct v4l2_capture* capture);
+
+/** Queues all buffers not borrowed and starts streaming. Returns 0 on success, -1 on failure */
+int v4l2_capture_start(struct v4l2_capture* capture);
+
+/**
+ * Stops streaming. Buffers owned by the driver are taken back, borrowed ones stay valid
+ * and are queued again on the next start once returned. Returns 0 on success, -1 on failure.
+ */
+int v4l2_capture_stop(struct v4l2_capture* capture);
+
+/**
+ * Takes the oldest frame filled by the driver, waiting at most timeout milliseconds
+ * (negative: indefinitely) for one. Planes of dmabuf buffers are ready for the cpu to read.
+ * Returns 0 if frame was borrowed, 1 if none was filled in time, -1 on failure.
+ */
+int v4l2_capture_borrow(struct v4l2_capture* capture, struct v4l2_capture_frame* frame, int timeout);
+
+/** Gives the frame back to the driver. Returns 0 on success, -1 on failure */
+int v4l2_capture_return(struct v4l2_capture* capture, const struct v4l2_capture_frame* frame);
+
+/** Number of frames borrowed and not returned yet */
+unsigned v4l2_capture_borrowed(struct v4l2_capture* capture);
+
+/**
+ * Queues one more buffer: a parked one which kept its memory or else a new one
+ * (VIDIOC_CREATE_BUFS, in place of a removed one if there is any), as long as all
+ * buffers fit into the budget. Sets index and whether the buffer is new, to be called
+ * by the borrowing thread. Returns 0 on success, 1 if the pool cannot grow, -1 on failure.
+ */
+int v4l2_capture_grow(struct v4l2_capture* capture, unsigned* index, bool* created);
+
+/**
+ * Puts the frame aside instead of returning it, its buffer is not queued again until
+ * v4l2_capture_grow() takes it. Its memory is freed (VIDIOC_REMOVE_BUFS) if the driver
+ * supports that. Returns 1 if it was, 0 if the buffer kept its memory, -1 on failure.
+ */
+int v4l2_capture_park(struct v4l2_capture* capture, const struct v4l2_capture_frame* frame);
+
+/** Number of buffers parked ... */
+unsigned v4l2_capture_parked(struct v4l2_capture* capture);
+
+/** ... and out of them the ones whose memory is freed */
+unsigned v4l2_capture_removed(struct v4l2_capture* capture);
+
+#endif /* _V4L2_CAPTURE_H_ */
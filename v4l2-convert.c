@@ -0,0 +1,823 @@
+/* SPDX-License-Identifier: MIT */
+/**
+ * @file v4l2-convert.c
+ *
+ * Pixel format conversion (see v4l2-convert.h).
+ */
+
+/*===========================================================================*\
+ * system header files
+\*===========================================================================*/
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include <linux/videodev2.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define V4L2_CONVERT_X86
+#endif
+
+/*===========================================================================*\
+ * project header files
+\*===========================================================================*/
+#include "v4l2-convert.h"
+
+/*===========================================================================*\
+ * preprocessor #define constants and macros
+\*===========================================================================*/
+#define V4L2_CONVERT_SELFTEST_MAX_WIDTH 642
+#define V4L2_CONVERT_SELFTEST_MAX_HEIGHT 10
+
+/*===========================================================================*\
+ * local type definitions
+\*===========================================================================*/
+struct v4l2_convert_kernels
+{
+    /* even[i] = src[2 * i], odd[i] = src[2 * i + 1] for i < n */
+    void (*deinterleave)(const uint8_t* src, uint8_t* even, uint8_t* odd, size_t n);
+    /* dst[i] = (a[i] + b[i] + 1) / 2 for i < n */
+    void (*average)(const uint8_t* a, const uint8_t* b, uint8_t* dst, size_t n);
+    /* one row of luma and its interleaved chroma to RGBA (BGRA when bgr is set) */
+    void (*yuv_to_rgba)(const uint8_t* y, const uint8_t* uv, uint8_t* dst, size_t width, int bgr);
+    /* drops every fourth byte */
+    void (*rgba_to_rgb)(const uint8_t* src, uint8_t* dst, size_t width);
+};
+
+/*===========================================================================*\
+ * global object definitions
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * local function declarations
+\*===========================================================================*/
+static void v4l2_deinterleave_c(const uint8_t* src, uint8_t* even, uint8_t* odd, size_t n);
+static void v4l2_average_c(const uint8_t* a, const uint8_t* b, uint8_t* dst, size_t n);
+static void v4l2_yuv_to_rgba_c(const uint8_t* y, const uint8_t* uv, uint8_t* dst, size_t width, int bgr);
+static void v4l2_rgba_to_rgb_c(const uint8_t* src, uint8_t* dst, size_t width);
+static void v4l2_reference_packed(uint32_t from, uint32_t to, uint32_t width, uint32_t height,
+    uint32_t stride, const uint8_t* src, uint8_t* dst);
+static void v4l2_reference_nv12(uint32_t to, uint32_t width, uint32_t height, uint32_t stride,
+    const uint8_t* luma, const uint8_t* chroma, uint8_t* dst);
+
+#if defined(V4L2_CONVERT_X86)
+static void v4l2_deinterleave_sse2(const uint8_t* src, uint8_t* even, uint8_t* odd, size_t n);
+static void v4l2_average_sse2(const uint8_t* a, const uint8_t* b, uint8_t* dst, size_t n);
+static void v4l2_yuv_to_rgba_sse2(const uint8_t* y, const uint8_t* uv, uint8_t* dst, size_t width, int bgr);
+static void v4l2_rgba_to_rgb_ssse3(const uint8_t* src, uint8_t* dst, size_t width);
+static void v4l2_deinterleave_avx2(const uint8_t* src, uint8_t* even, uint8_t* odd, size_t n);
+static void v4l2_average_avx2(const uint8_t* a, const uint8_t* b, uint8_t* dst, size_t n);
+static void v4l2_yuv_to_rgba_avx2(const uint8_t* y, const uint8_t* uv, uint8_t* dst, size_t width, int bgr);
+static void v4l2_deinterleave_avx512(const uint8_t* src, uint8_t* even, uint8_t* odd, size_t n);
+static void v4l2_average_avx512(const uint8_t* a, const uint8_t* b, uint8_t* dst, size_t n);
+static void v4l2_yuv_to_rgba_avx512(const uint8_t* y, const uint8_t* uv, uint8_t* dst, size_t width, int bgr);
+#endif
+
+/*===========================================================================*\
+ * local object definitions
+\*===========================================================================*/
+static const struct v4l2_convert_kernels v4l2_convert_kernels_c = {
+    v4l2_deinterleave_c, v4l2_average_c, v4l2_yuv_to_rgba_c, v4l2_rgba_to_rgb_c
+};
+
+#if defined(V4L2_CONVERT_X86)
+/* pshufb comes with SSSE3, plain SSE2 has nothing better than the C loop for dropping bytes */
+static const struct v4l2_convert_kernels v4l2_convert_kernels_sse2 = {
+    v4l2_deinterleave_sse2, v4l2_average_sse2, v4l2_yuv_to_rgba_sse2, v4l2_rgba_to_rgb_c
+};
+
+static const struct v4l2_convert_kernels v4l2_convert_kernels_avx2 = {
+    v4l2_deinterleave_avx2, v4l2_average_avx2, v4l2_yuv_to_rgba_avx2, v4l2_rgba_to_rgb_ssse3
+};
+
+static const struct v4l2_convert_kernels v4l2_convert_kernels_avx512 = {
+    v4l2_deinterleave_avx512, v4l2_average_avx512, v4l2_yuv_to_rgba_avx512, v4l2_rgba_to_rgb_ssse3
+};
+#endif
+
+static const char* v4l2_convert_isa_names[] = {
+    [V4L2_CONVERT_ISA_SCALAR] = "scalar",
+    [V4L2_CONVERT_ISA_SSE2] = "sse2",
+    [V4L2_CONVERT_ISA_AVX2] = "avx2",
+    [V4L2_CONVERT_ISA_AVX512] = "avx512bw",
+};
+
+/*===========================================================================*\
+ * inline function definitions
+\*===========================================================================*/
+static inline uint8_t v4l2_convert_clamp(int value)
+{
+    return value < 0 ? 0 : value > 255 ? 255 : value;
+}
+
+/*
+ * BT.601 limited range in 6 bit fixed point. All intermediate values fit into
+ * 16 bits, except the blue one which may exceed 32767 for the brightest pixels,
+ * where vector code saturates and gets 255 all the same.
+ */
+static inline void v4l2_convert_pixel(int y, int u, int v, uint8_t* r, uint8_t* g, uint8_t* b)
+{
+    int c = 74 * (y - 16) + 32;
+    int d = u - 128;
+    int e = v - 128;
+
+    *r = v4l2_convert_clamp((c + 102 * e) >> 6);
+    *g = v4l2_convert_clamp((c - 25 * d - 52 * e) >> 6);
+    *b = v4l2_convert_clamp((c + 129 * d) >> 6);
+}
+
+static inline bool v4l2_convert_packed(uint32_t pixelformat)
+{
+    return pixelformat == V4L2_PIX_FMT_YUYV || pixelformat == V4L2_PIX_FMT_UYVY;
+}
+
+static inline bool v4l2_convert_nv12(uint32_t pixelformat)
+{
+    return pixelformat == V4L2_PIX_FMT_NV12 || pixelformat == V4L2_PIX_FMT_NV12M;
+}
+
+/*===========================================================================*\
+ * public function definitions
+\*===========================================================================*/
+enum v4l2_convert_isa v4l2_convert_detect(void)
+{
+#if defined(V4L2_CONVERT_X86)
+    __builtin_cpu_init();
+
+    /* these also take into account whether the kernel saves the wider registers */
+    if (__builtin_cpu_supports("avx512bw"))
+        return V4L2_CONVERT_ISA_AVX512;
+    if (__builtin_cpu_supports("avx2"))
+        return V4L2_CONVERT_ISA_AVX2;
+    if (__builtin_cpu_supports("sse2"))
+        return V4L2_CONVERT_ISA_SSE2;
+#endif
+
+    return V4L2_CONVERT_ISA_SCALAR;
+}
+
+const char* v4l2_convert_isa_name(enum v4l2_convert_isa isa)
+{
+    return isa <= V4L2_CONVERT_ISA_AVX512 ? v4l2_convert_isa_names[isa] : "unknown";
+}
+
+int v4l2_convert_init(struct v4l2_convert* conv, uint32_t from, uint32_t to,
+    uint32_t width, uint32_t height, uint32_t bytesperline, enum v4l2_convert_isa isa)
+{
+    enum v4l2_convert_isa best = v4l2_convert_detect();
+
+    memset(conv, 0, sizeof(*conv));
+
+    if (v4l2_convert_packed(from)) {
+        if (to != V4L2_PIX_FMT_NV12 && to != V4L2_PIX_FMT_YUV420 && to != V4L2_PIX_FMT_GREY)
+            return -1;
+        if (bytesperline == 0)
+            bytesperline = 2 * width;
+        if (bytesperline < 2 * width)
+            return -1;
+    }
+    else
+    if (v4l2_convert_nv12(from)) {
+        if (to != V4L2_PIX_FMT_RGB24 && to != V4L2_PIX_FMT_ABGR32)
+            return -1;
+        if (bytesperline == 0)
+            bytesperline = width;
+        if (bytesperline < width)
+            return -1;
+    }
+    else
+        return -1;
+
+    if (width == 0 || height == 0 || (width | height) & 1)
+        return -1;
+
+    conv->from = from;
+    conv->to = to;
+    conv->width = width;
+    conv->height = height;
+    conv->bytesperline = bytesperline;
+
+    switch (to) {
+        case V4L2_PIX_FMT_NV12:
+        case V4L2_PIX_FMT_YUV420:
+            conv->size = (size_t)width * height * 3 / 2;
+            break;
+        case V4L2_PIX_FMT_GREY:
+            conv->size = (size_t)width * height;
+            break;
+        case V4L2_PIX_FMT_RGB24:
+            conv->size = (size_t)width * height * 3;
+            break;
+        default:
+            conv->size = (size_t)width * height * 4;
+            break;
+    }
+
+    conv->isa = isa < best ? isa : best;
+    switch (conv->isa) {
+#if defined(V4L2_CONVERT_X86)
+        case V4L2_CONVERT_ISA_AVX512:
+            conv->kernels = &v4l2_convert_kernels_avx512;
+            break;
+        case V4L2_CONVERT_ISA_AVX2:
+            conv->kernels = &v4l2_convert_kernels_avx2;
+            break;
+        case V4L2_CONVERT_ISA_SSE2:
+            conv->kernels = &v4l2_convert_kernels_sse2;
+            break;
+#endif
+        default:
+            conv->isa = V4L2_CONVERT_ISA_SCALAR;
+            conv->kernels = &v4l2_convert_kernels_c;
+            break;
+    }
+
+    conv->scratch = malloc(v4l2_convert_scratch_size(conv));
+    if (conv->scratch == NULL) {
+        fprintf(stderr, "malloc() failed\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+size_t v4l2_convert_scratch_size(const struct v4l2_convert* conv)
+{
+    /* three rows of chroma or one row of RGBA */
+    return 4 * (size_t)conv->width;
+}
+
+void v4l2_convert_destroy(struct v4l2_convert* conv)
+{
+    free(conv->scratch);
+    conv->scratch = NULL;
+}
+
+int v4l2_convert_check(const struct v4l2_convert* conv, const struct iovec* planes, size_t nplanes)
+{
+    size_t width = conv->width;
+    size_t height = conv->height;
+    size_t stride = conv->bytesperline;
+
+    if (nplanes == 0 || planes[0].iov_base == NULL)
+        return -1;
+
+    if (v4l2_convert_packed(conv->from))
+        return planes[0].iov_len < (height - 1) * stride + 2 * width ? -1 : 0;
+
+    if (conv->from == V4L2_PIX_FMT_NV12M)
+        return nplanes < 2 || planes[1].iov_base == NULL ||
+            planes[1].iov_len < (height / 2 - 1) * stride + width ||
+            planes[0].iov_len < (height - 1) * stride + width ? -1 : 0;
+
+    return planes[0].iov_len < (height + height / 2 - 1) * stride + width ? -1 : 0;
+}
+
+void v4l2_convert_rows(const struct v4l2_convert* conv, const struct iovec* planes, uint8_t* dst,
+    uint32_t first_row, uint32_t last_row, uint8_t* scratch)
+{
+    const struct v4l2_convert_kernels* k = conv->kernels;
+    size_t width = conv->width;
+    size_t height = conv->height;
+    size_t stride = conv->bytesperline;
+    const uint8_t* src = planes[0].iov_base;
+    size_t j;
+
+    if (v4l2_convert_packed(conv->from)) {
+        uint8_t* c0 = scratch;
+        uint8_t* c1 = scratch + width;
+        uint8_t* uv = scratch + 2 * width;
+        int uyvy = conv->from == V4L2_PIX_FMT_UYVY;
+
+        for (j = first_row; j < last_row; j += 2) {
+            const uint8_t* row0 = src + j * stride;
+            const uint8_t* row1 = row0 + stride;
+            uint8_t* y0 = dst + j * width;
+            uint8_t* y1 = y0 + width;
+
+            /* luma and chroma samples alternate, chroma being U and V in turn */
+            if (uyvy) {
+                k->deinterleave(row0, c0, y0, width);
+                k->deinterleave(row1, c1, y1, width);
+            }
+            else {
+                k->deinterleave(row0, y0, c0, width);
+                k->deinterleave(row1, y1, c1, width);
+            }
+
+            if (conv->to == V4L2_PIX_FMT_GREY)
+                continue;
+
+            if (conv->to == V4L2_PIX_FMT_NV12)
+                k->average(c0, c1, dst + width * height + j / 2 * width, width);
+            else {
+                uint8_t* cb = dst + width * height + j / 2 * (width / 2);
+                uint8_t* cr = cb + width * height / 4;
+
+                k->average(c0, c1, uv, width);
+                k->deinterleave(uv, cb, cr, width / 2);
+            }
+        }
+    }
+    else {
+        const uint8_t* chroma = conv->from == V4L2_PIX_FMT_NV12M ?
+            (const uint8_t*)planes[1].iov_base : src + height * stride;
+
+        for (j = first_row; j < last_row; ++j) {
+            const uint8_t* y = src + j * stride;
+            const uint8_t* uv = chroma + j / 2 * stride;
+
+            if (conv->to == V4L2_PIX_FMT_ABGR32)
+                k->yuv_to_rgba(y, uv, dst + j * width * 4, width, 1);
+            else {
+                k->yuv_to_rgba(y, uv, scratch, width, 0);
+                k->rgba_to_rgb(scratch, dst + j * width * 3, width);
+            }
+        }
+    }
+}
+
+int v4l2_convert_frame(const struct v4l2_convert* conv, const struct iovec* planes, size_t nplanes, uint8_t* dst)
+{
+    if (v4l2_convert_check(conv, planes, nplanes))
+        return -1;
+
+    v4l2_convert_rows(conv, planes, dst, 0, conv->height, conv->scratch);
+
+    return 0;
+}
+
+/*===========================================================================*\
+ * local function definitions
+\*===========================================================================*/
+static void v4l2_deinterleave_c(const uint8_t* src, uint8_t* even, uint8_t* odd, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n; ++i) {
+        even[i] = src[2 * i];
+        odd[i] = src[2 * i + 1];
+    }
+}
+
+static void v4l2_average_c(const uint8_t* a, const uint8_t* b, uint8_t* dst, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n; ++i)
+        dst[i] = (a[i] + b[i] + 1) >> 1;
+}
+
+static void v4l2_yuv_to_rgba_c(const uint8_t* y, const uint8_t* uv, uint8_t* dst, size_t width, int bgr)
+{
+    uint8_t r, g, b;
+    size_t x;
+
+    for (x = 0; x < width; ++x) {
+        v4l2_convert_pixel(y[x], uv[x & ~(size_t)1], uv[x | 1], &r, &g, &b);
+        dst[4 * x + 0] = bgr ? b : r;
+        dst[4 * x + 1] = g;
+        dst[4 * x + 2] = bgr ? r : b;
+        dst[4 * x + 3] = 0xff;
+    }
+}
+
+static void v4l2_rgba_to_rgb_c(const uint8_t* src, uint8_t* dst, size_t width)
+{
+    size_t x;
+
+    for (x = 0; x < width; ++x) {
+        dst[3 * x + 0] = src[4 * x + 0];
+        dst[3 * x + 1] = src[4 * x + 1];
+        dst[3 * x + 2] = src[4 * x + 2];
+    }
+}
+
+#if defined(V4L2_CONVERT_X86)
+__attribute__((target("sse2")))
+static void v4l2_deinterleave_sse2(const uint8_t* src, uint8_t* even, uint8_t* odd, size_t n)
+{
+    const __m128i mask = _mm_set1_epi16(0x00ff);
+    size_t i;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(src + 2 * i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(src + 2 * i + 16));
+
+        _mm_storeu_si128((__m128i*)(even + i),
+            _mm_packus_epi16(_mm_and_si128(a, mask), _mm_and_si128(b, mask)));
+        _mm_storeu_si128((__m128i*)(odd + i),
+            _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8)));
+    }
+
+    v4l2_deinterleave_c(src + 2 * i, even + i, odd + i, n - i);
+}
+
+__attribute__((target("sse2")))
+static void v4l2_average_sse2(const uint8_t* a, const uint8_t* b, uint8_t* dst, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i + 16 <= n; i += 16)
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_avg_epu8(
+            _mm_loadu_si128((const __m128i*)(a + i)), _mm_loadu_si128((const __m128i*)(b + i))));
+
+    v4l2_average_c(a + i, b + i, dst + i, n - i);
+}
+
+/* interleaves 16 samples of four channels */
+__attribute__((target("sse2")))
+static void v4l2_store_rgba_sse2(uint8_t* dst, __m128i c0, __m128i c1, __m128i c2, __m128i c3)
+{
+    __m128i lo01 = _mm_unpacklo_epi8(c0, c1);
+    __m128i hi01 = _mm_unpackhi_epi8(c0, c1);
+    __m128i lo23 = _mm_unpacklo_epi8(c2, c3);
+    __m128i hi23 = _mm_unpackhi_epi8(c2, c3);
+
+    _mm_storeu_si128((__m128i*)(dst + 0), _mm_unpacklo_epi16(lo01, lo23));
+    _mm_storeu_si128((__m128i*)(dst + 16), _mm_unpackhi_epi16(lo01, lo23));
+    _mm_storeu_si128((__m128i*)(dst + 32), _mm_unpacklo_epi16(hi01, hi23));
+    _mm_storeu_si128((__m128i*)(dst + 48), _mm_unpackhi_epi16(hi01, hi23));
+}
+
+/* the same as v4l2_convert_pixel() on eight pixels */
+__attribute__((target("sse2")))
+static void v4l2_convert_pixels_sse2(__m128i y, __m128i uv, __m128i* r, __m128i* g, __m128i* b)
+{
+    const __m128i offset = _mm_set1_epi16(128);
+    __m128i u = _mm_sub_epi16(_mm_and_si128(uv, _mm_set1_epi16(0x00ff)), offset);
+    __m128i v = _mm_sub_epi16(_mm_srli_epi16(uv, 8), offset);
+    __m128i c = _mm_add_epi16(_mm_mullo_epi16(_mm_sub_epi16(y, _mm_set1_epi16(16)), _mm_set1_epi16(74)),
+        _mm_set1_epi16(32));
+
+    *r = _mm_srai_epi16(_mm_add_epi16(c, _mm_mullo_epi16(v, _mm_set1_epi16(102))), 6);
+    *g = _mm_srai_epi16(_mm_sub_epi16(_mm_sub_epi16(c, _mm_mullo_epi16(u, _mm_set1_epi16(25))),
+        _mm_mullo_epi16(v, _mm_set1_epi16(52))), 6);
+    *b = _mm_srai_epi16(_mm_adds_epi16(c, _mm_mullo_epi16(u, _mm_set1_epi16(129))), 6);
+}
+
+__attribute__((target("sse2")))
+static void v4l2_yuv_to_rgba_sse2(const uint8_t* y, const uint8_t* uv, uint8_t* dst, size_t width, int bgr)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i alpha = _mm_set1_epi8(-1);
+    size_t x;
+
+    for (x = 0; x + 16 <= width; x += 16) {
+        __m128i y8 = _mm_loadu_si128((const __m128i*)(y + x));
+        __m128i uv8 = _mm_loadu_si128((const __m128i*)(uv + x));
+        __m128i r0, g0, b0, r1, g1, b1, r, g, b;
+
+        /* every chroma pair serves two pixels */
+        v4l2_convert_pixels_sse2(_mm_unpacklo_epi8(y8, zero), _mm_unpacklo_epi16(uv8, uv8), &r0, &g0, &b0);
+        v4l2_convert_pixels_sse2(_mm_unpackhi_epi8(y8, zero), _mm_unpackhi_epi16(uv8, uv8), &r1, &g1, &b1);
+
+        r = _mm_packus_epi16(r0, r1);
+        g = _mm_packus_epi16(g0, g1);
+        b = _mm_packus_epi16(b0, b1);
+
+        if (bgr)
+            v4l2_store_rgba_sse2(dst + 4 * x, b, g, r, alpha);
+        else
+            v4l2_store_rgba_sse2(dst + 4 * x, r, g, b, alpha);
+    }
+
+    v4l2_yuv_to_rgba_c(y + x, uv + x, dst + 4 * x, width - x, bgr);
+}
+
+__attribute__((target("ssse3")))
+static void v4l2_rgba_to_rgb_ssse3(const uint8_t* src, uint8_t* dst, size_t width)
+{
+    const __m128i shuffle = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    size_t x;
+
+    /* 16 bytes are stored, 12 of them valid, so the last few pixels are left to the C loop */
+    for (x = 0; x + 6 <= width; x += 4)
+        _mm_storeu_si128((__m128i*)(dst + 3 * x),
+            _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(src + 4 * x)), shuffle));
+
+    v4l2_rgba_to_rgb_c(src + 4 * x, dst + 3 * x, width - x);
+}
+
+__attribute__((target("avx2")))
+static void v4l2_deinterleave_avx2(const uint8_t* src, uint8_t* even, uint8_t* odd, size_t n)
+{
+    const __m256i mask = _mm256_set1_epi16(0x00ff);
+    size_t i;
+
+    for (i = 0; i + 32 <= n; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(src + 2 * i));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(src + 2 * i + 32));
+
+        /* packing works within 128 bit lanes, quadwords 1 and 2 end up swapped */
+        _mm256_storeu_si256((__m256i*)(even + i), _mm256_permute4x64_epi64(
+            _mm256_packus_epi16(_mm256_and_si256(a, mask), _mm256_and_si256(b, mask)), 0xd8));
+        _mm256_storeu_si256((__m256i*)(odd + i), _mm256_permute4x64_epi64(
+            _mm256_packus_epi16(_mm256_srli_epi16(a, 8), _mm256_srli_epi16(b, 8)), 0xd8));
+    }
+
+    v4l2_deinterleave_sse2(src + 2 * i, even + i, odd + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void v4l2_average_avx2(const uint8_t* a, const uint8_t* b, uint8_t* dst, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i + 32 <= n; i += 32)
+        _mm256_storeu_si256((__m256i*)(dst + i), _mm256_avg_epu8(
+            _mm256_loadu_si256((const __m256i*)(a + i)), _mm256_loadu_si256((const __m256i*)(b + i))));
+
+    v4l2_average_sse2(a + i, b + i, dst + i, n - i);
+}
+
+/* the same as v4l2_convert_pixel() on sixteen pixels */
+__attribute__((target("avx2")))
+static void v4l2_convert_pixels_avx2(__m256i y, __m256i uv, __m256i* r, __m256i* g, __m256i* b)
+{
+    const __m256i offset = _mm256_set1_epi16(128);
+    __m256i u = _mm256_sub_epi16(_mm256_and_si256(uv, _mm256_set1_epi16(0x00ff)), offset);
+    __m256i v = _mm256_sub_epi16(_mm256_srli_epi16(uv, 8), offset);
+    __m256i c = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_sub_epi16(y, _mm256_set1_epi16(16)),
+        _mm256_set1_epi16(74)), _mm256_set1_epi16(32));
+
+    *r = _mm256_srai_epi16(_mm256_add_epi16(c, _mm256_mullo_epi16(v, _mm256_set1_epi16(102))), 6);
+    *g = _mm256_srai_epi16(_mm256_sub_epi16(_mm256_sub_epi16(c, _mm256_mullo_epi16(u, _mm256_set1_epi16(25))),
+        _mm256_mullo_epi16(v, _mm256_set1_epi16(52))), 6);
+    *b = _mm256_srai_epi16(_mm256_adds_epi16(c, _mm256_mullo_epi16(u, _mm256_set1_epi16(129))), 6);
+}
+
+__attribute__((target("avx2")))
+static void v4l2_yuv_to_rgba_avx2(const uint8_t* y, const uint8_t* uv, uint8_t* dst, size_t width, int bgr)
+{
+    const __m256i alpha = _mm256_set1_epi16(0xff);
+    size_t x;
+
+    for (x = 0; x + 16 <= width; x += 16) {
+        __m256i y16 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(y + x)));
+        __m256i uv32 = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(uv + x)));
+        __m256i r, g, b, rg, ba;
+
+        /* every chroma pair serves two pixels */
+        v4l2_convert_pixels_avx2(y16, _mm256_or_si256(uv32, _mm256_slli_epi32(uv32, 16)), &r, &g, &b);
+
+        rg = _mm256_permute4x64_epi64(_mm256_packus_epi16(r, g), 0xd8);
+        ba = _mm256_permute4x64_epi64(_mm256_packus_epi16(b, alpha), 0xd8);
+
+        if (bgr)
+            v4l2_store_rgba_sse2(dst + 4 * x, _mm256_castsi256_si128(ba), _mm256_extracti128_si256(rg, 1),
+                _mm256_castsi256_si128(rg), _mm256_extracti128_si256(ba, 1));
+        else
+            v4l2_store_rgba_sse2(dst + 4 * x, _mm256_castsi256_si128(rg), _mm256_extracti128_si256(rg, 1),
+                _mm256_castsi256_si128(ba), _mm256_extracti128_si256(ba, 1));
+    }
+
+    v4l2_yuv_to_rgba_c(y + x, uv + x, dst + 4 * x, width - x, bgr);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void v4l2_deinterleave_avx512(const uint8_t* src, uint8_t* even, uint8_t* odd, size_t n)
+{
+    size_t i;
+
+    /* truncating words to bytes keeps the order, unlike packing */
+    for (i = 0; i + 32 <= n; i += 32) {
+        __m512i a = _mm512_loadu_si512((const void*)(src + 2 * i));
+
+        _mm256_storeu_si256((__m256i*)(even + i), _mm512_cvtepi16_epi8(a));
+        _mm256_storeu_si256((__m256i*)(odd + i), _mm512_cvtepi16_epi8(_mm512_srli_epi16(a, 8)));
+    }
+
+    v4l2_deinterleave_avx2(src + 2 * i, even + i, odd + i, n - i);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void v4l2_average_avx512(const uint8_t* a, const uint8_t* b, uint8_t* dst, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i + 64 <= n; i += 64)
+        _mm512_storeu_si512((void*)(dst + i), _mm512_avg_epu8(
+            _mm512_loadu_si512((const void*)(a + i)), _mm512_loadu_si512((const void*)(b + i))));
+
+    v4l2_average_avx2(a + i, b + i, dst + i, n - i);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void v4l2_yuv_to_rgba_avx512(const uint8_t* y, const uint8_t* uv, uint8_t* dst, size_t width, int bgr)
+{
+    const __m512i zero = _mm512_setzero_si512();
+    const __m512i offset = _mm512_set1_epi16(128);
+    const __m128i alpha = _mm_set1_epi8(-1);
+    size_t x;
+
+    for (x = 0; x + 32 <= width; x += 32) {
+        __m512i y16 = _mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i*)(y + x)));
+        __m512i uv32 = _mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i*)(uv + x)));
+        __m512i uv16 = _mm512_or_si512(uv32, _mm512_slli_epi32(uv32, 16));
+        __m512i u = _mm512_sub_epi16(_mm512_and_si512(uv16, _mm512_set1_epi16(0x00ff)), offset);
+        __m512i v = _mm512_sub_epi16(_mm512_srli_epi16(uv16, 8), offset);
+        __m512i c = _mm512_add_epi16(_mm512_mullo_epi16(_mm512_sub_epi16(y16, _mm512_set1_epi16(16)),
+            _mm512_set1_epi16(74)), _mm512_set1_epi16(32));
+        __m256i r, g, b;
+
+        /* unsigned saturation of the narrowing conversion clamps above, max() below */
+        r = _mm512_cvtusepi16_epi8(_mm512_max_epi16(_mm512_srai_epi16(
+            _mm512_add_epi16(c, _mm512_mullo_epi16(v, _mm512_set1_epi16(102))), 6), zero));
+        g = _mm512_cvtusepi16_epi8(_mm512_max_epi16(_mm512_srai_epi16(
+            _mm512_sub_epi16(_mm512_sub_epi16(c, _mm512_mullo_epi16(u, _mm512_set1_epi16(25))),
+                _mm512_mullo_epi16(v, _mm512_set1_epi16(52))), 6), zero));
+        b = _mm512_cvtusepi16_epi8(_mm512_max_epi16(_mm512_srai_epi16(
+            _mm512_adds_epi16(c, _mm512_mullo_epi16(u, _mm512_set1_epi16(129))), 6), zero));
+
+        if (bgr) {
+            __m256i t = r;
+            r = b;
+            b = t;
+        }
+
+        v4l2_store_rgba_sse2(dst + 4 * x, _mm256_castsi256_si128(r), _mm256_castsi256_si128(g),
+            _mm256_castsi256_si128(b), alpha);
+        v4l2_store_rgba_sse2(dst + 4 * x + 64, _mm256_extracti128_si256(r, 1), _mm256_extracti128_si256(g, 1),
+            _mm256_extracti128_si256(b, 1), alpha);
+    }
+
+    v4l2_yuv_to_rgba_avx2(y + x, uv + x, dst + 4 * x, width - x, bgr);
+}
+#endif
+
+/* plain per-pixel conversions the kernels are checked against */
+static void v4l2_reference_packed(uint32_t from, uint32_t to, uint32_t width, uint32_t height,
+    uint32_t stride, const uint8_t* src, uint8_t* dst)
+{
+    int yoff = from == V4L2_PIX_FMT_UYVY;
+    uint8_t* luma = dst;
+    uint8_t* chroma = dst + width * height;
+    uint32_t i, j;
+
+    for (j = 0; j < height; j += 2) {
+        const uint8_t* row0 = src + j * stride;
+        const uint8_t* row1 = row0 + stride;
+
+        for (i = 0; i < width / 2; ++i) {
+            int u = (row0[4 * i + 1 - yoff] + row1[4 * i + 1 - yoff] + 1) >> 1;
+            int v = (row0[4 * i + 3 - yoff] + row1[4 * i + 3 - yoff] + 1) >> 1;
+
+            luma[j * width + 2 * i] = row0[4 * i + yoff];
+            luma[j * width + 2 * i + 1] = row0[4 * i + 2 + yoff];
+            luma[(j + 1) * width + 2 * i] = row1[4 * i + yoff];
+            luma[(j + 1) * width + 2 * i + 1] = row1[4 * i + 2 + yoff];
+
+            if (to == V4L2_PIX_FMT_NV12) {
+                chroma[j / 2 * width + 2 * i] = u;
+                chroma[j / 2 * width + 2 * i + 1] = v;
+            }
+            else
+            if (to == V4L2_PIX_FMT_YUV420) {
+                chroma[j / 2 * (width / 2) + i] = u;
+                chroma[width * height / 4 + j / 2 * (width / 2) + i] = v;
+            }
+        }
+    }
+}
+
+static void v4l2_reference_nv12(uint32_t to, uint32_t width, uint32_t height, uint32_t stride,
+    const uint8_t* luma, const uint8_t* chroma, uint8_t* dst)
+{
+    size_t bpp = to == V4L2_PIX_FMT_RGB24 ? 3 : 4;
+    uint8_t r, g, b;
+    uint32_t i, j;
+
+    for (j = 0; j < height; ++j) {
+        for (i = 0; i < width; ++i) {
+            const uint8_t* uv = chroma + j / 2 * stride + i / 2 * 2;
+            uint8_t* p = dst + ((size_t)j * width + i) * bpp;
+
+            v4l2_convert_pixel(luma[j * stride + i], uv[0], uv[1], &r, &g, &b);
+            if (bpp == 3) {
+                p[0] = r;
+                p[1] = g;
+                p[2] = b;
+            }
+            else {
+                p[0] = b;
+                p[1] = g;
+                p[2] = r;
+                p[3] = 0xff;
+            }
+        }
+    }
+}
+
+int v4l2_convert_selftest(void)
+{
+    static const uint32_t sizes[][2] = {{2, 2}, {6, 4}, {34, 6}, {130, 8}, {642, 10}};
+    static const uint32_t pairs[][2] = {
+        {V4L2_PIX_FMT_YUYV, V4L2_PIX_FMT_NV12},
+        {V4L2_PIX_FMT_YUYV, V4L2_PIX_FMT_YUV420},
+        {V4L2_PIX_FMT_YUYV, V4L2_PIX_FMT_GREY},
+        {V4L2_PIX_FMT_UYVY, V4L2_PIX_FMT_NV12},
+        {V4L2_PIX_FMT_UYVY, V4L2_PIX_FMT_YUV420},
+        {V4L2_PIX_FMT_NV12, V4L2_PIX_FMT_RGB24},
+        {V4L2_PIX_FMT_NV12, V4L2_PIX_FMT_ABGR32},
+        {V4L2_PIX_FMT_NV12M, V4L2_PIX_FMT_RGB24},
+        {V4L2_PIX_FMT_NV12M, V4L2_PIX_FMT_ABGR32},
+    };
+    /* room for padded strides and for 4 bytes per pixel */
+    static uint8_t src[2 * (V4L2_CONVERT_SELFTEST_MAX_WIDTH + 32) * V4L2_CONVERT_SELFTEST_MAX_HEIGHT];
+    static uint8_t expected[4 * V4L2_CONVERT_SELFTEST_MAX_WIDTH * V4L2_CONVERT_SELFTEST_MAX_HEIGHT];
+    static uint8_t result[4 * V4L2_CONVERT_SELFTEST_MAX_WIDTH * V4L2_CONVERT_SELFTEST_MAX_HEIGHT + 1];
+    enum v4l2_convert_isa best = v4l2_convert_detect();
+    uint32_t seed = 0x12345678;
+    unsigned failures = 0;
+    unsigned checks = 0;
+    size_t p, s, n;
+    int isa;
+
+    for (p = 0; p < sizeof(pairs) / sizeof(pairs[0]); ++p) {
+        for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+            uint32_t from = pairs[p][0];
+            uint32_t to = pairs[p][1];
+            uint32_t width = sizes[s][0];
+            uint32_t height = sizes[s][1];
+            uint32_t stride = (v4l2_convert_packed(from) ? 2 * width : width) + 32;
+            struct iovec planes[2];
+            size_t nplanes = 1;
+
+            /* extremes are the interesting values for clamping and saturation */
+            for (n = 0; n < sizeof(src); ++n) {
+                seed = seed * 1103515245 + 12345;
+                src[n] = (seed >> 16) % 5 == 0 ? ((seed >> 8) & 1) * 255 : seed >> 24;
+            }
+
+            planes[0].iov_base = src;
+            planes[0].iov_len = (size_t)stride * height;
+
+            if (v4l2_convert_packed(from))
+                v4l2_reference_packed(from, to, width, height, stride, src, expected);
+            else {
+                if (from == V4L2_PIX_FMT_NV12M) {
+                    planes[1].iov_base = src + stride * height + stride / 2;
+                    planes[1].iov_len = (size_t)stride * height / 2;
+                    nplanes = 2;
+                }
+                else
+                    planes[0].iov_len = (size_t)stride * height * 3 / 2;
+
+                v4l2_reference_nv12(to, width, height, stride, src,
+                    nplanes == 2 ? planes[1].iov_base : src + stride * height, expected);
+            }
+
+            for (isa = V4L2_CONVERT_ISA_SCALAR; isa <= (int)best; ++isa) {
+                struct v4l2_convert conv;
+
+                if (-1 == v4l2_convert_init(&conv, from, to, width, height, stride, isa)) {
+                    fprintf(stdout, "%.4s -> %.4s %ux%u: not supported\n",
+                        (const char*)&from, (const char*)&to, width, height);
+                    failures++;
+                    continue;
+                }
+
+                memset(result, 0x5a, sizeof(result));
+                if (-1 == v4l2_convert_frame(&conv, planes, nplanes, result) ||
+                    memcmp(result, expected, conv.size)) {
+                    fprintf(stdout, "%.4s -> %.4s %ux%u: %s differs from reference\n",
+                        (const char*)&from, (const char*)&to, width, height, v4l2_convert_isa_name(isa));
+                    failures++;
+                }
+                else
+                if (result[conv.size] != 0x5a) {
+                    fprintf(stdout, "%.4s -> %.4s %ux%u: %s writes past the end of the frame\n",
+                        (const char*)&from, (const char*)&to, width, height, v4l2_convert_isa_name(isa));
+                    failures++;
+                }
+                else {
+                    uint32_t row;
+
+                    /* stripes of two rows, last to first, as they may come out of a worker pool */
+                    memset(result, 0x5a, sizeof(result));
+                    for (row = height; row > 0; row -= 2)
+                        v4l2_convert_rows(&conv, planes, result, row - 2, row, conv.scratch);
+
+                    if (memcmp(result, expected, conv.size)) {
+                        fprintf(stdout, "%.4s -> %.4s %ux%u: %s differs from reference when converted in stripes\n",
+                            (const char*)&from, (const char*)&to, width, height, v4l2_convert_isa_name(isa));
+                        failures++;
+                    }
+                }
+
+                checks++;
+                v4l2_convert_destroy(&conv);
+            }
+        }
+    }
+
+    fprintf(stdout, "conversions checked: %u (up to %s), failures: %u\n",
+        checks, v4l2_convert_isa_name(best), failures);
+
+    return failures ? -1 : 0;
+}
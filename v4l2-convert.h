@@ -0,0 +1,111 @@
+/* SPDX-License-Identifier: MIT */
+/**
+ * @file v4l2-convert.h
+ *
+ * Conversion of captured frames to another pixel format before they are stored:
+ * YUYV/UYVY to NV12, I420 (YU12) or GREY and NV12/NV12M to RGB24 (RGB3) or BGRA (AR24).
+ * Every conversion is built of a few row kernels (deinterleave, average of two rows,
+ * YUV to RGB), available in plain C and in SSE2, AVX2 and AVX-512BW flavours,
+ * the latter being picked at run time according to what the CPU supports.
+ * All flavours give bit-exact results, v4l2_convert_selftest() checks that.
+ * YUV to RGB follows BT.601 limited range, chroma is subsampled by averaging
+ * two rows and upsampled by repeating samples.
+ * Width and height have to be even, converted frame is tightly packed.
+ */
+
+#ifndef _V4L2_CONVERT_H_
+#define _V4L2_CONVERT_H_
+
+/*===========================================================================*\
+ * system header files
+\*===========================================================================*/
+#include <stdint.h>
+#include <stddef.h>
+
+#include <sys/uio.h>
+
+/*===========================================================================*\
+ * project header files
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * preprocessor #define constants and macros
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * global type definitions
+\*===========================================================================*/
+enum v4l2_convert_isa
+{
+    V4L2_CONVERT_ISA_SCALAR,
+    V4L2_CONVERT_ISA_SSE2,
+    V4L2_CONVERT_ISA_AVX2,
+    V4L2_CONVERT_ISA_AVX512,
+};
+
+struct v4l2_convert_kernels;
+
+struct v4l2_convert
+{
+    uint32_t from;
+    uint32_t to;
+    uint32_t width;
+    uint32_t height;
+    uint32_t bytesperline;   /* of the captured frame, chroma plane of NV12M included */
+    size_t size;             /* of a converted frame */
+    enum v4l2_convert_isa isa;
+    const struct v4l2_convert_kernels* kernels;
+    uint8_t* scratch;        /* used by v4l2_convert_frame(), which is not meant to be shared by threads */
+};
+
+/*===========================================================================*\
+ * global object declarations
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * function forward declarations
+\*===========================================================================*/
+
+/** Best instruction set the CPU (and the operating system) supports */
+enum v4l2_convert_isa v4l2_convert_detect(void);
+
+const char* v4l2_convert_isa_name(enum v4l2_convert_isa isa);
+
+/**
+ * Prepares conversion of from frames to to frames, using isa or the best instruction
+ * set the CPU supports, whichever is lower. bytesperline of 0 means tightly packed frames.
+ * Returns 0 on success, -1 when the conversion is not supported.
+ */
+int v4l2_convert_init(struct v4l2_convert* conv, uint32_t from, uint32_t to,
+    uint32_t width, uint32_t height, uint32_t bytesperline, enum v4l2_convert_isa isa);
+
+void v4l2_convert_destroy(struct v4l2_convert* conv);
+
+/** Bytes of scratch memory v4l2_convert_rows() needs */
+size_t v4l2_convert_scratch_size(const struct v4l2_convert* conv);
+
+/** Returns 0 if planes (with their bytes used) hold a whole frame, -1 if they are shorter */
+int v4l2_convert_check(const struct v4l2_convert* conv, const struct iovec* planes, size_t nplanes);
+
+/**
+ * Converts rows [first_row, last_row) of a frame checked by v4l2_convert_check() into dst
+ * of conv->size bytes, using scratch of v4l2_convert_scratch_size() bytes. Rows of YUYV
+ * and UYVY frames go in pairs, first_row and last_row have to be even. Distinct rows
+ * may be converted by distinct threads at the same time, as long as each has its own scratch.
+ */
+void v4l2_convert_rows(const struct v4l2_convert* conv, const struct iovec* planes, uint8_t* dst,
+    uint32_t first_row, uint32_t last_row, uint8_t* scratch);
+
+/**
+ * Converts a frame given as planes (with their bytes used) into dst of conv->size bytes.
+ * Returns 0 on success, -1 when the frame is shorter than its format says.
+ */
+int v4l2_convert_frame(const struct v4l2_convert* conv, const struct iovec* planes, size_t nplanes, uint8_t* dst);
+
+/**
+ * Compares every supported conversion, in every instruction set the CPU supports,
+ * against a plain per-pixel implementation. Returns 0 when all are bit-exact.
+ */
+int v4l2_convert_selftest(void);
+
+#endif /* _V4L2_CONVERT_H_ */
@@ -0,0 +1,368 @@
+/* SPDX-License-Identifier: MIT */
+/**
+ * @file v4l2-dmabuf.c
+ *
+ * Allocation of DMABUF buffers (see v4l2-dmabuf.h).
+ */
+
+/*===========================================================================*\
+ * system header files
+\*===========================================================================*/
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <sys/mman.h>
+
+#include <linux/dma-heap.h>
+#include <linux/udmabuf.h>
+
+/*===========================================================================*\
+ * project header files
+\*===========================================================================*/
+#include "v4l2-dmabuf.h"
+
+/*===========================================================================*\
+ * preprocessor #define constants and macros
+\*===========================================================================*/
+#define MEMFD_FILE_NAME "dmabuf"
+#define UDMABUF_DEVICE_NAME "/dev/udmabuf"
+#define DMA_HEAP_DIRECTORY "/dev/dma_heap"
+#define IS_POWER_OF_TWO(x) (((x) & ((x) - 1)) == 0)
+#define ALIGN(x, a) __ALIGN(x, (a) - 1)
+#define __ALIGN(x, mask) (((x) + (mask)) & ~(mask))
+
+/*===========================================================================*\
+ * local type definitions
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * global object definitions
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * local function declarations
+\*===========================================================================*/
+static int v4l2_dmabuf_open_heap(struct v4l2_dmabuf_allocator* allocator, bool quiet);
+static int v4l2_dmabuf_open_udmabuf(struct v4l2_dmabuf_allocator* allocator, bool quiet);
+static int v4l2_dmabuf_heap_alloc(struct v4l2_dmabuf_allocator* allocator, const size_t* sizes,
+    const size_t* offsets, unsigned count, size_t total, int* fds, void** addrs);
+static int v4l2_dmabuf_udmabuf_alloc(struct v4l2_dmabuf_allocator* allocator, const size_t* sizes,
+    const size_t* offsets, unsigned count, size_t total, int* fds, void** addrs, struct v4l2_hugepage_stats* stats);
+static int v4l2_create_memory_fd(size_t size);
+static int v4l2_create_dmabuf_fd(int fd, int memfd, size_t offset, size_t size);
+
+/*===========================================================================*\
+ * local object definitions
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * inline function definitions
+\*===========================================================================*/
+static inline size_t v4l2_dmabuf_page_align(size_t size)
+{
+    long pagesize = sysconf(_SC_PAGESIZE);
+
+    if (pagesize <= 0 || !IS_POWER_OF_TWO(pagesize))
+        pagesize = 0x1000; // set default value to 4KiB
+
+    return ALIGN(size, pagesize);
+}
+
+/*===========================================================================*\
+ * public function definitions
+\*===========================================================================*/
+int v4l2_dmabuf_allocator_open(struct v4l2_dmabuf_allocator* allocator, enum v4l2_dmabuf_source source,
+    const char* heap, bool hugepages)
+{
+    memset(allocator, 0, sizeof(*allocator));
+    allocator->fd = -1;
+    allocator->hugepages = hugepages;
+    snprintf(allocator->heap, sizeof(allocator->heap), "%s", heap ? heap : V4L2_DMABUF_DEFAULT_HEAP);
+
+    switch (source) {
+        case V4L2_DMABUF_SOURCE_HEAP:
+            return v4l2_dmabuf_open_heap(allocator, false);
+
+        case V4L2_DMABUF_SOURCE_UDMABUF:
+            return v4l2_dmabuf_open_udmabuf(allocator, false);
+
+        default:
+            /* heaps need no kernel patch, but only udmabuf can be backed by huge pages */
+            if (hugepages) {
+                if (0 == v4l2_dmabuf_open_udmabuf(allocator, true) || 0 == v4l2_dmabuf_open_heap(allocator, true))
+                    return 0;
+            } else {
+                if (0 == v4l2_dmabuf_open_heap(allocator, true) || 0 == v4l2_dmabuf_open_udmabuf(allocator, true))
+                    return 0;
+            }
+
+            fprintf(stderr, "neither %s/%s nor %s is available\n",
+                DMA_HEAP_DIRECTORY, allocator->heap, UDMABUF_DEVICE_NAME);
+            return -1;
+    }
+}
+
+void v4l2_dmabuf_allocator_close(struct v4l2_dmabuf_allocator* allocator)
+{
+    while (allocator->number_of_pools > 0) {
+        allocator->number_of_pools--;
+        munmap(allocator->pools[allocator->number_of_pools].addr, allocator->pools[allocator->number_of_pools].size);
+    }
+
+    if (allocator->fd != -1)
+        close(allocator->fd);
+    allocator->fd = -1;
+}
+
+int v4l2_dmabuf_alloc_pool(struct v4l2_dmabuf_allocator* allocator, const size_t* sizes, unsigned count,
+    int* fds, void** addrs, struct v4l2_hugepage_stats* stats)
+{
+    size_t offsets[count];
+    size_t total = 0;
+    unsigned i;
+    int status;
+
+    if (allocator->number_of_pools == V4L2_DMABUF_MAX_POOLS) {
+        fprintf(stderr, "too many dmabuf pools, at most %d are supported\n", V4L2_DMABUF_MAX_POOLS);
+        return -1;
+    }
+
+    for (i = 0; i < count; ++i) {
+        offsets[i] = total;
+        total += v4l2_dmabuf_page_align(sizes[i]);
+    }
+
+    if (allocator->source == V4L2_DMABUF_SOURCE_HEAP)
+        status = v4l2_dmabuf_heap_alloc(allocator, sizes, offsets, count, total, fds, addrs);
+    else
+        status = v4l2_dmabuf_udmabuf_alloc(allocator, sizes, offsets, count, total, fds, addrs, stats);
+
+    /* huge page backed pools are longer than total, see v4l2_dmabuf_udmabuf_alloc() */
+    if (status == 0) {
+        allocator->pools[allocator->number_of_pools].addr = addrs[0];
+        allocator->pools[allocator->number_of_pools].size =
+            allocator->source == V4L2_DMABUF_SOURCE_UDMABUF && allocator->hugepages ? v4l2_hugepage_round(total) : total;
+        allocator->number_of_pools++;
+    }
+
+    return status;
+}
+
+int v4l2_dmabuf_free_pool(struct v4l2_dmabuf_allocator* allocator, void* addr)
+{
+    unsigned i;
+
+    for (i = 0; i < allocator->number_of_pools; ++i)
+        if (allocator->pools[i].addr == addr) {
+            munmap(allocator->pools[i].addr, allocator->pools[i].size);
+            allocator->pools[i] = allocator->pools[--allocator->number_of_pools];
+            return 0;
+        }
+
+    return -1;
+}
+
+const char* v4l2_dmabuf_allocator_name(const struct v4l2_dmabuf_allocator* allocator, char* buf, size_t size)
+{
+    if (allocator->source == V4L2_DMABUF_SOURCE_HEAP)
+        snprintf(buf, size, "dma_heap/%s", allocator->heap);
+    else
+        snprintf(buf, size, "udmabuf");
+
+    return buf;
+}
+
+/*===========================================================================*\
+ * local function definitions
+\*===========================================================================*/
+static int v4l2_dmabuf_open_heap(struct v4l2_dmabuf_allocator* allocator, bool quiet)
+{
+    char filename[PATH_MAX];
+
+    snprintf(filename, sizeof(filename), "%s/%s", DMA_HEAP_DIRECTORY, allocator->heap);
+
+    allocator->fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (allocator->fd == -1) {
+        if (!quiet)
+            fprintf(stderr, "cannot open '%s': %s\n", filename, strerror(errno));
+        return -1;
+    }
+
+    allocator->source = V4L2_DMABUF_SOURCE_HEAP;
+    return 0;
+}
+
+static int v4l2_dmabuf_open_udmabuf(struct v4l2_dmabuf_allocator* allocator, bool quiet)
+{
+    allocator->fd = open(UDMABUF_DEVICE_NAME, O_RDWR | O_CLOEXEC);
+    if (allocator->fd == -1) {
+        if (!quiet)
+            fprintf(stderr, "cannot open '%s': %s\n", UDMABUF_DEVICE_NAME, strerror(errno));
+        return -1;
+    }
+
+    allocator->source = V4L2_DMABUF_SOURCE_UDMABUF;
+    return 0;
+}
+
+static int v4l2_dmabuf_heap_alloc(struct v4l2_dmabuf_allocator* allocator, const size_t* sizes,
+    const size_t* offsets, unsigned count, size_t total, int* fds, void** addrs)
+{
+    struct dma_heap_allocation_data data;
+    char* base;
+    unsigned i;
+
+    /* heap buffers cannot be carved out of a single one, but they can still be mapped back to back */
+    base = mmap(NULL, total, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED) {
+        fprintf(stderr, "mmap(%zu) failed: %s\n", total, strerror(errno));
+        return -1;
+    }
+
+    for (i = 0; i < count; ++i) {
+        memset(&data, 0, sizeof(data));
+        data.len = v4l2_dmabuf_page_align(sizes[i]);
+        data.fd_flags = O_RDWR | O_CLOEXEC;
+
+        if (-1 == ioctl(allocator->fd, DMA_HEAP_IOCTL_ALLOC, &data)) {
+            fprintf(stderr, "ioctl(DMA_HEAP_IOCTL_ALLOC, %llu) failed: %s\n",
+                (unsigned long long)data.len, strerror(errno));
+            break;
+        }
+
+        if (MAP_FAILED == mmap(base + offsets[i], data.len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, data.fd, 0)) {
+            fprintf(stderr, "mmap() failed: %s\n", strerror(errno));
+            close(data.fd);
+            break;
+        }
+
+        fds[i] = data.fd;
+        addrs[i] = base + offsets[i];
+    }
+
+    if (i < count) {
+        while (i--)
+            close(fds[i]);
+        munmap(base, total);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int v4l2_dmabuf_udmabuf_alloc(struct v4l2_dmabuf_allocator* allocator, const size_t* sizes,
+    const size_t* offsets, unsigned count, size_t total, int* fds, void** addrs, struct v4l2_hugepage_stats* stats)
+{
+    int memfd;
+    char* base;
+    void* p;
+    unsigned i;
+
+    /* one memfd and one mapping for the whole pool, every plane is a dmabuf of a range of it */
+    if (allocator->hugepages) {
+        memfd = v4l2_hugepage_alloc(total, &p, stats);
+        if (memfd == -1)
+            return -1;
+        total = v4l2_hugepage_round(total);
+    } else {
+        memfd = v4l2_create_memory_fd(total);
+        if (memfd == -1)
+            return -1;
+
+        p = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+        if (p == MAP_FAILED) {
+            fprintf(stderr, "mmap() failed: %s\n", strerror(errno));
+            close(memfd);
+            return -1;
+        }
+    }
+
+    base = p;
+    for (i = 0; i < count; ++i) {
+        fds[i] = v4l2_create_dmabuf_fd(allocator->fd, memfd, offsets[i], v4l2_dmabuf_page_align(sizes[i]));
+        if (fds[i] == -1)
+            break;
+        addrs[i] = base + offsets[i];
+    }
+
+    /* memfd can be closed here.
+    Only when all references to the memfd are dropped,
+    it will be automatically released. */
+    close(memfd);
+
+    if (i < count) {
+        while (i--)
+            close(fds[i]);
+        munmap(base, total);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int v4l2_create_memory_fd(size_t size)
+{
+    int retval = -1;
+
+    do {
+        int memfd;
+        int status;
+
+        /*
+         * Set the close-on-exec (FD_CLOEXEC) flag on the new file descriptor.
+         * Allow sealing operations on this file. See the discussion
+         * of the F_ADD_SEALS and F_GET_SEALS operations in fcntl(2).
+         * The initial set of seals is empty.
+         * If this flag is not set, the initial set of seals will be
+         * F_SEAL_SEAL, meaning that no other seals can be set on the file.
+         */
+        memfd = memfd_create(MEMFD_FILE_NAME, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+        if (memfd == -1) {
+            fprintf(stderr, "memfd_create(%s) failed: %s\n", MEMFD_FILE_NAME, strerror(errno));
+            break;
+        }
+
+        status = ftruncate(memfd, size);
+        if (status == -1) {
+            fprintf(stderr, "ftruncate(%zu) failed: %s\n", size, strerror(errno));
+            close(memfd);
+            break;
+        }
+
+        /* udmabuf_create requires that file descriptors be sealed with F_SEAL_SHRINK */
+        status = fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK);
+        if (status == -1) {
+            fprintf(stderr, "fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK) failed: %s\n", strerror(errno));
+            close(memfd);
+            break;
+        }
+
+        retval = memfd;
+    } while (0);
+
+    return retval;
+}
+
+static int v4l2_create_dmabuf_fd(int fd, int memfd, size_t offset, size_t size)
+{
+    int dmabuffd;
+    struct udmabuf_create udmabuf_create;
+
+    memset(&udmabuf_create, 0, sizeof(udmabuf_create));
+    udmabuf_create.memfd = memfd;
+    udmabuf_create.flags = UDMABUF_FLAGS_CLOEXEC;
+    udmabuf_create.offset = offset;
+    udmabuf_create.size = size;
+
+    dmabuffd = ioctl(fd, UDMABUF_CREATE, &udmabuf_create);
+    if (dmabuffd == -1) {
+        fprintf(stderr, "ioctl(UDMABUF_CREATE) failed: %s\n", strerror(errno));
+    }
+
+    return dmabuffd;
+}
@@ -0,0 +1,137 @@
+/* SPDX-License-Identifier: MIT */
+/**
+ * @file v4l2-dmabuf.h
+ *
+ * Allocation of DMABUF buffers imported by the capture device (V4L2_MEMORY_DMABUF).
+ * Two sources are supported: a DMA-BUF heap (/dev/dma_heap/<name>, available
+ * on stock kernels since 5.6) and udmabuf (/dev/udmabuf turning sealed memfds
+ * into dmabufs, which videobuf2 can import only with the vmap patch shipped
+ * in this repository). With V4L2_DMABUF_SOURCE_AUTO whichever is available
+ * is used, the heap being preferred unless the memory has to come from huge pages.
+ * A pool of buffers allocated at once is a single udmabuf memfd, so it takes one
+ * memfd_create(), one mmap() and one UDMABUF_CREATE per buffer; heap buffers are
+ * separate allocations, but they are mapped back to back as well, so the CPU
+ * sees every pool as one contiguous range in either case.
+ * Every buffer is mapped for CPU access, which has to be bracketed by
+ * v4l2_dmabuf_begin_cpu_access() and v4l2_dmabuf_end_cpu_access(),
+ * so that caches are maintained for non-coherent devices.
+ */
+
+#ifndef _V4L2_DMABUF_H_
+#define _V4L2_DMABUF_H_
+
+/*===========================================================================*\
+ * system header files
+\*===========================================================================*/
+#include <stdbool.h>
+#include <stddef.h>
+#include <limits.h>
+#include <errno.h>
+
+#include <sys/ioctl.h>
+
+#include <linux/dma-buf.h>
+
+/*===========================================================================*\
+ * project header files
+\*===========================================================================*/
+#include "v4l2-hugepage.h"
+
+/*===========================================================================*\
+ * preprocessor #define constants and macros
+\*===========================================================================*/
+#define V4L2_DMABUF_DEFAULT_HEAP "system"
+#define V4L2_DMABUF_MAX_POOLS 64 /* v4l2_dmabuf_alloc_pool() calls per allocator */
+
+/*===========================================================================*\
+ * global type definitions
+\*===========================================================================*/
+enum v4l2_dmabuf_source
+{
+    V4L2_DMABUF_SOURCE_AUTO,
+    V4L2_DMABUF_SOURCE_HEAP,
+    V4L2_DMABUF_SOURCE_UDMABUF,
+};
+
+struct v4l2_dmabuf_allocator
+{
+    enum v4l2_dmabuf_source source; /* never V4L2_DMABUF_SOURCE_AUTO once opened */
+    char heap[NAME_MAX + 1];
+    int fd;                         /* of the heap or of /dev/udmabuf */
+    bool hugepages;                 /* udmabuf memfds come from v4l2_hugepage_alloc() */
+    struct {
+        void* addr;
+        size_t size;
+    } pools[V4L2_DMABUF_MAX_POOLS]; /* mappings of the pools, unmapped on close */
+    unsigned number_of_pools;
+};
+
+/*===========================================================================*\
+ * global object declarations
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * function forward declarations
+\*===========================================================================*/
+
+/**
+ * Opens given source (heap may be NULL for V4L2_DMABUF_DEFAULT_HEAP).
+ * Returns 0 on success, -1 if the source (or, with V4L2_DMABUF_SOURCE_AUTO, none of them) is available.
+ */
+int v4l2_dmabuf_allocator_open(struct v4l2_dmabuf_allocator* allocator, enum v4l2_dmabuf_source source,
+    const char* heap, bool hugepages);
+
+/**
+ * Unmaps all pools allocated so far and closes the source. Dmabufs themselves
+ * are released once their file descriptors are closed and the device let them go.
+ */
+void v4l2_dmabuf_allocator_close(struct v4l2_dmabuf_allocator* allocator);
+
+/**
+ * Allocates count dmabufs of given sizes at once, stores their file descriptors
+ * in fds and their mappings, which follow each other in one range of addresses, in addrs.
+ * Returns 0 on success, -1 on failure (nothing is left allocated then).
+ * stats (may be NULL) are updated when the memory comes from v4l2_hugepage_alloc().
+ */
+int v4l2_dmabuf_alloc_pool(struct v4l2_dmabuf_allocator* allocator, const size_t* sizes, unsigned count,
+    int* fds, void** addrs, struct v4l2_hugepage_stats* stats);
+
+/**
+ * Unmaps the pool starting at addr before the allocator is closed, its dmabufs
+ * are released once their file descriptors are closed. Returns -1 if there is no such pool.
+ */
+int v4l2_dmabuf_free_pool(struct v4l2_dmabuf_allocator* allocator, void* addr);
+
+/** e.g. "dma_heap/system" or "udmabuf" */
+const char* v4l2_dmabuf_allocator_name(const struct v4l2_dmabuf_allocator* allocator, char* buf, size_t size);
+
+/*===========================================================================*\
+ * inline function definitions
+\*===========================================================================*/
+
+/** Waits for the device to finish writing the buffer and makes its contents visible to the CPU */
+static inline int v4l2_dmabuf_begin_cpu_access(int fd)
+{
+    struct dma_buf_sync sync = { .flags = DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ };
+    int status;
+
+    do {
+        status = ioctl(fd, DMA_BUF_IOCTL_SYNC, &sync);
+    } while (status == -1 && (errno == EINTR || errno == EAGAIN));
+
+    return status;
+}
+
+static inline int v4l2_dmabuf_end_cpu_access(int fd)
+{
+    struct dma_buf_sync sync = { .flags = DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ };
+    int status;
+
+    do {
+        status = ioctl(fd, DMA_BUF_IOCTL_SYNC, &sync);
+    } while (status == -1 && (errno == EINTR || errno == EAGAIN));
+
+    return status;
+}
+
+#endif /* _V4L2_DMABUF_H_ */
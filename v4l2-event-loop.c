@@ -0,0 +1,151 @@
+/* SPDX-License-Identifier: MIT */
+/**
+ * @file v4l2-event-loop.c
+ *
+ * Minimal epoll based event loop (see v4l2-event-loop.h).
+ */
+
+/*===========================================================================*\
+ * system header files
+\*===========================================================================*/
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <sys/epoll.h>
+
+/*===========================================================================*\
+ * project header files
+\*===========================================================================*/
+#include "v4l2-event-loop.h"
+
+/*===========================================================================*\
+ * preprocessor #define constants and macros
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * local type definitions
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * global object definitions
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * local function declarations
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * local object definitions
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * inline function definitions
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * public function definitions
+\*===========================================================================*/
+int v4l2_event_loop_init(struct v4l2_event_loop* loop)
+{
+    unsigned i;
+
+    for (i = 0; i < V4L2_EVENT_LOOP_MAX_SOURCES; ++i)
+        loop->sources[i].fd = -1;
+
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll_fd == -1) {
+        fprintf(stderr, "epoll_create1() failed: %s\n", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+void v4l2_event_loop_close(struct v4l2_event_loop* loop)
+{
+    if (loop->epoll_fd != -1)
+        close(loop->epoll_fd);
+
+    loop->epoll_fd = -1;
+}
+
+int v4l2_event_loop_add(struct v4l2_event_loop* loop, int fd, uint32_t events,
+    v4l2_event_handler_t handler, void* arg)
+{
+    struct v4l2_event_source* source = NULL;
+    struct epoll_event event;
+    unsigned i;
+
+    for (i = 0; i < V4L2_EVENT_LOOP_MAX_SOURCES; ++i)
+        if (loop->sources[i].fd == -1) {
+            source = &loop->sources[i];
+            break;
+        }
+
+    if (!source) {
+        fprintf(stderr, "too many event sources\n");
+        return -1;
+    }
+
+    memset(&event, 0, sizeof(event));
+    event.events = events;
+    event.data.ptr = source;
+
+    if (-1 == epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &event)) {
+        fprintf(stderr, "epoll_ctl(EPOLL_CTL_ADD, %d) failed: %s\n", fd, strerror(errno));
+        return -1;
+    }
+
+    source->fd = fd;
+    source->handler = handler;
+    source->arg = arg;
+
+    return 0;
+}
+
+int v4l2_event_loop_remove(struct v4l2_event_loop* loop, int fd)
+{
+    unsigned i;
+
+    for (i = 0; i < V4L2_EVENT_LOOP_MAX_SOURCES; ++i)
+        if (loop->sources[i].fd == fd) {
+            if (-1 == epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, fd, NULL))
+                fprintf(stderr, "epoll_ctl(EPOLL_CTL_DEL, %d) failed: %s\n", fd, strerror(errno));
+            loop->sources[i].fd = -1;
+            return 0;
+        }
+
+    return -1;
+}
+
+int v4l2_event_loop_run(struct v4l2_event_loop* loop, int timeout_ms)
+{
+    struct epoll_event events[V4L2_EVENT_LOOP_MAX_SOURCES];
+    int n;
+    int i;
+
+    n = epoll_wait(loop->epoll_fd, events, V4L2_EVENT_LOOP_MAX_SOURCES, timeout_ms);
+    if (n == -1) {
+        if (errno == EINTR)
+            return 0;
+        fprintf(stderr, "epoll_wait() failed: %s\n", strerror(errno));
+        return -1;
+    }
+
+    for (i = 0; i < n; ++i) {
+        struct v4l2_event_source* source = events[i].data.ptr;
+
+        /* source might have been removed by one of the previous handlers */
+        if (source->fd == -1)
+            continue;
+
+        if (source->handler(source->arg, source->fd, events[i].events) < 0)
+            return -1;
+    }
+
+    return n;
+}
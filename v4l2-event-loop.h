@@ -0,0 +1,72 @@
+/* SPDX-License-Identifier: MIT */
+/**
+ * @file v4l2-event-loop.h
+ *
+ * Minimal epoll based event loop. Every watched file descriptor
+ * (capture device, writer completions, control descriptors, ...)
+ * gets its own handler which is called whenever the descriptor is ready.
+ */
+
+#ifndef _V4L2_EVENT_LOOP_H_
+#define _V4L2_EVENT_LOOP_H_
+
+/*===========================================================================*\
+ * system header files
+\*===========================================================================*/
+#include <stdint.h>
+
+/*===========================================================================*\
+ * project header files
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * preprocessor #define constants and macros
+\*===========================================================================*/
+#define V4L2_EVENT_LOOP_MAX_SOURCES 16
+
+/*===========================================================================*\
+ * global type definitions
+\*===========================================================================*/
+
+/**
+ * Called with the epoll events reported for fd.
+ * Returning negative value stops the loop iteration and makes
+ * v4l2_event_loop_run() fail.
+ */
+typedef int (*v4l2_event_handler_t)(void* arg, int fd, uint32_t events);
+
+struct v4l2_event_source
+{
+    int fd; /* -1 marks unused entry */
+    v4l2_event_handler_t handler;
+    void* arg;
+};
+
+struct v4l2_event_loop
+{
+    int epoll_fd;
+    struct v4l2_event_source sources[V4L2_EVENT_LOOP_MAX_SOURCES];
+};
+
+/*===========================================================================*\
+ * global object declarations
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * function forward declarations
+\*===========================================================================*/
+int v4l2_event_loop_init(struct v4l2_event_loop* loop);
+void v4l2_event_loop_close(struct v4l2_event_loop* loop);
+
+int v4l2_event_loop_add(struct v4l2_event_loop* loop, int fd, uint32_t events,
+    v4l2_event_handler_t handler, void* arg);
+int v4l2_event_loop_remove(struct v4l2_event_loop* loop, int fd);
+
+/**
+ * Waits at most timeout_ms milliseconds (-1 means forever) for events
+ * and dispatches them to their handlers.
+ * Returns number of dispatched events (0 on timeout) or -1 on error.
+ */
+int v4l2_event_loop_run(struct v4l2_event_loop* loop, int timeout_ms);
+
+#endif /* _V4L2_EVENT_LOOP_H_ */
@@ -0,0 +1,420 @@
+/* SPDX-License-Identifier: MIT */
+/**
+ * @file v4l2-frame-server.c
+ *
+ * Sharing of captured buffers with other processes (see v4l2-frame-server.h).
+ */
+
+/*===========================================================================*\
+ * system header files
+\*===========================================================================*/
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/epoll.h>
+
+/*===========================================================================*\
+ * project header files
+\*===========================================================================*/
+#include "v4l2-frame-server.h"
+
+/*===========================================================================*\
+ * preprocessor #define constants and macros
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * local type definitions
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * global object definitions
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * local function declarations
+\*===========================================================================*/
+static int v4l2_frame_server_send(int fd, const struct v4l2_frame_server_message* message,
+    const int* fds, unsigned nfds);
+static int v4l2_frame_server_send_buffer(int fd, unsigned index, const struct v4l2_frame_server_buffer* buffer);
+static int v4l2_frame_server_on_connect(void* arg, int fd, uint32_t events);
+static int v4l2_frame_server_on_message(void* arg, int fd, uint32_t events);
+static int v4l2_frame_server_unhold(struct v4l2_frame_server_client* client, unsigned index);
+static int v4l2_frame_server_disconnect(struct v4l2_frame_server_client* client);
+
+/*===========================================================================*\
+ * local object definitions
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * inline function definitions
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * public function definitions
+\*===========================================================================*/
+int v4l2_frame_server_open(struct v4l2_frame_server* server, const char* path, struct v4l2_event_loop* loop,
+    uint32_t pixelformat, uint32_t width, uint32_t height, unsigned max_held,
+    v4l2_frame_server_release_t release, void* arg)
+{
+    unsigned i;
+
+    memset(server, 0, sizeof(*server));
+    server->fd = -1;
+    for (i = 0; i < V4L2_FRAME_SERVER_MAX_CLIENTS; ++i) {
+        server->clients[i].server = server;
+        server->clients[i].fd = -1;
+    }
+
+    if (strlen(path) >= sizeof(server->address.sun_path)) {
+        fprintf(stderr, "socket name '%s' is too long\n", path);
+        return -1;
+    }
+
+    server->address.sun_family = AF_UNIX;
+    strcpy(server->address.sun_path, path);
+    server->loop = loop;
+    server->pixelformat = pixelformat;
+    server->width = width;
+    server->height = height;
+    server->max_held = max_held;
+    server->release = release;
+    server->arg = arg;
+
+    server->fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (server->fd == -1) {
+        fprintf(stderr, "socket() failed: %s\n", strerror(errno));
+        return -1;
+    }
+
+    /* socket left behind by a previous run */
+    if (-1 == unlink(path) && errno != ENOENT)
+        fprintf(stderr, "cannot remove '%s': %s\n", path, strerror(errno));
+
+    if (-1 == bind(server->fd, (const struct sockaddr*)&server->address, sizeof(server->address))) {
+        fprintf(stderr, "bind(%s) failed: %s\n", path, strerror(errno));
+        close(server->fd);
+        server->fd = -1;
+        return -1;
+    }
+
+    if (-1 == listen(server->fd, V4L2_FRAME_SERVER_MAX_CLIENTS) ||
+        v4l2_event_loop_add(loop, server->fd, EPOLLIN, v4l2_frame_server_on_connect, server)) {
+        fprintf(stderr, "cannot accept consumers on '%s'\n", path);
+        close(server->fd);
+        server->fd = -1;
+        unlink(path);
+        return -1;
+    }
+
+    return 0;
+}
+
+void v4l2_frame_server_close(struct v4l2_frame_server* server)
+{
+    unsigned i;
+
+    for (i = 0; i < V4L2_FRAME_SERVER_MAX_CLIENTS; ++i) {
+        struct v4l2_frame_server_client* client = server->clients + i;
+
+        if (client->fd == -1)
+            continue;
+
+        v4l2_event_loop_remove(server->loop, client->fd);
+        close(client->fd);
+        client->fd = -1;
+    }
+
+    if (server->fd != -1) {
+        v4l2_event_loop_remove(server->loop, server->fd);
+        close(server->fd);
+        server->fd = -1;
+        unlink(server->address.sun_path);
+    }
+}
+
+int v4l2_frame_server_add_buffer(struct v4l2_frame_server* server, unsigned index, unsigned nplanes,
+    const int* fds, const uint32_t* sizes)
+{
+    struct v4l2_frame_server_buffer* buffer;
+    unsigned i;
+
+    if (index >= VIDEO_MAX_FRAME || nplanes == 0 || nplanes > VIDEO_MAX_PLANES)
+        return -1;
+
+    buffer = server->buffers + index;
+    buffer->nplanes = nplanes;
+    buffer->holders = 0;
+    for (i = 0; i < nplanes; ++i) {
+        buffer->fds[i] = fds[i];
+        buffer->sizes[i] = sizes[i];
+    }
+
+    /* consumers which cannot take it are dropped once the event loop gets to them */
+    for (i = 0; i < V4L2_FRAME_SERVER_MAX_CLIENTS; ++i) {
+        struct v4l2_frame_server_client* client = server->clients + i;
+
+        if (client->fd != -1 && v4l2_frame_server_send_buffer(client->fd, index, buffer))
+            shutdown(client->fd, SHUT_RDWR);
+    }
+
+    return 0;
+}
+
+void v4l2_frame_server_remove_buffer(struct v4l2_frame_server* server, unsigned index)
+{
+    if (index < VIDEO_MAX_FRAME)
+        server->buffers[index].nplanes = 0;
+}
+
+unsigned v4l2_frame_server_publish(struct v4l2_frame_server* server, unsigned index,
+    uint32_t sequence, uint64_t timestamp, unsigned nplanes, const uint32_t* bytesused)
+{
+    struct v4l2_frame_server_message message;
+    struct v4l2_frame_server_buffer* buffer;
+    unsigned i;
+
+    if (index >= VIDEO_MAX_FRAME || server->buffers[index].nplanes == 0)
+        return 0;
+
+    memset(&message, 0, sizeof(message));
+    message.type = V4L2_FRAME_SERVER_READY;
+    message.index = index;
+    message.nplanes = nplanes;
+    message.sequence = sequence;
+    message.timestamp = timestamp;
+    for (i = 0; i < nplanes && i < VIDEO_MAX_PLANES; ++i)
+        message.bytes[i] = bytesused[i];
+
+    buffer = server->buffers + index;
+    buffer->holders = 0;
+
+    for (i = 0; i < V4L2_FRAME_SERVER_MAX_CLIENTS; ++i) {
+        struct v4l2_frame_server_client* client = server->clients + i;
+
+        if (client->fd == -1)
+            continue;
+
+        /* a slow consumer must not take all buffers away from the driver */
+        if (client->number_of_held >= server->max_held ||
+            v4l2_frame_server_send(client->fd, &message, NULL, 0)) {
+            client->skipped++;
+            server->skipped++;
+            continue;
+        }
+
+        client->held[index] = true;
+        client->number_of_held++;
+        client->received++;
+        server->announced++;
+        buffer->holders++;
+    }
+
+    return buffer->holders;
+}
+
+void v4l2_frame_server_print_stats(const char* name, const struct v4l2_frame_server* server)
+{
+    fprintf(stdout, "%s: %llu consumer(s) connected, %llu frame(s) announced, %llu skipped\n",
+        name, (unsigned long long)server->connections,
+        (unsigned long long)server->announced, (unsigned long long)server->skipped);
+}
+
+/*===========================================================================*\
+ * local function definitions
+\*===========================================================================*/
+static int v4l2_frame_server_send(int fd, const struct v4l2_frame_server_message* message,
+    const int* fds, unsigned nfds)
+{
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * VIDEO_MAX_PLANES)];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov;
+    struct msghdr msg;
+    ssize_t n;
+
+    iov.iov_base = (void*)message;
+    iov.iov_len = sizeof(*message);
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    if (nfds > 0) {
+        struct cmsghdr* cmsg;
+
+        memset(&control, 0, sizeof(control));
+        msg.msg_control = control.buf;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+    }
+
+    do {
+        n = sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+    } while (n == -1 && errno == EINTR);
+
+    return n == (ssize_t)sizeof(*message) ? 0 : -1;
+}
+
+static int v4l2_frame_server_send_buffer(int fd, unsigned index, const struct v4l2_frame_server_buffer* buffer)
+{
+    struct v4l2_frame_server_message message;
+    unsigned i;
+
+    memset(&message, 0, sizeof(message));
+    message.type = V4L2_FRAME_SERVER_BUFFER;
+    message.index = index;
+    message.nplanes = buffer->nplanes;
+    for (i = 0; i < buffer->nplanes; ++i)
+        message.bytes[i] = buffer->sizes[i];
+
+    return v4l2_frame_server_send(fd, &message, buffer->fds, buffer->nplanes);
+}
+
+static int v4l2_frame_server_on_connect(void* arg, int fd, uint32_t events)
+{
+    struct v4l2_frame_server* server = arg;
+    struct v4l2_frame_server_message message;
+    struct v4l2_frame_server_client* client;
+    unsigned index;
+    unsigned i;
+    int cfd;
+
+    (void)events;
+
+    for (;;) {
+        cfd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (cfd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                fprintf(stderr, "accept4() failed: %s\n", strerror(errno)); /* threat this as non-fatal error */
+            break;
+        }
+
+        client = NULL;
+        for (i = 0; i < V4L2_FRAME_SERVER_MAX_CLIENTS; ++i)
+            if (server->clients[i].fd == -1) {
+                client = server->clients + i;
+                break;
+            }
+
+        if (client == NULL) {
+            fprintf(stderr, "%s: too many consumers, connection refused\n", server->address.sun_path);
+            close(cfd);
+            continue;
+        }
+
+        memset(&message, 0, sizeof(message));
+        message.type = V4L2_FRAME_SERVER_FORMAT;
+        message.pixelformat = server->pixelformat;
+        message.width = server->width;
+        message.height = server->height;
+
+        if (v4l2_frame_server_send(cfd, &message, NULL, 0)) {
+            close(cfd);
+            continue;
+        }
+
+        for (index = 0; index < VIDEO_MAX_FRAME; ++index)
+            if (server->buffers[index].nplanes &&
+                v4l2_frame_server_send_buffer(cfd, index, server->buffers + index))
+                break;
+
+        if (index < VIDEO_MAX_FRAME ||
+            v4l2_event_loop_add(server->loop, cfd, EPOLLIN, v4l2_frame_server_on_message, client)) {
+            fprintf(stderr, "%s: buffers cannot be passed to consumer, connection closed\n", server->address.sun_path);
+            close(cfd);
+            continue;
+        }
+
+        memset(client->held, 0, sizeof(client->held));
+        client->number_of_held = 0;
+        client->received = 0;
+        client->skipped = 0;
+        client->fd = cfd;
+        server->connections++;
+
+        fprintf(stdout, "%s: consumer %u connected\n", server->address.sun_path, i);
+    }
+
+    return 0;
+}
+
+static int v4l2_frame_server_on_message(void* arg, int fd, uint32_t events)
+{
+    struct v4l2_frame_server_client* client = arg;
+    struct v4l2_frame_server_message message;
+    ssize_t n;
+
+    (void)events;
+
+    for (;;) {
+        n = recv(fd, &message, sizeof(message), MSG_DONTWAIT);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            return v4l2_frame_server_disconnect(client);
+        }
+
+        if (n == 0)
+            return v4l2_frame_server_disconnect(client);
+
+        /* anything else than a release of a frame the consumer holds is ignored */
+        if (n == (ssize_t)sizeof(message) && message.type == V4L2_FRAME_SERVER_RELEASE &&
+            message.index < VIDEO_MAX_FRAME && client->held[message.index] &&
+            v4l2_frame_server_unhold(client, message.index) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+static int v4l2_frame_server_unhold(struct v4l2_frame_server_client* client, unsigned index)
+{
+    struct v4l2_frame_server* server = client->server;
+    struct v4l2_frame_server_buffer* buffer = server->buffers + index;
+
+    client->held[index] = false;
+    client->number_of_held--;
+
+    if (--buffer->holders > 0)
+        return 0;
+
+    return server->release(server->arg, index);
+}
+
+static int v4l2_frame_server_disconnect(struct v4l2_frame_server_client* client)
+{
+    struct v4l2_frame_server* server = client->server;
+    unsigned index;
+    int retval = 0;
+
+    fprintf(stdout, "%s: consumer %u disconnected, %llu frame(s) received, %llu skipped\n",
+        server->address.sun_path, (unsigned)(client - server->clients),
+        (unsigned long long)client->received, (unsigned long long)client->skipped);
+
+    v4l2_event_loop_remove(server->loop, client->fd);
+    close(client->fd);
+    client->fd = -1;
+
+    /* frames the consumer is not going to release any more */
+    for (index = 0; index < VIDEO_MAX_FRAME; ++index)
+        if (client->held[index] && v4l2_frame_server_unhold(client, index) < 0)
+            retval = -1;
+
+    return retval;
+}
@@ -0,0 +1,151 @@
+/* SPDX-License-Identifier: MIT */
+/**
+ * @file v4l2-frame-server.h
+ *
+ * Sharing of captured buffers with other processes on the same machine.
+ * Consumers connect to a SOCK_SEQPACKET Unix socket and get, once, a
+ * V4L2_FRAME_SERVER_FORMAT message followed by a V4L2_FRAME_SERVER_BUFFER
+ * message per buffer, the latter carrying dmabuf file descriptors of its
+ * planes (SCM_RIGHTS), which consumers mmap() on their own. From then on
+ * they get V4L2_FRAME_SERVER_READY whenever a buffer holds a new frame,
+ * and have to answer with V4L2_FRAME_SERVER_RELEASE once they are done
+ * with it, as the buffer is not given back to the driver before all
+ * consumers released it. Frames are never copied.
+ * A consumer which does not keep up misses frames rather than stalls capture:
+ * it is not told about a frame when its socket is full or when it already
+ * holds max_held buffers. Buffers held by a consumer which disconnects are
+ * released on its behalf.
+ * A buffer which is removed and created again later is announced again by
+ * another V4L2_FRAME_SERVER_BUFFER message for its index, consumers drop
+ * their mapping of the old one then.
+ * Everything runs on the event loop of the capture thread.
+ */
+
+#ifndef _V4L2_FRAME_SERVER_H_
+#define _V4L2_FRAME_SERVER_H_
+
+/*===========================================================================*\
+ * system header files
+\*===========================================================================*/
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <sys/un.h>
+
+#include <linux/videodev2.h>
+
+/*===========================================================================*\
+ * project header files
+\*===========================================================================*/
+#include "v4l2-event-loop.h"
+
+/*===========================================================================*\
+ * preprocessor #define constants and macros
+\*===========================================================================*/
+#define V4L2_FRAME_SERVER_MAX_CLIENTS 8
+
+/*===========================================================================*\
+ * global type definitions
+\*===========================================================================*/
+enum v4l2_frame_server_message_type
+{
+    V4L2_FRAME_SERVER_FORMAT = 1, /* server -> consumer, right after connecting */
+    V4L2_FRAME_SERVER_BUFFER,     /* server -> consumer, once per buffer, with fds of its planes */
+    V4L2_FRAME_SERVER_READY,      /* server -> consumer, buffer holds a new frame */
+    V4L2_FRAME_SERVER_RELEASE,    /* consumer -> server, consumer is done with the frame */
+};
+
+/* the only message of the protocol, fields not used by given type are 0 */
+struct v4l2_frame_server_message
+{
+    uint32_t type;        /* enum v4l2_frame_server_message_type */
+    uint32_t index;       /* BUFFER, READY, RELEASE: buffer */
+    uint32_t nplanes;     /* BUFFER, READY */
+    uint32_t sequence;    /* READY: sequence number set by the driver */
+    uint64_t timestamp;   /* READY: nanoseconds */
+    uint32_t pixelformat; /* FORMAT */
+    uint32_t width;       /* FORMAT */
+    uint32_t height;      /* FORMAT */
+    uint32_t reserved;
+    uint32_t bytes[VIDEO_MAX_PLANES]; /* BUFFER: size of every plane, READY: bytes used */
+};
+
+/* release of a buffer by the last consumer holding it, negative return value is fatal */
+typedef int (*v4l2_frame_server_release_t)(void* arg, unsigned index);
+
+struct v4l2_frame_server_buffer
+{
+    unsigned nplanes; /* 0 marks buffer not added yet */
+    int fds[VIDEO_MAX_PLANES];
+    uint32_t sizes[VIDEO_MAX_PLANES];
+    unsigned holders; /* consumers the buffer has been announced to and not released by */
+};
+
+struct v4l2_frame_server_client
+{
+    struct v4l2_frame_server* server;
+    int fd; /* -1 marks unused entry */
+    bool held[VIDEO_MAX_FRAME];
+    unsigned number_of_held;
+    uint64_t received;
+    uint64_t skipped;
+};
+
+struct v4l2_frame_server
+{
+    int fd; /* listening socket */
+    struct sockaddr_un address;
+    struct v4l2_event_loop* loop;
+    uint32_t pixelformat;
+    uint32_t width;
+    uint32_t height;
+    unsigned max_held;
+    struct v4l2_frame_server_buffer buffers[VIDEO_MAX_FRAME];
+    struct v4l2_frame_server_client clients[V4L2_FRAME_SERVER_MAX_CLIENTS];
+    uint64_t connections; /* consumers connected so far */
+    uint64_t announced;   /* frames announced to consumers, counted once per consumer */
+    uint64_t skipped;     /* frames not announced to consumers which did not keep up */
+    v4l2_frame_server_release_t release;
+    void* arg;
+};
+
+/*===========================================================================*\
+ * global object declarations
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * function forward declarations
+\*===========================================================================*/
+
+/**
+ * Starts listening on given path (an existing socket is replaced) and accepting
+ * consumers on given event loop. Returns 0 on success, -1 on failure.
+ */
+int v4l2_frame_server_open(struct v4l2_frame_server* server, const char* path, struct v4l2_event_loop* loop,
+    uint32_t pixelformat, uint32_t width, uint32_t height, unsigned max_held,
+    v4l2_frame_server_release_t release, void* arg);
+
+/** Disconnects all consumers and removes the socket, buffers still held are not released */
+void v4l2_frame_server_close(struct v4l2_frame_server* server);
+
+/**
+ * Makes buffer available to consumers, connected ones get it right away.
+ * File descriptors are borrowed, they have to stay open until the server is closed.
+ */
+int v4l2_frame_server_add_buffer(struct v4l2_frame_server* server, unsigned index, unsigned nplanes,
+    const int* fds, const uint32_t* sizes);
+
+/** Buffer is not going to be published any more, consumers connecting later do not get it */
+void v4l2_frame_server_remove_buffer(struct v4l2_frame_server* server, unsigned index);
+
+/**
+ * Announces a new frame in buffer index.
+ * Returns number of consumers which are going to release it.
+ */
+unsigned v4l2_frame_server_publish(struct v4l2_frame_server* server, unsigned index,
+    uint32_t sequence, uint64_t timestamp, unsigned nplanes, const uint32_t* bytesused);
+
+/** Prints one line summary of what consumers received */
+void v4l2_frame_server_print_stats(const char* name, const struct v4l2_frame_server* server);
+
+#endif /* _V4L2_FRAME_SERVER_H_ */
@@ -0,0 +1,120 @@
+/* SPDX-License-Identifier: MIT */
+/**
+ * @file v4l2-histogram.c
+ *
+ * Fixed size log-linear histogram (see v4l2-histogram.h).
+ */
+
+/*===========================================================================*\
+ * system header files
+\*===========================================================================*/
+#include <string.h>
+
+/*===========================================================================*\
+ * project header files
+\*===========================================================================*/
+#include "v4l2-histogram.h"
+
+/*===========================================================================*\
+ * preprocessor #define constants and macros
+\*===========================================================================*/
+#define SUB_BUCKETS (1U << V4L2_HISTOGRAM_SUB_BITS)
+
+/*===========================================================================*\
+ * local type definitions
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * global object definitions
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * local function declarations
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * local object definitions
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * inline function definitions
+\*===========================================================================*/
+static inline unsigned v4l2_histogram_bucket(uint64_t value)
+{
+    unsigned shift;
+
+    if (value < 2 * SUB_BUCKETS)
+        return value;
+
+    if (value >> V4L2_HISTOGRAM_MAX_BITS)
+        return V4L2_HISTOGRAM_BUCKETS - 1;
+
+    /* keep the leading one and V4L2_HISTOGRAM_SUB_BITS bits below it */
+    shift = 63 - __builtin_clzll(value) - V4L2_HISTOGRAM_SUB_BITS;
+
+    return (shift << V4L2_HISTOGRAM_SUB_BITS) + (value >> shift);
+}
+
+/*===========================================================================*\
+ * public function definitions
+\*===========================================================================*/
+void v4l2_histogram_init(struct v4l2_histogram* histogram)
+{
+    memset(histogram, 0, sizeof(*histogram));
+    histogram->min = UINT64_MAX;
+}
+
+void v4l2_histogram_record(struct v4l2_histogram* histogram, uint64_t value)
+{
+    histogram->buckets[v4l2_histogram_bucket(value)]++;
+    histogram->count++;
+    histogram->sum += value;
+
+    if (histogram->min > value)
+        histogram->min = value;
+    if (histogram->max < value)
+        histogram->max = value;
+}
+
+uint64_t v4l2_histogram_percentile(const struct v4l2_histogram* histogram, double percentile)
+{
+    uint64_t rank;
+    uint64_t seen = 0;
+    uint64_t lower;
+    uint64_t upper;
+    unsigned i;
+
+    if (histogram->count == 0)
+        return 0;
+
+    rank = (uint64_t)(percentile / 100.0 * histogram->count + 0.5);
+    if (rank == 0)
+        rank = 1;
+
+    for (i = 0; i < V4L2_HISTOGRAM_BUCKETS; ++i) {
+        seen += histogram->buckets[i];
+        if (seen >= rank) {
+            v4l2_histogram_bucket_range(i, &lower, &upper);
+            return upper < histogram->max ? upper : histogram->max;
+        }
+    }
+
+    return histogram->max;
+}
+
+void v4l2_histogram_bucket_range(unsigned bucket, uint64_t* lower, uint64_t* upper)
+{
+    unsigned shift;
+    uint64_t mantissa;
+
+    if (bucket < 2 * SUB_BUCKETS) {
+        *lower = *upper = bucket;
+        return;
+    }
+
+    shift = (bucket >> V4L2_HISTOGRAM_SUB_BITS) - 1;
+    mantissa = (bucket & (SUB_BUCKETS - 1)) + SUB_BUCKETS;
+
+    *lower = mantissa << shift;
+    *upper = ((mantissa + 1) << shift) - 1;
+}
@@ -0,0 +1,62 @@
+/* SPDX-License-Identifier: MIT */
+/**
+ * @file v4l2-histogram.h
+ *
+ * Fixed size log-linear histogram of 64-bit values (e.g. latencies in ns).
+ * Values below 64 are counted exactly, above that every power of two
+ * is split into 32 equal buckets, so percentiles are accurate to ~3%.
+ * Recording is a couple of arithmetic operations and never allocates.
+ */
+
+#ifndef _V4L2_HISTOGRAM_H_
+#define _V4L2_HISTOGRAM_H_
+
+/*===========================================================================*\
+ * system header files
+\*===========================================================================*/
+#include <stdint.h>
+
+/*===========================================================================*\
+ * project header files
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * preprocessor #define constants and macros
+\*===========================================================================*/
+#define V4L2_HISTOGRAM_SUB_BITS 5
+#define V4L2_HISTOGRAM_MAX_BITS 48 /* larger values are counted in the last bucket */
+#define V4L2_HISTOGRAM_BUCKETS \
+    (((V4L2_HISTOGRAM_MAX_BITS - V4L2_HISTOGRAM_SUB_BITS) + 1) << V4L2_HISTOGRAM_SUB_BITS)
+
+/*===========================================================================*\
+ * global type definitions
+\*===========================================================================*/
+struct v4l2_histogram
+{
+    uint64_t count;
+    uint64_t min;
+    uint64_t max;
+    uint64_t sum;
+    uint64_t buckets[V4L2_HISTOGRAM_BUCKETS];
+};
+
+/*===========================================================================*\
+ * global object declarations
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * function forward declarations
+\*===========================================================================*/
+void v4l2_histogram_init(struct v4l2_histogram* histogram);
+void v4l2_histogram_record(struct v4l2_histogram* histogram, uint64_t value);
+
+/**
+ * Returns the smallest value v such that at least 'percentile' percent
+ * of the recorded values are not greater than v (within bucket accuracy).
+ */
+uint64_t v4l2_histogram_percentile(const struct v4l2_histogram* histogram, double percentile);
+
+/** Range of values [lower, upper] counted by given bucket */
+void v4l2_histogram_bucket_range(unsigned bucket, uint64_t* lower, uint64_t* upper);
+
+#endif /* _V4L2_HISTOGRAM_H_ */
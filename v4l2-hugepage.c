@@ -0,0 +1,270 @@
+/* SPDX-License-Identifier: MIT */
+/**
+ * @file v4l2-hugepage.c
+ *
+ * Allocation of buffer memory backed by huge pages (see v4l2-hugepage.h).
+ */
+
+/*===========================================================================*\
+ * system header files
+\*===========================================================================*/
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <sys/mman.h>
+
+/*===========================================================================*\
+ * project header files
+\*===========================================================================*/
+#include "v4l2-hugepage.h"
+
+/*===========================================================================*\
+ * preprocessor #define constants and macros
+\*===========================================================================*/
+#define HUGEPAGE_FILE_NAME "hugepage"
+#define DEFAULT_HUGEPAGE_SIZE (2UL << 20)
+#define ALIGN(x, a) __ALIGN(x, (a) - 1)
+#define __ALIGN(x, mask) (((x) + (mask)) & ~(mask))
+
+/*===========================================================================*\
+ * local type definitions
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * global object definitions
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * local function declarations
+\*===========================================================================*/
+static size_t v4l2_hugepage_size(void);
+static int v4l2_hugepage_memfd(size_t size, unsigned flags);
+static void v4l2_hugepage_prefault(void* addr, size_t size);
+static enum v4l2_hugepage_kind v4l2_hugepage_query(const void* addr);
+
+/*===========================================================================*\
+ * local object definitions
+\*===========================================================================*/
+static const char* hugepage_kinds[] = {
+    [V4L2_HUGEPAGE_NONE]    = "none",
+    [V4L2_HUGEPAGE_HUGETLB] = "hugetlb",
+    [V4L2_HUGEPAGE_THP]     = "thp",
+};
+
+/*===========================================================================*\
+ * inline function definitions
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * public function definitions
+\*===========================================================================*/
+int v4l2_hugepage_alloc(size_t size, void** addr, struct v4l2_hugepage_stats* stats)
+{
+    static bool mlock_reported;
+    enum v4l2_hugepage_kind kind = V4L2_HUGEPAGE_HUGETLB;
+    int memfd;
+    void* p = MAP_FAILED;
+
+    /* both kinds are rounded up alike, so that v4l2_hugepage_free() needs the size only */
+    size = v4l2_hugepage_round(size);
+
+    /* pages of the hugetlb pool are reserved by mmap(), which fails if there are not enough of them */
+    memfd = v4l2_hugepage_memfd(size, MFD_HUGETLB);
+    if (memfd != -1) {
+        p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, memfd, 0);
+        if (p == MAP_FAILED) {
+            close(memfd);
+            memfd = -1;
+        }
+    }
+
+    if (memfd == -1) {
+        kind = V4L2_HUGEPAGE_THP;
+
+        memfd = v4l2_hugepage_memfd(size, 0);
+        if (memfd == -1)
+            return -1;
+
+        p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+        if (p == MAP_FAILED) {
+            fprintf(stderr, "mmap() failed: %s\n", strerror(errno));
+            close(memfd);
+            return -1;
+        }
+
+        /* has to be advised before the first fault, MAP_POPULATE would be too early */
+        if (-1 == madvise(p, size, MADV_HUGEPAGE))
+            kind = V4L2_HUGEPAGE_NONE;
+
+        v4l2_hugepage_prefault(p, size);
+    }
+
+    if (kind != V4L2_HUGEPAGE_NONE)
+        kind = v4l2_hugepage_query(p);
+
+    if (stats) {
+        stats->allocations++;
+        stats->kinds[kind]++;
+        stats->bytes += size;
+    }
+
+    if (-1 == mlock(p, size)) {
+        /* threat this as non-fatal error, memory is prefaulted anyway */
+        if (!mlock_reported)
+            fprintf(stderr, "mlock() failed: %s (see RLIMIT_MEMLOCK)\n", strerror(errno));
+        mlock_reported = true;
+    }
+    else
+    if (stats)
+        stats->locked++;
+
+    *addr = p;
+    return memfd;
+}
+
+size_t v4l2_hugepage_round(size_t size)
+{
+    return ALIGN(size, v4l2_hugepage_size());
+}
+
+void v4l2_hugepage_free(void* addr, size_t size)
+{
+    if (addr)
+        munmap(addr, v4l2_hugepage_round(size));
+}
+
+void v4l2_hugepage_print_stats(const char* name, const struct v4l2_hugepage_stats* stats)
+{
+    unsigned kind;
+
+    fprintf(stdout, "%s buffer memory: %u allocation(s), %.1f MiB, huge pages:",
+        name, stats->allocations, stats->bytes / (double)(1 << 20));
+    for (kind = 0; kind <= V4L2_HUGEPAGE_THP; ++kind)
+        fprintf(stdout, " %s: %u", hugepage_kinds[kind], stats->kinds[kind]);
+    fprintf(stdout, ", locked: %u\n", stats->locked);
+
+    if (stats->kinds[V4L2_HUGEPAGE_NONE])
+        fprintf(stdout, "\tnot all buffers got huge pages, see /proc/sys/vm/nr_hugepages"
+            " and /sys/kernel/mm/transparent_hugepage/shmem_enabled\n");
+}
+
+/*===========================================================================*\
+ * local function definitions
+\*===========================================================================*/
+static size_t v4l2_hugepage_size(void)
+{
+    static size_t hugepage_size;
+    FILE* file;
+    char line[128];
+    unsigned long kib;
+
+    if (hugepage_size)
+        return hugepage_size;
+
+    hugepage_size = DEFAULT_HUGEPAGE_SIZE;
+
+    file = fopen("/proc/meminfo", "r");
+    if (NULL == file)
+        return hugepage_size;
+
+    while (fgets(line, sizeof(line), file))
+        if (1 == sscanf(line, "Hugepagesize: %lu kB", &kib) && kib) {
+            hugepage_size = kib << 10;
+            break;
+        }
+
+    fclose(file);
+    return hugepage_size;
+}
+
+static int v4l2_hugepage_memfd(size_t size, unsigned flags)
+{
+    int memfd;
+
+    memfd = memfd_create(HUGEPAGE_FILE_NAME, MFD_CLOEXEC | MFD_ALLOW_SEALING | flags);
+    if (memfd == -1) {
+        /* no hugetlbfs is just a reason to try the other kind */
+        if (!(flags & MFD_HUGETLB))
+            fprintf(stderr, "memfd_create(%s) failed: %s\n", HUGEPAGE_FILE_NAME, strerror(errno));
+        return -1;
+    }
+
+    if (-1 == ftruncate(memfd, size)) {
+        if (!(flags & MFD_HUGETLB))
+            fprintf(stderr, "ftruncate(%zu) failed: %s\n", size, strerror(errno));
+        close(memfd);
+        return -1;
+    }
+
+    /* udmabuf_create requires that file descriptors be sealed with F_SEAL_SHRINK */
+    if (-1 == fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK)) {
+        fprintf(stderr, "fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK) failed: %s\n", strerror(errno));
+        close(memfd);
+        return -1;
+    }
+
+    return memfd;
+}
+
+static void v4l2_hugepage_prefault(void* addr, size_t size)
+{
+    long pagesize = sysconf(_SC_PAGESIZE);
+    size_t offset;
+
+#ifdef MADV_POPULATE_WRITE
+    if (0 == madvise(addr, size, MADV_POPULATE_WRITE))
+        return;
+#endif
+
+    if (pagesize <= 0)
+        pagesize = 0x1000;
+
+    /* one write per page, older kernels do not know MADV_POPULATE_WRITE */
+    for (offset = 0; offset < size; offset += pagesize)
+        ((volatile char*)addr)[offset] = 0;
+}
+
+static enum v4l2_hugepage_kind v4l2_hugepage_query(const void* addr)
+{
+    enum v4l2_hugepage_kind kind = V4L2_HUGEPAGE_NONE;
+    bool found = false;
+    FILE* file;
+    char line[256];
+
+    file = fopen("/proc/self/smaps", "r");
+    if (NULL == file)
+        return kind;
+
+    while (fgets(line, sizeof(line), file)) {
+        unsigned long start;
+        unsigned long end;
+        unsigned long kib;
+
+        /* every mapping starts with its address range, followed by "Key: value" lines */
+        if (2 == sscanf(line, "%lx-%lx ", &start, &end)) {
+            if (found)
+                break;
+            found = start <= (unsigned long)addr && (unsigned long)addr < end;
+            continue;
+        }
+
+        if (!found)
+            continue;
+
+        if (1 == sscanf(line, "KernelPageSize: %lu kB", &kib) && (kib << 10) > (unsigned long)sysconf(_SC_PAGESIZE))
+            kind = V4L2_HUGEPAGE_HUGETLB;
+        else
+        if (1 == sscanf(line, "ShmemPmdMapped: %lu kB", &kib) && kib && kind == V4L2_HUGEPAGE_NONE)
+            kind = V4L2_HUGEPAGE_THP;
+    }
+
+    fclose(file);
+    return kind;
+}
@@ -0,0 +1,76 @@
+/* SPDX-License-Identifier: MIT */
+/**
+ * @file v4l2-hugepage.h
+ *
+ * Allocation of buffer memory backed by huge pages.
+ * Buffers are memfds (so they can be turned into dmabufs as well), created
+ * with MFD_HUGETLB if the hugetlb pool has enough free pages, otherwise as
+ * regular shmem memfds advised to use transparent huge pages. Either way the
+ * memory is prefaulted when mapped and locked, so that neither the driver
+ * nor the capture path ever takes a page fault, and every buffer is covered
+ * by a couple of TLB entries and scatter-gather segments instead of thousands.
+ * Whether huge pages were really obtained is read back from /proc/self/smaps.
+ */
+
+#ifndef _V4L2_HUGEPAGE_H_
+#define _V4L2_HUGEPAGE_H_
+
+/*===========================================================================*\
+ * system header files
+\*===========================================================================*/
+#include <stdint.h>
+#include <stddef.h>
+
+/*===========================================================================*\
+ * project header files
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * preprocessor #define constants and macros
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * global type definitions
+\*===========================================================================*/
+enum v4l2_hugepage_kind
+{
+    V4L2_HUGEPAGE_NONE,    /* huge pages were not obtained, memory consists of base pages */
+    V4L2_HUGEPAGE_HUGETLB, /* MFD_HUGETLB memfd */
+    V4L2_HUGEPAGE_THP,     /* shmem memfd, at least partly mapped by transparent huge pages */
+};
+
+/* what the allocations of one device ended up with */
+struct v4l2_hugepage_stats
+{
+    unsigned allocations;
+    unsigned kinds[V4L2_HUGEPAGE_THP + 1]; /* allocations by enum v4l2_hugepage_kind */
+    unsigned locked;       /* allocations locked by mlock() */
+    uint64_t bytes;        /* mapped, i.e. rounded up to the page size used */
+};
+
+/*===========================================================================*\
+ * global object declarations
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * function forward declarations
+\*===========================================================================*/
+
+/**
+ * Allocates, prefaults and locks at least size bytes.
+ * Returns memfd holding the memory (sealed against shrinking, so it can be
+ * passed to UDMABUF_CREATE; the mapping stays valid when it is closed)
+ * and its mapping in addr, or -1 on failure. stats may be NULL.
+ */
+int v4l2_hugepage_alloc(size_t size, void** addr, struct v4l2_hugepage_stats* stats);
+
+/** Size of the memory v4l2_hugepage_alloc() allocates for given size */
+size_t v4l2_hugepage_round(size_t size);
+
+/** Unmaps memory returned by v4l2_hugepage_alloc() for the same size */
+void v4l2_hugepage_free(void* addr, size_t size);
+
+/** Prints one line summary of the stats */
+void v4l2_hugepage_print_stats(const char* name, const struct v4l2_hugepage_stats* stats);
+
+#endif /* _V4L2_HUGEPAGE_H_ */
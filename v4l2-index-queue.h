@@ -0,0 +1,96 @@
+/* SPDX-License-Identifier: MIT */
+/**
+ * @file v4l2-index-queue.h
+ *
+ * Bounded, lock-free, single-producer/single-consumer queue of buffer indices.
+ * It is used to pass ownership of v4l2 buffers between the capture thread
+ * and the writer thread. As there can never be more buffers in flight than
+ * VIDEO_MAX_FRAME, the queue has fixed capacity and push never fails
+ * as long as every index is owned by at most one party at a time.
+ */
+
+#ifndef _V4L2_INDEX_QUEUE_H_
+#define _V4L2_INDEX_QUEUE_H_
+
+/*===========================================================================*\
+ * system header files
+\*===========================================================================*/
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#include <linux/videodev2.h>
+
+/*===========================================================================*\
+ * project header files
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * preprocessor #define constants and macros
+\*===========================================================================*/
+#define V4L2_INDEX_QUEUE_SIZE 64 /* power of two, not less than VIDEO_MAX_FRAME */
+#define V4L2_INDEX_QUEUE_CACHELINE 64
+
+/*===========================================================================*\
+ * global type definitions
+\*===========================================================================*/
+struct v4l2_index_queue
+{
+    /* written by consumer only */
+    _Alignas(V4L2_INDEX_QUEUE_CACHELINE) atomic_uint head;
+    /* written by producer only */
+    _Alignas(V4L2_INDEX_QUEUE_CACHELINE) atomic_uint tail;
+    _Alignas(V4L2_INDEX_QUEUE_CACHELINE) unsigned slots[V4L2_INDEX_QUEUE_SIZE];
+};
+
+_Static_assert((V4L2_INDEX_QUEUE_SIZE & (V4L2_INDEX_QUEUE_SIZE - 1)) == 0,
+    "V4L2_INDEX_QUEUE_SIZE must be power of two");
+_Static_assert(V4L2_INDEX_QUEUE_SIZE >= VIDEO_MAX_FRAME,
+    "V4L2_INDEX_QUEUE_SIZE must not be less than VIDEO_MAX_FRAME");
+
+/*===========================================================================*\
+ * inline function definitions
+\*===========================================================================*/
+static inline void v4l2_index_queue_init(struct v4l2_index_queue* queue)
+{
+    atomic_init(&queue->head, 0);
+    atomic_init(&queue->tail, 0);
+}
+
+/* producer side */
+static inline bool v4l2_index_queue_push(struct v4l2_index_queue* queue, unsigned index)
+{
+    unsigned tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    unsigned head = atomic_load_explicit(&queue->head, memory_order_acquire);
+
+    if (tail - head >= V4L2_INDEX_QUEUE_SIZE)
+        return false; /* full */
+
+    queue->slots[tail & (V4L2_INDEX_QUEUE_SIZE - 1)] = index;
+    atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+
+    return true;
+}
+
+/* consumer side */
+static inline bool v4l2_index_queue_pop(struct v4l2_index_queue* queue, unsigned* index)
+{
+    unsigned head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+
+    if (head == tail)
+        return false; /* empty */
+
+    *index = queue->slots[head & (V4L2_INDEX_QUEUE_SIZE - 1)];
+    atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+
+    return true;
+}
+
+/* may be called from any side, result is only a snapshot */
+static inline unsigned v4l2_index_queue_size(struct v4l2_index_queue* queue)
+{
+    return atomic_load_explicit(&queue->tail, memory_order_acquire) -
+           atomic_load_explicit(&queue->head, memory_order_acquire);
+}
+
+#endif /* _V4L2_INDEX_QUEUE_H_ */
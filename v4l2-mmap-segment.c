@@ -0,0 +1,367 @@
+/* SPDX-License-Identifier: MIT */
+/**
+ * @file v4l2-mmap-segment.c
+ *
+ * Zero-copy recording into memory mapped segment files (see v4l2-mmap-segment.h).
+ */
+
+/*===========================================================================*\
+ * system header files
+\*===========================================================================*/
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+
+#include <sys/mman.h>
+#include <sys/vfs.h>
+
+#include <linux/magic.h>
+
+/*===========================================================================*\
+ * project header files
+\*===========================================================================*/
+#include "v4l2-mmap-segment.h"
+#include "v4l2-segment.h"
+
+/*===========================================================================*\
+ * preprocessor #define constants and macros
+\*===========================================================================*/
+#define IS_POWER_OF_TWO(x) (((x) & ((x) - 1)) == 0)
+#define ALIGN(x, a) __ALIGN(x, (a) - 1)
+#define __ALIGN(x, mask) (((x) + (mask)) & ~(mask))
+#define DEFAULT_SLOTS_PER_FILE 256
+
+/*===========================================================================*\
+ * local type definitions
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * global object definitions
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * local function declarations
+\*===========================================================================*/
+static int v4l2_mmap_segment_create(struct v4l2_mmap_segment* segment);
+static void v4l2_mmap_segment_release(struct v4l2_mmap_segment_file* file);
+static void v4l2_mmap_segment_finish(struct v4l2_mmap_segment_file* file);
+
+/*===========================================================================*\
+ * local object definitions
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * inline function definitions
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * public function definitions
+\*===========================================================================*/
+int v4l2_mmap_segment_check(const char* directory)
+{
+    struct statfs fs;
+
+    if (-1 == statfs(directory, &fs)) {
+        fprintf(stderr, "statfs(%s) failed: %s\n", directory, strerror(errno));
+        return -1;
+    }
+
+    /* pages of these are not written back to a file, nothing keeps them from being pinned */
+    switch (fs.f_type) {
+        case TMPFS_MAGIC:
+        case RAMFS_MAGIC:
+        case HUGETLBFS_MAGIC:
+            return 0;
+
+        default:
+            return -1;
+    }
+}
+
+int v4l2_mmap_segment_init(struct v4l2_mmap_segment* segment, const char* directory,
+    uint32_t fourcc, uint32_t width, uint32_t height,
+    const size_t* plane_sizes, unsigned nplanes, uint64_t max_size)
+{
+    long pagesize = sysconf(_SC_PAGESIZE);
+    size_t offset = 0;
+    unsigned i;
+
+    if (pagesize <= 0 || !IS_POWER_OF_TWO(pagesize))
+        pagesize = 0x1000; // set default value to 4KiB
+
+    if (nplanes == 0 || nplanes > VIDEO_MAX_PLANES)
+        return -1;
+
+    memset(segment, 0, sizeof(*segment));
+    segment->directory = directory;
+    segment->fourcc = fourcc;
+    segment->width = width;
+    segment->height = height;
+    segment->nplanes = nplanes;
+
+    /* every plane starts on page boundary, as the driver may require it */
+    for (i = 0; i < nplanes; ++i) {
+        segment->plane_offset[i] = offset;
+        offset += ALIGN(plane_sizes[i], (size_t)pagesize);
+    }
+    segment->slot_size = offset;
+
+    if (max_size)
+        segment->nslots = max_size / segment->slot_size;
+    else
+        segment->nslots = DEFAULT_SLOTS_PER_FILE;
+    if (segment->nslots == 0)
+        segment->nslots = 1;
+
+    segment->current = -1;
+    for (i = 0; i < V4L2_MMAP_SEGMENT_FILES; ++i) {
+        segment->files[i].data_fd = -1;
+        segment->files[i].index_fd = -1;
+        atomic_init(&segment->files[i].active, false);
+        atomic_init(&segment->files[i].refs, 0);
+    }
+
+    for (i = 0; i < VIDEO_MAX_FRAME; ++i)
+        segment->windows[i].file = -1;
+
+    return 0;
+}
+
+int v4l2_mmap_segment_assign(struct v4l2_mmap_segment* segment, unsigned index, void** addrs)
+{
+    struct v4l2_mmap_segment_file* file;
+    unsigned slot;
+    unsigned i;
+
+    if (index >= VIDEO_MAX_FRAME)
+        return -1;
+
+    /* slot which has never been committed (e.g. erroneous frame) is simply abandoned */
+    if (segment->windows[index].file != -1) {
+        v4l2_mmap_segment_release(&segment->files[segment->windows[index].file]);
+        segment->windows[index].file = -1;
+    }
+
+    if (segment->current != -1 && segment->files[segment->current].assigned == segment->nslots) {
+        /* no more slots will be taken from this file, drop its 'current' reference */
+        v4l2_mmap_segment_release(&segment->files[segment->current]);
+        segment->current = -1;
+    }
+
+    if (segment->current == -1)
+        if (v4l2_mmap_segment_create(segment))
+            return -1;
+
+    file = &segment->files[segment->current];
+    slot = file->assigned++;
+    atomic_fetch_add(&file->refs, 1);
+
+    segment->windows[index].file = segment->current;
+    segment->windows[index].slot = slot;
+
+    for (i = 0; i < segment->nplanes; ++i)
+        addrs[i] = (char*)file->base + (size_t)slot * segment->slot_size + segment->plane_offset[i];
+
+    return 0;
+}
+
+int v4l2_mmap_segment_commit(struct v4l2_mmap_segment* segment, unsigned index, uint64_t frame,
+    uint32_t sequence, uint32_t flags, uint64_t timestamp, const struct iovec* iov, size_t iovcnt)
+{
+    int retval = -1;
+    struct v4l2_mmap_segment_file* file;
+
+    if (index >= VIDEO_MAX_FRAME || segment->windows[index].file == -1)
+        return -1;
+
+    file = &segment->files[segment->windows[index].file];
+
+    do {
+        struct v4l2_segment_index_entry entry;
+        size_t last;
+        uint64_t offset = (uint64_t)segment->windows[index].slot * segment->slot_size;
+        uint64_t size;
+
+        for (last = 0; last + 1 < iovcnt && last + 1 < segment->nplanes && iov[last + 1].iov_base; ++last)
+            ;
+        size = segment->plane_offset[last] + iov[last].iov_len;
+
+        if (file->nframes == 0) {
+            struct v4l2_segment_index_header header;
+
+            v4l2_segment_index_header_init(&header, segment->fourcc, segment->width, segment->height, frame);
+            if (-1 == pwrite(file->index_fd, &header, sizeof(header), 0)) {
+                fprintf(stderr, "pwrite() failed: %s\n", strerror(errno));
+                break;
+            }
+        }
+
+        memset(&entry, 0, sizeof(entry));
+        entry.sequence = sequence;
+        entry.flags = flags;
+        entry.timestamp = timestamp;
+        entry.offset = offset;
+        entry.size = size;
+
+        if (-1 == pwrite(file->index_fd, &entry, sizeof(entry),
+                sizeof(struct v4l2_segment_index_header) + file->nframes * sizeof(entry))) {
+            fprintf(stderr, "pwrite() failed: %s\n", strerror(errno));
+            break;
+        }
+
+        file->nframes++;
+        if (file->used < offset + segment->slot_size)
+            file->used = offset + segment->slot_size;
+
+        /* only kicks off writeback, it does not wait for it */
+        if (-1 == sync_file_range(file->data_fd, offset, size, SYNC_FILE_RANGE_WRITE))
+            fprintf(stderr, "sync_file_range() failed: %s\n", strerror(errno));
+
+        retval = 0;
+    } while (0);
+
+    segment->windows[index].file = -1;
+    v4l2_mmap_segment_release(file);
+
+    return retval;
+}
+
+void v4l2_mmap_segment_close(struct v4l2_mmap_segment* segment)
+{
+    unsigned i;
+
+    for (i = 0; i < V4L2_MMAP_SEGMENT_FILES; ++i)
+        if (atomic_load(&segment->files[i].active))
+            v4l2_mmap_segment_finish(&segment->files[i]);
+
+    for (i = 0; i < VIDEO_MAX_FRAME; ++i)
+        segment->windows[i].file = -1;
+
+    segment->current = -1;
+}
+
+/*===========================================================================*\
+ * local function definitions
+\*===========================================================================*/
+static int v4l2_mmap_segment_create(struct v4l2_mmap_segment* segment)
+{
+    int retval = -1;
+    struct v4l2_mmap_segment_file* file = NULL;
+    unsigned i;
+
+    /* the writer thread may still be finishing a file whose last slot it has just committed */
+    for (i = 0; i < V4L2_MMAP_SEGMENT_FILES; ++i)
+        if (!atomic_load(&segment->files[i].active)) {
+            file = &segment->files[i];
+            break;
+        }
+
+    if (!file) {
+        fprintf(stderr, "too many segment files in use\n");
+        return -1;
+    }
+
+    atomic_store(&file->active, true);
+
+    do {
+        char filename[PATH_MAX];
+        struct v4l2_segment_index_header header;
+
+        file->number = segment->number;
+        file->size = (size_t)segment->nslots * segment->slot_size;
+        file->assigned = 0;
+        file->nframes = 0;
+        file->used = 0;
+
+        if (v4l2_segment_filename(filename, sizeof(filename), segment->directory, file->number, segment->fourcc, NULL))
+            break;
+
+        file->data_fd = open(filename, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0664);
+        if (-1 == file->data_fd) {
+            fprintf(stderr, "cannot open '%s': %s\n", filename, strerror(errno));
+            break;
+        }
+
+        if (-1 == fallocate(file->data_fd, 0, 0, file->size)) {
+            if (errno != EOPNOTSUPP) {
+                fprintf(stderr, "fallocate(%s) failed: %s\n", filename, strerror(errno));
+                break;
+            }
+            if (-1 == ftruncate(file->data_fd, file->size)) {
+                fprintf(stderr, "ftruncate(%s) failed: %s\n", filename, strerror(errno));
+                break;
+            }
+        }
+
+        file->base = mmap(NULL, file->size, PROT_READ | PROT_WRITE, MAP_SHARED, file->data_fd, 0);
+        if (file->base == MAP_FAILED) {
+            file->base = NULL;
+            fprintf(stderr, "mmap(%s) failed: %s\n", filename, strerror(errno));
+            break;
+        }
+
+        if (v4l2_segment_filename(filename, sizeof(filename), segment->directory, file->number, segment->fourcc, "idx"))
+            break;
+
+        file->index_fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0664);
+        if (-1 == file->index_fd) {
+            fprintf(stderr, "cannot open '%s': %s\n", filename, strerror(errno));
+            break;
+        }
+
+        /* rewritten with the right first frame number on the first commit */
+        v4l2_segment_index_header_init(&header, segment->fourcc, segment->width, segment->height, 0);
+        if (-1 == pwrite(file->index_fd, &header, sizeof(header), 0)) {
+            fprintf(stderr, "pwrite() failed: %s\n", strerror(errno));
+            break;
+        }
+
+        atomic_store(&file->refs, 1);
+        segment->current = file - segment->files;
+        segment->number++;
+
+        retval = 0;
+    } while (0);
+
+    if (retval)
+        v4l2_mmap_segment_finish(file);
+
+    return retval;
+}
+
+static void v4l2_mmap_segment_release(struct v4l2_mmap_segment_file* file)
+{
+    if (atomic_fetch_sub(&file->refs, 1) == 1)
+        v4l2_mmap_segment_finish(file);
+}
+
+static void v4l2_mmap_segment_finish(struct v4l2_mmap_segment_file* file)
+{
+    if (file->base) {
+        munmap(file->base, file->size);
+        file->base = NULL;
+    }
+
+    if (file->data_fd != -1) {
+        /* drop preallocated slots which have never been filled */
+        if (-1 == ftruncate(file->data_fd, file->used))
+            fprintf(stderr, "ftruncate() failed: %s\n", strerror(errno));
+        close(file->data_fd);
+        file->data_fd = -1;
+    }
+
+    if (file->index_fd != -1) {
+        close(file->index_fd);
+        file->index_fd = -1;
+    }
+
+    atomic_store(&file->refs, 0);
+    atomic_store(&file->active, false);
+}
@@ -0,0 +1,121 @@
+/* SPDX-License-Identifier: MIT */
+/**
+ * @file v4l2-mmap-segment.h
+ *
+ * Zero-copy recording for V4L2_MEMORY_USERPTR. Segment data files are
+ * preallocated, mapped into memory and divided into page aligned slots,
+ * one slot per frame. Every time a buffer is queued it gets the next free
+ * slot as its userptr, so the driver writes the frame straight into
+ * the page cache of the file. Storing a frame then only means adding
+ * an entry to the segment index (same format as v4l2-segment.h) and
+ * starting writeback of its slot.
+ *
+ * Note that pages written by the device are marked dirty when the driver
+ * releases them, i.e. when the buffer is queued again with a new slot,
+ * and that the driver pins the pages of a slot long term (FOLL_LONGTERM),
+ * which Linux 6.5 and later refuse for pages of regular filesystems
+ * (ext4, xfs, btrfs, ...) with EFAULT from VIDIOC_QBUF. Only files on
+ * tmpfs, ramfs and hugetlbfs can be used, see v4l2_mmap_segment_check().
+ */
+
+#ifndef _V4L2_MMAP_SEGMENT_H_
+#define _V4L2_MMAP_SEGMENT_H_
+
+/*===========================================================================*\
+ * system header files
+\*===========================================================================*/
+#include <stdint.h>
+#include <stdatomic.h>
+#include <sys/uio.h>
+
+#include <linux/videodev2.h>
+
+/*===========================================================================*\
+ * project header files
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * preprocessor #define constants and macros
+\*===========================================================================*/
+/* every buffer may hold a slot of a different file, plus the one slots are taken from */
+#define V4L2_MMAP_SEGMENT_FILES (VIDEO_MAX_FRAME + 1)
+
+/*===========================================================================*\
+ * global type definitions
+\*===========================================================================*/
+struct v4l2_mmap_segment_file
+{
+    atomic_bool active;   /* cleared only after the file has been completely finished */
+    int data_fd;
+    int index_fd;
+    void* base;
+    size_t size;
+    unsigned number;
+    unsigned assigned;    /* number of slots handed out so far */
+    atomic_uint refs;     /* one per outstanding slot + one while slots are taken from this file */
+    uint64_t nframes;     /* number of index entries */
+    uint64_t used;        /* end of the last committed slot */
+};
+
+struct v4l2_mmap_segment
+{
+    const char* directory;
+    uint32_t fourcc;
+    uint32_t width;
+    uint32_t height;
+
+    unsigned nplanes;
+    size_t plane_offset[VIDEO_MAX_PLANES];
+    size_t slot_size;
+    unsigned nslots;      /* slots per file */
+
+    unsigned number;      /* number of the next file to be created */
+    int current;          /* entry of files[] slots are taken from, -1 if none */
+    struct v4l2_mmap_segment_file files[V4L2_MMAP_SEGMENT_FILES];
+
+    struct {
+        int file;
+        unsigned slot;
+    } windows[VIDEO_MAX_FRAME]; /* slot currently held by given buffer */
+};
+
+/*===========================================================================*\
+ * global object declarations
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * function forward declarations
+\*===========================================================================*/
+
+/**
+ * Checks whether files in given directory live on a filesystem whose pages can be pinned
+ * long term by a driver. Returns 0 if they can, -1 if they cannot or the check failed.
+ */
+int v4l2_mmap_segment_check(const char* directory);
+
+/**
+ * Prepares slot layout for frames made of nplanes planes of given sizes.
+ * Files are created lazily; each of them holds as many slots
+ * as fit into max_size bytes (at least one).
+ */
+int v4l2_mmap_segment_init(struct v4l2_mmap_segment* segment, const char* directory,
+    uint32_t fourcc, uint32_t width, uint32_t height,
+    const size_t* plane_sizes, unsigned nplanes, uint64_t max_size);
+
+/**
+ * Assigns the next free slot to buffer 'index' and stores addresses
+ * of its planes in addrs. Called by the capture thread before VIDIOC_QBUF.
+ */
+int v4l2_mmap_segment_assign(struct v4l2_mmap_segment* segment, unsigned index, void** addrs);
+
+/**
+ * Records the frame held by buffer 'index' in the segment index, starts
+ * writeback of its slot and releases the slot. Called by the writer thread.
+ */
+int v4l2_mmap_segment_commit(struct v4l2_mmap_segment* segment, unsigned index, uint64_t frame,
+    uint32_t sequence, uint32_t flags, uint64_t timestamp, const struct iovec* iov, size_t iovcnt);
+
+/** Finishes all files, including the ones with slots which have never been committed */
+void v4l2_mmap_segment_close(struct v4l2_mmap_segment* segment);
+
+#endif /* _V4L2_MMAP_SEGMENT_H_ */
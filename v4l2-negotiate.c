@@ -0,0 +1,312 @@
+/* SPDX-License-Identifier: MIT */
+/**
+ * @file v4l2-negotiate.c
+ *
+ * Automatic choice of format, frame size and frame interval (see v4l2-negotiate.h).
+ */
+
+/*===========================================================================*\
+ * system header files
+\*===========================================================================*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+/*===========================================================================*\
+ * project header files
+\*===========================================================================*/
+#include "v4l2-negotiate.h"
+
+/*===========================================================================*\
+ * preprocessor #define constants and macros
+\*===========================================================================*/
+#define ARRAY_SIZE(arr) (sizeof(arr) / sizeof(arr[0]))
+
+/*===========================================================================*\
+ * local type definitions
+\*===========================================================================*/
+struct v4l2_candidate_list
+{
+    struct v4l2_format_candidate* candidates;
+    unsigned count;
+    unsigned capacity;
+};
+
+/*===========================================================================*\
+ * global object definitions
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * local function declarations
+\*===========================================================================*/
+static int v4l2_negotiate_add(struct v4l2_candidate_list* list, const struct v4l2_format_candidate* candidate);
+static int v4l2_negotiate_collect(const struct v4l2_caps_cache* cache, struct v4l2_candidate_list* list);
+static double v4l2_negotiate_decode_factor(const struct v4l2_format_candidate* candidate);
+static double v4l2_negotiate_score(const struct v4l2_format_candidate* candidate,
+    uint32_t width, uint32_t height, double fps, double bus_bandwidth, double* bandwidth);
+
+/*===========================================================================*\
+ * local object definitions
+\*===========================================================================*/
+
+/* bits per pixel of common uncompressed formats, anything else is assumed to be packed 4:2:2 */
+static const struct {
+    uint32_t pixelformat;
+    unsigned bits;
+} bits_per_pixel[] = {
+    {V4L2_PIX_FMT_GREY,    8},
+    {V4L2_PIX_FMT_SBGGR8,  8},
+    {V4L2_PIX_FMT_SGBRG8,  8},
+    {V4L2_PIX_FMT_SGRBG8,  8},
+    {V4L2_PIX_FMT_SRGGB8,  8},
+    {V4L2_PIX_FMT_NV12,    12},
+    {V4L2_PIX_FMT_NV21,    12},
+    {V4L2_PIX_FMT_NV12M,   12},
+    {V4L2_PIX_FMT_YUV420,  12},
+    {V4L2_PIX_FMT_YVU420,  12},
+    {V4L2_PIX_FMT_YUYV,    16},
+    {V4L2_PIX_FMT_UYVY,    16},
+    {V4L2_PIX_FMT_NV16,    16},
+    {V4L2_PIX_FMT_RGB565,  16},
+    {V4L2_PIX_FMT_Y16,     16},
+    {V4L2_PIX_FMT_RGB24,   24},
+    {V4L2_PIX_FMT_BGR24,   24},
+    {V4L2_PIX_FMT_XRGB32,  32},
+    {V4L2_PIX_FMT_XBGR32,  32},
+    {V4L2_PIX_FMT_ARGB32,  32},
+    {V4L2_PIX_FMT_ABGR32,  32},
+};
+
+/*===========================================================================*\
+ * inline function definitions
+\*===========================================================================*/
+static inline double v4l2_negotiate_fps(const struct v4l2_format_candidate* candidate)
+{
+    if (candidate->timeperframe.numerator == 0)
+        return 0;
+
+    return (double)candidate->timeperframe.denominator / candidate->timeperframe.numerator;
+}
+
+static inline bool v4l2_negotiate_is_video_codec(uint32_t pixelformat)
+{
+    return pixelformat == V4L2_PIX_FMT_H264 || pixelformat == V4L2_PIX_FMT_HEVC ||
+           pixelformat == V4L2_PIX_FMT_VP8 || pixelformat == V4L2_PIX_FMT_VP9;
+}
+
+/* 1 if value meets the target exactly, less the further it is from the target */
+static inline double v4l2_negotiate_ratio(double value, double target)
+{
+    if (value <= 0 || target <= 0)
+        return 0.5; /* unknown */
+
+    if (value <= target)
+        return value / target;
+
+    /* more than needed costs bandwidth and processing, but is still usable */
+    return 0.5 + 0.5 * target / value;
+}
+
+/*===========================================================================*\
+ * public function definitions
+\*===========================================================================*/
+double v4l2_negotiate_frame_size(const struct v4l2_format_candidate* candidate)
+{
+    double pixels = (double)candidate->width * candidate->height;
+    unsigned i;
+
+    /* typical rates of a good quality stream */
+    if (v4l2_negotiate_is_video_codec(candidate->pixelformat))
+        return pixels * 0.5 / 8;
+
+    if (candidate->pixelformat == V4L2_PIX_FMT_MJPEG || candidate->pixelformat == V4L2_PIX_FMT_JPEG ||
+        (candidate->flags & V4L2_FMT_FLAG_COMPRESSED))
+        return pixels * 3 / 8;
+
+    for (i = 0; i < ARRAY_SIZE(bits_per_pixel); ++i)
+        if (bits_per_pixel[i].pixelformat == candidate->pixelformat)
+            return pixels * bits_per_pixel[i].bits / 8;
+
+    return pixels * 2;
+}
+
+int v4l2_negotiate_format(const struct v4l2_caps_cache* cache, const struct v4l2_format_target* target,
+    struct v4l2_format_candidate* best)
+{
+    struct v4l2_candidate_list list;
+    uint32_t width = target->width;
+    uint32_t height = target->height;
+    double fps = target->fps;
+    double best_score = -1;
+    unsigned i;
+
+    memset(&list, 0, sizeof(list));
+    if (v4l2_negotiate_collect(cache, &list) || list.count == 0) {
+        free(list.candidates);
+        return -1;
+    }
+
+    /* without a target the best the device can do is aimed at */
+    for (i = 0; i < list.count; ++i) {
+        const struct v4l2_format_candidate* c = list.candidates + i;
+
+        if (target->width == 0 && (uint64_t)c->width * c->height > (uint64_t)width * height) {
+            width = c->width;
+            height = c->height;
+        }
+        if (target->fps == 0 && v4l2_negotiate_fps(c) > fps)
+            fps = v4l2_negotiate_fps(c);
+    }
+
+    fprintf(stdout, "format negotiation (target: %ux%u @ %.2f fps, bus: ", width, height, fps);
+    if (target->bus_bandwidth > 0)
+        fprintf(stdout, "%.1f MB/s):\n", target->bus_bandwidth / 1e6);
+    else
+        fprintf(stdout, "unlimited):\n");
+
+    for (i = 0; i < list.count; ++i) {
+        const struct v4l2_format_candidate* c = list.candidates + i;
+        double bandwidth;
+        double score = v4l2_negotiate_score(c, width, height, fps, target->bus_bandwidth, &bandwidth);
+
+        fprintf(stdout, "\t'%c%c%c%c' %5ux%-5u @ %6.2f fps %8.1f MB/s, score: %.3f\n",
+            (c->pixelformat >>  0) & 0xff,
+            (c->pixelformat >>  8) & 0xff,
+            (c->pixelformat >> 16) & 0xff,
+            (c->pixelformat >> 24) & 0xff,
+            c->width, c->height, v4l2_negotiate_fps(c), bandwidth / 1e6, score);
+
+        /* enumeration order (i.e. driver preference) breaks ties */
+        if (score > best_score) {
+            best_score = score;
+            *best = *c;
+        }
+    }
+
+    free(list.candidates);
+    return 0;
+}
+
+/*===========================================================================*\
+ * local function definitions
+\*===========================================================================*/
+static int v4l2_negotiate_add(struct v4l2_candidate_list* list, const struct v4l2_format_candidate* candidate)
+{
+    if (list->count == list->capacity) {
+        unsigned capacity = list->capacity ? 2 * list->capacity : 32;
+        struct v4l2_format_candidate* candidates = realloc(list->candidates, capacity * sizeof(*candidates));
+
+        if (NULL == candidates) {
+            fprintf(stderr, "realloc(%zu) failed\n", capacity * sizeof(*candidates));
+            return -1;
+        }
+
+        list->candidates = candidates;
+        list->capacity = capacity;
+    }
+
+    list->candidates[list->count++] = *candidate;
+    return 0;
+}
+
+static int v4l2_negotiate_collect(const struct v4l2_caps_cache* cache, struct v4l2_candidate_list* list)
+{
+    const struct v4l2_fmtdesc* fmtdesc = NULL;
+    struct v4l2_format_candidate size;
+    bool size_valid = false;
+    bool intervals = false;
+    unsigned i;
+
+    for (i = 0; i <= cache->count; ++i) {
+        const struct v4l2_caps_record* record = i < cache->count ? cache->records + i : NULL;
+
+        if (record && record->type == V4L2_CAPS_RECORD_FRMIVAL) {
+            const struct v4l2_frmivalenum* frmival = &record->u.frmival;
+            struct v4l2_format_candidate candidate;
+
+            if (!size_valid)
+                continue;
+
+            candidate = size;
+
+            /* of a stepwise range only the fastest interval is worth considering */
+            if (V4L2_FRMIVAL_TYPE_DISCRETE == frmival->type)
+                candidate.timeperframe = frmival->discrete;
+            else
+                candidate.timeperframe = frmival->stepwise.min;
+
+            if (v4l2_negotiate_add(list, &candidate))
+                return -1;
+
+            intervals = true;
+            continue;
+        }
+
+        /* frame size without any enumerated interval is still a candidate */
+        if (size_valid && !intervals && v4l2_negotiate_add(list, &size))
+            return -1;
+        size_valid = false;
+        intervals = false;
+
+        if (NULL == record)
+            break;
+
+        if (record->type == V4L2_CAPS_RECORD_FMTDESC)
+            fmtdesc = &record->u.fmtdesc;
+        else
+        if (record->type == V4L2_CAPS_RECORD_FRMSIZE && fmtdesc) {
+            const struct v4l2_frmsizeenum* frmsize = &record->u.frmsize;
+
+            memset(&size, 0, sizeof(size));
+            size.pixelformat = fmtdesc->pixelformat;
+            size.flags = fmtdesc->flags;
+
+            if (V4L2_FRMSIZE_TYPE_DISCRETE == frmsize->type) {
+                size.width = frmsize->discrete.width;
+                size.height = frmsize->discrete.height;
+                size_valid = true;
+            }
+            else
+            if (V4L2_FRMSIZE_TYPE_STEPWISE == frmsize->type) {
+                /* intervals are enumerated for the largest size */
+                size.width = frmsize->stepwise.max_width;
+                size.height = frmsize->stepwise.max_height;
+                size_valid = true;
+            }
+        }
+    }
+
+    return 0;
+}
+
+static double v4l2_negotiate_decode_factor(const struct v4l2_format_candidate* candidate)
+{
+    if (v4l2_negotiate_is_video_codec(candidate->pixelformat))
+        return 0.8;
+
+    if (candidate->pixelformat == V4L2_PIX_FMT_MJPEG || candidate->pixelformat == V4L2_PIX_FMT_JPEG ||
+        (candidate->flags & V4L2_FMT_FLAG_COMPRESSED))
+        return 0.9;
+
+    return 1.0;
+}
+
+static double v4l2_negotiate_score(const struct v4l2_format_candidate* candidate,
+    uint32_t width, uint32_t height, double fps, double bus_bandwidth, double* bandwidth)
+{
+    double rate = v4l2_negotiate_fps(candidate);
+    double score;
+
+    *bandwidth = v4l2_negotiate_frame_size(candidate) * (rate > 0 ? rate : fps);
+
+    score = v4l2_negotiate_ratio((double)candidate->width * candidate->height, (double)width * height);
+    score *= v4l2_negotiate_ratio(rate, fps);
+    score *= v4l2_negotiate_decode_factor(candidate);
+
+    /* the bus cannot carry more, the remaining frames would be dropped */
+    if (bus_bandwidth > 0 && *bandwidth > bus_bandwidth)
+        score *= bus_bandwidth / *bandwidth;
+
+    return score;
+}
@@ -0,0 +1,74 @@
+/* SPDX-License-Identifier: MIT */
+/**
+ * @file v4l2-negotiate.h
+ *
+ * Automatic choice of format, frame size and frame interval.
+ * Every (format, frame size, frame interval) tuple enumerated from a device
+ * is scored against a target: how close its resolution and frame rate get to
+ * the requested ones (overshooting is penalised less than falling short),
+ * whether its estimated data rate fits into the bandwidth of the bus
+ * (frames get dropped otherwise) and how much CPU is needed downstream
+ * (compressed formats have to be decoded). The best scoring tuple wins.
+ */
+
+#ifndef _V4L2_NEGOTIATE_H_
+#define _V4L2_NEGOTIATE_H_
+
+/*===========================================================================*\
+ * system header files
+\*===========================================================================*/
+#include <stdint.h>
+
+#include <linux/videodev2.h>
+
+/*===========================================================================*\
+ * project header files
+\*===========================================================================*/
+#include "v4l2-caps-cache.h"
+
+/*===========================================================================*\
+ * preprocessor #define constants and macros
+\*===========================================================================*/
+
+/* isochronous bandwidth of USB 2.0 high speed: 3 x 1024 bytes every 125 us */
+#define V4L2_NEGOTIATE_USB2_BANDWIDTH 24576000.0
+
+/*===========================================================================*\
+ * global type definitions
+\*===========================================================================*/
+struct v4l2_format_target
+{
+    uint32_t width;         /* 0 if any, the largest enumerated is aimed at */
+    uint32_t height;
+    double fps;             /* 0 if any, the highest enumerated is aimed at */
+    double bus_bandwidth;   /* bytes per second, 0 if unlimited */
+};
+
+struct v4l2_format_candidate
+{
+    uint32_t pixelformat;
+    uint32_t flags;         /* of struct v4l2_fmtdesc */
+    uint32_t width;
+    uint32_t height;
+    struct v4l2_fract timeperframe; /* 0/0 if the driver does not enumerate intervals */
+};
+
+/*===========================================================================*\
+ * global object declarations
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * function forward declarations
+\*===========================================================================*/
+
+/** Estimated size of a frame in bytes (compressed formats by a typical bits per pixel ratio) */
+double v4l2_negotiate_frame_size(const struct v4l2_format_candidate* candidate);
+
+/**
+ * Scores all tuples recorded in the cache, prints them and stores the best one.
+ * Returns 0 on success, -1 if no tuple is known.
+ */
+int v4l2_negotiate_format(const struct v4l2_caps_cache* cache, const struct v4l2_format_target* target,
+    struct v4l2_format_candidate* best);
+
+#endif /* _V4L2_NEGOTIATE_H_ */
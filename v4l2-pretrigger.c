@@ -0,0 +1,350 @@
+/* SPDX-License-Identifier: MIT */
+/**
+ * @file v4l2-pretrigger.c
+ *
+ * Pre-trigger ring and its trigger (see v4l2-pretrigger.h).
+ */
+
+/*===========================================================================*\
+ * system header files
+\*===========================================================================*/
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/signalfd.h>
+
+/*===========================================================================*\
+ * project header files
+\*===========================================================================*/
+#include "v4l2-pretrigger.h"
+
+/*===========================================================================*\
+ * preprocessor #define constants and macros
+\*===========================================================================*/
+#define ALIGN(x, a) __ALIGN(x, (a) - 1)
+#define __ALIGN(x, mask) (((x) + (mask)) & ~(mask))
+
+#define V4L2_PRETRIGGER_HEADER_SIZE ALIGN(sizeof(struct v4l2_pretrigger_record), V4L2_PRETRIGGER_ALIGNMENT)
+
+/*===========================================================================*\
+ * local type definitions
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * global object definitions
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * local function declarations
+\*===========================================================================*/
+static void v4l2_pretrigger_ring_drop(struct v4l2_pretrigger_ring* ring);
+static uint8_t* v4l2_pretrigger_ring_alloc(struct v4l2_pretrigger_ring* ring, size_t size, uint64_t captured);
+static int v4l2_trigger_on_signal(void* arg, int fd, uint32_t events);
+static int v4l2_trigger_on_datagram(void* arg, int fd, uint32_t events);
+
+/*===========================================================================*\
+ * local object definitions
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * inline function definitions
+\*===========================================================================*/
+static inline struct v4l2_pretrigger_record* v4l2_pretrigger_ring_oldest(const struct v4l2_pretrigger_ring* ring)
+{
+    return (struct v4l2_pretrigger_record*)(ring->data + ring->tail);
+}
+
+/*===========================================================================*\
+ * public function definitions
+\*===========================================================================*/
+int v4l2_pretrigger_ring_init(struct v4l2_pretrigger_ring* ring, size_t size, uint64_t window)
+{
+    void* addr;
+
+    memset(ring, 0, sizeof(*ring));
+
+    size = ALIGN(size, (size_t)V4L2_PRETRIGGER_ALIGNMENT);
+    if (size == 0)
+        return -1;
+
+    /* prefaulted, so that keeping frames never takes a page fault */
+    addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (addr == MAP_FAILED) {
+        fprintf(stderr, "mmap(%zu) failed: %s\n", size, strerror(errno));
+        return -1;
+    }
+
+    ring->data = addr;
+    ring->size = size;
+    ring->window = window;
+    ring->wrap = size;
+
+    return 0;
+}
+
+void v4l2_pretrigger_ring_destroy(struct v4l2_pretrigger_ring* ring)
+{
+    if (ring->data)
+        munmap(ring->data, ring->size);
+
+    ring->data = NULL;
+    ring->count = 0;
+}
+
+void v4l2_pretrigger_ring_push(struct v4l2_pretrigger_ring* ring, const struct v4l2_pretrigger_record* record,
+    const struct iovec* iov, size_t iovcnt)
+{
+    struct v4l2_pretrigger_record* r;
+    size_t bytes = 0;
+    uint8_t* data;
+    size_t i;
+
+    for (i = 0; i < iovcnt && i < VIDEO_MAX_PLANES && iov[i].iov_base; ++i)
+        bytes += iov[i].iov_len;
+    iovcnt = i;
+
+    /* nothing older than the window is worth keeping, whether memory is short or not */
+    while (ring->count > 0 && v4l2_pretrigger_ring_oldest(ring)->captured + ring->window < record->captured) {
+        v4l2_pretrigger_ring_drop(ring);
+        ring->expired++;
+    }
+
+    data = v4l2_pretrigger_ring_alloc(ring, V4L2_PRETRIGGER_HEADER_SIZE + ALIGN(bytes, (size_t)V4L2_PRETRIGGER_ALIGNMENT),
+        record->captured);
+    if (data == NULL) {
+        ring->oversized++;
+        return;
+    }
+
+    r = (struct v4l2_pretrigger_record*)data;
+    *r = *record;
+    r->size = V4L2_PRETRIGGER_HEADER_SIZE + ALIGN(bytes, (size_t)V4L2_PRETRIGGER_ALIGNMENT);
+    r->nplanes = iovcnt;
+
+    data += V4L2_PRETRIGGER_HEADER_SIZE;
+    for (i = 0; i < VIDEO_MAX_PLANES; ++i) {
+        r->bytesused[i] = i < iovcnt ? iov[i].iov_len : 0;
+        if (i < iovcnt) {
+            memcpy(data, iov[i].iov_base, iov[i].iov_len);
+            data += iov[i].iov_len;
+        }
+    }
+
+    ring->buffered++;
+}
+
+void v4l2_pretrigger_ring_flush(struct v4l2_pretrigger_ring* ring, v4l2_pretrigger_flush_t flush, void* arg)
+{
+    while (ring->count > 0) {
+        struct v4l2_pretrigger_record* r = v4l2_pretrigger_ring_oldest(ring);
+        struct iovec iov[VIDEO_MAX_PLANES];
+        uint8_t* data = (uint8_t*)r + V4L2_PRETRIGGER_HEADER_SIZE;
+        uint32_t i;
+
+        memset(iov, 0, sizeof(iov));
+        for (i = 0; i < r->nplanes; ++i) {
+            iov[i].iov_base = data;
+            iov[i].iov_len = r->bytesused[i];
+            data += r->bytesused[i];
+        }
+
+        flush(arg, r, iov, VIDEO_MAX_PLANES);
+
+        v4l2_pretrigger_ring_drop(ring);
+        ring->flushed++;
+    }
+}
+
+int v4l2_trigger_open(struct v4l2_trigger* trigger, const sigset_t* signals, const char* socket_path)
+{
+    memset(trigger, 0, sizeof(*trigger));
+    atomic_init(&trigger->requests, 0);
+    trigger->signal_fd = -1;
+    trigger->socket_fd = -1;
+
+    if (signals) {
+        int status;
+
+        /* delivered through the signalfd only, so that they never interrupt anything */
+        status = pthread_sigmask(SIG_BLOCK, signals, NULL);
+        if (status) {
+            fprintf(stderr, "pthread_sigmask() failed: %s\n", strerror(status));
+            return -1;
+        }
+
+        trigger->signal_fd = signalfd(-1, signals, SFD_NONBLOCK | SFD_CLOEXEC);
+        if (trigger->signal_fd == -1) {
+            fprintf(stderr, "signalfd() failed: %s\n", strerror(errno));
+            return -1;
+        }
+    }
+
+    if (socket_path) {
+        if (strlen(socket_path) >= sizeof(trigger->address.sun_path)) {
+            fprintf(stderr, "socket name '%s' is too long\n", socket_path);
+            v4l2_trigger_close(trigger);
+            return -1;
+        }
+
+        trigger->address.sun_family = AF_UNIX;
+        strcpy(trigger->address.sun_path, socket_path);
+
+        trigger->socket_fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (trigger->socket_fd == -1) {
+            fprintf(stderr, "socket() failed: %s\n", strerror(errno));
+            v4l2_trigger_close(trigger);
+            return -1;
+        }
+
+        /* socket left behind by a previous run */
+        if (-1 == unlink(socket_path) && errno != ENOENT)
+            fprintf(stderr, "cannot remove '%s': %s\n", socket_path, strerror(errno));
+
+        if (-1 == bind(trigger->socket_fd, (const struct sockaddr*)&trigger->address, sizeof(trigger->address))) {
+            fprintf(stderr, "bind(%s) failed: %s\n", socket_path, strerror(errno));
+            close(trigger->socket_fd);
+            trigger->socket_fd = -1;
+            v4l2_trigger_close(trigger);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+void v4l2_trigger_close(struct v4l2_trigger* trigger)
+{
+    if (trigger->signal_fd != -1)
+        close(trigger->signal_fd);
+
+    if (trigger->socket_fd != -1) {
+        close(trigger->socket_fd);
+        unlink(trigger->address.sun_path);
+    }
+
+    trigger->signal_fd = -1;
+    trigger->socket_fd = -1;
+}
+
+int v4l2_trigger_watch(struct v4l2_trigger* trigger, struct v4l2_event_loop* loop)
+{
+    if (trigger->signal_fd != -1 &&
+        v4l2_event_loop_add(loop, trigger->signal_fd, EPOLLIN, v4l2_trigger_on_signal, trigger))
+        return -1;
+
+    if (trigger->socket_fd != -1 &&
+        v4l2_event_loop_add(loop, trigger->socket_fd, EPOLLIN, v4l2_trigger_on_datagram, trigger)) {
+        if (trigger->signal_fd != -1)
+            v4l2_event_loop_remove(loop, trigger->signal_fd);
+        return -1;
+    }
+
+    return 0;
+}
+
+void v4l2_trigger_fire(struct v4l2_trigger* trigger)
+{
+    atomic_fetch_add(&trigger->requests, 1);
+}
+
+uint64_t v4l2_trigger_requests(struct v4l2_trigger* trigger)
+{
+    return atomic_load(&trigger->requests);
+}
+
+/*===========================================================================*\
+ * local function definitions
+\*===========================================================================*/
+static void v4l2_pretrigger_ring_drop(struct v4l2_pretrigger_ring* ring)
+{
+    ring->tail += v4l2_pretrigger_ring_oldest(ring)->size;
+    if (ring->tail == ring->wrap) {
+        ring->tail = 0;
+        ring->wrap = ring->size;
+    }
+
+    if (--ring->count == 0) {
+        ring->head = 0;
+        ring->tail = 0;
+        ring->wrap = ring->size;
+    }
+}
+
+/* records are never split, the end of the memory is left unused when the next one does not fit there */
+static uint8_t* v4l2_pretrigger_ring_alloc(struct v4l2_pretrigger_ring* ring, size_t size, uint64_t captured)
+{
+    size_t offset;
+
+    if (size > ring->size)
+        return NULL;
+
+    for (;;) {
+        if (ring->count == 0 || ring->head > ring->tail) {
+            /* records lie in [tail, head), free space is after head and before tail */
+            if (ring->size - ring->head >= size) {
+                offset = ring->head;
+                break;
+            }
+            if (ring->count > 0 && ring->tail >= size) {
+                ring->wrap = ring->head;
+                offset = 0;
+                break;
+            }
+        }
+        else
+        if (ring->tail - ring->head >= size) {
+            /* records lie in [tail, wrap) and [0, head) */
+            offset = ring->head;
+            break;
+        }
+
+        if (v4l2_pretrigger_ring_oldest(ring)->captured + ring->window < captured)
+            ring->expired++;
+        else
+            ring->evicted++;
+        v4l2_pretrigger_ring_drop(ring);
+    }
+
+    ring->head = offset + size;
+    ring->count++;
+
+    return ring->data + offset;
+}
+
+static int v4l2_trigger_on_signal(void* arg, int fd, uint32_t events)
+{
+    struct v4l2_trigger* trigger = arg;
+    struct signalfd_siginfo info;
+
+    (void)events;
+
+    /* another loop watching the trigger may have read it already */
+    while (read(fd, &info, sizeof(info)) == sizeof(info))
+        v4l2_trigger_fire(trigger);
+
+    return 0;
+}
+
+static int v4l2_trigger_on_datagram(void* arg, int fd, uint32_t events)
+{
+    struct v4l2_trigger* trigger = arg;
+    char message[64];
+
+    (void)events;
+
+    /* content of the datagram does not matter */
+    while (recv(fd, message, sizeof(message), 0) >= 0)
+        v4l2_trigger_fire(trigger);
+
+    return 0;
+}
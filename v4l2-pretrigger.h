@@ -0,0 +1,136 @@
+/* SPDX-License-Identifier: MIT */
+/**
+ * @file v4l2-pretrigger.h
+ *
+ * Recording of what happened around an event rather than of everything.
+ * Frames are copied into a ring in memory which keeps those captured within
+ * the last window nanoseconds, as many of them as fit into the memory budget.
+ * Records take only the bytes used, so compressed frames are held in their
+ * compressed size. The memory is allocated and populated up front, so that
+ * keeping frames costs neither disk I/O nor page faults.
+ * Once a trigger fires, the ring is flushed to storage, oldest frame first,
+ * and frames are stored as usual for a while after the event.
+ * Triggers are counted by struct v4l2_trigger, which can be fired by SIGUSR1,
+ * by any datagram sent to a control socket or by v4l2_trigger_fire() called
+ * from any thread, a processing stage for instance.
+ */
+
+#ifndef _V4L2_PRETRIGGER_H_
+#define _V4L2_PRETRIGGER_H_
+
+/*===========================================================================*\
+ * system header files
+\*===========================================================================*/
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <signal.h>
+
+#include <sys/un.h>
+#include <sys/uio.h>
+
+#include <linux/videodev2.h>
+
+/*===========================================================================*\
+ * project header files
+\*===========================================================================*/
+#include "v4l2-event-loop.h"
+
+/*===========================================================================*\
+ * preprocessor #define constants and macros
+\*===========================================================================*/
+#define V4L2_PRETRIGGER_DEFAULT_BUDGET_MIB 256
+#define V4L2_PRETRIGGER_ALIGNMENT 64 /* of records and of frame data within them */
+
+/*===========================================================================*\
+ * global type definitions
+\*===========================================================================*/
+
+/* header of a frame in the ring, frame data (planes one after another) follows it */
+struct v4l2_pretrigger_record
+{
+    uint64_t size;            /* of the whole record, set by the ring */
+    uint64_t timestamp;       /* set by the driver, nanoseconds */
+    uint64_t captured;        /* CLOCK_MONOTONIC nanoseconds, the window is measured in */
+    int counter;
+    uint32_t sequence;
+    uint32_t flags;
+    uint32_t nplanes;         /* set by the ring */
+    uint32_t bytesused[VIDEO_MAX_PLANES]; /* set by the ring */
+};
+
+/* gets frames of the ring one by one, iov points into the ring */
+typedef void (*v4l2_pretrigger_flush_t)(void* arg, const struct v4l2_pretrigger_record* record,
+    struct iovec* iov, size_t iovcnt);
+
+struct v4l2_pretrigger_ring
+{
+    uint8_t* data;
+    size_t size;              /* memory budget */
+    uint64_t window;          /* nanoseconds of frames kept */
+    size_t head;              /* where the next record goes */
+    size_t tail;              /* oldest record */
+    size_t wrap;              /* records stop here and go on at the beginning */
+    unsigned count;           /* records in the ring */
+    uint64_t buffered;        /* frames put into the ring */
+    uint64_t expired;         /* ... dropped as older than the window */
+    uint64_t evicted;         /* ... dropped for lack of memory while still within the window */
+    uint64_t flushed;         /* ... handed to storage */
+    uint64_t oversized;       /* frames larger than the whole ring */
+};
+
+struct v4l2_trigger
+{
+    _Atomic uint64_t requests; /* triggers fired so far */
+    int signal_fd;             /* -1 if no signal fires the trigger */
+    int socket_fd;             /* -1 if there is no control socket */
+    struct sockaddr_un address;
+};
+
+/*===========================================================================*\
+ * global object declarations
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * function forward declarations
+\*===========================================================================*/
+
+/** Allocates size bytes for frames captured within window nanoseconds. Returns 0 on success, -1 on failure */
+int v4l2_pretrigger_ring_init(struct v4l2_pretrigger_ring* ring, size_t size, uint64_t window);
+
+/** Frees the ring, frames not flushed are lost */
+void v4l2_pretrigger_ring_destroy(struct v4l2_pretrigger_ring* ring);
+
+/**
+ * Copies frame described by record (counter, sequence, flags, timestamp, captured)
+ * and planes iov into the ring, dropping frames older than the window and,
+ * if it is still short of memory, the oldest ones.
+ */
+void v4l2_pretrigger_ring_push(struct v4l2_pretrigger_ring* ring, const struct v4l2_pretrigger_record* record,
+    const struct iovec* iov, size_t iovcnt);
+
+/** Hands all frames of the ring to flush, oldest first, and empties it */
+void v4l2_pretrigger_ring_flush(struct v4l2_pretrigger_ring* ring, v4l2_pretrigger_flush_t flush, void* arg);
+
+/**
+ * Prepares trigger to be fired by signals (NULL: none), which are blocked in the calling thread
+ * and in threads it creates from now on, and by datagrams sent to socket_path (NULL: none),
+ * an existing socket is replaced. Returns 0 on success, -1 on failure.
+ */
+int v4l2_trigger_open(struct v4l2_trigger* trigger, const sigset_t* signals, const char* socket_path);
+
+void v4l2_trigger_close(struct v4l2_trigger* trigger);
+
+/**
+ * Lets loop handle signals and datagrams of the trigger. The same trigger can be
+ * watched by several loops, any of them fires it. Returns 0 on success, -1 on failure.
+ */
+int v4l2_trigger_watch(struct v4l2_trigger* trigger, struct v4l2_event_loop* loop);
+
+/** Fires the trigger, safe to be called from any thread and from signal handlers */
+void v4l2_trigger_fire(struct v4l2_trigger* trigger);
+
+/** Number of times the trigger has been fired */
+uint64_t v4l2_trigger_requests(struct v4l2_trigger* trigger);
+
+#endif /* _V4L2_PRETRIGGER_H_ */
@@ -0,0 +1,216 @@
+/* SPDX-License-Identifier: MIT */
+/**
+ * @file v4l2-sched.c
+ *
+ * Placement of the capture path on the machine (see v4l2-sched.h).
+ */
+
+/*===========================================================================*\
+ * system header files
+\*===========================================================================*/
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include <linux/mempolicy.h>
+
+/*===========================================================================*\
+ * project header files
+\*===========================================================================*/
+#include "v4l2-sched.h"
+
+/*===========================================================================*\
+ * preprocessor #define constants and macros
+\*===========================================================================*/
+#define NUMA_MAX_NODES 1024
+
+/*===========================================================================*\
+ * local type definitions
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * global object definitions
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * local function declarations
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * local object definitions
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * inline function definitions
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * public function definitions
+\*===========================================================================*/
+int v4l2_sched_parse_cpus(const char* list, cpu_set_t* cpus)
+{
+    const char* p = list;
+
+    CPU_ZERO(cpus);
+
+    while (*p) {
+        char* end;
+        long first;
+        long last;
+
+        first = strtol(p, &end, 10);
+        if (end == p || first < 0 || first >= CPU_SETSIZE)
+            return -1;
+
+        last = first;
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first || last >= CPU_SETSIZE)
+                return -1;
+        }
+
+        for (; first <= last; ++first)
+            CPU_SET(first, cpus);
+
+        if (*end == ',')
+            end++;
+        else
+        if (*end != '\0')
+            return -1;
+
+        p = end;
+    }
+
+    return CPU_COUNT(cpus) > 0 ? 0 : -1;
+}
+
+void v4l2_sched_apply(const char* name, const cpu_set_t* cpus, int fifo_priority)
+{
+    int status;
+
+    if (cpus) {
+        status = pthread_setaffinity_np(pthread_self(), sizeof(*cpus), cpus);
+        if (status)
+            fprintf(stderr, "%s: pthread_setaffinity_np() failed: %s\n", name, strerror(status));
+    }
+
+    if (fifo_priority > 0) {
+        struct sched_param param;
+
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = fifo_priority;
+
+        /* threat this as non-fatal error, e.g. without CAP_SYS_NICE or RLIMIT_RTPRIO */
+        status = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        if (status)
+            fprintf(stderr, "%s: SCHED_FIFO priority %d cannot be set: %s\n", name, fifo_priority, strerror(status));
+    }
+}
+
+void v4l2_sched_sample(struct v4l2_sched_stats* stats)
+{
+    unsigned long long run_time;
+    unsigned long long run_delay;
+    unsigned long long timeslices;
+    struct rusage usage;
+    FILE* file;
+
+    memset(stats, 0, sizeof(*stats));
+    stats->cpu = sched_getcpu();
+
+    /* on-CPU time, run queue wait time, number of timeslices; missing without CONFIG_SCHED_INFO */
+    file = fopen("/proc/thread-self/schedstat", "r");
+    if (file) {
+        if (3 == fscanf(file, "%llu %llu %llu", &run_time, &run_delay, &timeslices)) {
+            stats->run_delay = run_delay;
+            stats->timeslices = timeslices;
+        }
+        fclose(file);
+    }
+
+    if (0 == getrusage(RUSAGE_THREAD, &usage)) {
+        stats->nvcsw = usage.ru_nvcsw;
+        stats->nivcsw = usage.ru_nivcsw;
+    }
+}
+
+void v4l2_sched_diff(struct v4l2_sched_stats* diff, const struct v4l2_sched_stats* start,
+    const struct v4l2_sched_stats* end)
+{
+    diff->run_delay = end->run_delay - start->run_delay;
+    diff->timeslices = end->timeslices - start->timeslices;
+    diff->nvcsw = end->nvcsw - start->nvcsw;
+    diff->nivcsw = end->nivcsw - start->nivcsw;
+    diff->cpu = end->cpu;
+}
+
+int v4l2_sched_device_node(const char* filename)
+{
+    char path[PATH_MAX];
+    char resolved[PATH_MAX];
+    struct stat st;
+    char* slash;
+
+    if (-1 == stat(filename, &st) || !S_ISCHR(st.st_mode))
+        return -1;
+
+    snprintf(path, sizeof(path), "/sys/dev/char/%u:%u/device", major(st.st_rdev), minor(st.st_rdev));
+    if (NULL == realpath(path, resolved))
+        return -1;
+
+    /* USB and other devices have no node of their own, but the controller they hang off has */
+    while ((slash = strrchr(resolved, '/')) && slash != resolved) {
+        FILE* file;
+        int node;
+        int n;
+
+        n = snprintf(path, sizeof(path), "%s/numa_node", resolved);
+        if (n > 0 && (size_t)n < sizeof(path) && (file = fopen(path, "r"))) {
+            n = fscanf(file, "%d", &node);
+            fclose(file);
+            if (n == 1 && node >= 0)
+                return node;
+        }
+
+        *slash = '\0';
+    }
+
+    return -1;
+}
+
+int v4l2_sched_bind_memory(void* addr, size_t size, int node)
+{
+    unsigned long nodemask[NUMA_MAX_NODES / (8 * sizeof(unsigned long))];
+    long pagesize = sysconf(_SC_PAGESIZE);
+    uintptr_t start;
+    uintptr_t end;
+
+    if (node < 0 || node >= NUMA_MAX_NODES || addr == NULL)
+        return -1;
+
+    if (pagesize <= 0)
+        pagesize = 0x1000;
+
+    /* whole pages, malloc()ed memory rarely starts at a page boundary */
+    start = (uintptr_t)addr & ~(uintptr_t)(pagesize - 1);
+    end = ((uintptr_t)addr + size + pagesize - 1) & ~(uintptr_t)(pagesize - 1);
+
+    memset(nodemask, 0, sizeof(nodemask));
+    nodemask[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+
+    /* preferred rather than bound, so that a full node does not end in an allocation failure */
+    return syscall(SYS_mbind, start, end - start, MPOL_PREFERRED, nodemask, NUMA_MAX_NODES + 1, MPOL_MF_MOVE);
+}
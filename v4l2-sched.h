@@ -0,0 +1,73 @@
+/* SPDX-License-Identifier: MIT */
+/**
+ * @file v4l2-sched.h
+ *
+ * Placement of the capture path on the machine: CPU affinity and real-time
+ * priority of threads, NUMA node of buffer memory, and accounting of how long
+ * threads waited for a CPU. The latter comes from /proc/thread-self/schedstat
+ * (time spent runnable but not running) and getrusage(RUSAGE_THREAD)
+ * (involuntary context switches), sampled when a thread starts and stops,
+ * so it costs the hot path nothing.
+ */
+
+#ifndef _V4L2_SCHED_H_
+#define _V4L2_SCHED_H_
+
+/*===========================================================================*\
+ * system header files
+\*===========================================================================*/
+#include <stdint.h>
+#include <stddef.h>
+#include <sched.h> /* cpu_set_t requires _GNU_SOURCE */
+
+/*===========================================================================*\
+ * project header files
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * preprocessor #define constants and macros
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * global type definitions
+\*===========================================================================*/
+struct v4l2_sched_stats
+{
+    uint64_t run_delay;   /* nanoseconds spent waiting on a run queue */
+    uint64_t timeslices;  /* number of times the thread got a CPU */
+    uint64_t nvcsw;       /* voluntary context switches (e.g. waiting for a frame) */
+    uint64_t nivcsw;      /* involuntary context switches (preempted) */
+    int cpu;              /* CPU the thread was last running on */
+};
+
+/*===========================================================================*\
+ * global object declarations
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * function forward declarations
+\*===========================================================================*/
+
+/** Parses a list of CPUs like "2,3" or "0-3,8". Returns 0 on success, -1 if malformed */
+int v4l2_sched_parse_cpus(const char* list, cpu_set_t* cpus);
+
+/**
+ * Applies affinity (if cpus is not NULL) and SCHED_FIFO priority (if greater than 0)
+ * to the calling thread. Failures are reported and ignored.
+ */
+void v4l2_sched_apply(const char* name, const cpu_set_t* cpus, int fifo_priority);
+
+/** Samples cumulative statistics of the calling thread */
+void v4l2_sched_sample(struct v4l2_sched_stats* stats);
+
+/** Statistics accumulated between two samples of the same thread */
+void v4l2_sched_diff(struct v4l2_sched_stats* diff, const struct v4l2_sched_stats* start,
+    const struct v4l2_sched_stats* end);
+
+/** NUMA node the device (e.g. /dev/video0) is attached to, -1 if unknown */
+int v4l2_sched_device_node(const char* filename);
+
+/** Prefers given NUMA node for the pages of a range, including ones already faulted in */
+int v4l2_sched_bind_memory(void* addr, size_t size, int node);
+
+#endif /* _V4L2_SCHED_H_ */
@@ -0,0 +1,261 @@
+/* SPDX-License-Identifier: MIT */
+/**
+ * @file v4l2-segment.c
+ *
+ * Writer of the segmented recording format (see v4l2-segment.h).
+ */
+
+/*===========================================================================*\
+ * system header files
+\*===========================================================================*/
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+
+/*===========================================================================*\
+ * project header files
+\*===========================================================================*/
+#include "v4l2-segment.h"
+
+/*===========================================================================*\
+ * preprocessor #define constants and macros
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * local type definitions
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * global object definitions
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * local function declarations
+\*===========================================================================*/
+static int v4l2_segment_open(struct v4l2_segment_writer* writer, uint64_t frame, uint64_t timestamp);
+static int v4l2_segment_pwritev(int fd, const struct iovec* iov, size_t iovcnt, uint64_t offset);
+
+/*===========================================================================*\
+ * local object definitions
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * inline function definitions
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * public function definitions
+\*===========================================================================*/
+void v4l2_segment_writer_init(struct v4l2_segment_writer* writer, const char* directory,
+    uint32_t fourcc, uint32_t width, uint32_t height, uint64_t max_size, uint64_t max_duration)
+{
+    memset(writer, 0, sizeof(*writer));
+    writer->directory = directory;
+    writer->fourcc = fourcc;
+    writer->width = width;
+    writer->height = height;
+    writer->max_size = max_size;
+    writer->max_duration = max_duration;
+    writer->data_fd = -1;
+    writer->index_fd = -1;
+}
+
+int v4l2_segment_writer_append(struct v4l2_segment_writer* writer, uint64_t frame,
+    uint32_t sequence, uint32_t flags, uint64_t timestamp, const struct iovec* iov, size_t iovcnt)
+{
+    struct v4l2_segment_index_entry entry;
+    uint64_t size = 0;
+    size_t i;
+
+    for (i = 0; i < iovcnt && iov[i].iov_base; ++i)
+        size += iov[i].iov_len;
+    iovcnt = i;
+
+    if (writer->data_fd != -1 && writer->nframes > 0) {
+        bool full = writer->max_size && writer->offset + size > writer->max_size;
+        bool expired = writer->max_duration && timestamp - writer->start >= writer->max_duration;
+        if (full || expired)
+            v4l2_segment_writer_close(writer);
+    }
+
+    if (writer->data_fd == -1)
+        if (v4l2_segment_open(writer, frame, timestamp))
+            return -1;
+
+    if (v4l2_segment_pwritev(writer->data_fd, iov, iovcnt, writer->offset))
+        return -1;
+
+    memset(&entry, 0, sizeof(entry));
+    entry.sequence = sequence;
+    entry.flags = flags;
+    entry.timestamp = timestamp;
+    entry.offset = writer->offset;
+    entry.size = size;
+
+    if (-1 == pwrite(writer->index_fd, &entry, sizeof(entry),
+            sizeof(struct v4l2_segment_index_header) + writer->nframes * sizeof(entry))) {
+        fprintf(stderr, "pwrite() failed: %s\n", strerror(errno));
+        return -1;
+    }
+
+    writer->offset += size;
+    writer->nframes++;
+
+    return 0;
+}
+
+void v4l2_segment_writer_close(struct v4l2_segment_writer* writer)
+{
+    if (writer->data_fd != -1) {
+        /* give back the preallocated space which has not been used */
+        if (writer->max_size > writer->offset)
+            fallocate(writer->data_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                writer->offset, writer->max_size - writer->offset);
+        close(writer->data_fd);
+        writer->data_fd = -1;
+    }
+
+    if (writer->index_fd != -1) {
+        close(writer->index_fd);
+        writer->index_fd = -1;
+    }
+
+    writer->number++;
+    writer->offset = 0;
+    writer->nframes = 0;
+}
+
+int v4l2_segment_filename(char* buf, size_t size, const char* directory, unsigned number, uint32_t fourcc, const char* extension)
+{
+    int n;
+
+    if (extension)
+        n = snprintf(buf, size, "%s/segment%06u.%s",
+            directory, number, extension);
+    else
+        n = snprintf(buf, size, "%s/segment%06u.%c%c%c%c",
+            directory, number,
+            (fourcc >>  0) & 0xff,
+            (fourcc >>  8) & 0xff,
+            (fourcc >> 16) & 0xff,
+            (fourcc >> 24) & 0xff);
+
+    if (n < 0)
+        return -1;
+    if ((size_t)n >= size)
+        return -1;
+
+    return 0;
+}
+
+void v4l2_segment_index_header_init(struct v4l2_segment_index_header* header,
+    uint32_t fourcc, uint32_t width, uint32_t height, uint64_t first_frame)
+{
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, V4L2_SEGMENT_MAGIC, sizeof(V4L2_SEGMENT_MAGIC));
+    header->version = V4L2_SEGMENT_VERSION;
+    header->entry_size = sizeof(struct v4l2_segment_index_entry);
+    header->fourcc = fourcc;
+    header->width = width;
+    header->height = height;
+    header->first_frame = first_frame;
+}
+
+/*===========================================================================*\
+ * local function definitions
+\*===========================================================================*/
+static int v4l2_segment_open(struct v4l2_segment_writer* writer, uint64_t frame, uint64_t timestamp)
+{
+    int retval = -1;
+
+    do {
+        char filename[PATH_MAX];
+        struct v4l2_segment_index_header header;
+
+        if (v4l2_segment_filename(filename, sizeof(filename), writer->directory, writer->number, writer->fourcc, NULL))
+            break;
+
+        writer->data_fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0664);
+        if (-1 == writer->data_fd) {
+            fprintf(stderr, "cannot open '%s': %s\n", filename, strerror(errno));
+            break;
+        }
+
+        /* reserve space up front (without changing file size), so appends do not fragment the file */
+        if (writer->max_size)
+            if (-1 == fallocate(writer->data_fd, FALLOC_FL_KEEP_SIZE, 0, writer->max_size) &&
+                errno != EOPNOTSUPP)
+                fprintf(stderr, "fallocate(%s) failed: %s\n", filename, strerror(errno));
+
+        if (v4l2_segment_filename(filename, sizeof(filename), writer->directory, writer->number, writer->fourcc, "idx"))
+            break;
+
+        writer->index_fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0664);
+        if (-1 == writer->index_fd) {
+            fprintf(stderr, "cannot open '%s': %s\n", filename, strerror(errno));
+            break;
+        }
+
+        v4l2_segment_index_header_init(&header, writer->fourcc, writer->width, writer->height, frame);
+
+        if (-1 == pwrite(writer->index_fd, &header, sizeof(header), 0)) {
+            fprintf(stderr, "pwrite() failed: %s\n", strerror(errno));
+            break;
+        }
+
+        writer->offset = 0;
+        writer->nframes = 0;
+        writer->start = timestamp;
+
+        retval = 0;
+    } while (0);
+
+    if (retval) {
+        if (writer->data_fd != -1)
+            close(writer->data_fd);
+        if (writer->index_fd != -1)
+            close(writer->index_fd);
+        writer->data_fd = -1;
+        writer->index_fd = -1;
+    }
+
+    return retval;
+}
+
+static int v4l2_segment_pwritev(int fd, const struct iovec* iov, size_t iovcnt, uint64_t offset)
+{
+    struct iovec v[iovcnt ? iovcnt : 1];
+    struct iovec* p = v;
+
+    memcpy(v, iov, iovcnt * sizeof(*iov));
+
+    while (iovcnt > 0) {
+        ssize_t n = pwritev(fd, p, iovcnt, offset);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "pwritev() failed: %s\n", strerror(errno));
+            return -1;
+        }
+
+        offset += n;
+        while (iovcnt > 0 && (size_t)n >= p->iov_len) {
+            n -= p->iov_len;
+            p++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            p->iov_base = (char*)p->iov_base + n;
+            p->iov_len -= n;
+        }
+    }
+
+    return 0;
+}
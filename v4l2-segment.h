@@ -0,0 +1,113 @@
+/* SPDX-License-Identifier: MIT */
+/**
+ * @file v4l2-segment.h
+ *
+ * Segmented recording format. Frames are appended back to back into large,
+ * preallocated segment data files (segmentNNNNNN.<fourcc>). Every data file
+ * is accompanied by an index file (segmentNNNNNN.idx) made of a fixed size
+ * header followed by fixed size entries, one per frame, in capture order.
+ * Entry of the k-th frame of a segment is therefore located at
+ *
+ *     sizeof(struct v4l2_segment_index_header) + k * header.entry_size
+ *
+ * and frame with global number n lives in the entry n - header.first_frame.
+ * A new segment is started when the current one would exceed its size limit
+ * or when it spans more than the configured duration.
+ * All fields are stored in host byte order.
+ */
+
+#ifndef _V4L2_SEGMENT_H_
+#define _V4L2_SEGMENT_H_
+
+/*===========================================================================*\
+ * system header files
+\*===========================================================================*/
+#include <stdint.h>
+#include <sys/uio.h>
+
+/*===========================================================================*\
+ * project header files
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * preprocessor #define constants and macros
+\*===========================================================================*/
+#define V4L2_SEGMENT_MAGIC "V4L2SEG"
+#define V4L2_SEGMENT_VERSION 1
+
+/*===========================================================================*\
+ * global type definitions
+\*===========================================================================*/
+struct v4l2_segment_index_header
+{
+    char magic[8];        /* V4L2_SEGMENT_MAGIC */
+    uint32_t version;     /* V4L2_SEGMENT_VERSION */
+    uint32_t entry_size;  /* sizeof(struct v4l2_segment_index_entry) */
+    uint32_t fourcc;
+    uint32_t width;
+    uint32_t height;
+    uint32_t reserved;
+    uint64_t first_frame; /* global number of the frame described by the first entry */
+};
+
+struct v4l2_segment_index_entry
+{
+    uint32_t sequence;    /* v4l2_buffer.sequence */
+    uint32_t flags;       /* v4l2_buffer.flags */
+    uint64_t timestamp;   /* v4l2_buffer.timestamp in nanoseconds */
+    uint64_t offset;      /* offset of the frame within the data file */
+    uint32_t size;        /* size of the frame (all planes) */
+    uint32_t reserved;
+};
+
+_Static_assert(sizeof(struct v4l2_segment_index_header) == 40, "unexpected index header layout");
+_Static_assert(sizeof(struct v4l2_segment_index_entry) == 32, "unexpected index entry layout");
+
+struct v4l2_segment_writer
+{
+    const char* directory;
+    uint32_t fourcc;
+    uint32_t width;
+    uint32_t height;
+    uint64_t max_size;     /* bytes, 0 means no limit */
+    uint64_t max_duration; /* nanoseconds, 0 means no limit */
+
+    unsigned number;       /* number of the current segment */
+    int data_fd;
+    int index_fd;
+    uint64_t offset;       /* end of data in the current segment */
+    uint64_t nframes;      /* number of frames in the current segment */
+    uint64_t start;        /* timestamp of the first frame in the current segment */
+};
+
+/*===========================================================================*\
+ * global object declarations
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * function forward declarations
+\*===========================================================================*/
+void v4l2_segment_writer_init(struct v4l2_segment_writer* writer, const char* directory,
+    uint32_t fourcc, uint32_t width, uint32_t height, uint64_t max_size, uint64_t max_duration);
+
+/**
+ * Appends a frame made of iovcnt planes to the current segment,
+ * starting a new one when needed. frame is the global frame number.
+ * Returns 0 on success, -1 otherwise.
+ */
+int v4l2_segment_writer_append(struct v4l2_segment_writer* writer, uint64_t frame,
+    uint32_t sequence, uint32_t flags, uint64_t timestamp, const struct iovec* iov, size_t iovcnt);
+
+/** Finishes the current segment (if any) */
+void v4l2_segment_writer_close(struct v4l2_segment_writer* writer);
+
+/**
+ * Builds name of the data file (extension == NULL) or of the index file
+ * (extension == "idx") of the segment with given number.
+ */
+int v4l2_segment_filename(char* buf, size_t size, const char* directory, unsigned number, uint32_t fourcc, const char* extension);
+
+void v4l2_segment_index_header_init(struct v4l2_segment_index_header* header,
+    uint32_t fourcc, uint32_t width, uint32_t height, uint64_t first_frame);
+
+#endif /* _V4L2_SEGMENT_H_ */
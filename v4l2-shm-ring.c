@@ -0,0 +1,523 @@
+/* SPDX-License-Identifier: MIT */
+/**
+ * @file v4l2-shm-ring.c
+ *
+ * Publication of frames through shared memory (see v4l2-shm-ring.h).
+ */
+
+/*===========================================================================*\
+ * system header files
+\*===========================================================================*/
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*===========================================================================*\
+ * project header files
+\*===========================================================================*/
+#include "v4l2-shm-ring.h"
+
+/*===========================================================================*\
+ * preprocessor #define constants and macros
+\*===========================================================================*/
+#define ALIGN(x, a) __ALIGN(x, (a) - 1)
+#define __ALIGN(x, mask) (((x) + (mask)) & ~(mask))
+
+#define V4L2_SHM_RING_SELFTEST_FRAMES 20000
+#define V4L2_SHM_RING_SELFTEST_SLOTS 4
+#define V4L2_SHM_RING_SELFTEST_SLOT_SIZE 8192
+
+/*===========================================================================*\
+ * local type definitions
+\*===========================================================================*/
+enum v4l2_shm_ring_selftest_mode
+{
+    V4L2_SHM_RING_SELFTEST_NEXT,      /* keeps up as well as it can */
+    V4L2_SHM_RING_SELFTEST_LAGGING,   /* is overrun for sure */
+    V4L2_SHM_RING_SELFTEST_LATEST,
+};
+
+struct v4l2_shm_ring_selftest_reader
+{
+    enum v4l2_shm_ring_selftest_mode mode;
+    struct v4l2_shm_ring_reader reader;
+    uint64_t read;
+    uint64_t torn;                    /* frames returned as complete which were not */
+    uint64_t reordered;               /* frames returned out of order */
+};
+
+/*===========================================================================*\
+ * global object definitions
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * local function declarations
+\*===========================================================================*/
+static void v4l2_shm_ring_name(char* buf, size_t size, const char* name);
+static size_t v4l2_shm_ring_selftest_frame(uint64_t number, size_t* bytesused);
+static void* v4l2_shm_ring_selftest_read(void* arg);
+
+/*===========================================================================*\
+ * local object definitions
+\*===========================================================================*/
+_Static_assert(sizeof(struct v4l2_shm_ring_slot) <= V4L2_SHM_RING_SLOT_HEADER_SIZE,
+    "slot header does not fit in front of the frame data");
+
+/*===========================================================================*\
+ * inline function definitions
+\*===========================================================================*/
+static inline struct v4l2_shm_ring_slot* v4l2_shm_ring_slot(const struct v4l2_shm_ring_header* header, uint64_t number)
+{
+    return (struct v4l2_shm_ring_slot*)((char*)header + header->slots_offset +
+        (number % header->number_of_slots) * header->slot_stride);
+}
+
+static inline char* v4l2_shm_ring_data(const struct v4l2_shm_ring_slot* slot)
+{
+    return (char*)slot + V4L2_SHM_RING_SLOT_HEADER_SIZE;
+}
+
+/*===========================================================================*\
+ * public function definitions
+\*===========================================================================*/
+int v4l2_shm_ring_create(struct v4l2_shm_ring* ring, const char* name, unsigned number_of_slots,
+    size_t slot_size, uint32_t pixelformat, uint32_t width, uint32_t height)
+{
+    struct v4l2_shm_ring_header* header;
+    long pagesize = sysconf(_SC_PAGESIZE);
+    size_t slots_offset;
+    size_t slot_stride;
+    void* addr;
+    int fd;
+
+    memset(ring, 0, sizeof(*ring));
+    v4l2_shm_ring_name(ring->name, sizeof(ring->name), name);
+
+    if (number_of_slots < 2 || slot_size == 0) {
+        fprintf(stderr, "shared memory ring needs at least 2 slots\n");
+        return -1;
+    }
+
+    if (pagesize <= 0)
+        pagesize = 0x1000; // set default value to 4KiB
+
+    /* frame data of every slot starts in a new page */
+    slots_offset = ALIGN(sizeof(*header), (size_t)pagesize);
+    slot_stride = ALIGN(V4L2_SHM_RING_SLOT_HEADER_SIZE + slot_size, (size_t)pagesize);
+    ring->size = slots_offset + slot_stride * number_of_slots;
+
+    /* readers attached to a previous incarnation keep it, the new one starts empty */
+    if (-1 == shm_unlink(ring->name) && errno != ENOENT)
+        fprintf(stderr, "shm_unlink(%s) failed: %s\n", ring->name, strerror(errno));
+
+    fd = shm_open(ring->name, O_CREAT | O_EXCL | O_RDWR | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        fprintf(stderr, "shm_open(%s) failed: %s\n", ring->name, strerror(errno));
+        return -1;
+    }
+
+    if (-1 == ftruncate(fd, ring->size)) {
+        fprintf(stderr, "ftruncate(%zu) failed: %s\n", ring->size, strerror(errno));
+        close(fd);
+        shm_unlink(ring->name);
+        return -1;
+    }
+
+    /* prefaulted, so that publishing never takes a page fault */
+    addr = mmap(NULL, ring->size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        fprintf(stderr, "mmap(%zu) failed: %s\n", ring->size, strerror(errno));
+        shm_unlink(ring->name);
+        return -1;
+    }
+
+    header = addr;
+    header->version = V4L2_SHM_RING_VERSION;
+    header->number_of_slots = number_of_slots;
+    header->pixelformat = pixelformat;
+    header->width = width;
+    header->height = height;
+    header->slot_size = slot_size;
+    header->slot_stride = slot_stride;
+    header->slots_offset = slots_offset;
+    atomic_store_explicit(&header->head, 0, memory_order_relaxed);
+    atomic_store_explicit(&header->closed, 0, memory_order_relaxed);
+
+    /* readers check the magic first, the rest of the header has to be visible by then */
+    atomic_thread_fence(memory_order_release);
+    header->magic = V4L2_SHM_RING_MAGIC;
+
+    ring->header = header;
+
+    return 0;
+}
+
+void v4l2_shm_ring_destroy(struct v4l2_shm_ring* ring)
+{
+    if (ring->header == NULL)
+        return;
+
+    atomic_store_explicit(&ring->header->closed, 1, memory_order_release);
+    munmap(ring->header, ring->size);
+    ring->header = NULL;
+
+    shm_unlink(ring->name);
+}
+
+void v4l2_shm_ring_publish(struct v4l2_shm_ring* ring, const struct iovec* iov, size_t iovcnt,
+    uint32_t sequence, uint64_t timestamp)
+{
+    struct v4l2_shm_ring_header* header = ring->header;
+    struct v4l2_shm_ring_slot* slot;
+    uint64_t n = ring->published;
+    size_t total = 0;
+    size_t nplanes = 0;
+    char* p;
+    size_t i;
+
+    for (i = 0; i < iovcnt && i < VIDEO_MAX_PLANES; ++i) {
+        total += iov[i].iov_len;
+        if (iov[i].iov_len)
+            nplanes = i + 1;
+    }
+
+    if (total > header->slot_size) {
+        ring->oversized++;
+        return;
+    }
+
+    slot = v4l2_shm_ring_slot(header, n);
+
+    /* odd seq has to be visible before any byte of the frame changes */
+    atomic_store_explicit(&slot->seq, 2 * n + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    slot->timestamp = timestamp;
+    slot->sequence = sequence;
+    slot->nplanes = nplanes;
+
+    p = v4l2_shm_ring_data(slot);
+    for (i = 0; i < VIDEO_MAX_PLANES; ++i) {
+        size_t len = i < nplanes ? iov[i].iov_len : 0;
+
+        memcpy(p, iov[i].iov_base, len);
+        slot->bytesused[i] = len;
+        p += len;
+    }
+
+    atomic_store_explicit(&slot->seq, 2 * n + 2, memory_order_release);
+    atomic_store_explicit(&header->head, n + 1, memory_order_release);
+
+    ring->published++;
+}
+
+int v4l2_shm_ring_attach(struct v4l2_shm_ring_reader* reader, const char* name)
+{
+    const struct v4l2_shm_ring_header* header;
+    char filename[NAME_MAX + 1];
+    struct stat st;
+    void* addr;
+    int fd;
+
+    memset(reader, 0, sizeof(*reader));
+    v4l2_shm_ring_name(filename, sizeof(filename), name);
+
+    fd = shm_open(filename, O_RDONLY | O_CLOEXEC, 0);
+    if (fd == -1) {
+        fprintf(stderr, "shm_open(%s) failed: %s\n", filename, strerror(errno));
+        return -1;
+    }
+
+    if (-1 == fstat(fd, &st) || (size_t)st.st_size < sizeof(*header)) {
+        fprintf(stderr, "'%s' is not a frame ring\n", filename);
+        close(fd);
+        return -1;
+    }
+
+    addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        fprintf(stderr, "mmap(%zu) failed: %s\n", (size_t)st.st_size, strerror(errno));
+        return -1;
+    }
+
+    header = addr;
+    if (header->magic != V4L2_SHM_RING_MAGIC || header->version != V4L2_SHM_RING_VERSION) {
+        fprintf(stderr, "'%s' is not a frame ring of version %d\n", filename, V4L2_SHM_RING_VERSION);
+        munmap(addr, st.st_size);
+        return -1;
+    }
+    atomic_thread_fence(memory_order_acquire);
+
+    reader->header = header;
+    reader->size = st.st_size;
+    reader->next = atomic_load_explicit(&header->head, memory_order_acquire);
+
+    return 0;
+}
+
+void v4l2_shm_ring_detach(struct v4l2_shm_ring_reader* reader)
+{
+    if (reader->header)
+        munmap((void*)reader->header, reader->size);
+    reader->header = NULL;
+}
+
+enum v4l2_shm_ring_status v4l2_shm_ring_read(const struct v4l2_shm_ring_reader* reader, uint64_t number,
+    void* buf, size_t size, struct v4l2_shm_ring_frame* frame)
+{
+    const struct v4l2_shm_ring_header* header = reader->header;
+    const struct v4l2_shm_ring_slot* slot = v4l2_shm_ring_slot(header, number);
+    const uint64_t complete = 2 * number + 2;
+    uint64_t seq;
+    size_t total = 0;
+    unsigned i;
+
+    seq = atomic_load_explicit((_Atomic uint64_t*)&slot->seq, memory_order_acquire);
+    if (seq < complete)
+        return atomic_load_explicit((_Atomic uint32_t*)&header->closed, memory_order_acquire) ?
+            V4L2_SHM_RING_CLOSED : V4L2_SHM_RING_AGAIN;
+    if (seq > complete)
+        return V4L2_SHM_RING_OVERRUN;
+
+    frame->number = number;
+    frame->timestamp = slot->timestamp;
+    frame->sequence = slot->sequence;
+    frame->nplanes = slot->nplanes < VIDEO_MAX_PLANES ? slot->nplanes : VIDEO_MAX_PLANES;
+    for (i = 0; i < VIDEO_MAX_PLANES; ++i) {
+        frame->bytesused[i] = slot->bytesused[i];
+        total += frame->bytesused[i];
+    }
+
+    /* values read while the frame was being overwritten are discarded below */
+    if (total > header->slot_size)
+        total = header->slot_size;
+    memcpy(buf, v4l2_shm_ring_data(slot), total < size ? total : size);
+
+    atomic_thread_fence(memory_order_acquire);
+    seq = atomic_load_explicit((_Atomic uint64_t*)&slot->seq, memory_order_relaxed);
+
+    return seq == complete ? V4L2_SHM_RING_OK : V4L2_SHM_RING_OVERRUN;
+}
+
+enum v4l2_shm_ring_status v4l2_shm_ring_next(struct v4l2_shm_ring_reader* reader,
+    void* buf, size_t size, struct v4l2_shm_ring_frame* frame)
+{
+    enum v4l2_shm_ring_status status;
+    uint64_t head;
+    uint64_t oldest;
+
+    status = v4l2_shm_ring_read(reader, reader->next, buf, size, frame);
+    if (status == V4L2_SHM_RING_OK) {
+        reader->next++;
+    } else
+    if (status == V4L2_SHM_RING_OVERRUN) {
+        /* slot of the oldest frame is the next one to be written, so skip that one as well */
+        head = atomic_load_explicit((_Atomic uint64_t*)&reader->header->head, memory_order_acquire);
+        oldest = head >= reader->header->number_of_slots ? head - reader->header->number_of_slots + 1 : 0;
+        if (oldest > reader->next) {
+            reader->overruns += oldest - reader->next;
+            reader->next = oldest;
+        }
+    }
+
+    return status;
+}
+
+enum v4l2_shm_ring_status v4l2_shm_ring_latest(struct v4l2_shm_ring_reader* reader,
+    void* buf, size_t size, struct v4l2_shm_ring_frame* frame)
+{
+    enum v4l2_shm_ring_status status;
+    uint64_t head;
+
+    do {
+        head = atomic_load_explicit((_Atomic uint64_t*)&reader->header->head, memory_order_acquire);
+        if (head == 0)
+            return atomic_load_explicit((_Atomic uint32_t*)&reader->header->closed, memory_order_acquire) ?
+                V4L2_SHM_RING_CLOSED : V4L2_SHM_RING_AGAIN;
+
+        /* lapped by the writer while copying, the newer one is the latest now */
+        status = v4l2_shm_ring_read(reader, head - 1, buf, size, frame);
+    } while (status == V4L2_SHM_RING_OVERRUN);
+
+    return status;
+}
+
+int v4l2_shm_ring_selftest(void)
+{
+    static const char* modes[] = {
+        [V4L2_SHM_RING_SELFTEST_NEXT]    = "next",
+        [V4L2_SHM_RING_SELFTEST_LAGGING] = "next, lagging",
+        [V4L2_SHM_RING_SELFTEST_LATEST]  = "latest",
+    };
+    static uint8_t data[V4L2_SHM_RING_SELFTEST_SLOT_SIZE];
+    struct v4l2_shm_ring_selftest_reader readers[3];
+    pthread_t threads[3];
+    struct v4l2_shm_ring ring;
+    char name[64];
+    unsigned failures = 0;
+    uint64_t n;
+    size_t i;
+
+    snprintf(name, sizeof(name), "v4l2-shm-ring-selftest.%d", (int)getpid());
+    if (v4l2_shm_ring_create(&ring, name, V4L2_SHM_RING_SELFTEST_SLOTS, V4L2_SHM_RING_SELFTEST_SLOT_SIZE,
+            V4L2_PIX_FMT_GREY, 64, 64))
+        return -1;
+
+    /* all readers follow the ring from its very first frame */
+    for (i = 0; i < 3; ++i) {
+        memset(readers + i, 0, sizeof(readers[i]));
+        readers[i].mode = i;
+        if (v4l2_shm_ring_attach(&readers[i].reader, name) ||
+            pthread_create(threads + i, NULL, v4l2_shm_ring_selftest_read, readers + i)) {
+            fprintf(stderr, "reader cannot follow '%s'\n", name);
+            v4l2_shm_ring_destroy(&ring);
+            return -1;
+        }
+    }
+
+    for (n = 0; n < V4L2_SHM_RING_SELFTEST_FRAMES; ++n) {
+        size_t bytesused[2];
+        struct iovec iov[2];
+        size_t total = v4l2_shm_ring_selftest_frame(n, bytesused);
+
+        for (i = 0; i < total; ++i)
+            data[i] = (uint8_t)(n * 7 + i);
+        iov[0].iov_base = data;
+        iov[0].iov_len = bytesused[0];
+        iov[1].iov_base = data + bytesused[0];
+        iov[1].iov_len = bytesused[1];
+
+        v4l2_shm_ring_publish(&ring, iov, 2, (uint32_t)n, n * 1000);
+
+        /* bursts with short breaks, readers are caught both copying and waiting */
+        if (n % 8 == 7)
+            usleep(20);
+    }
+
+    /* readers run until the ring is closed */
+    v4l2_shm_ring_destroy(&ring);
+
+    for (i = 0; i < 3; ++i) {
+        const struct v4l2_shm_ring_selftest_reader* r = readers + i;
+        bool lost;
+
+        pthread_join(threads[i], NULL);
+
+        lost = r->mode != V4L2_SHM_RING_SELFTEST_LATEST &&
+            r->read + r->reader.overruns != V4L2_SHM_RING_SELFTEST_FRAMES;
+
+        fprintf(stdout, "%-14s: %llu frame(s) read, %llu overrun, %llu torn, %llu out of order%s\n",
+            modes[r->mode], (unsigned long long)r->read, (unsigned long long)r->reader.overruns,
+            (unsigned long long)r->torn, (unsigned long long)r->reordered,
+            lost ? ", frames lost without an overrun" : "");
+
+        if (r->torn || r->reordered || lost)
+            failures++;
+        if (r->mode == V4L2_SHM_RING_SELFTEST_LAGGING && r->reader.overruns == 0) {
+            fprintf(stdout, "%-14s: overruns are not detected\n", modes[r->mode]);
+            failures++;
+        }
+
+        v4l2_shm_ring_detach(&readers[i].reader);
+    }
+
+    fprintf(stdout, "%d frame(s) published to %u slots, %u failure(s)\n",
+        V4L2_SHM_RING_SELFTEST_FRAMES, V4L2_SHM_RING_SELFTEST_SLOTS, failures);
+
+    return failures ? -1 : 0;
+}
+
+/*===========================================================================*\
+ * local function definitions
+\*===========================================================================*/
+static void v4l2_shm_ring_name(char* buf, size_t size, const char* name)
+{
+    snprintf(buf, size, "%s%s", name[0] == '/' ? "" : "/", name);
+}
+
+/* frames differ in size and in content, so that a torn frame never looks like a complete one */
+static size_t v4l2_shm_ring_selftest_frame(uint64_t number, size_t* bytesused)
+{
+    size_t total = 1024 + (number % 13) * 512;
+
+    bytesused[0] = total / 3;
+    bytesused[1] = total - bytesused[0];
+
+    return total;
+}
+
+static void* v4l2_shm_ring_selftest_read(void* arg)
+{
+    struct v4l2_shm_ring_selftest_reader* r = arg;
+    static _Thread_local uint8_t data[V4L2_SHM_RING_SELFTEST_SLOT_SIZE];
+    struct v4l2_shm_ring_frame frame;
+    enum v4l2_shm_ring_status status;
+    bool first = true;
+    uint64_t last = 0;
+
+    for (;;) {
+        size_t bytesused[2];
+        size_t total;
+        bool torn;
+        size_t i;
+
+        if (r->mode == V4L2_SHM_RING_SELFTEST_LATEST)
+            status = v4l2_shm_ring_latest(&r->reader, data, sizeof(data), &frame);
+        else
+            status = v4l2_shm_ring_next(&r->reader, data, sizeof(data), &frame);
+
+        if (status == V4L2_SHM_RING_CLOSED)
+            break;
+
+        if (status != V4L2_SHM_RING_OK) {
+            /* latest keeps returning the last frame once publishing is over */
+            if (r->mode == V4L2_SHM_RING_SELFTEST_LATEST &&
+                atomic_load_explicit((_Atomic uint32_t*)&r->reader.header->closed, memory_order_acquire))
+                break;
+            sched_yield();
+            continue;
+        }
+
+        if (r->mode == V4L2_SHM_RING_SELFTEST_LATEST) {
+            if (!first && frame.number == last) {
+                if (atomic_load_explicit((_Atomic uint32_t*)&r->reader.header->closed, memory_order_acquire))
+                    break;
+                sched_yield();
+                continue;
+            }
+        }
+
+        total = v4l2_shm_ring_selftest_frame(frame.number, bytesused);
+        torn = frame.sequence != (uint32_t)frame.number || frame.timestamp != frame.number * 1000 ||
+            frame.nplanes != 2 || frame.bytesused[0] != bytesused[0] || frame.bytesused[1] != bytesused[1];
+        for (i = 0; i < total && !torn; ++i)
+            torn = data[i] != (uint8_t)(frame.number * 7 + i);
+
+        r->read++;
+        if (torn)
+            r->torn++;
+        if (!first && frame.number <= last)
+            r->reordered++;
+        first = false;
+        last = frame.number;
+
+        /* one frame takes the writer a fraction of that */
+        if (r->mode == V4L2_SHM_RING_SELFTEST_LAGGING)
+            usleep(100);
+    }
+
+    return NULL;
+}
@@ -0,0 +1,156 @@
+/* SPDX-License-Identifier: MIT */
+/**
+ * @file v4l2-shm-ring.h
+ *
+ * Publication of captured frames to any number of local readers through
+ * a named POSIX shared memory object (/dev/shm/<name>).
+ * The object is a header followed by a fixed number of fixed size slots,
+ * frame n being copied to slot n % number_of_slots. Every slot is guarded
+ * by a sequence lock: its seq is 2n + 1 while frame n is being written and
+ * 2n + 2 once it is complete, so readers tell a complete frame from a torn
+ * one, and a frame not published yet from one already overwritten, without
+ * the writer ever waiting for them. Readers map the object read-only, hence
+ * they cannot stall or corrupt capture in any way; a reader which does not
+ * keep up gets V4L2_SHM_RING_OVERRUN and resumes at the oldest frame left.
+ * Readers use the v4l2_shm_ring_reader functions below (and link this module).
+ */
+
+#ifndef _V4L2_SHM_RING_H_
+#define _V4L2_SHM_RING_H_
+
+/*===========================================================================*\
+ * system header files
+\*===========================================================================*/
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <limits.h>
+
+#include <sys/uio.h>
+
+#include <linux/videodev2.h>
+
+/*===========================================================================*\
+ * project header files
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * preprocessor #define constants and macros
+\*===========================================================================*/
+#define V4L2_SHM_RING_MAGIC 0x474e5256 /* "VRNG" */
+#define V4L2_SHM_RING_VERSION 1
+#define V4L2_SHM_RING_DEFAULT_SLOTS 8
+#define V4L2_SHM_RING_SLOT_HEADER_SIZE 64 /* frame data follows the slot header at this offset */
+
+/*===========================================================================*\
+ * global type definitions
+\*===========================================================================*/
+struct v4l2_shm_ring_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t number_of_slots;
+    uint32_t pixelformat;
+    uint32_t width;
+    uint32_t height;
+    uint64_t slot_size;      /* bytes of frame data a slot holds */
+    uint64_t slot_stride;    /* distance between slots */
+    uint64_t slots_offset;   /* of the first slot from the beginning of the object */
+    _Atomic uint64_t head;   /* frames published so far */
+    _Atomic uint32_t closed; /* writer is gone, nothing is going to be published any more */
+};
+
+struct v4l2_shm_ring_slot
+{
+    _Atomic uint64_t seq;    /* 2n + 1 while frame n is being written, 2n + 2 once it is complete */
+    uint64_t timestamp;      /* nanoseconds */
+    uint32_t sequence;       /* set by the driver */
+    uint32_t nplanes;
+    uint32_t bytesused[VIDEO_MAX_PLANES]; /* planes follow each other in the frame data */
+};
+
+/* writer side, owned by the thread which publishes frames */
+struct v4l2_shm_ring
+{
+    char name[NAME_MAX + 1];
+    struct v4l2_shm_ring_header* header;
+    size_t size;
+    uint64_t published;
+    uint64_t oversized;      /* frames which did not fit into a slot */
+};
+
+enum v4l2_shm_ring_status
+{
+    V4L2_SHM_RING_OK,
+    V4L2_SHM_RING_AGAIN,     /* frame has not been published yet */
+    V4L2_SHM_RING_OVERRUN,   /* frame has already been overwritten */
+    V4L2_SHM_RING_CLOSED,    /* frame is never going to be published */
+};
+
+/* what readers get along with the frame data */
+struct v4l2_shm_ring_frame
+{
+    uint64_t number;         /* position in the ring, counted from 0 */
+    uint64_t timestamp;
+    uint32_t sequence;
+    uint32_t nplanes;
+    uint32_t bytesused[VIDEO_MAX_PLANES];
+};
+
+struct v4l2_shm_ring_reader
+{
+    const struct v4l2_shm_ring_header* header;
+    size_t size;
+    uint64_t next;           /* frame v4l2_shm_ring_next() returns */
+    uint64_t overruns;       /* frames missed by v4l2_shm_ring_next() */
+};
+
+/*===========================================================================*\
+ * global object declarations
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * function forward declarations
+\*===========================================================================*/
+
+/**
+ * Creates (or replaces) shared memory object of given name (leading '/' may be omitted)
+ * with number_of_slots slots of slot_size bytes. Returns 0 on success, -1 on failure.
+ */
+int v4l2_shm_ring_create(struct v4l2_shm_ring* ring, const char* name, unsigned number_of_slots,
+    size_t slot_size, uint32_t pixelformat, uint32_t width, uint32_t height);
+
+/** Marks the ring closed for readers and removes its name, readers still attached keep their mapping */
+void v4l2_shm_ring_destroy(struct v4l2_shm_ring* ring);
+
+/** Copies planes of a frame to the next slot, never blocks */
+void v4l2_shm_ring_publish(struct v4l2_shm_ring* ring, const struct iovec* iov, size_t iovcnt,
+    uint32_t sequence, uint64_t timestamp);
+
+/** Attaches to a ring, following it from the next frame published. Returns 0 on success, -1 on failure */
+int v4l2_shm_ring_attach(struct v4l2_shm_ring_reader* reader, const char* name);
+void v4l2_shm_ring_detach(struct v4l2_shm_ring_reader* reader);
+
+/** Copies frame number into buf (at most size bytes) */
+enum v4l2_shm_ring_status v4l2_shm_ring_read(const struct v4l2_shm_ring_reader* reader, uint64_t number,
+    void* buf, size_t size, struct v4l2_shm_ring_frame* frame);
+
+/**
+ * Copies the frame following the one returned last. On V4L2_SHM_RING_OVERRUN
+ * the reader skips to the oldest frame still in the ring, the next call returns it.
+ */
+enum v4l2_shm_ring_status v4l2_shm_ring_next(struct v4l2_shm_ring_reader* reader,
+    void* buf, size_t size, struct v4l2_shm_ring_frame* frame);
+
+/** Copies the most recent complete frame, V4L2_SHM_RING_AGAIN if none has been published yet */
+enum v4l2_shm_ring_status v4l2_shm_ring_latest(struct v4l2_shm_ring_reader* reader,
+    void* buf, size_t size, struct v4l2_shm_ring_frame* frame);
+
+/**
+ * Publishes frames of known content to a ring of its own as fast as possible, while readers
+ * keeping up, lagging behind and taking the latest frame only check every frame they get.
+ * Returns 0 if none of them got a torn frame and all frames were either read or reported overrun.
+ */
+int v4l2_shm_ring_selftest(void);
+
+#endif /* _V4L2_SHM_RING_H_ */
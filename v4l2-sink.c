@@ -0,0 +1,295 @@
+/* SPDX-License-Identifier: MIT */
+/**
+ * @file v4l2-sink.c
+ *
+ * Consumers of frames with drop policies (see v4l2-sink.h).
+ */
+
+/*===========================================================================*\
+ * system header files
+\*===========================================================================*/
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <sys/eventfd.h>
+
+/*===========================================================================*\
+ * project header files
+\*===========================================================================*/
+#include "v4l2-sink.h"
+#include "v4l2-sched.h"
+
+/*===========================================================================*\
+ * preprocessor #define constants and macros
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * local type definitions
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * global object definitions
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * local function declarations
+\*===========================================================================*/
+static bool v4l2_sink_take(struct v4l2_sink* sink, unsigned index, int* replaced);
+static bool v4l2_sink_next(struct v4l2_sink* sink, unsigned* index);
+static void* v4l2_sink_thread(void* arg);
+
+/*===========================================================================*\
+ * local object definitions
+\*===========================================================================*/
+static const char* policy_names[] = {
+    [V4L2_SINK_KEEP_ALL] = "keep",
+    [V4L2_SINK_DROP_NEW] = "drop-new",
+    [V4L2_SINK_DROP_OLD] = "drop-old",
+};
+
+/*===========================================================================*\
+ * inline function definitions
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * public function definitions
+\*===========================================================================*/
+int v4l2_sink_open(struct v4l2_sink* sink, const char* name, enum v4l2_sink_policy policy, unsigned max_held,
+    v4l2_sink_process_t process, v4l2_sink_poll_t poll, void* arg, const cpu_set_t* cpus)
+{
+    memset(sink, 0, sizeof(*sink));
+    sink->name = name;
+    sink->policy = policy;
+    sink->max_held = max_held ? max_held : V4L2_SINK_DEFAULT_MAX_HELD;
+    sink->process = process;
+    sink->poll = poll;
+    sink->arg = arg;
+    sink->cpus = cpus;
+    atomic_init(&sink->stop, false);
+    atomic_init(&sink->latest, -1);
+    atomic_init(&sink->held, 0);
+    v4l2_index_queue_init(&sink->taken);
+    v4l2_index_queue_init(&sink->completed);
+    v4l2_index_queue_init(&sink->returned);
+
+    sink->wakeup_fd = eventfd(0, EFD_CLOEXEC);
+    if (-1 == sink->wakeup_fd) {
+        fprintf(stderr, "eventfd() failed: %s\n", strerror(errno));
+        return -1;
+    }
+
+    sink->completion_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (-1 == sink->completion_fd) {
+        fprintf(stderr, "eventfd() failed: %s\n", strerror(errno));
+        close(sink->wakeup_fd);
+        return -1;
+    }
+
+    return 0;
+}
+
+int v4l2_sink_start(struct v4l2_sink* sink)
+{
+    int status;
+
+    status = pthread_create(&sink->thread, NULL, v4l2_sink_thread, sink);
+    if (status) {
+        fprintf(stderr, "pthread_create() failed: %s\n", strerror(status));
+        return -1;
+    }
+
+    return 0;
+}
+
+void v4l2_sink_stop(struct v4l2_sink* sink)
+{
+    atomic_store(&sink->stop, true);
+    if (-1 == eventfd_write(sink->wakeup_fd, 1))
+        fprintf(stderr, "eventfd_write() failed: %s\n", strerror(errno));
+
+    pthread_join(sink->thread, NULL);
+}
+
+void v4l2_sink_close(struct v4l2_sink* sink)
+{
+    close(sink->completion_fd);
+    close(sink->wakeup_fd);
+}
+
+bool v4l2_sink_offer(struct v4l2_sink* sink, unsigned index, int* replaced)
+{
+    if (!v4l2_sink_take(sink, index, replaced))
+        return false;
+
+    if (-1 == eventfd_write(sink->wakeup_fd, 1))
+        fprintf(stderr, "eventfd_write() failed: %s\n", strerror(errno));
+
+    return true;
+}
+
+void v4l2_sink_hand_over(struct v4l2_sink* sink, unsigned index)
+{
+    int replaced;
+
+    if (v4l2_sink_take(sink, index, &replaced)) {
+        if (-1 == eventfd_write(sink->wakeup_fd, 1))
+            fprintf(stderr, "eventfd_write() failed: %s\n", strerror(errno));
+        if (replaced == -1)
+            return;
+        index = replaced;
+    }
+
+    /* the owner gets it back as if the sink were done with it */
+    v4l2_index_queue_push(&sink->returned, index);
+    if (-1 == eventfd_write(sink->completion_fd, 1))
+        fprintf(stderr, "eventfd_write() failed: %s\n", strerror(errno));
+}
+
+void v4l2_sink_complete(struct v4l2_sink* sink, unsigned index)
+{
+    v4l2_index_queue_push(&sink->completed, index);
+    if (-1 == eventfd_write(sink->completion_fd, 1))
+        fprintf(stderr, "eventfd_write() failed: %s\n", strerror(errno));
+}
+
+unsigned v4l2_sink_reclaim(struct v4l2_sink* sink, unsigned* indices)
+{
+    unsigned count = 0;
+    uint64_t value;
+
+    /* reset the counter first, so that no completion can be lost */
+    if (-1 == eventfd_read(sink->completion_fd, &value) && errno != EAGAIN)
+        fprintf(stderr, "eventfd_read() failed: %s\n", strerror(errno));
+
+    while (count < VIDEO_MAX_FRAME && v4l2_index_queue_pop(&sink->completed, indices + count))
+        count++;
+
+    atomic_fetch_sub(&sink->held, count);
+
+    while (count < VIDEO_MAX_FRAME && v4l2_index_queue_pop(&sink->returned, indices + count))
+        count++;
+
+    return count;
+}
+
+const char* v4l2_sink_policy_name(enum v4l2_sink_policy policy)
+{
+    return policy_names[policy];
+}
+
+int v4l2_sink_policy_parse(const char* name, enum v4l2_sink_policy* policy)
+{
+    unsigned i;
+
+    for (i = 0; i < sizeof(policy_names) / sizeof(policy_names[0]); ++i)
+        if (strcmp(name, policy_names[i]) == 0) {
+            *policy = i;
+            return 0;
+        }
+
+    return -1;
+}
+
+void v4l2_sink_print_stats(const char* name, const struct v4l2_sink* sink)
+{
+    fprintf(stdout, "%s: %s (%s): %llu frame(s) offered, %llu processed, %llu skipped, %llu replaced by newer ones\n",
+        name, sink->name, v4l2_sink_policy_name(sink->policy),
+        (unsigned long long)sink->offers, (unsigned long long)sink->processed,
+        (unsigned long long)sink->skipped, (unsigned long long)sink->replaced);
+}
+
+/*===========================================================================*\
+ * local function definitions
+\*===========================================================================*/
+static bool v4l2_sink_take(struct v4l2_sink* sink, unsigned index, int* replaced)
+{
+    *replaced = -1;
+    sink->offers++;
+
+    switch (sink->policy) {
+        case V4L2_SINK_DROP_NEW:
+            if (atomic_load(&sink->held) >= sink->max_held) {
+                sink->skipped++;
+                return false;
+            }
+            /* fall through */
+
+        case V4L2_SINK_KEEP_ALL:
+            /* never full, there are not more buffers than slots */
+            v4l2_index_queue_push(&sink->taken, index);
+            break;
+
+        case V4L2_SINK_DROP_OLD:
+            /* whichever of the two gets the older frame, sink or owner, owns it */
+            *replaced = atomic_exchange(&sink->latest, (int)index);
+            if (*replaced != -1) {
+                sink->replaced++;
+                return true;
+            }
+            break;
+    }
+
+    atomic_fetch_add(&sink->held, 1);
+
+    return true;
+}
+
+static bool v4l2_sink_next(struct v4l2_sink* sink, unsigned* index)
+{
+    int latest;
+
+    if (sink->policy != V4L2_SINK_DROP_OLD)
+        return v4l2_index_queue_pop(&sink->taken, index);
+
+    latest = atomic_exchange(&sink->latest, -1);
+    if (latest == -1)
+        return false;
+
+    *index = latest;
+    return true;
+}
+
+static void* v4l2_sink_thread(void* arg)
+{
+    struct v4l2_sink* sink = arg;
+    struct v4l2_sched_stats start;
+    struct v4l2_sched_stats end;
+    unsigned index;
+    uint64_t value;
+    bool stop;
+
+    v4l2_sched_apply(sink->name, sink->cpus, 0);
+    v4l2_sched_sample(&start);
+
+    for (;;) {
+        /* frames taken before stop was set are processed as well */
+        stop = atomic_load(&sink->stop);
+
+        while (v4l2_sink_next(sink, &index)) {
+            if (sink->process(sink->arg, index))
+                v4l2_sink_complete(sink, index);
+            sink->processed++;
+        }
+
+        if (sink->poll && sink->poll(sink->arg) > 0)
+            stop = false; /* keep going until all frames still in use are done */
+
+        if (stop)
+            break;
+
+        if (-1 == eventfd_read(sink->wakeup_fd, &value) && errno != EINTR) {
+            fprintf(stderr, "eventfd_read() failed: %s\n", strerror(errno));
+            break;
+        }
+    }
+
+    v4l2_sched_sample(&end);
+    v4l2_sched_diff(&sink->sched, &start, &end);
+
+    return NULL;
+}
@@ -0,0 +1,149 @@
+/* SPDX-License-Identifier: MIT */
+/**
+ * @file v4l2-sink.h
+ *
+ * Consumer of frames running on a thread of its own (preview, analytics, publishing, ...).
+ * Frames are identified by the index of their buffer, the owner of the buffers
+ * (the capture thread) offers every frame to each of its sinks and counts the ones
+ * which took it; the buffer goes back to the driver once all of them are done with it.
+ * What a sink does when it does not keep up is given by its policy, so that a slow
+ * sink never holds more buffers than it is allowed to:
+ * - V4L2_SINK_KEEP_ALL: every frame is taken, the sink may hold any number of buffers,
+ * - V4L2_SINK_DROP_NEW: frames offered while the sink holds max_held of them are skipped,
+ * - V4L2_SINK_DROP_OLD: only the newest frame waits for the sink, an older one still
+ *   waiting is given back unprocessed, so the sink holds at most two buffers.
+ * Offering and reclaiming are done by the owner only, processing by the sink thread only.
+ * Frames may be handed over by another thread instead (one at a time), those
+ * the sink does not take come back to the owner along with the completed ones.
+ * A sink whose processing goes on after process returns (e.g. asynchronous I/O)
+ * completes such frames later from its poll hook, the thread does not stop before.
+ */
+
+#ifndef _V4L2_SINK_H_
+#define _V4L2_SINK_H_
+
+/*===========================================================================*\
+ * system header files
+\*===========================================================================*/
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include <linux/videodev2.h>
+
+/*===========================================================================*\
+ * project header files
+\*===========================================================================*/
+#include "v4l2-index-queue.h"
+#include "v4l2-sched.h"
+
+/*===========================================================================*\
+ * preprocessor #define constants and macros
+\*===========================================================================*/
+#define V4L2_SINK_DEFAULT_MAX_HELD 2
+
+/*===========================================================================*\
+ * global type definitions
+\*===========================================================================*/
+enum v4l2_sink_policy
+{
+    V4L2_SINK_KEEP_ALL,
+    V4L2_SINK_DROP_NEW,
+    V4L2_SINK_DROP_OLD,
+};
+
+/*
+ * Does whatever the sink does with the frame in buffer index, on the sink thread.
+ * Returns false if the frame is still in use, it is completed by v4l2_sink_complete() then.
+ */
+typedef bool (*v4l2_sink_process_t)(void* arg, unsigned index);
+
+/* called on the sink thread whenever it wakes up, returns number of frames still in use */
+typedef unsigned (*v4l2_sink_poll_t)(void* arg);
+
+struct v4l2_sink
+{
+    const char* name;
+    enum v4l2_sink_policy policy;
+    unsigned max_held;                 /* V4L2_SINK_DROP_NEW only */
+    v4l2_sink_process_t process;
+    v4l2_sink_poll_t poll;             /* NULL if every frame is done once processed */
+    void* arg;
+    const cpu_set_t* cpus;             /* the thread runs on, NULL: anywhere */
+    pthread_t thread;
+    int wakeup_fd;                     /* signalled when a frame is taken or stop is set */
+    int completion_fd;                 /* signalled when the sink is done with a frame */
+    atomic_bool stop;
+    struct v4l2_index_queue taken;     /* owner -> sink, unless V4L2_SINK_DROP_OLD */
+    _Atomic int latest;                /* owner -> sink, V4L2_SINK_DROP_OLD only, -1 if empty */
+    struct v4l2_index_queue completed; /* sink -> owner */
+    struct v4l2_index_queue returned;  /* handed over, but not taken or replaced, -> owner */
+    atomic_uint held;                  /* frames taken and not reclaimed yet */
+    uint64_t offers;                   /* whoever offers */
+    uint64_t skipped;                  /* ... out of them not taken */
+    uint64_t replaced;                 /* frames given back unprocessed */
+    uint64_t processed;                /* sink thread only */
+    struct v4l2_sched_stats sched;     /* of the sink thread, over its whole run */
+};
+
+/*===========================================================================*\
+ * global object declarations
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * function forward declarations
+\*===========================================================================*/
+
+/**
+ * Prepares the sink, whose thread (pinned to cpus if not NULL) is going to call process for every
+ * frame taken. max_held of 0 stands for V4L2_SINK_DEFAULT_MAX_HELD. Returns 0 on success, -1 on failure.
+ */
+int v4l2_sink_open(struct v4l2_sink* sink, const char* name, enum v4l2_sink_policy policy, unsigned max_held,
+    v4l2_sink_process_t process, v4l2_sink_poll_t poll, void* arg, const cpu_set_t* cpus);
+
+/** Starts the sink thread. Returns 0 on success, -1 on failure (the sink is still open then) */
+int v4l2_sink_start(struct v4l2_sink* sink);
+
+/**
+ * Lets the sink process the frames it has taken, waits until none of them is in use
+ * and stops its thread, frames are reclaimed afterwards
+ */
+void v4l2_sink_stop(struct v4l2_sink* sink);
+
+/** Releases what v4l2_sink_open() acquired */
+void v4l2_sink_close(struct v4l2_sink* sink);
+
+/**
+ * Offers the frame in buffer index to the sink. Returns true if the sink took it.
+ * Sets replaced to the frame the sink gave back unprocessed instead (V4L2_SINK_DROP_OLD),
+ * to -1 if there is none.
+ */
+bool v4l2_sink_offer(struct v4l2_sink* sink, unsigned index, int* replaced);
+
+/**
+ * Offers the frame in buffer index to the sink on behalf of its owner, from another thread.
+ * A frame the sink does not take or gives back instead is returned by v4l2_sink_reclaim().
+ */
+void v4l2_sink_hand_over(struct v4l2_sink* sink, unsigned index);
+
+/** Reports a frame process returned false for as done, on the sink thread */
+void v4l2_sink_complete(struct v4l2_sink* sink, unsigned index);
+
+/**
+ * Stores in indices (room for VIDEO_MAX_FRAME of them) the frames the sink is done with
+ * or did not take, to be called when completion_fd is readable. Returns their number.
+ */
+unsigned v4l2_sink_reclaim(struct v4l2_sink* sink, unsigned* indices);
+
+/** e.g. "keep", "drop-new" or "drop-old" */
+const char* v4l2_sink_policy_name(enum v4l2_sink_policy policy);
+
+/** Parses name returned by v4l2_sink_policy_name(). Returns 0 on success, -1 if it is unknown */
+int v4l2_sink_policy_parse(const char* name, enum v4l2_sink_policy* policy);
+
+/** Prints one line summary of what the sink took and dropped */
+void v4l2_sink_print_stats(const char* name, const struct v4l2_sink* sink);
+
+#endif /* _V4L2_SINK_H_ */
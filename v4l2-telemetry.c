@@ -0,0 +1,399 @@
+/* SPDX-License-Identifier: MIT */
+/**
+ * @file v4l2-telemetry.c
+ *
+ * Periodic, machine readable capture statistics (see v4l2-telemetry.h).
+ */
+
+/*===========================================================================*\
+ * system header files
+\*===========================================================================*/
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+
+#include <sys/eventfd.h>
+
+/*===========================================================================*\
+ * project header files
+\*===========================================================================*/
+#include "v4l2-telemetry.h"
+
+/*===========================================================================*\
+ * preprocessor #define constants and macros
+\*===========================================================================*/
+#define ARRAY_SIZE(arr) (sizeof(arr) / sizeof(arr[0]))
+#define NSEC_PER_SEC 1000000000ULL
+
+/*===========================================================================*\
+ * local type definitions
+\*===========================================================================*/
+
+/* one interval of one source */
+struct v4l2_telemetry_sample
+{
+    uint64_t frames;
+    uint64_t bytes;
+    uint64_t lost;
+    uint64_t erroneous;
+    uint64_t timeouts;
+    uint64_t starvations;
+    unsigned queued;
+    unsigned backlog;
+    double fps;
+    double bytes_per_sec;
+    struct {
+        uint64_t count;  /* within the interval */
+        double avg;      /* microseconds */
+        double max;      /* microseconds */
+    } stages[V4L2_TELEMETRY_MAX_STAGES];
+};
+
+/*===========================================================================*\
+ * global object definitions
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * local function declarations
+\*===========================================================================*/
+static void* v4l2_telemetry_thread(void* arg);
+static void v4l2_telemetry_take(struct v4l2_telemetry* telemetry, struct v4l2_telemetry_source* source,
+    double elapsed, struct v4l2_telemetry_sample* sample);
+static void v4l2_telemetry_print_string(FILE* file, const char* str);
+static void v4l2_telemetry_write_json(struct v4l2_telemetry* telemetry, double elapsed,
+    const struct v4l2_telemetry_sample* samples);
+static int v4l2_telemetry_write_prometheus(struct v4l2_telemetry* telemetry,
+    const struct v4l2_telemetry_sample* samples);
+static void v4l2_telemetry_sample(struct v4l2_telemetry* telemetry);
+
+/*===========================================================================*\
+ * local object definitions
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * inline function definitions
+\*===========================================================================*/
+static inline uint64_t v4l2_telemetry_clock_ns(clockid_t clock)
+{
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+
+    return (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static inline uint64_t v4l2_telemetry_load(atomic_uint_least64_t* counter)
+{
+    return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+/*===========================================================================*\
+ * public function definitions
+\*===========================================================================*/
+int v4l2_telemetry_init(struct v4l2_telemetry* telemetry, const char* filename,
+    enum v4l2_telemetry_format format, int interval, const char* const* stage_names, unsigned nstages)
+{
+    memset(telemetry, 0, sizeof(*telemetry));
+    telemetry->stop_fd = -1;
+    telemetry->filename = filename;
+    telemetry->format = format;
+    telemetry->interval = interval > 0 ? interval : V4L2_TELEMETRY_DEFAULT_INTERVAL_MS;
+    telemetry->stage_names = stage_names;
+    telemetry->nstages = nstages < V4L2_TELEMETRY_MAX_STAGES ? nstages : V4L2_TELEMETRY_MAX_STAGES;
+
+    if (format == V4L2_TELEMETRY_FORMAT_JSON) {
+        telemetry->file = strcmp(filename, "-") == 0 ? stdout : fopen(filename, "w");
+        if (NULL == telemetry->file) {
+            fprintf(stderr, "cannot open '%s': %s\n", filename, strerror(errno));
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int v4l2_telemetry_add_source(struct v4l2_telemetry* telemetry, const char* name,
+    struct v4l2_telemetry_counters* counters, struct v4l2_index_queue* backlog)
+{
+    struct v4l2_telemetry_source* source;
+
+    if (telemetry->nsources == V4L2_TELEMETRY_MAX_SOURCES) {
+        fprintf(stderr, "at most %d telemetry sources are supported\n", V4L2_TELEMETRY_MAX_SOURCES);
+        return -1;
+    }
+
+    source = &telemetry->sources[telemetry->nsources++];
+    memset(source, 0, sizeof(*source));
+    source->name = name;
+    source->counters = counters;
+    source->backlog = backlog;
+
+    return 0;
+}
+
+int v4l2_telemetry_start(struct v4l2_telemetry* telemetry)
+{
+    int status;
+
+    telemetry->stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (telemetry->stop_fd == -1) {
+        fprintf(stderr, "eventfd() failed: %s\n", strerror(errno));
+        return -1;
+    }
+
+    telemetry->sampled = v4l2_telemetry_clock_ns(CLOCK_MONOTONIC);
+
+    status = pthread_create(&telemetry->thread, NULL, v4l2_telemetry_thread, telemetry);
+    if (status) {
+        fprintf(stderr, "pthread_create() failed: %s\n", strerror(status));
+        close(telemetry->stop_fd);
+        telemetry->stop_fd = -1;
+        return -1;
+    }
+
+    return 0;
+}
+
+void v4l2_telemetry_stop(struct v4l2_telemetry* telemetry)
+{
+    if (telemetry->stop_fd != -1) {
+        if (-1 == eventfd_write(telemetry->stop_fd, 1))
+            fprintf(stderr, "eventfd_write() failed: %s\n", strerror(errno));
+        pthread_join(telemetry->thread, NULL);
+        close(telemetry->stop_fd);
+        telemetry->stop_fd = -1;
+    }
+
+    if (telemetry->file && telemetry->file != stdout)
+        fclose(telemetry->file);
+    telemetry->file = NULL;
+}
+
+/*===========================================================================*\
+ * local function definitions
+\*===========================================================================*/
+static void* v4l2_telemetry_thread(void* arg)
+{
+    struct v4l2_telemetry* telemetry = arg;
+    struct pollfd pfd;
+    int status;
+
+    pfd.fd = telemetry->stop_fd;
+    pfd.events = POLLIN;
+
+    for (;;) {
+        status = poll(&pfd, 1, telemetry->interval);
+        if (status == -1 && errno != EINTR) {
+            fprintf(stderr, "poll() failed: %s\n", strerror(errno));
+            break;
+        }
+
+        /* stop request gets its own, possibly shorter, last interval */
+        v4l2_telemetry_sample(telemetry);
+
+        if (status > 0)
+            break;
+    }
+
+    return NULL;
+}
+
+static void v4l2_telemetry_take(struct v4l2_telemetry* telemetry, struct v4l2_telemetry_source* source,
+    double elapsed, struct v4l2_telemetry_sample* sample)
+{
+    struct v4l2_telemetry_counters* counters = source->counters;
+    unsigned stage;
+
+    sample->frames = v4l2_telemetry_load(&counters->frames);
+    sample->bytes = v4l2_telemetry_load(&counters->bytes);
+    sample->lost = v4l2_telemetry_load(&counters->lost);
+    sample->erroneous = v4l2_telemetry_load(&counters->erroneous);
+    sample->timeouts = v4l2_telemetry_load(&counters->timeouts);
+    sample->starvations = v4l2_telemetry_load(&counters->starvations);
+    sample->queued = atomic_load_explicit(&counters->queued, memory_order_relaxed);
+    sample->backlog = source->backlog ? v4l2_index_queue_size(source->backlog) : 0;
+
+    sample->fps = elapsed > 0 ? (sample->frames - source->frames) / elapsed : 0;
+    sample->bytes_per_sec = elapsed > 0 ? (sample->bytes - source->bytes) / elapsed : 0;
+    source->frames = sample->frames;
+    source->bytes = sample->bytes;
+
+    for (stage = 0; stage < telemetry->nstages; ++stage) {
+        struct v4l2_telemetry_stage* s = &counters->stages[stage];
+        uint64_t count = v4l2_telemetry_load(&s->count);
+        uint64_t sum = v4l2_telemetry_load(&s->sum);
+        uint64_t max = atomic_exchange_explicit(&s->max, 0, memory_order_relaxed);
+
+        sample->stages[stage].count = count - source->stage_count[stage];
+        sample->stages[stage].avg = sample->stages[stage].count ?
+            (sum - source->stage_sum[stage]) / 1000.0 / sample->stages[stage].count : 0;
+        sample->stages[stage].max = max / 1000.0;
+        source->stage_count[stage] = count;
+        source->stage_sum[stage] = sum;
+    }
+}
+
+static void v4l2_telemetry_print_string(FILE* file, const char* str)
+{
+    /* device names are paths, only quotes and backslashes need escaping */
+    fputc('"', file);
+    for (; *str; ++str) {
+        if (*str == '"' || *str == '\\')
+            fputc('\\', file);
+        fputc(*str, file);
+    }
+    fputc('"', file);
+}
+
+static void v4l2_telemetry_write_json(struct v4l2_telemetry* telemetry, double elapsed,
+    const struct v4l2_telemetry_sample* samples)
+{
+    FILE* file = telemetry->file;
+    uint64_t now = v4l2_telemetry_clock_ns(CLOCK_REALTIME);
+    unsigned i;
+    unsigned stage;
+
+    fprintf(file, "{\"time\":%llu.%03llu,\"interval\":%.3f,\"devices\":[",
+        (unsigned long long)(now / NSEC_PER_SEC), (unsigned long long)(now % NSEC_PER_SEC / 1000000),
+        elapsed);
+
+    for (i = 0; i < telemetry->nsources; ++i) {
+        const struct v4l2_telemetry_sample* sample = samples + i;
+
+        fprintf(file, "%s{\"device\":", i ? "," : "");
+        v4l2_telemetry_print_string(file, telemetry->sources[i].name);
+        fprintf(file, ",\"frames\":%llu,\"fps\":%.2f,\"bytes\":%llu,\"bytes_per_sec\":%.0f"
+            ",\"lost\":%llu,\"erroneous\":%llu,\"timeouts\":%llu,\"starvations\":%llu"
+            ",\"driver_queue\":%u,\"writer_queue\":%u,\"latency_us\":{",
+            (unsigned long long)sample->frames, sample->fps,
+            (unsigned long long)sample->bytes, sample->bytes_per_sec,
+            (unsigned long long)sample->lost, (unsigned long long)sample->erroneous,
+            (unsigned long long)sample->timeouts, (unsigned long long)sample->starvations,
+            sample->queued, sample->backlog);
+
+        for (stage = 0; stage < telemetry->nstages; ++stage)
+            fprintf(file, "%s\"%s\":{\"count\":%llu,\"avg\":%.1f,\"max\":%.1f}",
+                stage ? "," : "", telemetry->stage_names[stage],
+                (unsigned long long)sample->stages[stage].count,
+                sample->stages[stage].avg, sample->stages[stage].max);
+
+        fprintf(file, "}}");
+    }
+
+    fprintf(file, "]}\n");
+    fflush(file);
+}
+
+static int v4l2_telemetry_write_prometheus(struct v4l2_telemetry* telemetry,
+    const struct v4l2_telemetry_sample* samples)
+{
+    char tmpname[PATH_MAX];
+    FILE* file;
+    unsigned i;
+    unsigned stage;
+
+    static const struct {
+        const char* name;
+        const char* type;
+        const char* help;
+    } metrics[] = {
+        {"v4l2_capture_frames_total",          "counter", "Frames captured"},
+        {"v4l2_capture_bytes_total",           "counter", "Payload bytes captured"},
+        {"v4l2_capture_lost_frames_total",     "counter", "Frames missing from the buffer sequence"},
+        {"v4l2_capture_erroneous_frames_total","counter", "Frames flagged with V4L2_BUF_FLAG_ERROR"},
+        {"v4l2_capture_timeouts_total",        "counter", "Waits for a frame which timed out"},
+        {"v4l2_capture_starvations_total",     "counter", "Times all buffers were held by userspace"},
+        {"v4l2_capture_fps",                   "gauge",   "Frames per second within the last interval"},
+        {"v4l2_capture_bytes_per_second",      "gauge",   "Bytes per second within the last interval"},
+        {"v4l2_capture_driver_queue",          "gauge",   "Buffers owned by the driver"},
+        {"v4l2_capture_writer_queue",          "gauge",   "Frames waiting to be stored"},
+    };
+
+    if ((size_t)snprintf(tmpname, sizeof(tmpname), "%s.tmp", telemetry->filename) >= sizeof(tmpname)) {
+        fprintf(stderr, "telemetry filename '%s' is too long\n", telemetry->filename);
+        return -1;
+    }
+
+    file = fopen(tmpname, "w");
+    if (NULL == file) {
+        fprintf(stderr, "cannot open '%s': %s\n", tmpname, strerror(errno));
+        return -1;
+    }
+
+    for (i = 0; i < ARRAY_SIZE(metrics); ++i) {
+        unsigned j;
+
+        fprintf(file, "# HELP %s %s\n", metrics[i].name, metrics[i].help);
+        fprintf(file, "# TYPE %s %s\n", metrics[i].name, metrics[i].type);
+
+        for (j = 0; j < telemetry->nsources; ++j) {
+            const struct v4l2_telemetry_sample* sample = samples + j;
+            double values[] = {
+                sample->frames, sample->bytes, sample->lost, sample->erroneous,
+                sample->timeouts, sample->starvations, sample->fps, sample->bytes_per_sec,
+                sample->queued, sample->backlog,
+            };
+
+            fprintf(file, "%s{device=", metrics[i].name);
+            v4l2_telemetry_print_string(file, telemetry->sources[j].name);
+            fprintf(file, "} %.17g\n", values[i]);
+        }
+    }
+
+    /* samples of one metric have to be listed together */
+    for (i = 0; i < 2; ++i) {
+        const char* name = i ? "v4l2_capture_latency_max_seconds" : "v4l2_capture_latency_avg_seconds";
+        unsigned j;
+
+        fprintf(file, "# HELP %s %s latency of a stage within the last interval\n", name, i ? "Maximal" : "Average");
+        fprintf(file, "# TYPE %s gauge\n", name);
+
+        for (j = 0; j < telemetry->nsources; ++j)
+            for (stage = 0; stage < telemetry->nstages; ++stage) {
+                fprintf(file, "%s{device=", name);
+                v4l2_telemetry_print_string(file, telemetry->sources[j].name);
+                fprintf(file, ",stage=\"%s\"} %.9f\n", telemetry->stage_names[stage],
+                    (i ? samples[j].stages[stage].max : samples[j].stages[stage].avg) / 1e6);
+            }
+    }
+
+    if (fclose(file)) {
+        fprintf(stderr, "fclose('%s') failed: %s\n", tmpname, strerror(errno));
+        unlink(tmpname);
+        return -1;
+    }
+
+    /* collectors never see a partially written file */
+    if (-1 == rename(tmpname, telemetry->filename)) {
+        fprintf(stderr, "rename('%s', '%s') failed: %s\n", tmpname, telemetry->filename, strerror(errno));
+        unlink(tmpname);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void v4l2_telemetry_sample(struct v4l2_telemetry* telemetry)
+{
+    struct v4l2_telemetry_sample samples[V4L2_TELEMETRY_MAX_SOURCES];
+    uint64_t now = v4l2_telemetry_clock_ns(CLOCK_MONOTONIC);
+    double elapsed = (now - telemetry->sampled) / (double)NSEC_PER_SEC;
+    unsigned i;
+
+    telemetry->sampled = now;
+
+    memset(samples, 0, sizeof(samples));
+    for (i = 0; i < telemetry->nsources; ++i)
+        v4l2_telemetry_take(telemetry, telemetry->sources + i, elapsed, samples + i);
+
+    if (telemetry->format == V4L2_TELEMETRY_FORMAT_JSON)
+        v4l2_telemetry_write_json(telemetry, elapsed, samples);
+    else
+        v4l2_telemetry_write_prometheus(telemetry, samples);
+}
@@ -0,0 +1,136 @@
+/* SPDX-License-Identifier: MIT */
+/**
+ * @file v4l2-telemetry.h
+ *
+ * Periodic, machine readable capture statistics.
+ * Every source (device) publishes its counters in a struct v4l2_telemetry_counters,
+ * which is written by a single thread with relaxed atomic stores only, so publishing
+ * costs the hot path no more than plain increments. A separate thread samples all
+ * sources every interval and writes one record per interval, either appended as
+ * a JSON line or as a Prometheus textfile (replaced atomically by rename()).
+ */
+
+#ifndef _V4L2_TELEMETRY_H_
+#define _V4L2_TELEMETRY_H_
+
+/*===========================================================================*\
+ * system header files
+\*===========================================================================*/
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+/*===========================================================================*\
+ * project header files
+\*===========================================================================*/
+#include "v4l2-index-queue.h"
+
+/*===========================================================================*\
+ * preprocessor #define constants and macros
+\*===========================================================================*/
+#define V4L2_TELEMETRY_MAX_SOURCES 8
+#define V4L2_TELEMETRY_MAX_STAGES 8
+#define V4L2_TELEMETRY_DEFAULT_INTERVAL_MS 1000
+
+/*===========================================================================*\
+ * global type definitions
+\*===========================================================================*/
+enum v4l2_telemetry_format
+{
+    V4L2_TELEMETRY_FORMAT_JSON,       /* one line per interval, appended */
+    V4L2_TELEMETRY_FORMAT_PROMETHEUS, /* textfile collector format, rewritten every interval */
+};
+
+struct v4l2_telemetry_stage
+{
+    atomic_uint_least64_t count;
+    atomic_uint_least64_t sum;   /* nanoseconds */
+    atomic_uint_least64_t max;   /* nanoseconds, since the previous sample */
+};
+
+/* written by one thread only, totals since the start of capturing */
+struct v4l2_telemetry_counters
+{
+    atomic_uint_least64_t frames;
+    atomic_uint_least64_t bytes;
+    atomic_uint_least64_t lost;
+    atomic_uint_least64_t erroneous;
+    atomic_uint_least64_t timeouts;
+    atomic_uint_least64_t starvations;
+    atomic_uint queued;          /* buffers owned by the driver, current value */
+    struct v4l2_telemetry_stage stages[V4L2_TELEMETRY_MAX_STAGES];
+};
+
+struct v4l2_telemetry_source
+{
+    const char* name;
+    struct v4l2_telemetry_counters* counters;
+    struct v4l2_index_queue* backlog;  /* frames waiting to be stored, may be NULL */
+
+    /* values seen by the previous sample */
+    uint64_t frames;
+    uint64_t bytes;
+    uint64_t stage_count[V4L2_TELEMETRY_MAX_STAGES];
+    uint64_t stage_sum[V4L2_TELEMETRY_MAX_STAGES];
+};
+
+struct v4l2_telemetry
+{
+    pthread_t thread;
+    int stop_fd;
+    const char* filename;
+    FILE* file;                  /* V4L2_TELEMETRY_FORMAT_JSON only */
+    enum v4l2_telemetry_format format;
+    int interval;                /* milliseconds */
+    uint64_t sampled;            /* CLOCK_MONOTONIC nanoseconds of the previous sample */
+    const char* const* stage_names;
+    unsigned nstages;
+    unsigned nsources;
+    struct v4l2_telemetry_source sources[V4L2_TELEMETRY_MAX_SOURCES];
+};
+
+/*===========================================================================*\
+ * global object declarations
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * function forward declarations
+\*===========================================================================*/
+
+/** Stage names are used as JSON keys and Prometheus label values, so keep them plain */
+int v4l2_telemetry_init(struct v4l2_telemetry* telemetry, const char* filename,
+    enum v4l2_telemetry_format format, int interval, const char* const* stage_names, unsigned nstages);
+int v4l2_telemetry_add_source(struct v4l2_telemetry* telemetry, const char* name,
+    struct v4l2_telemetry_counters* counters, struct v4l2_index_queue* backlog);
+int v4l2_telemetry_start(struct v4l2_telemetry* telemetry);
+
+/** Writes the last record (covering the time since the previous one) and releases everything */
+void v4l2_telemetry_stop(struct v4l2_telemetry* telemetry);
+
+/*===========================================================================*\
+ * inline function definitions
+\*===========================================================================*/
+
+/* writer side, no read-modify-write as there is only one writer */
+static inline void v4l2_telemetry_add(atomic_uint_least64_t* counter, uint64_t value)
+{
+    atomic_store_explicit(counter,
+        atomic_load_explicit(counter, memory_order_relaxed) + value, memory_order_relaxed);
+}
+
+static inline void v4l2_telemetry_record(struct v4l2_telemetry_stage* stage, uint64_t value)
+{
+    uint_least64_t max = atomic_load_explicit(&stage->max, memory_order_relaxed);
+
+    v4l2_telemetry_add(&stage->count, 1);
+    v4l2_telemetry_add(&stage->sum, value);
+
+    /* the sampling thread resets the maximum concurrently */
+    while (value > max &&
+        !atomic_compare_exchange_weak_explicit(&stage->max, &max, value,
+            memory_order_relaxed, memory_order_relaxed))
+        ;
+}
+
+#endif /* _V4L2_TELEMETRY_H_ */
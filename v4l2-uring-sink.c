@@ -0,0 +1,398 @@
+/* SPDX-License-Identifier: MIT */
+/**
+ * @file v4l2-uring-sink.c
+ *
+ * io_uring based storage backend. It talks to the kernel directly through
+ * io_uring_setup/io_uring_enter/io_uring_register system calls,
+ * so there is no dependency on liburing.
+ */
+
+/*===========================================================================*\
+ * system header files
+\*===========================================================================*/
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <linux/io_uring.h>
+
+/*===========================================================================*\
+ * project header files
+\*===========================================================================*/
+#include "v4l2-uring-sink.h"
+
+/*===========================================================================*\
+ * preprocessor #define constants and macros
+\*===========================================================================*/
+#define ARRAY_SIZE(arr) (sizeof(arr) / sizeof(arr[0]))
+
+/* user_data layout: [63:32] expected result, [31:0] buffer index */
+#define USER_DATA(index, expected) (((uint64_t)(expected) << 32) | (uint32_t)(index))
+#define USER_DATA_INDEX(user_data) ((uint32_t)(user_data))
+#define USER_DATA_EXPECTED(user_data) ((uint32_t)((user_data) >> 32))
+
+/*===========================================================================*\
+ * local type definitions
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * global object definitions
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * local function declarations
+\*===========================================================================*/
+static int v4l2_uring_setup(unsigned entries, struct io_uring_params* params);
+static int v4l2_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags);
+static int v4l2_uring_register(int fd, unsigned opcode, const void* arg, unsigned nr_args);
+static int v4l2_uring_probe(int fd);
+static struct io_uring_sqe* v4l2_uring_get_sqe(struct v4l2_uring_sink* sink);
+
+/*===========================================================================*\
+ * local object definitions
+\*===========================================================================*/
+static const uint8_t required_ops[] = {
+    IORING_OP_OPENAT,
+    IORING_OP_WRITE,
+    IORING_OP_WRITE_FIXED,
+    IORING_OP_CLOSE,
+};
+
+/*===========================================================================*\
+ * inline function definitions
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * public function definitions
+\*===========================================================================*/
+int v4l2_uring_sink_open(struct v4l2_uring_sink* sink, int eventfd,
+    const struct iovec* planes, unsigned nbuffers, unsigned nplanes)
+{
+    int retval = -1;
+
+    memset(sink, 0, sizeof(*sink));
+    sink->ring_fd = -1;
+
+    do {
+        struct io_uring_params params;
+        unsigned entries;
+        unsigned i;
+        int files[VIDEO_MAX_FRAME];
+
+        if (nbuffers == 0 || nbuffers > VIDEO_MAX_FRAME || nplanes > VIDEO_MAX_PLANES)
+            break;
+
+        sink->nbuffers = nbuffers;
+        sink->nplanes = nplanes;
+
+        /* every buffer in flight needs openat + one write per plane + close */
+        entries = nbuffers * (nplanes + 2);
+
+        memset(&params, 0, sizeof(params));
+        sink->ring_fd = v4l2_uring_setup(entries, &params);
+        if (sink->ring_fd == -1) {
+            fprintf(stderr, "io_uring_setup() failed: %s\n", strerror(errno));
+            break;
+        }
+
+        sink->sq_entries = params.sq_entries;
+        sink->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        sink->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+        if (params.features & IORING_FEAT_SINGLE_MMAP) {
+            if (sink->cq_ring_size > sink->sq_ring_size)
+                sink->sq_ring_size = sink->cq_ring_size;
+            sink->cq_ring_size = sink->sq_ring_size;
+        }
+
+        sink->sq_ring = mmap(NULL, sink->sq_ring_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, sink->ring_fd, IORING_OFF_SQ_RING);
+        if (sink->sq_ring == MAP_FAILED) {
+            sink->sq_ring = NULL;
+            fprintf(stderr, "mmap(IORING_OFF_SQ_RING) failed: %s\n", strerror(errno));
+            break;
+        }
+
+        if (params.features & IORING_FEAT_SINGLE_MMAP) {
+            sink->cq_ring = sink->sq_ring;
+        } else {
+            sink->cq_ring = mmap(NULL, sink->cq_ring_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, sink->ring_fd, IORING_OFF_CQ_RING);
+            if (sink->cq_ring == MAP_FAILED) {
+                sink->cq_ring = NULL;
+                fprintf(stderr, "mmap(IORING_OFF_CQ_RING) failed: %s\n", strerror(errno));
+                break;
+            }
+        }
+
+        sink->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+        sink->sqes = mmap(NULL, sink->sqes_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, sink->ring_fd, IORING_OFF_SQES);
+        if (sink->sqes == MAP_FAILED) {
+            sink->sqes = NULL;
+            fprintf(stderr, "mmap(IORING_OFF_SQES) failed: %s\n", strerror(errno));
+            break;
+        }
+
+        sink->sq_head = (unsigned*)((char*)sink->sq_ring + params.sq_off.head);
+        sink->sq_tail = (unsigned*)((char*)sink->sq_ring + params.sq_off.tail);
+        sink->sq_mask = (unsigned*)((char*)sink->sq_ring + params.sq_off.ring_mask);
+        sink->sq_array = (unsigned*)((char*)sink->sq_ring + params.sq_off.array);
+        sink->sq_local_tail = *sink->sq_tail;
+
+        sink->cq_head = (unsigned*)((char*)sink->cq_ring + params.cq_off.head);
+        sink->cq_tail = (unsigned*)((char*)sink->cq_ring + params.cq_off.tail);
+        sink->cq_mask = (unsigned*)((char*)sink->cq_ring + params.cq_off.ring_mask);
+        sink->cqes = (struct io_uring_cqe*)((char*)sink->cq_ring + params.cq_off.cqes);
+
+        if (v4l2_uring_probe(sink->ring_fd))
+            break;
+
+        /* one direct descriptor slot per buffer, initially all empty */
+        for (i = 0; i < nbuffers; ++i)
+            files[i] = -1;
+        if (v4l2_uring_register(sink->ring_fd, IORING_REGISTER_FILES, files, nbuffers)) {
+            fprintf(stderr, "IORING_REGISTER_FILES failed: %s\n", strerror(errno));
+            break;
+        }
+
+        if (planes && nplanes > 0) {
+            if (v4l2_uring_register(sink->ring_fd, IORING_REGISTER_BUFFERS, planes, nbuffers * nplanes) == 0)
+                sink->fixed_buffers = true;
+            else
+                fprintf(stderr, "IORING_REGISTER_BUFFERS failed: %s (continuing with regular writes)\n",
+                    strerror(errno));
+        }
+
+        if (eventfd != -1)
+            if (v4l2_uring_register(sink->ring_fd, IORING_REGISTER_EVENTFD, &eventfd, 1)) {
+                fprintf(stderr, "IORING_REGISTER_EVENTFD failed: %s\n", strerror(errno));
+                break;
+            }
+
+        retval = 0;
+    } while (0);
+
+    if (retval)
+        v4l2_uring_sink_close(sink);
+
+    return retval;
+}
+
+void v4l2_uring_sink_close(struct v4l2_uring_sink* sink)
+{
+    if (sink->sqes)
+        munmap(sink->sqes, sink->sqes_size);
+    if (sink->cq_ring && sink->cq_ring != sink->sq_ring)
+        munmap(sink->cq_ring, sink->cq_ring_size);
+    if (sink->sq_ring)
+        munmap(sink->sq_ring, sink->sq_ring_size);
+    if (sink->ring_fd != -1)
+        close(sink->ring_fd);
+
+    sink->sqes = NULL;
+    sink->cq_ring = NULL;
+    sink->sq_ring = NULL;
+    sink->ring_fd = -1;
+}
+
+int v4l2_uring_sink_store(struct v4l2_uring_sink* sink, unsigned index,
+    const char* filename, const struct iovec* iov, size_t iovcnt)
+{
+    struct io_uring_sqe* sqe;
+    size_t i;
+    uint64_t offset = 0;
+    unsigned slot = index;
+
+    if (index >= sink->nbuffers || sink->frames[index].pending) {
+        fprintf(stderr, "buffer[%u] cannot be stored now\n", index);
+        return -1;
+    }
+
+    /* the path is read by the kernel asynchronously, so it has to stay valid until then */
+    snprintf(sink->frames[index].filename, sizeof(sink->frames[index].filename), "%s", filename);
+    sink->frames[index].status = 0;
+    sink->frames[index].pending = 0;
+
+    sqe = v4l2_uring_get_sqe(sink);
+    if (!sqe)
+        return -1;
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uintptr_t)sink->frames[index].filename;
+    sqe->len = 0664;
+    sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC; /* O_CLOEXEC is not allowed for direct descriptors */
+    sqe->file_index = slot + 1;
+    sqe->user_data = USER_DATA(index, 0);
+    sink->frames[index].pending++;
+
+    for (i = 0; i < iovcnt && iov[i].iov_base; ++i) {
+        sqe = v4l2_uring_get_sqe(sink);
+        if (!sqe)
+            return -1;
+        sqe->opcode = sink->fixed_buffers ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+        /* close has to be issued even if (short) write fails, so hard link it */
+        sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+        sqe->fd = slot;
+        sqe->addr = (uintptr_t)iov[i].iov_base;
+        sqe->len = iov[i].iov_len;
+        sqe->off = offset;
+        if (sink->fixed_buffers)
+            sqe->buf_index = index * sink->nplanes + i;
+        sqe->user_data = USER_DATA(index, iov[i].iov_len);
+        sink->frames[index].pending++;
+
+        offset += iov[i].iov_len;
+    }
+
+    sqe = v4l2_uring_get_sqe(sink);
+    if (!sqe)
+        return -1;
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->file_index = slot + 1;
+    sqe->user_data = USER_DATA(index, 0);
+    sink->frames[index].pending++;
+
+    sink->inflight++;
+
+    return 0;
+}
+
+int v4l2_uring_sink_submit(struct v4l2_uring_sink* sink)
+{
+    unsigned to_submit = sink->sq_local_tail - *sink->sq_tail;
+
+    if (to_submit == 0)
+        return 0;
+
+    __atomic_store_n(sink->sq_tail, sink->sq_local_tail, __ATOMIC_RELEASE);
+
+    while (to_submit > 0) {
+        int n = v4l2_uring_enter(sink->ring_fd, to_submit, 0, 0);
+        if (n < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+                continue;
+            fprintf(stderr, "io_uring_enter() failed: %s\n", strerror(errno));
+            return -1;
+        }
+        to_submit -= n;
+    }
+
+    return 0;
+}
+
+int v4l2_uring_sink_reap(struct v4l2_uring_sink* sink, v4l2_uring_sink_done_t done, void* arg)
+{
+    unsigned head = *sink->cq_head;
+    unsigned tail = __atomic_load_n(sink->cq_tail, __ATOMIC_ACQUIRE);
+    int completed = 0;
+
+    for (; head != tail; ++head) {
+        const struct io_uring_cqe* cqe = &sink->cqes[head & *sink->cq_mask];
+        unsigned index = USER_DATA_INDEX(cqe->user_data);
+        int res = cqe->res;
+
+        if (index >= sink->nbuffers || sink->frames[index].pending == 0)
+            continue;
+
+        if (res >= 0 && (uint32_t)res != USER_DATA_EXPECTED(cqe->user_data))
+            res = -EIO; /* short write */
+
+        if (res < 0 && sink->frames[index].status == 0) {
+            sink->frames[index].status = res;
+            fprintf(stderr, "storing '%s' failed: %s\n", sink->frames[index].filename, strerror(-res));
+        }
+
+        if (--sink->frames[index].pending == 0) {
+            sink->inflight--;
+            completed++;
+            if (done)
+                done(arg, index, sink->frames[index].status);
+        }
+    }
+
+    __atomic_store_n(sink->cq_head, head, __ATOMIC_RELEASE);
+
+    return completed;
+}
+
+/*===========================================================================*\
+ * local function definitions
+\*===========================================================================*/
+static int v4l2_uring_setup(unsigned entries, struct io_uring_params* params)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int v4l2_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int v4l2_uring_register(int fd, unsigned opcode, const void* arg, unsigned nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static int v4l2_uring_probe(int fd)
+{
+    int retval = -1;
+    struct io_uring_probe* probe;
+    size_t size = sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op);
+
+    probe = calloc(1, size);
+    if (!probe)
+        return -1;
+
+    do {
+        size_t i;
+
+        if (v4l2_uring_register(fd, IORING_REGISTER_PROBE, probe, 256)) {
+            fprintf(stderr, "IORING_REGISTER_PROBE failed: %s\n", strerror(errno));
+            break;
+        }
+
+        for (i = 0; i < ARRAY_SIZE(required_ops); ++i)
+            if (required_ops[i] > probe->last_op ||
+                !(probe->ops[required_ops[i]].flags & IO_URING_OP_SUPPORTED)) {
+                fprintf(stderr, "io_uring opcode %u is not supported\n", required_ops[i]);
+                break;
+            }
+
+        if (i < ARRAY_SIZE(required_ops))
+            break;
+
+        retval = 0;
+    } while (0);
+
+    free(probe);
+    return retval;
+}
+
+static struct io_uring_sqe* v4l2_uring_get_sqe(struct v4l2_uring_sink* sink)
+{
+    unsigned head = __atomic_load_n(sink->sq_head, __ATOMIC_ACQUIRE);
+    unsigned tail = sink->sq_local_tail;
+    struct io_uring_sqe* sqe;
+
+    if (tail - head >= sink->sq_entries) {
+        fprintf(stderr, "io_uring submission queue is full\n");
+        return NULL;
+    }
+
+    sqe = &sink->sqes[tail & *sink->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    sink->sq_array[tail & *sink->sq_mask] = tail & *sink->sq_mask;
+    sink->sq_local_tail = tail + 1;
+
+    return sqe;
+}
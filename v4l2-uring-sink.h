@@ -0,0 +1,119 @@
+/* SPDX-License-Identifier: MIT */
+/**
+ * @file v4l2-uring-sink.h
+ *
+ * io_uring based storage backend. Every frame is stored by a linked chain
+ * of openat -> write(s) -> close requests, all of them referring to
+ * a direct (registered) file descriptor, so no file descriptor ever
+ * appears in the process file table. Whenever possible capture buffers
+ * are registered as fixed buffers, so the kernel does not need to pin
+ * and unpin their pages for every write.
+ */
+
+#ifndef _V4L2_URING_SINK_H_
+#define _V4L2_URING_SINK_H_
+
+/*===========================================================================*\
+ * system header files
+\*===========================================================================*/
+#include <stdbool.h>
+#include <sys/uio.h>
+
+#include <linux/videodev2.h>
+
+/*===========================================================================*\
+ * project header files
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * preprocessor #define constants and macros
+\*===========================================================================*/
+#define V4L2_URING_SINK_FILENAME_SIZE 256
+
+/*===========================================================================*\
+ * global type definitions
+\*===========================================================================*/
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+struct v4l2_uring_sink
+{
+    int ring_fd;
+
+    /* submission queue */
+    void* sq_ring;
+    size_t sq_ring_size;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned sq_entries;
+    unsigned sq_local_tail; /* prepared but not yet submitted entries end here */
+    struct io_uring_sqe* sqes;
+    size_t sqes_size;
+
+    /* completion queue */
+    void* cq_ring;
+    size_t cq_ring_size;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqes;
+
+    unsigned nbuffers;
+    unsigned nplanes;
+    bool fixed_buffers;
+    unsigned inflight;
+
+    struct {
+        unsigned pending; /* number of requests which have not completed yet */
+        int status;       /* first error reported for this frame */
+        char filename[V4L2_URING_SINK_FILENAME_SIZE];
+    } frames[VIDEO_MAX_FRAME];
+};
+
+/**
+ * Called for every frame whose all requests have completed.
+ * status is 0 on success or negative errno value of the first failed request.
+ */
+typedef void (*v4l2_uring_sink_done_t)(void* arg, unsigned index, int status);
+
+/*===========================================================================*\
+ * global object declarations
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * function forward declarations
+\*===========================================================================*/
+
+/**
+ * Sets up the ring. planes is an array of nbuffers * nplanes iovecs
+ * describing the capture buffers; they are registered as fixed buffers
+ * if the kernel allows it (e.g. it may refuse for PFN mapped buffers).
+ * If eventfd is not -1, it is signalled on every completion.
+ * Returns 0 on success, -1 if io_uring is not usable.
+ */
+int v4l2_uring_sink_open(struct v4l2_uring_sink* sink, int eventfd,
+    const struct iovec* planes, unsigned nbuffers, unsigned nplanes);
+
+void v4l2_uring_sink_close(struct v4l2_uring_sink* sink);
+
+/**
+ * Prepares (but does not submit) requests storing iovcnt planes
+ * of buffer 'index' into a file named 'filename'.
+ */
+int v4l2_uring_sink_store(struct v4l2_uring_sink* sink, unsigned index,
+    const char* filename, const struct iovec* iov, size_t iovcnt);
+
+/** Submits all prepared requests with a single io_uring_enter() call */
+int v4l2_uring_sink_submit(struct v4l2_uring_sink* sink);
+
+/** Consumes all available completions without blocking */
+int v4l2_uring_sink_reap(struct v4l2_uring_sink* sink, v4l2_uring_sink_done_t done, void* arg);
+
+static inline unsigned v4l2_uring_sink_inflight(const struct v4l2_uring_sink* sink)
+{
+    return sink->inflight;
+}
+
+#endif /* _V4L2_URING_SINK_H_ */
@@ -23,57 +23,223 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <limits.h>
+#include <time.h>
+#include <signal.h>
 
 #include <sys/ioctl.h>
-#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
 
 #include <linux/videodev2.h>
-#include <linux/udmabuf.h>
 
 /*===========================================================================*\
  * project header files
 \*===========================================================================*/
+#include "v4l2-index-queue.h"
+#include "v4l2-uring-sink.h"
+#include "v4l2-segment.h"
+#include "v4l2-mmap-segment.h"
+#include "v4l2-event-loop.h"
+#include "v4l2-aligner.h"
+#include "v4l2-histogram.h"
+#include "v4l2-telemetry.h"
+#include "v4l2-caps-cache.h"
+#include "v4l2-negotiate.h"
+#include "v4l2-hugepage.h"
+#include "v4l2-dmabuf.h"
+#include "v4l2-sched.h"
+#include "v4l2-frame-server.h"
+#include "v4l2-shm-ring.h"
+#include "v4l2-convert.h"
+#include "v4l2-worker-pool.h"
+#include "v4l2-pretrigger.h"
+#include "v4l2-sink.h"
+#include "v4l2-capture.h"
 
 /*===========================================================================*\
  * preprocessor #define constants and macros
 \*===========================================================================*/
-#define SELECT_TIMEOUT_SEC 1
 #define ARRAY_SIZE(arr) (sizeof(arr) / sizeof(arr[0]))
-#define MEMFD_FILE_NAME "dmabuf"
-#define UDMABUF_DEVICE_NAME "/dev/udmabuf"
-#define IS_POWER_OF_TWO(x) (((x) & ((x) - 1)) == 0)
-#define ALIGN(x, a) __ALIGN(x, (a) - 1)
-#define __ALIGN(x, mask) (((x) + (mask)) & ~(mask))
+#define NSEC_PER_SEC 1000000000ULL
+#define DEFAULT_SEGMENT_SIZE_MIB 1024
+#define DEFAULT_TIMEOUT_MS 1000     /* until the first frame arrives or if frame interval is unknown */
+#define TIMEOUT_FRAME_INTERVALS 4   /* missing frames tolerated before a timeout is reported */
+#define DEFAULT_ALIGN_TOLERANCE_US 5000 /* used if frame intervals are unknown */
 
 /*===========================================================================*\
  * local type definitions
 \*===========================================================================*/
-struct v4l2_buffer_descriptor
-{
-    unsigned index;
-    unsigned nplanes;
-    struct {
-        void* addr;
-        size_t size;
-        int fd;
-    } planes[VIDEO_MAX_PLANES];
-};
-
 enum v4l2_buffer_sharing_mode
 {
     V4L2_BUFFER_SHARING_MODE_MMAP,
     V4L2_BUFFER_SHARING_MODE_DMA
 };
 
+enum v4l2_storage_mode
+{
+    V4L2_STORAGE_MODE_FILE,  /* synchronous open/write/close */
+    V4L2_STORAGE_MODE_URING, /* batched io_uring submissions */
+    V4L2_STORAGE_MODE_SEGMENT, /* frames appended to indexed segment files */
+    V4L2_STORAGE_MODE_MMAP,    /* USERPTR buffers are windows of mapped segment files */
+};
+
+/* values of long only options, outside of the range of short ones */
+enum v4l2_long_option
+{
+    V4L2_OPTION_SEGMENT_SIZE = 0x100,
+    V4L2_OPTION_SEGMENT_DURATION,
+    V4L2_OPTION_ALIGN_TOLERANCE,
+    V4L2_OPTION_LATENCY_HISTOGRAM,
+    V4L2_OPTION_TELEMETRY,
+    V4L2_OPTION_TELEMETRY_FORMAT,
+    V4L2_OPTION_TELEMETRY_INTERVAL,
+    V4L2_OPTION_CAPABILITY_CACHE,
+    V4L2_OPTION_FAST_START,
+    V4L2_OPTION_FORMAT,
+    V4L2_OPTION_SIZE,
+    V4L2_OPTION_FPS,
+    V4L2_OPTION_BUS_BANDWIDTH,
+    V4L2_OPTION_BUFFER_BUDGET,
+    V4L2_OPTION_BUFFER_WATERMARKS,
+    V4L2_OPTION_HUGEPAGES,
+    V4L2_OPTION_DMABUF_ALLOCATOR,
+    V4L2_OPTION_CAPTURE_CPUS,
+    V4L2_OPTION_WRITER_CPUS,
+    V4L2_OPTION_SCHED_FIFO,
+    V4L2_OPTION_NUMA_NODE,
+    V4L2_OPTION_FRAME_SERVER,
+    V4L2_OPTION_SHM_RING,
+    V4L2_OPTION_SHM_RING_FOLLOW,
+    V4L2_OPTION_SHM_RING_SELFTEST,
+    V4L2_OPTION_CONVERT,
+    V4L2_OPTION_CONVERT_SELFTEST,
+    V4L2_OPTION_CONVERT_THREADS,
+    V4L2_OPTION_PRE_TRIGGER,
+    V4L2_OPTION_POST_TRIGGER,
+    V4L2_OPTION_TRIGGER_SOCKET,
+    V4L2_OPTION_TRIGGER_ON_DROP,
+    V4L2_OPTION_DURATION,
+    V4L2_OPTION_SINK_POLICY,
+};
+
+/* intervals between the points in time recorded for every frame */
+enum v4l2_latency_stage
+{
+    V4L2_LATENCY_DRIVER_TO_DQBUF,  /* driver timestamp -> VIDIOC_DQBUF returned */
+    V4L2_LATENCY_DQBUF_TO_STORE,   /* VIDIOC_DQBUF returned -> writer started storing */
+    V4L2_LATENCY_STORE,            /* writer started storing -> frame written out */
+    V4L2_LATENCY_STORE_TO_QBUF,    /* frame written out -> VIDIOC_QBUF returned */
+    V4L2_LATENCY_DRIVER_TO_STORED, /* driver timestamp -> frame written out */
+    V4L2_LATENCY_STAGES
+};
+
 struct v4l2_iovec {
     void  *iov_base;
     size_t iov_len;
 };
 
+struct v4l2_frame {
+    unsigned index;
+    int counter;
+    uint32_t sequence;
+    uint32_t flags;
+    uint64_t timestamp; /* nanoseconds */
+    uint64_t dequeued;    /* CLOCK_MONOTONIC nanoseconds */
+    uint64_t store_start; /* CLOCK_MONOTONIC nanoseconds */
+    uint64_t store_done;  /* CLOCK_MONOTONIC nanoseconds */
+    struct v4l2_iovec iov[VIDEO_MAX_PLANES];
+    unsigned holds;       /* buffer goes back to the driver when everyone who took the frame released it */
+    struct v4l2_capture_frame borrowed; /* as borrowed from the capture, to give it back */
+};
+
 struct v4l2_selected_format {
     uint32_t pixelformat;
     uint32_t width;
     uint32_t height;
+    uint32_t bytesperline;          /* of the first plane, set by the driver */
+    struct v4l2_fract timeperframe; /* 0/0 leaves the frame interval to the driver */
+};
+
+struct v4l2_writer {
+    struct v4l2_sink sink;             /* the writer thread, in V4L2_STORAGE_MODE_URING its wakeup_fd
+                                          is signalled by io_uring on every completion as well */
+    enum v4l2_storage_mode storage;
+    struct v4l2_device* device;        /* owner of the frames being written */
+    struct v4l2_uring_sink uring;
+    struct v4l2_segment_writer segment;
+    struct v4l2_mmap_segment mmap;
+    uint32_t pixelformat;              /* of the stored frames, differs from the captured one if converting */
+    bool converting;
+    struct v4l2_convert convert;       /* used only if converting */
+    uint8_t* converted;                /* frame being stored, storage is synchronous if converting */
+    bool striped;                      /* frames are converted in stripes by the pool, writer thread included */
+    struct v4l2_worker_pool pool;      /* used only if striped */
+    unsigned stripe_rows;
+    uint8_t* scratch[V4L2_WORKER_POOL_MAX_WORKERS]; /* of every worker of the pool */
+    const struct iovec* source;        /* planes of the frame being converted in stripes */
+    bool pretriggering;                /* frames are kept in memory until the trigger fires */
+    struct v4l2_pretrigger_ring pretrigger; /* used only if pretriggering */
+    uint64_t triggers_seen;            /* trigger requests handled so far */
+    uint64_t recording_until;          /* CLOCK_MONOTONIC nanoseconds, frames dequeued before are stored */
+    uint64_t triggers;                 /* handled, firing while recording only extends the recording */
+    uint64_t recorded;                 /* frames stored after triggers */
+};
+
+/* reasons for frames not making it to the storage, updated by the capture thread only */
+struct v4l2_drop_stats {
+    uint64_t lost;         /* frames missing from the sequence */
+    uint64_t lost_starved; /* ... out of them lost while the driver queue was empty */
+    uint64_t gaps;         /* discontinuities of the sequence */
+    uint64_t erroneous;    /* frames flagged with V4L2_BUF_FLAG_ERROR */
+    uint64_t timeouts;     /* waits for a frame which timed out */
+    uint64_t starvations;  /* times all buffers were held by userspace */
+    uint64_t starved_ns;   /* total time all buffers were held by userspace */
+};
+
+/* everything needed to capture from one device, owned by its capture thread */
+struct v4l2_device {
+    unsigned id;                /* position on the command line */
+    const char* filename;
+    char directory[PATH_MAX];   /* where frames of this device are stored */
+    int fd;                     /* owned by capture once it is attached */
+    enum v4l2_buf_type buf_type;
+    enum v4l2_memory memory;
+    struct v4l2_capture* capture; /* the device and its buffers, see v4l2-capture.h */
+    int initial_buffers;        /* allocated by VIDIOC_REQBUFS */
+    size_t buffer_size;         /* bytes of all planes of one buffer */
+    int number_of_frames;       /* 0 if not limited */
+    uint64_t duration;          /* nanoseconds of capturing, 0 if not limited */
+    uint64_t deadline;          /* CLOCK_MONOTONIC nanoseconds capturing stops at, 0 if none */
+    uint64_t frame_interval;    /* nanoseconds, 0 if unknown */
+    int timeout;                /* milliseconds */
+    struct v4l2_selected_format selected_format;
+    struct v4l2_frame* frames;
+    uint64_t dequeued;          /* CLOCK_MONOTONIC nanoseconds of the last VIDIOC_DQBUF */
+    struct v4l2_writer writer;
+    struct v4l2_event_loop events;
+    int captured;
+    pthread_t thread;
+    int retval;
+    struct v4l2_histogram latency[V4L2_LATENCY_STAGES]; /* updated by the capture thread only */
+    int queued;                 /* buffers owned by the driver */
+    bool sequence_valid;
+    uint32_t last_sequence;
+    bool starved;               /* driver queue ran empty since the last dequeued frame */
+    uint64_t starved_since;     /* CLOCK_MONOTONIC nanoseconds, 0 if the queue is not empty */
+    struct v4l2_drop_stats drops;
+    struct v4l2_telemetry_counters telemetry; /* published copy of the above, see v4l2-telemetry.h */
+    int low_watermark;          /* buffers are added when fewer than that are queued */
+    int high_watermark;         /* surplus buffers are parked when at least that many are queued */
+    struct v4l2_hugepage_stats hugepage_stats; /* of buffers allocated by us, if hugepages is set */
+    int numa_node;              /* buffers allocated by us are bound to, -1 if they are not */
+    struct v4l2_sched_stats capture_sched; /* of the capture thread, over its whole run */
+    struct v4l2_frame_server server;       /* used only if frame_server_path is set */
+    struct v4l2_shm_ring ring;             /* used only if shm_ring_name is set, written by the publisher */
+    struct v4l2_sink publisher;            /* used only if shm_ring_name is set */
 };
 
 /*===========================================================================*\
@@ -97,47 +263,179 @@ static void v4l2_print_format(const struct v4l2_format* format);
 static void v4l2_print_buffer(const struct v4l2_buffer* buffer);
 static void v4l2_print_control(int fd, const struct v4l2_query_ext_ctrl* qextctrl);
 
-static int v4l2_create_memory_fd(size_t size);
-static int v4l2_create_dmabuf_fd(int memfd, size_t size);
-static int v4l2_dma_alloc(size_t size, void **addr);
-
-static uint32_t v4l2_query_capabilities(int fd, uint32_t flags);
-static void v4l2_query_controls(int fd);
-static int v4l2_query_mmap_buffers(int fd, int number_of_buffers, enum v4l2_buf_type buf_type);
-static int v4l2_query_userptr_buffers(int fd, int number_of_buffers, enum v4l2_buf_type buf_type);
-static int v4l2_query_dma_buffers(int fd, int number_of_buffers, enum v4l2_buf_type buf_type);
-static int v4l2_query_buffers(int fd, int number_of_buffers, enum v4l2_buf_type buf_type, enum v4l2_memory memory);
-static int v4l2_queue_buffer(int fd, int index, enum v4l2_buf_type buf_type, enum v4l2_memory memory, int verbosity);
-static int v4l2_queue_buffers(int fd, int number_of_buffers, enum v4l2_buf_type buf_type, enum v4l2_memory memory);
-static int v4l2_capture_frame(int fd, struct v4l2_iovec *iov, size_t iovcnt, enum v4l2_buf_type buf_type, enum v4l2_memory memory);
-static void v4l2_store_frame(uint32_t fourcc, const struct v4l2_iovec *iov, size_t iovcnt, int counter);
-static int v4l2_video_capture(int fd, int number_of_frames, enum v4l2_buf_type buf_type, enum v4l2_memory memory);
+static uint32_t v4l2_query_capabilities(int fd, uint32_t flags, struct v4l2_selected_format* selected_format);
+static void v4l2_enumerate_formats(int fd, enum v4l2_buf_type buf_type, struct v4l2_caps_cache* cache);
+static void v4l2_enumerate_controls(int fd, struct v4l2_caps_cache* cache);
+static void v4l2_replay_capabilities(const struct v4l2_caps_cache* cache, int fd);
+static void v4l2_select_format(const struct v4l2_caps_cache* cache, uint32_t flags, struct v4l2_selected_format* selected_format);
+static int v4l2_prepare_buffer(void* arg, unsigned index, void** addrs);
+static int v4l2_grow_buffers(struct v4l2_device* dev);
+static int v4l2_dequeue_frame(struct v4l2_device* dev, struct v4l2_frame* frame);
+static int v4l2_frame_filename(char* buf, size_t size, const char* directory, uint32_t fourcc, int counter);
+static void v4l2_store_frame(const char* directory, uint32_t fourcc, const struct v4l2_iovec *iov, size_t iovcnt, int counter);
+static void v4l2_writer_finish(struct v4l2_writer* w, unsigned index);
+static void v4l2_writer_complete(void* arg, unsigned index, int status);
+static bool v4l2_writer_store(void* arg, unsigned index);
+static unsigned v4l2_writer_poll(void* arg);
+static void v4l2_writer_init(struct v4l2_writer* w, struct v4l2_device* dev, enum v4l2_storage_mode storage, uint64_t max_size, uint64_t max_duration);
+static void v4l2_writer_start_pool(struct v4l2_writer* w, unsigned number_of_workers);
+static void v4l2_writer_convert_stripe(void* arg, unsigned worker, unsigned first_row, unsigned last_row);
+static void v4l2_writer_write(struct v4l2_writer* w, int counter, uint32_t sequence, uint32_t flags,
+    uint64_t timestamp, const struct iovec* iov, size_t iovcnt);
+static void v4l2_writer_flush_record(void* arg, const struct v4l2_pretrigger_record* record,
+    struct iovec* iov, size_t iovcnt);
+static bool v4l2_writer_triggered(struct v4l2_writer* w, const struct v4l2_frame* frame);
+static int v4l2_writer_start(struct v4l2_writer* w, int number_of_buffers);
+static void v4l2_writer_stop(struct v4l2_writer* w);
+static int v4l2_release_buffer(struct v4l2_device* dev, unsigned index);
+static int v4l2_reclaim_buffers(struct v4l2_device* dev, struct v4l2_sink* sink);
+static uint64_t v4l2_query_frame_interval(struct v4l2_device* dev);
+static void v4l2_set_frame_interval(struct v4l2_device* dev);
+static int v4l2_open_device(struct v4l2_device* dev, int number_of_buffers, bool use_compressed_formats,
+    enum v4l2_storage_mode storage, uint64_t max_size, uint64_t max_duration);
+static FILE* v4l2_open_aligner(uint64_t tolerance);
+static void v4l2_emit_frames(void* arg, const struct v4l2_aligner_entry* entries, unsigned count);
+static void v4l2_hand_over_frame(struct v4l2_device* dev, unsigned index);
+static int v4l2_on_device_ready(void* arg, int fd, uint32_t events);
+static int v4l2_on_writer_completion(void* arg, int fd, uint32_t events);
+static int v4l2_on_frame_released(void* arg, unsigned index);
+static int v4l2_serve_buffer(struct v4l2_device* dev, unsigned index);
+static unsigned v4l2_publish_frame(struct v4l2_device* dev, const struct v4l2_frame* frame);
+static int v4l2_start_frame_server(struct v4l2_device* dev);
+static int v4l2_create_shm_ring(struct v4l2_device* dev);
+static int v4l2_follow_shm_ring(const char* name);
+static int v4l2_offer_frame(struct v4l2_device* dev, struct v4l2_sink* sink, unsigned index);
+static bool v4l2_publish_to_ring(void* arg, unsigned index);
+static int v4l2_on_publisher_completion(void* arg, int fd, uint32_t events);
+static int v4l2_start_publisher(struct v4l2_device* dev);
+static int v4l2_start_capture(struct v4l2_device* dev);
+static void* v4l2_capture_thread(void* arg);
+static int v4l2_stop_capture(struct v4l2_device* dev);
+static int v4l2_video_capture(void);
+static void v4l2_record_latency(struct v4l2_device* dev, const struct v4l2_frame* frame, uint64_t requeued);
+static void v4l2_print_latency(const struct v4l2_device* dev);
+static int v4l2_dump_latency(const char* filename);
+static void v4l2_account_dequeue(void* arg, const struct v4l2_buffer* buffer);
+static void v4l2_account_queue(void* arg, const struct v4l2_buffer* buffer);
+static void v4l2_print_drops(const struct v4l2_device* dev);
+static void v4l2_print_scheduling(const struct v4l2_device* dev);
+static int v4l2_start_telemetry(void);
 
 /*===========================================================================*\
  * local object definitions
 \*===========================================================================*/
 static const char* output_directory;
-static struct v4l2_selected_format selected_format;
-static struct v4l2_buffer_descriptor* buffer_descriptors;
+static struct v4l2_device* devices;
+static int number_of_devices;
+static struct v4l2_aligner aligner; /* used only if there is more than one device */
+static struct v4l2_telemetry telemetry; /* used only if telemetry_filename is set */
+static const char* latency_histogram_filename;
+static const char* telemetry_filename;
+static enum v4l2_telemetry_format telemetry_format = V4L2_TELEMETRY_FORMAT_JSON;
+static int telemetry_interval = V4L2_TELEMETRY_DEFAULT_INTERVAL_MS;
+static int verbosity;
+static const char* capability_cache_directory; /* enumeration results are not stored if NULL */
+static bool fast_start;
+static uint32_t requested_pixelformat; /* 0 if not given */
+static bool auto_format;
+static struct v4l2_format_target format_target = { .bus_bandwidth = -1 }; /* negative: guessed from bus_info */
+static uint64_t buffer_budget; /* bytes, 0: the pool never grows */
+static int low_watermark;      /* 0: half of the initial buffers */
+static int high_watermark;     /* 0: all of the initial buffers */
+static bool hugepages;         /* USERPTR and DMABUF buffers are huge page backed, prefaulted and locked */
+static enum v4l2_dmabuf_source dmabuf_source = V4L2_DMABUF_SOURCE_AUTO;
+static const char* dmabuf_heap; /* NULL: V4L2_DMABUF_DEFAULT_HEAP */
+static cpu_set_t capture_cpus;
+static bool capture_cpus_set;  /* capture threads are pinned to capture_cpus */
+static cpu_set_t writer_cpus;
+static bool writer_cpus_set;   /* writer threads are pinned to writer_cpus */
+static int fifo_priority;      /* SCHED_FIFO priority of capture threads, 0: SCHED_OTHER */
+static int numa_node = -1;     /* buffers are bound to, -1: not bound */
+static bool numa_auto;         /* buffers are bound to the node of their device */
+static const char* frame_server_path; /* buffers are not shared with other processes if NULL */
+static const char* shm_ring_name;     /* frames are not published to shared memory if NULL */
+static unsigned shm_ring_slots = V4L2_SHM_RING_DEFAULT_SLOTS;
+static enum v4l2_sink_policy shm_ring_policy = V4L2_SINK_DROP_OLD; /* readers want the newest frame */
+static unsigned shm_ring_max_held;    /* 0: V4L2_SINK_DEFAULT_MAX_HELD */
+static enum v4l2_sink_policy writer_policy = V4L2_SINK_KEEP_ALL;
+static unsigned writer_max_held;      /* 0: V4L2_SINK_DEFAULT_MAX_HELD */
+static uint32_t convert_pixelformat;  /* frames are stored as captured if 0 */
+static unsigned convert_threads = 1;  /* converting each frame, writer thread included */
+static uint64_t pretrigger_window;    /* nanoseconds, frames are stored continuously if 0 */
+static uint64_t pretrigger_budget = (uint64_t)V4L2_PRETRIGGER_DEFAULT_BUDGET_MIB << 20;
+static int64_t posttrigger_window = -1; /* nanoseconds, negative: as long as pretrigger_window */
+static const char* trigger_socket_path; /* NULL: trigger fired by SIGUSR1 only */
+static bool trigger_on_drop;          /* lost and erroneous frames fire the trigger */
+static struct v4l2_trigger trigger;   /* used only if pretrigger_window is set */
+static struct v4l2_trigger shutdown_request; /* fired by SIGINT and SIGTERM */
 static enum v4l2_buffer_sharing_mode buffer_sharing_mode = V4L2_BUFFER_SHARING_MODE_DMA;
 
+/* names of the latency stages in the telemetry records */
+static const char* latency_stage_keys[] = {
+    [V4L2_LATENCY_DRIVER_TO_DQBUF]  = "driver_to_dqbuf",
+    [V4L2_LATENCY_DQBUF_TO_STORE]   = "dqbuf_to_store",
+    [V4L2_LATENCY_STORE]            = "store",
+    [V4L2_LATENCY_STORE_TO_QBUF]    = "store_to_qbuf",
+    [V4L2_LATENCY_DRIVER_TO_STORED] = "driver_to_stored",
+};
+
 /*===========================================================================*\
  * inline function definitions
 \*===========================================================================*/
+static inline uint64_t v4l2_monotonic_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static inline size_t v4l2_frame_size(const struct v4l2_frame* frame)
+{
+    size_t size = 0;
+    unsigned plane;
+
+    for (plane = 0; plane < ARRAY_SIZE(frame->iov); ++plane)
+        size += frame->iov[plane].iov_len;
+
+    return size;
+}
+
+/* false once the frame count or the deadline is reached, or a shutdown was requested */
+static inline bool v4l2_capturing(const struct v4l2_device* dev)
+{
+    if (dev->number_of_frames && dev->captured >= dev->number_of_frames)
+        return false;
+
+    if (dev->deadline && v4l2_monotonic_ns() >= dev->deadline)
+        return false;
+
+    return v4l2_trigger_requests(&shutdown_request) == 0;
+}
+
+static inline void v4l2_record_stage(struct v4l2_device* dev, enum v4l2_latency_stage stage, uint64_t value)
+{
+    v4l2_histogram_record(&dev->latency[stage], value);
+    v4l2_telemetry_record(&dev->telemetry.stages[stage], value);
+}
 
 /*===========================================================================*\
  * public function definitions
 \*===========================================================================*/
 int main(int argc, char *argv[])
 {
-    int fd;
-    uint32_t capabilities;
     int number_of_frames = 1;
+    uint64_t duration = 0;
     int number_of_buffers = 1;
     enum v4l2_memory memory = V4L2_MEMORY_MMAP;
+    enum v4l2_storage_mode storage = V4L2_STORAGE_MODE_FILE;
+    uint64_t segment_size = DEFAULT_SEGMENT_SIZE_MIB;
+    uint64_t segment_duration = 0;
+    uint64_t align_tolerance = 0;
     bool use_compressed_formats = false;
-    enum v4l2_buf_type buf_type;
-    struct v4l2_format format;
+    FILE* groups = NULL;
+    int i;
 
     static struct option long_options[] = {
         {"number-of-frames",       required_argument, 0, 'n'},
@@ -145,11 +443,47 @@ int main(int argc, char *argv[])
         {"memory",                 required_argument, 0, 'm'},
         {"use-compressed-formats", no_argument,       0, 'c'},
         {"output-directory",       required_argument, 0, 'o'},
+        {"storage",                required_argument, 0, 's'},
+        {"segment-size",           required_argument, 0, V4L2_OPTION_SEGMENT_SIZE},
+        {"segment-duration",       required_argument, 0, V4L2_OPTION_SEGMENT_DURATION},
+        {"align-tolerance",        required_argument, 0, V4L2_OPTION_ALIGN_TOLERANCE},
+        {"latency-histogram",      required_argument, 0, V4L2_OPTION_LATENCY_HISTOGRAM},
+        {"telemetry",              required_argument, 0, V4L2_OPTION_TELEMETRY},
+        {"telemetry-format",       required_argument, 0, V4L2_OPTION_TELEMETRY_FORMAT},
+        {"telemetry-interval",     required_argument, 0, V4L2_OPTION_TELEMETRY_INTERVAL},
+        {"verbose",                no_argument,       0, 'v'},
+        {"capability-cache",       required_argument, 0, V4L2_OPTION_CAPABILITY_CACHE},
+        {"fast-start",             no_argument,       0, V4L2_OPTION_FAST_START},
+        {"format",                 required_argument, 0, V4L2_OPTION_FORMAT},
+        {"size",                   required_argument, 0, V4L2_OPTION_SIZE},
+        {"fps",                    required_argument, 0, V4L2_OPTION_FPS},
+        {"bus-bandwidth",          required_argument, 0, V4L2_OPTION_BUS_BANDWIDTH},
+        {"buffer-budget",          required_argument, 0, V4L2_OPTION_BUFFER_BUDGET},
+        {"buffer-watermarks",      required_argument, 0, V4L2_OPTION_BUFFER_WATERMARKS},
+        {"hugepages",              no_argument,       0, V4L2_OPTION_HUGEPAGES},
+        {"dmabuf-allocator",       required_argument, 0, V4L2_OPTION_DMABUF_ALLOCATOR},
+        {"capture-cpus",           required_argument, 0, V4L2_OPTION_CAPTURE_CPUS},
+        {"writer-cpus",            required_argument, 0, V4L2_OPTION_WRITER_CPUS},
+        {"sched-fifo",             required_argument, 0, V4L2_OPTION_SCHED_FIFO},
+        {"numa-node",              required_argument, 0, V4L2_OPTION_NUMA_NODE},
+        {"frame-server",           required_argument, 0, V4L2_OPTION_FRAME_SERVER},
+        {"shm-ring",               required_argument, 0, V4L2_OPTION_SHM_RING},
+        {"shm-ring-follow",        required_argument, 0, V4L2_OPTION_SHM_RING_FOLLOW},
+        {"shm-ring-selftest",      no_argument,       0, V4L2_OPTION_SHM_RING_SELFTEST},
+        {"convert",                required_argument, 0, V4L2_OPTION_CONVERT},
+        {"convert-selftest",       no_argument,       0, V4L2_OPTION_CONVERT_SELFTEST},
+        {"convert-threads",        required_argument, 0, V4L2_OPTION_CONVERT_THREADS},
+        {"pre-trigger",            required_argument, 0, V4L2_OPTION_PRE_TRIGGER},
+        {"post-trigger",           required_argument, 0, V4L2_OPTION_POST_TRIGGER},
+        {"trigger-socket",         required_argument, 0, V4L2_OPTION_TRIGGER_SOCKET},
+        {"trigger-on-drop",        no_argument,       0, V4L2_OPTION_TRIGGER_ON_DROP},
+        {"duration",               required_argument, 0, V4L2_OPTION_DURATION},
+        {"sink-policy",            required_argument, 0, V4L2_OPTION_SINK_POLICY},
         {0, 0, 0, 0}
     };
 
     for (;;) {
-        int c = getopt_long(argc, argv, "n:b:m:co:", long_options, 0);
+        int c = getopt_long(argc, argv, "n:b:m:co:s:v", long_options, 0);
         if (-1 == c)
             break;
 
@@ -185,100 +519,433 @@ int main(int argc, char *argv[])
                 output_directory = optarg;
                 break;
 
+            case 's':
+                if (strcmp(optarg, "file") == 0) {
+                    storage = V4L2_STORAGE_MODE_FILE;
+                } else
+                if (strcmp(optarg, "uring") == 0) {
+                    storage = V4L2_STORAGE_MODE_URING;
+                } else
+                if (strcmp(optarg, "segment") == 0) {
+                    storage = V4L2_STORAGE_MODE_SEGMENT;
+                } else
+                if (strcmp(optarg, "mmap") == 0) {
+                    storage = V4L2_STORAGE_MODE_MMAP;
+                } else {
+                    /* use default value */
+                    storage = V4L2_STORAGE_MODE_FILE;
+                }
+                break;
+
+            case V4L2_OPTION_SEGMENT_SIZE:
+                segment_size = strtoull(optarg, NULL, 0);
+                break;
+
+            case V4L2_OPTION_SEGMENT_DURATION:
+                segment_duration = strtoull(optarg, NULL, 0);
+                break;
+
+            case V4L2_OPTION_ALIGN_TOLERANCE:
+                align_tolerance = strtoull(optarg, NULL, 0);
+                break;
+
+            case V4L2_OPTION_LATENCY_HISTOGRAM:
+                latency_histogram_filename = optarg;
+                break;
+
+            case V4L2_OPTION_TELEMETRY:
+                telemetry_filename = optarg;
+                break;
+
+            case V4L2_OPTION_TELEMETRY_FORMAT:
+                if (strcmp(optarg, "prometheus") == 0) {
+                    telemetry_format = V4L2_TELEMETRY_FORMAT_PROMETHEUS;
+                } else {
+                    /* use default value */
+                    telemetry_format = V4L2_TELEMETRY_FORMAT_JSON;
+                }
+                break;
+
+            case V4L2_OPTION_TELEMETRY_INTERVAL:
+                telemetry_interval = atoi(optarg);
+                break;
+
+            case 'v':
+                verbosity++;
+                break;
+
+            case V4L2_OPTION_CAPABILITY_CACHE:
+                capability_cache_directory = optarg;
+                break;
+
+            case V4L2_OPTION_FAST_START:
+                fast_start = true;
+                break;
+
+            case V4L2_OPTION_FORMAT:
+                if (strcmp(optarg, "auto") == 0) {
+                    auto_format = true;
+                } else {
+                    char fourcc[4] = {' ', ' ', ' ', ' '};
+                    memcpy(fourcc, optarg, strnlen(optarg, sizeof(fourcc)));
+                    requested_pixelformat = v4l2_fourcc(fourcc[0], fourcc[1], fourcc[2], fourcc[3]);
+                    auto_format = false;
+                }
+                break;
+
+            case V4L2_OPTION_SIZE:
+                if (2 != sscanf(optarg, "%ux%u", &format_target.width, &format_target.height)) {
+                    /* use default value */
+                    format_target.width = 0;
+                    format_target.height = 0;
+                }
+                break;
+
+            case V4L2_OPTION_FPS:
+                format_target.fps = strtod(optarg, NULL);
+                break;
+
+            case V4L2_OPTION_BUS_BANDWIDTH:
+                format_target.bus_bandwidth = strtod(optarg, NULL) * 1e6;
+                break;
+
+            case V4L2_OPTION_BUFFER_BUDGET:
+                buffer_budget = strtoull(optarg, NULL, 0) << 20;
+                break;
+
+            case V4L2_OPTION_BUFFER_WATERMARKS:
+                low_watermark = 0;
+                high_watermark = 0;
+                if (sscanf(optarg, "%d,%d", &low_watermark, &high_watermark) < 1) {
+                    /* use default values */
+                    low_watermark = 0;
+                    high_watermark = 0;
+                }
+                break;
+
+            case V4L2_OPTION_HUGEPAGES:
+                hugepages = true;
+                break;
+
+            case V4L2_OPTION_DMABUF_ALLOCATOR:
+                if (strcmp(optarg, "udmabuf") == 0) {
+                    dmabuf_source = V4L2_DMABUF_SOURCE_UDMABUF;
+                } else
+                if (strcmp(optarg, "heap") == 0) {
+                    dmabuf_source = V4L2_DMABUF_SOURCE_HEAP;
+                    dmabuf_heap = NULL;
+                } else
+                if (strncmp(optarg, "heap:", 5) == 0) {
+                    dmabuf_source = V4L2_DMABUF_SOURCE_HEAP;
+                    dmabuf_heap = optarg + 5;
+                } else {
+                    /* use default value */
+                    dmabuf_source = V4L2_DMABUF_SOURCE_AUTO;
+                }
+                break;
+
+            case V4L2_OPTION_CAPTURE_CPUS:
+                capture_cpus_set = (0 == v4l2_sched_parse_cpus(optarg, &capture_cpus));
+                if (!capture_cpus_set)
+                    fprintf(stderr, "invalid list of cpus '%s', capture threads are not pinned\n", optarg);
+                break;
+
+            case V4L2_OPTION_WRITER_CPUS:
+                writer_cpus_set = (0 == v4l2_sched_parse_cpus(optarg, &writer_cpus));
+                if (!writer_cpus_set)
+                    fprintf(stderr, "invalid list of cpus '%s', writer threads are not pinned\n", optarg);
+                break;
+
+            case V4L2_OPTION_SCHED_FIFO:
+                fifo_priority = atoi(optarg);
+                break;
+
+            case V4L2_OPTION_NUMA_NODE:
+                if (strcmp(optarg, "auto") == 0) {
+                    numa_auto = true;
+                    numa_node = -1;
+                } else {
+                    numa_auto = false;
+                    numa_node = atoi(optarg);
+                }
+                break;
+
+            case V4L2_OPTION_FRAME_SERVER:
+                frame_server_path = optarg;
+                break;
+
+            case V4L2_OPTION_SHM_RING: {
+                char* slots = strchr(optarg, ',');
+                shm_ring_slots = V4L2_SHM_RING_DEFAULT_SLOTS;
+                if (slots) {
+                    *slots++ = '\0';
+                    if (atoi(slots) >= 2)
+                        shm_ring_slots = atoi(slots);
+                }
+                shm_ring_name = optarg;
+                break;
+            }
+
+            case V4L2_OPTION_CONVERT: {
+                char fourcc[4] = {' ', ' ', ' ', ' '};
+                memcpy(fourcc, optarg, strnlen(optarg, sizeof(fourcc)));
+                convert_pixelformat = v4l2_fourcc(fourcc[0], fourcc[1], fourcc[2], fourcc[3]);
+                break;
+            }
+
+            case V4L2_OPTION_CONVERT_SELFTEST:
+                exit(v4l2_convert_selftest() ? EXIT_FAILURE : EXIT_SUCCESS);
+
+            case V4L2_OPTION_SHM_RING_FOLLOW:
+                exit(v4l2_follow_shm_ring(optarg) ? EXIT_FAILURE : EXIT_SUCCESS);
+
+            case V4L2_OPTION_SHM_RING_SELFTEST:
+                exit(v4l2_shm_ring_selftest() ? EXIT_FAILURE : EXIT_SUCCESS);
+
+            case V4L2_OPTION_CONVERT_THREADS:
+                convert_threads = atoi(optarg);
+                break;
+
+            case V4L2_OPTION_PRE_TRIGGER: {
+                char* budget = strchr(optarg, ',');
+                pretrigger_budget = (uint64_t)V4L2_PRETRIGGER_DEFAULT_BUDGET_MIB << 20;
+                if (budget) {
+                    *budget++ = '\0';
+                    if (atoi(budget) > 0)
+                        pretrigger_budget = (uint64_t)atoi(budget) << 20;
+                }
+                pretrigger_window = atof(optarg) > 0 ? (uint64_t)(atof(optarg) * NSEC_PER_SEC) : 0;
+                break;
+            }
+
+            case V4L2_OPTION_POST_TRIGGER:
+                posttrigger_window = atof(optarg) >= 0 ? (int64_t)(atof(optarg) * NSEC_PER_SEC) : -1;
+                break;
+
+            case V4L2_OPTION_TRIGGER_SOCKET:
+                trigger_socket_path = optarg;
+                break;
+
+            case V4L2_OPTION_TRIGGER_ON_DROP:
+                trigger_on_drop = true;
+                break;
+
+            case V4L2_OPTION_DURATION:
+                duration = atof(optarg) > 0 ? (uint64_t)(atof(optarg) * NSEC_PER_SEC) : 0;
+                break;
+
+            case V4L2_OPTION_SINK_POLICY: {
+                char* policy_name = strchr(optarg, ':');
+                char* frames = policy_name ? strchr(policy_name, ',') : NULL;
+                enum v4l2_sink_policy policy;
+                unsigned max_held = 0;
+                if (frames) {
+                    *frames++ = '\0';
+                    if (atoi(frames) > 0)
+                        max_held = atoi(frames);
+                }
+                if (policy_name)
+                    *policy_name++ = '\0';
+                if (policy_name == NULL || v4l2_sink_policy_parse(policy_name, &policy))
+                    fprintf(stderr, "invalid sink policy '%s', ignored\n", policy_name ? policy_name : optarg);
+                else
+                if (strcmp(optarg, "writer") == 0) {
+                    writer_policy = policy;
+                    writer_max_held = max_held;
+                }
+                else
+                if (strcmp(optarg, "shm-ring") == 0) {
+                    shm_ring_policy = policy;
+                    shm_ring_max_held = max_held;
+                }
+                else
+                    fprintf(stderr, "unknown sink '%s', policy ignored\n", optarg);
+                break;
+            }
+
             default:
                 /* do nothing */
                 break;
         }
     }
 
-    if (number_of_frames < 1)
+    /* 0 stands for capturing until a signal (or --duration) stops it */
+    if (number_of_frames < 0)
         number_of_frames = 1;
 
     if (number_of_buffers < 1)
         number_of_buffers = 1;
 
+    if (number_of_buffers > VIDEO_MAX_FRAME)
+        number_of_buffers = VIDEO_MAX_FRAME;
+
+    if (telemetry_interval < 1)
+        telemetry_interval = V4L2_TELEMETRY_DEFAULT_INTERVAL_MS;
+
+    if (fast_start && capability_cache_directory == NULL) {
+        static char directory[PATH_MAX];
+        capability_cache_directory = v4l2_caps_cache_default_directory(directory, sizeof(directory));
+        if (capability_cache_directory == NULL)
+            fprintf(stderr, "no directory for capability cache, devices are enumerated every time\n");
+    }
+
     if (output_directory == NULL)
         output_directory = ".";
 
-    const char* filename = argv[optind];
-    if (!filename) {
-        fprintf(stderr, "device filename is not provided\n");
-        v4l2_print_usage(argv[0]);
-        exit(EXIT_FAILURE);
+    if (storage == V4L2_STORAGE_MODE_MMAP && memory == V4L2_MEMORY_USERPTR &&
+        v4l2_mmap_segment_check(output_directory)) {
+        fprintf(stderr, "mmap storage needs a directory on tmpfs, ramfs or hugetlbfs, whose pages a driver may pin "
+            "(%s is not), segment storage is used instead\n", output_directory);
+        storage = V4L2_STORAGE_MODE_SEGMENT;
     }
 
-    fd = open(filename, O_RDWR);
-    if (-1 == fd) {
-        fprintf(stderr, "cannot open '%s': %s\n", filename, strerror(errno));
-        v4l2_print_usage(argv[0]);
-        exit(EXIT_FAILURE);
+    if (hugepages && (memory == V4L2_MEMORY_MMAP || storage == V4L2_STORAGE_MODE_MMAP)) {
+        fprintf(stderr, "buffers are not allocated by us, --hugepages is ignored\n");
+        hugepages = false;
     }
 
-    memset(&selected_format, 0, sizeof(selected_format));
+    if (fifo_priority < 0 || fifo_priority > sched_get_priority_max(SCHED_FIFO)) {
+        fprintf(stderr, "SCHED_FIFO priority %d is out of range, capture threads are not real-time\n", fifo_priority);
+        fifo_priority = 0;
+    }
 
-    capabilities = v4l2_query_capabilities(fd, use_compressed_formats ? V4L2_FMT_FLAG_COMPRESSED : 0);
-    if (!(capabilities & (V4L2_CAP_VIDEO_CAPTURE | V4L2_CAP_VIDEO_CAPTURE_MPLANE)) ||
-        !(capabilities & V4L2_CAP_STREAMING)) {
-        fprintf(stderr, "%s doesn't support video capture or streaming\n", filename);
-        exit(EXIT_FAILURE);
+    if ((numa_auto || numa_node >= 0) && memory == V4L2_MEMORY_MMAP) {
+        fprintf(stderr, "buffers are not allocated by us, --numa-node is ignored\n");
+        numa_auto = false;
+        numa_node = -1;
     }
 
-    /*
-     * If driver supports multiplanar format (V4L2_CAP_VIDEO_CAPTURE_MPLANE),
-     * then prefer this one instead of single planar one (V4L2_CAP_VIDEO_CAPTURE)
-     */
-    buf_type =
-        capabilities & V4L2_CAP_VIDEO_CAPTURE_MPLANE ?
-        V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE : V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    if (frame_server_path && memory == V4L2_MEMORY_USERPTR) {
+        fprintf(stderr, "userptr buffers cannot be exported, --frame-server is ignored\n");
+        frame_server_path = NULL;
+    }
 
-    v4l2_query_controls(fd);
+    if (convert_threads < 1 || convert_threads > V4L2_WORKER_POOL_MAX_WORKERS) {
+        fprintf(stderr, "number of conversion threads is out of range, frames are converted by writer threads\n");
+        convert_threads = 1;
+    }
 
-    if (selected_format.pixelformat == 0) {
-        fprintf(stderr, "No frame format is selected for capturing\n");
-        exit(EXIT_FAILURE);
+    if (convert_pixelformat && (storage == V4L2_STORAGE_MODE_URING || storage == V4L2_STORAGE_MODE_MMAP)) {
+        fprintf(stderr, "%s storage writes frames straight from capture buffers, --convert is ignored\n",
+            storage == V4L2_STORAGE_MODE_URING ? "uring" : "mmap");
+        convert_pixelformat = 0;
     }
 
-    memset(&format, 0, sizeof(format));
-    format.type = buf_type;
-    if (V4L2_TYPE_IS_MULTIPLANAR(buf_type)) {
-        format.fmt.pix.pixelformat = selected_format.pixelformat;
-        format.fmt.pix.width = selected_format.width;
-        format.fmt.pix.height = selected_format.height;
-    } else {
-        format.fmt.pix_mp.pixelformat = selected_format.pixelformat;
-        format.fmt.pix_mp.width = selected_format.width;
-        format.fmt.pix_mp.height = selected_format.height;
+    if (pretrigger_window && (storage == V4L2_STORAGE_MODE_URING || storage == V4L2_STORAGE_MODE_MMAP)) {
+        fprintf(stderr, "%s storage writes frames straight from capture buffers, --pre-trigger is ignored\n",
+            storage == V4L2_STORAGE_MODE_URING ? "uring" : "mmap");
+        pretrigger_window = 0;
     }
 
-    if (-1 == ioctl(fd, VIDIOC_TRY_FMT, &format)) {
-        fprintf(stderr, "VIDIOC_TRY_FMT failed: %s\n", strerror(errno));
+    if ((trigger_socket_path || trigger_on_drop) && pretrigger_window == 0) {
+        fprintf(stderr, "frames are stored continuously, trigger options are ignored\n");
+        trigger_socket_path = NULL;
+        trigger_on_drop = false;
     }
 
-    fprintf(stdout, "Using following format:\n");
-    v4l2_print_format(&format);
+    if (posttrigger_window < 0)
+        posttrigger_window = pretrigger_window;
 
-    if (-1 == ioctl(fd, VIDIOC_S_FMT, &format)) {
-        fprintf(stderr, "VIDIOC_S_FMT failed: %s\n", strerror(errno));
+    if (buffer_budget && storage == V4L2_STORAGE_MODE_URING) {
+        fprintf(stderr, "buffers registered with io_uring cannot be added later, buffer budget is ignored\n");
+        buffer_budget = 0;
+    }
+
+    if (storage == V4L2_STORAGE_MODE_MMAP && memory != V4L2_MEMORY_USERPTR) {
+        fprintf(stderr, "mmap storage requires userptr memory\n");
+        v4l2_print_usage(argv[0]);
         exit(EXIT_FAILURE);
     }
 
-    number_of_buffers = v4l2_query_buffers(fd, number_of_buffers, buf_type, memory);
-    if (number_of_buffers < 0) {
-        fprintf(stderr, "v4l2_query_buffers() failed\n");
+    number_of_devices = argc - optind;
+    if (number_of_devices < 1) {
+        fprintf(stderr, "device filename is not provided\n");
+        v4l2_print_usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    /* before any thread is created, all of them have to leave SIGUSR1 to the trigger */
+    if (pretrigger_window) {
+        sigset_t signals;
+
+        sigemptyset(&signals);
+        sigaddset(&signals, SIGUSR1);
+        if (v4l2_trigger_open(&trigger, &signals, trigger_socket_path)) {
+            fprintf(stderr, "v4l2_trigger_open() failed\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    /* ... and SIGINT and SIGTERM to the capture loops, which stop and tear everything down */
+    {
+        sigset_t signals;
+
+        sigemptyset(&signals);
+        sigaddset(&signals, SIGINT);
+        sigaddset(&signals, SIGTERM);
+        if (v4l2_trigger_open(&shutdown_request, &signals, NULL)) {
+            fprintf(stderr, "v4l2_trigger_open() failed\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (number_of_devices > V4L2_ALIGNER_MAX_STREAMS) {
+        fprintf(stderr, "at most %d devices can be captured at once\n", V4L2_ALIGNER_MAX_STREAMS);
+        v4l2_print_usage(argv[0]);
         exit(EXIT_FAILURE);
     }
 
-    if (v4l2_queue_buffers(fd, number_of_buffers, buf_type, memory)) {
-        fprintf(stderr, "v4l2_queue_buffers() failed\n");
+    devices = calloc(number_of_devices, sizeof(*devices));
+    if (NULL == devices) {
+        fprintf(stderr, "calloc(%d, %zu) failed\n", number_of_devices, sizeof(*devices));
         exit(EXIT_FAILURE);
     }
 
-    if (v4l2_video_capture(fd, number_of_frames, buf_type, memory)) {
+    for (i = 0; i < number_of_devices; ++i) {
+        struct v4l2_device* dev = devices + i;
+
+        dev->id = i;
+        dev->filename = argv[optind + i];
+        dev->memory = memory;
+        dev->number_of_frames = number_of_frames;
+        dev->duration = duration;
+
+        if (v4l2_open_device(dev, number_of_buffers, use_compressed_formats,
+                storage, segment_size << 20, segment_duration * NSEC_PER_SEC)) {
+            v4l2_print_usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (number_of_devices > 1) {
+        groups = v4l2_open_aligner(align_tolerance * 1000);
+        if (NULL == groups)
+            exit(EXIT_FAILURE);
+    }
+
+    if (v4l2_video_capture()) {
         fprintf(stderr, "v4l2_capture_image() failed\n");
         exit(EXIT_FAILURE);
     }
 
-    close(fd);
+    if (groups) {
+        fclose(groups);
+        v4l2_aligner_destroy(&aligner);
+    }
+
+    for (i = 0; i < number_of_devices; ++i) {
+        v4l2_capture_close(devices[i].capture);
+        free(devices[i].frames);
+        if (shm_ring_name)
+            v4l2_shm_ring_destroy(&devices[i].ring);
+    }
+
+    if (pretrigger_window)
+        v4l2_trigger_close(&trigger);
+
+    v4l2_trigger_close(&shutdown_request);
+    free(devices);
+
     return 0;
 }
 
@@ -287,14 +954,86 @@ int main(int argc, char *argv[])
 \*===========================================================================*/
 static void v4l2_print_usage(const char* progname)
 {
-    fprintf(stdout, "usage: %s [-n <frames>] [-b <buffers>] [-m <memory>] [-c] [-o <output-directory>] <filename>\n", progname);
+    fprintf(stdout, "usage: %s [-n <frames>] [-b <buffers>] [-m <memory>] [-c] [-o <output-directory>] [-s <storage>] [--segment-size=<MiB>] [--segment-duration=<sec>] [--align-tolerance=<us>] [--latency-histogram=<file>] [--telemetry=<file>] [--telemetry-format=<format>] [--telemetry-interval=<ms>] [-v] [--capability-cache=<dir>] [--fast-start] [--format=<fourcc|auto>] [--size=<W>x<H>] [--fps=<fps>] [--bus-bandwidth=<MB/s>] [--buffer-budget=<MiB>] [--buffer-watermarks=<low>[,<high>]] [--hugepages] [--dmabuf-allocator=<allocator>] [--capture-cpus=<list>] [--writer-cpus=<list>] [--sched-fifo=<priority>] [--numa-node=<node|auto>] [--frame-server=<socket>] [--shm-ring=<name>[,<slots>]] [--shm-ring-follow=<name>] [--shm-ring-selftest] [--convert=<fourcc>] [--convert-selftest] [--convert-threads=<n>] [--pre-trigger=<sec>[,<MiB>]] [--post-trigger=<sec>] [--trigger-socket=<socket>] [--trigger-on-drop] [--duration=<sec>] [--sink-policy=<sink>:<policy>[,<frames>]] <filename> [<filename>...]\n", progname);
     fprintf(stdout, " options:\n");
-    fprintf(stdout, "  -n <frames>  --number-of-frames=<frames>   : number of frames to be captured (default: 1)\n");
+    fprintf(stdout, "  -n <frames>  --number-of-frames=<frames>   : number of frames to be captured (default: 1, 0: no limit)\n");
     fprintf(stdout, "  -b <buffers> --number-of-buffers=<buffers> : number of buffers to be allocated for capturing (default: 1)\n");
     fprintf(stdout, "  -m <memory>  --memory=<memory>             : memory allocation type {mmap, userptr, dmabuf} (default: mmap)\n");
     fprintf(stdout, "  -c --use-compressed-formats                : if set, capturing will search for compressed formats\n");
     fprintf(stdout, "  -o <dir> --output-directory=<dir>          : if set, specifies directory for captured frames\n");
-    fprintf(stdout, "  <filename>                                 : capturing device (e.g. /dev/video0)\n");
+    fprintf(stdout, "  -s <storage> --storage=<storage>           : how frames are written {file, uring, segment, mmap} (default: file)\n");
+    fprintf(stdout, "                                               mmap requires userptr memory, frames are captured directly into segment files\n");
+    fprintf(stdout, "                                               of an output directory on tmpfs, ramfs or hugetlbfs (e.g. /dev/shm), since the driver\n");
+    fprintf(stdout, "                                               pins pages of its buffers, which Linux 6.5 and later refuse for regular filesystems;\n");
+    fprintf(stdout, "                                               elsewhere segment storage is used instead\n");
+    fprintf(stdout, "  --segment-size=<MiB>                       : segment is closed when it would exceed given size (default: %d, 0: no limit)\n", DEFAULT_SEGMENT_SIZE_MIB);
+    fprintf(stdout, "  --segment-duration=<sec>                   : segment is closed when it spans given time (default: 0, no limit)\n");
+    fprintf(stdout, "  --align-tolerance=<us>                     : frames of different devices closer than that are grouped (default: half of frame interval)\n");
+    fprintf(stdout, "  --latency-histogram=<file>                 : if set, latency histograms of all stages are dumped to given file\n");
+    fprintf(stdout, "  --telemetry=<file>                         : if set, capture statistics are written to given file every interval ('-': stdout)\n");
+    fprintf(stdout, "  --telemetry-format=<format>                : format of the statistics {json, prometheus} (default: json)\n");
+    fprintf(stdout, "                                               json appends a line per interval, prometheus rewrites a textfile\n");
+    fprintf(stdout, "  --telemetry-interval=<ms>                  : how often the statistics are written (default: %d)\n", V4L2_TELEMETRY_DEFAULT_INTERVAL_MS);
+    fprintf(stdout, "  -v --verbose                               : print every dequeued buffer\n");
+    fprintf(stdout, "  --capability-cache=<dir>                   : if set, results of device enumeration are stored in given directory\n");
+    fprintf(stdout, "  --fast-start                               : skip enumeration of devices found in the capability cache\n");
+    fprintf(stdout, "                                               (default cache directory: $XDG_CACHE_HOME or ~/.cache)\n");
+    fprintf(stdout, "  --format=<fourcc>                          : capture in given format (e.g. YUYV, MJPG), overrides -c\n");
+    fprintf(stdout, "  --format=auto                              : choose format, size and frame rate which suit --size and --fps best\n");
+    fprintf(stdout, "                                               within the bus bandwidth and at lowest decoding cost\n");
+    fprintf(stdout, "  --size=<W>x<H>                             : frame size (default: first enumerated one)\n");
+    fprintf(stdout, "  --fps=<fps>                                : frame rate (default: chosen by the driver)\n");
+    fprintf(stdout, "  --bus-bandwidth=<MB/s>                     : bandwidth available to --format=auto (default: %.1f for USB devices, 0: unlimited)\n", V4L2_NEGOTIATE_USB2_BANDWIDTH / 1e6);
+    fprintf(stdout, "  --buffer-budget=<MiB>                      : if set, buffers are added by VIDIOC_CREATE_BUFS while the driver runs short of them,\n");
+    fprintf(stdout, "                                               as long as all of them fit into given size\n");
+    fprintf(stdout, "  --buffer-watermarks=<low>[,<high>]         : buffers are added when fewer than <low> are queued (default: half of -b)\n");
+    fprintf(stdout, "                                               and surplus ones put aside when <high> are queued (default: -b);\n");
+    fprintf(stdout, "                                               these are freed by VIDIOC_REMOVE_BUFS if the driver supports it (Linux 6.10),\n");
+    fprintf(stdout, "                                               otherwise they keep their memory and growth is permanent\n");
+    fprintf(stdout, "  --hugepages                                : userptr and dmabuf buffers are backed by huge pages (hugetlb or THP),\n");
+    fprintf(stdout, "                                               prefaulted and locked in memory\n");
+    fprintf(stdout, "  --dmabuf-allocator=<allocator>             : where dmabuf buffers come from {auto, heap, heap:<name>, udmabuf} (default: auto)\n");
+    fprintf(stdout, "                                               auto uses /dev/dma_heap/%s if available, /dev/udmabuf otherwise\n", V4L2_DMABUF_DEFAULT_HEAP);
+    fprintf(stdout, "  --capture-cpus=<list>                      : capture threads run only on given cpus (e.g. 2,3 or 0-3)\n");
+    fprintf(stdout, "  --writer-cpus=<list>                       : writer threads run only on given cpus\n");
+    fprintf(stdout, "  --sched-fifo=<priority>                    : capture threads run under SCHED_FIFO with given priority (default: 0, not real-time)\n");
+    fprintf(stdout, "  --numa-node=<node|auto>                    : userptr and dmabuf buffers are placed on given NUMA node,\n");
+    fprintf(stdout, "                                               auto uses the node the device is attached to\n");
+    fprintf(stdout, "  --frame-server=<socket>                    : mmap and dmabuf buffers are shared as dmabufs with consumers connecting to given\n");
+    fprintf(stdout, "                                               unix socket, a buffer is queued again once all of them released it\n");
+    fprintf(stdout, "                                               (with more than one device the socket of each of them is <socket>.camN)\n");
+    fprintf(stdout, "  --shm-ring=<name>[,<slots>]                : frames are copied to a ring of given number of slots (default: %d) in shared memory\n", V4L2_SHM_RING_DEFAULT_SLOTS);
+    fprintf(stdout, "                                               /dev/shm/<name>, which any number of local readers can follow (see v4l2-shm-ring.h)\n");
+    fprintf(stdout, "                                               (with more than one device the ring of each of them is <name>.camN)\n");
+    fprintf(stdout, "  --shm-ring-follow=<name>                   : follow a ring another instance publishes to, reporting frames read and overruns\n");
+    fprintf(stdout, "                                               every second, until the ring is closed\n");
+    fprintf(stdout, "  --shm-ring-selftest                        : check readers of a ring against its writer publishing as fast as possible and exit\n");
+    fprintf(stdout, "  --convert=<fourcc>                         : frames are stored converted to given format, supported conversions:\n");
+    fprintf(stdout, "                                               YUYV, UYVY -> NV12, YU12, GREY and NV12, NM12 -> RGB3, AR24\n");
+    fprintf(stdout, "                                               (file and segment storage only, shared memory ring gets captured frames)\n");
+    fprintf(stdout, "  --convert-threads=<n>                      : each frame is converted in row stripes by n threads, writer thread\n");
+    fprintf(stdout, "                                               included, which steal stripes from each other (default: 1)\n");
+    fprintf(stdout, "  --convert-selftest                         : check conversions in all instruction sets the cpu supports and exit\n");
+    fprintf(stdout, "  --pre-trigger=<sec>[,<MiB>]                : frames are not stored but kept in memory (default: %d MiB per device)\n", V4L2_PRETRIGGER_DEFAULT_BUDGET_MIB);
+    fprintf(stdout, "                                               for given number of seconds, until SIGUSR1 or another trigger fires;\n");
+    fprintf(stdout, "                                               frames kept are stored then, followed by frames of --post-trigger\n");
+    fprintf(stdout, "                                               (file and segment storage only)\n");
+    fprintf(stdout, "  --post-trigger=<sec>                       : frames are stored for given number of seconds after a trigger (default: as --pre-trigger)\n");
+    fprintf(stdout, "  --trigger-socket=<socket>                  : any datagram sent to given unix socket fires the trigger\n");
+    fprintf(stdout, "  --trigger-on-drop                          : lost and erroneous frames fire the trigger\n");
+    fprintf(stdout, "  --duration=<sec>                           : capturing stops after given number of seconds (default: 0, no limit)\n");
+    fprintf(stdout, "                                               or once -n frames are captured, whichever comes first;\n");
+    fprintf(stdout, "                                               SIGINT and SIGTERM stop it at any time, frames captured so far are stored\n");
+    fprintf(stdout, "                                               (for capturing around the clock use segment storage, which rotates files)\n");
+    fprintf(stdout, "  --sink-policy=<sink>:<policy>[,<frames>]   : what a sink which does not keep up does with new frames, so that it never\n");
+    fprintf(stdout, "                                               starves the driver of buffers; sinks: writer, shm-ring, policies:\n");
+    fprintf(stdout, "                                               keep (takes every frame, default of writer),\n");
+    fprintf(stdout, "                                               drop-new (skips frames while holding given number of them, default: %d),\n", V4L2_SINK_DEFAULT_MAX_HELD);
+    fprintf(stdout, "                                               drop-old (takes the newest frame only, default of shm-ring),\n");
+    fprintf(stdout, "                                               with mmap storage the writer keeps every frame\n");
+    fprintf(stdout, "                                               (frame server consumers skip frames once they hold half of the buffers)\n");
+    fprintf(stdout, "  <filename>                                 : capturing device (e.g. /dev/video0), with more than one device frames\n");
+    fprintf(stdout, "                                               of each of them go to <output-directory>/camN and groups to groups.txt\n");
 }
 
 static const char* v4l2_capabilities_to_string(char* buf, size_t size, uint32_t capabilities)
@@ -739,6 +1478,10 @@ static void v4l2_print_control(int fd, const struct v4l2_query_ext_ctrl* qextctr
         if ((qextctrl->flags & V4L2_CTRL_FLAG_WRITE_ONLY) || (qextctrl->type == V4L2_CTRL_TYPE_BUTTON))
             break;
 
+        /* descriptor comes from the capability cache, the value is not read to keep startup fast */
+        if (fd == -1)
+            break;
+
         memset(&extctrl, 0, sizeof(extctrl));
         memset(&extctrls, 0, sizeof(extctrls));
 
@@ -790,249 +1533,131 @@ static void v4l2_print_control(int fd, const struct v4l2_query_ext_ctrl* qextctr
     } while (0);
 }
 
-static int v4l2_create_memory_fd(size_t size)
+static uint32_t v4l2_query_capabilities(int fd, uint32_t flags, struct v4l2_selected_format* selected_format)
 {
-    int retval = -1;
+    uint32_t capabilities = 0;
 
     do {
-        int memfd;
         int status;
+        struct v4l2_capability caps;
+        struct v4l2_caps_cache cache;
+        bool cached = false;
 
-        /*
-         * Set the close-on-exec (FD_CLOEXEC) flag on the new file descriptor.
-         * Allow sealing operations on this file. See the discussion
-         * of the F_ADD_SEALS and F_GET_SEALS operations in fcntl(2).
-         * The initial set of seals is empty.
-         * If this flag is not set, the initial set of seals will be
-         * F_SEAL_SEAL, meaning that no other seals can be set on the file.
-         */
-        memfd = memfd_create(MEMFD_FILE_NAME, MFD_CLOEXEC | MFD_ALLOW_SEALING);
-        if (memfd == -1) {
-            fprintf(stderr, "memfd_create(%s) failed: %s\n", MEMFD_FILE_NAME, strerror(errno));
+        memset(&caps, 0, sizeof(caps));
+        status = ioctl(fd, VIDIOC_QUERYCAP, &caps);
+        if (-1 == status) {
+            fprintf(stderr, "VIDIOC_QUERYCAP failed: %s\n", strerror(errno));
             break;
         }
 
-        status = ftruncate(memfd, size);
-        if (status == -1) {
-            fprintf(stderr, "ftruncate(%zu) failed: %s\n", size, strerror(errno));
-            break;
-        }
+        capabilities = caps.capabilities;
+        v4l2_print_capabilities(&caps);
 
-        /* udmabuf_create requires that file descriptors be sealed with F_SEAL_SHRINK */
-        status = fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK);
-        if (status == -1) {
-            fprintf(stderr, "fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK) failed: %s\n", strerror(errno));
-            break;
+        /* if the cache directory is not usable, results are kept in memory only */
+        v4l2_caps_cache_init(&cache, capability_cache_directory, &caps);
+
+        if (fast_start && 0 == v4l2_caps_cache_load(&cache)) {
+            fprintf(stdout, "Using cached enumeration results from '%s'\n", cache.filename);
+            cached = true;
+        } else {
+            /*
+             * If driver supports multiplanar format (V4L2_CAP_VIDEO_CAPTURE_MPLANE),
+             * then prefer this one instead of single planar one (V4L2_CAP_VIDEO_CAPTURE)
+             */
+            enum v4l2_buf_type buf_type =
+                capabilities & V4L2_CAP_VIDEO_CAPTURE_MPLANE ?
+                V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE : V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+            v4l2_enumerate_formats(fd, buf_type, &cache);
+            v4l2_enumerate_controls(fd, &cache);
+
+            if (capability_cache_directory && v4l2_caps_cache_store(&cache))
+                fprintf(stderr, "v4l2_caps_cache_store() failed\n"); /* threat this as non-fatal error */
         }
 
-        retval = memfd;
+        v4l2_replay_capabilities(&cache, cached ? -1 : fd);
+        v4l2_select_format(&cache, flags, selected_format);
+        v4l2_caps_cache_destroy(&cache);
     } while (0);
 
-    return retval;
+    return capabilities;
 }
 
-static int v4l2_create_dmabuf_fd(int memfd, size_t size)
+static void v4l2_enumerate_formats(int fd, enum v4l2_buf_type buf_type, struct v4l2_caps_cache* cache)
 {
-    int retval = -1;
+    int status;
+    struct v4l2_fmtdesc fmtdesc;
+    struct v4l2_cropcap cropcap;
+    struct v4l2_frmsizeenum frmsizeenum;
+    struct v4l2_frmivalenum frmivalenum;
+
+    memset(&fmtdesc, 0, sizeof(fmtdesc));
+    fmtdesc.index = 0;
+    fmtdesc.type = buf_type;
+    for (; 0 == (status = ioctl(fd, VIDIOC_ENUM_FMT, &fmtdesc)); fmtdesc.index++) {
+        v4l2_caps_cache_append(cache, V4L2_CAPS_RECORD_FMTDESC, &fmtdesc, sizeof(fmtdesc));
+
+        memset(&frmsizeenum, 0, sizeof(frmsizeenum));
+        frmsizeenum.index = 0;
+        frmsizeenum.pixel_format = fmtdesc.pixelformat;
+        for (; 0 == (status = ioctl(fd, VIDIOC_ENUM_FRAMESIZES, &frmsizeenum)); frmsizeenum.index++) {
+            v4l2_caps_cache_append(cache, V4L2_CAPS_RECORD_FRMSIZE, &frmsizeenum, sizeof(frmsizeenum));
+
+            memset(&frmivalenum, 0, sizeof(frmivalenum));
+            frmivalenum.index = 0;
+            frmivalenum.pixel_format = frmsizeenum.pixel_format;
+            if (V4L2_FRMSIZE_TYPE_DISCRETE == frmsizeenum.type) {
+                frmivalenum.width = frmsizeenum.discrete.width;
+                frmivalenum.height = frmsizeenum.discrete.height;
+            }
+            else
+            if (V4L2_FRMSIZE_TYPE_STEPWISE == frmsizeenum.type) {
+                frmivalenum.width = frmsizeenum.stepwise.max_width;
+                frmivalenum.height = frmsizeenum.stepwise.max_height;
+            }
+            else
+                continue;
 
-    do {
-        int fd;
-        int dmabuffd;
-        int status;
-        struct udmabuf_create udmabuf_create;
+            for (; 0 == (status = ioctl(fd, VIDIOC_ENUM_FRAMEINTERVALS, &frmivalenum)); frmivalenum.index++)
+                v4l2_caps_cache_append(cache, V4L2_CAPS_RECORD_FRMIVAL, &frmivalenum, sizeof(frmivalenum));
+            if (-1 == status && errno != EINVAL)
+                fprintf(stderr, "VIDIOC_ENUM_FRAMEINTERVALS failed: %s\n", strerror(errno));
+        }
+        if (-1 == status && errno != EINVAL)
+            fprintf(stderr, "VIDIOC_ENUM_FRAMESIZES failed: %s\n", strerror(errno));
+    }
+    if (-1 == status && errno != EINVAL)
+        fprintf(stderr, "VIDIOC_ENUM_FMT failed: %s\n", strerror(errno));
+
+    memset(&cropcap, 0, sizeof(cropcap));
+    cropcap.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    status = ioctl(fd, VIDIOC_CROPCAP, &cropcap);
+    if (-1 == status)
+        fprintf(stderr, "VIDIOC_CROPCAP failed: %s\n", strerror(errno));
+    else
+        v4l2_caps_cache_append(cache, V4L2_CAPS_RECORD_CROPCAP, &cropcap, sizeof(cropcap));
+}
 
-        if (memfd == -1)
-            break;
+static void v4l2_enumerate_controls(int fd, struct v4l2_caps_cache* cache)
+{
+    int status;
+    struct v4l2_query_ext_ctrl qextctrl;
 
-        fd = open(UDMABUF_DEVICE_NAME, O_RDWR);
-        if (fd == -1) {
-            fprintf(stderr, "cannot open '%s': %s\n", UDMABUF_DEVICE_NAME, strerror(errno));
-            break;
-        }
-
-        memset(&udmabuf_create, 0, sizeof(udmabuf_create));
-        udmabuf_create.memfd = memfd;
-        udmabuf_create.flags = UDMABUF_FLAGS_CLOEXEC;
-        udmabuf_create.offset = 0;
-        udmabuf_create.size = size;
-
-        dmabuffd = ioctl(fd, UDMABUF_CREATE, &udmabuf_create);
-        if (dmabuffd == -1) {
-            fprintf(stderr, "ioctl(UDMABUF_CREATE) failed: %s\n", strerror(errno));
-        }
-
-        close(fd);
-
-        retval = dmabuffd;
-    } while (0);
-
-    return retval;
-}
-
-static int v4l2_dma_alloc(size_t size, void **addr)
-{
-    int memfd;
-    int dmabuffd;
-    void *p;
-    long pagesize = sysconf(_SC_PAGESIZE);
-
-    if (pagesize <= 0 || !IS_POWER_OF_TWO(pagesize))
-        pagesize = 0x1000; // set default value to 4KiB
-
-    size = ALIGN(size, pagesize);
-
-    memfd = v4l2_create_memory_fd(size);
-
-    p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
-    if (p == MAP_FAILED) {
-        fprintf(stderr, "mmap() failed: %s\n", strerror(errno));
-        close(memfd);
-        return -1;
-    }
-
-    if (addr)
-        *addr = p;
-
-    dmabuffd = v4l2_create_dmabuf_fd(memfd, size);
-
-    /* memfd can be closed here.
-    Only when all references to the memfd are dropped,
-    it will be automatically released. */
-    close(memfd);
-
-    return dmabuffd;
-}
-
-static uint32_t v4l2_query_capabilities(int fd, uint32_t flags)
-{
-    uint32_t capabilities = 0;
-
-    do {
-        int status;
-        struct v4l2_capability caps;
-        struct v4l2_fmtdesc fmtdesc;
-        struct v4l2_cropcap cropcap;
-        struct v4l2_frmsizeenum frmsizeenum;
-        struct v4l2_frmivalenum frmivalenum;
-
-        memset(&caps, 0, sizeof(caps));
-        status = ioctl(fd, VIDIOC_QUERYCAP, &caps);
-        if (-1 == status) {
-            fprintf(stderr, "VIDIOC_QUERYCAP failed: %s\n", strerror(errno));
-            break;
-        }
-
-        capabilities = caps.capabilities;
-        v4l2_print_capabilities(&caps);
-
-        /*
-         * If driver supports multiplanar format (V4L2_CAP_VIDEO_CAPTURE_MPLANE),
-         * then prefer this one instead of single planar one (V4L2_CAP_VIDEO_CAPTURE)
-         */
-        enum v4l2_buf_type buf_type =
-            capabilities & V4L2_CAP_VIDEO_CAPTURE_MPLANE ?
-            V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE : V4L2_BUF_TYPE_VIDEO_CAPTURE;
-
-        memset(&fmtdesc, 0, sizeof(fmtdesc));
-        fmtdesc.index = 0;
-        fmtdesc.type = buf_type;
-        for (; 0 == (status = ioctl(fd, VIDIOC_ENUM_FMT, &fmtdesc)); fmtdesc.index++) {
-            v4l2_print_fmtdesc(&fmtdesc);
-
-            memset(&frmsizeenum, 0, sizeof(frmsizeenum));
-            frmsizeenum.index = 0;
-            frmsizeenum.pixel_format = fmtdesc.pixelformat;
-            for (; 0 == (status = ioctl(fd, VIDIOC_ENUM_FRAMESIZES, &frmsizeenum)); frmsizeenum.index++) {
-                v4l2_print_frmsizeenum(&frmsizeenum);
-
-                if (V4L2_FRMSIZE_TYPE_DISCRETE == frmsizeenum.type) {
-                    memset(&frmivalenum, 0, sizeof(frmivalenum));
-                    frmivalenum.index = 0;
-                    frmivalenum.pixel_format = frmsizeenum.pixel_format;
-                    frmivalenum.width = frmsizeenum.discrete.width;
-                    frmivalenum.height = frmsizeenum.discrete.height;
-                    for (; 0 == (status = ioctl(fd, VIDIOC_ENUM_FRAMEINTERVALS, &frmivalenum)); frmivalenum.index++)
-                        v4l2_print_frmivalenum(&frmivalenum);
-                    if (-1 == status && errno != EINVAL)
-                        fprintf(stderr, "VIDIOC_ENUM_FRAMEINTERVALS failed: %s\n", strerror(errno));
-                }
-                else
-                if (V4L2_FRMSIZE_TYPE_STEPWISE == frmsizeenum.type) {
-                    memset(&frmivalenum, 0, sizeof(frmivalenum));
-                    frmivalenum.index = 0;
-                    frmivalenum.pixel_format = frmsizeenum.pixel_format;
-                    frmivalenum.width = frmsizeenum.stepwise.max_width;
-                    frmivalenum.height = frmsizeenum.stepwise.max_height;
-                    for (; 0 == (status = ioctl(fd, VIDIOC_ENUM_FRAMEINTERVALS, &frmivalenum)); frmivalenum.index++)
-                        v4l2_print_frmivalenum(&frmivalenum);
-                    if (-1 == status && errno != EINVAL)
-                        fprintf(stderr, "VIDIOC_ENUM_FRAMEINTERVALS failed: %s\n", strerror(errno));
-                }
-                else
-                    continue;
-
-                if (selected_format.pixelformat == 0) {
-                    if (flags == fmtdesc.flags) {
-                        selected_format.pixelformat = frmsizeenum.pixel_format;
-
-                        if (V4L2_FRMSIZE_TYPE_DISCRETE == frmsizeenum.type) {
-                            selected_format.width = frmsizeenum.discrete.width;
-                            selected_format.height = frmsizeenum.discrete.height;
-                        }
-                        else
-                        if (V4L2_FRMSIZE_TYPE_STEPWISE == frmsizeenum.type) {
-                            selected_format.width = frmsizeenum.stepwise.min_width;
-                            selected_format.height = frmsizeenum.stepwise.min_height;
-                        }
-                        else {
-                            selected_format.width = 0;
-                            selected_format.height = 0;
-                        }
-                    }
-                }
-            }
-            if (-1 == status && errno != EINVAL)
-                fprintf(stderr, "VIDIOC_ENUM_FRAMESIZES failed: %s\n", strerror(errno));
-        }
-        if (-1 == status && errno != EINVAL)
-            fprintf(stderr, "VIDIOC_ENUM_FMT failed: %s\n", strerror(errno));
-
-        memset(&cropcap, 0, sizeof(cropcap));
-        cropcap.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        status = ioctl(fd, VIDIOC_CROPCAP, &cropcap);
-        if (-1 == status) {
-            fprintf(stderr, "VIDIOC_CROPCAP failed: %s\n", strerror(errno));
-            break;
-        }
-
-        v4l2_print_cropping_capabilities(&cropcap);
-    } while (0);
-
-    return capabilities;
-}
-
-static void v4l2_query_controls(int fd)
-{
-    int status;
-    struct v4l2_query_ext_ctrl qextctrl;
-
-    fprintf(stdout, "VIDIOC_QUERY_EXT_CTRL:\n");
-
-    memset(&qextctrl, 0, sizeof(qextctrl));
-    qextctrl.id = V4L2_CTRL_FLAG_NEXT_CTRL | V4L2_CTRL_FLAG_NEXT_COMPOUND;
-
-    do {
-        status = ioctl(fd, VIDIOC_QUERY_EXT_CTRL, &qextctrl);
-        if (-1 == status) {
-            if (errno != EINVAL)
-                fprintf(stderr, "VIDIOC_QUERY_EXT_CTRL failed: %s\n", strerror(errno));
+    memset(&qextctrl, 0, sizeof(qextctrl));
+    qextctrl.id = V4L2_CTRL_FLAG_NEXT_CTRL | V4L2_CTRL_FLAG_NEXT_COMPOUND;
+
+    do {
+        status = ioctl(fd, VIDIOC_QUERY_EXT_CTRL, &qextctrl);
+        if (-1 == status) {
+            if (errno != EINVAL)
+                fprintf(stderr, "VIDIOC_QUERY_EXT_CTRL failed: %s\n", strerror(errno));
             break;
         }
 
         if (qextctrl.flags & V4L2_CTRL_FLAG_DISABLED)
             continue;
 
-        v4l2_print_control(fd, &qextctrl);
+        v4l2_caps_cache_append(cache, V4L2_CAPS_RECORD_CONTROL, &qextctrl, sizeof(qextctrl));
         qextctrl.id |= V4L2_CTRL_FLAG_NEXT_CTRL | V4L2_CTRL_FLAG_NEXT_COMPOUND;
     } while (1);
 
@@ -1050,7 +1675,7 @@ static void v4l2_query_controls(int fd)
         if (qextctrl.flags & V4L2_CTRL_FLAG_DISABLED)
             continue;
 
-        v4l2_print_control(fd, &qextctrl);
+        v4l2_caps_cache_append(cache, V4L2_CAPS_RECORD_CONTROL, &qextctrl, sizeof(qextctrl));
         qextctrl.id++;
     } while (1);
 
@@ -1069,441 +1694,567 @@ static void v4l2_query_controls(int fd)
         if (qextctrl.flags & V4L2_CTRL_FLAG_DISABLED)
             continue;
 
-        v4l2_print_control(fd, &qextctrl);
+        v4l2_caps_cache_append(cache, V4L2_CAPS_RECORD_CONTROL, &qextctrl, sizeof(qextctrl));
         qextctrl.id++;
     } while (qextctrl.id < V4L2_CID_LASTP1);
 }
 
-static int v4l2_query_mmap_buffers(int fd, int number_of_buffers, enum v4l2_buf_type buf_type)
+static void v4l2_replay_capabilities(const struct v4l2_caps_cache* cache, int fd)
 {
-    int i;
+    bool controls = false;
+    unsigned i;
 
-    for (i = 0; i < number_of_buffers; ++i) {
-        struct v4l2_buffer_descriptor* bd = buffer_descriptors + i;
-        struct v4l2_buffer buffer;
-        struct v4l2_plane planes[VIDEO_MAX_PLANES];
-        void* addr;
-
-        memset(&buffer, 0, sizeof(buffer));
-        buffer.index = i;
-        buffer.type = buf_type;
-        buffer.memory = V4L2_MEMORY_MMAP;
-        if (V4L2_TYPE_IS_MULTIPLANAR(buf_type)) {
-            memset(&planes, 0, sizeof(planes));
-            buffer.length = ARRAY_SIZE(planes);
-            buffer.m.planes = planes;
-        }
-
-        if(-1 == ioctl(fd, VIDIOC_QUERYBUF, &buffer)) {
-            fprintf(stderr, "VIDIOC_QUERYBUF[%d] failed: %s\n", i, strerror(errno));
-            break;
-        }
+    for (i = 0; i < cache->count; ++i) {
+        const struct v4l2_caps_record* record = cache->records + i;
 
-        fprintf(stdout, "VIDIOC_QUERYBUF[%u]:\n", i);
-        v4l2_print_buffer(&buffer);
+        switch (record->type) {
+            case V4L2_CAPS_RECORD_FMTDESC:
+                v4l2_print_fmtdesc(&record->u.fmtdesc);
+                break;
 
-        if (V4L2_TYPE_IS_MULTIPLANAR(buf_type)) {
-            unsigned plane;
+            case V4L2_CAPS_RECORD_FRMSIZE:
+                v4l2_print_frmsizeenum(&record->u.frmsize);
+                break;
 
-            bd->index = i;
-            bd->nplanes = buffer.length;
-
-            for (plane = 0; plane < buffer.length; ++plane) {
-                if (buffer.m.planes[plane].length > 0) {
-                    addr = mmap(NULL, buffer.m.planes[plane].length,
-                        PROT_READ | PROT_WRITE, MAP_SHARED,
-                        fd, buffer.m.planes[plane].m.mem_offset);
-                    if (MAP_FAILED == addr) {
-                        fprintf(stderr, "mmap() failed: %s\n", strerror(errno));
-                        break;
-                    }
-                }
+            case V4L2_CAPS_RECORD_FRMIVAL:
+                v4l2_print_frmivalenum(&record->u.frmival);
+                break;
 
-                bd->planes[plane].addr = addr;
-                bd->planes[plane].size = buffer.m.planes[plane].length;
-                bd->planes[plane].fd = -1;
-            }
-            if (plane < buffer.length)
+            case V4L2_CAPS_RECORD_CROPCAP:
+                v4l2_print_cropping_capabilities(&record->u.cropcap);
                 break;
-        } else {
-            addr = mmap(NULL, buffer.length,
-                PROT_READ | PROT_WRITE, MAP_SHARED, fd, buffer.m.offset);
-            if (MAP_FAILED == addr) {
-                fprintf(stderr, "mmap() failed: %s\n", strerror(errno));
+
+            case V4L2_CAPS_RECORD_CONTROL:
+                if (!controls) {
+                    fprintf(stdout, "VIDIOC_QUERY_EXT_CTRL:\n");
+                    controls = true;
+                }
+                v4l2_print_control(fd, &record->u.control);
                 break;
-            }
 
-            bd->index = i;
-            bd->nplanes = 1;
-            bd->planes[0].addr = addr;
-            bd->planes[0].size = buffer.length;
-            bd->planes[0].fd = -1;
+            default:
+                /* do nothing */
+                break;
         }
     }
-
-    return i == number_of_buffers ? 0 /*success*/ : -1 /*failture*/;
 }
 
-static int v4l2_query_userptr_buffers(int fd, int number_of_buffers, enum v4l2_buf_type buf_type)
+static void v4l2_select_format(const struct v4l2_caps_cache* cache, uint32_t flags, struct v4l2_selected_format* selected_format)
 {
-    int i;
-    struct v4l2_format format;
-
-    memset(&format, 0, sizeof(format));
-    format.type = buf_type;
-    if (-1 == ioctl(fd, VIDIOC_G_FMT, &format)) {
-        fprintf(stderr, "VIDIOC_G_FMT failed: %s\n", strerror(errno));
-        return -1;
-    }
+    const struct v4l2_fmtdesc* fmtdesc = NULL;
+    unsigned i;
+
+    if (auto_format) {
+        struct v4l2_format_target target = format_target;
+        struct v4l2_format_candidate best;
+
+        /* there is no way to learn the speed of the bus, so the slower one is assumed */
+        if (target.bus_bandwidth < 0)
+            target.bus_bandwidth = strncmp((const char*)cache->caps.bus_info, "usb", 3) == 0 ?
+                V4L2_NEGOTIATE_USB2_BANDWIDTH : 0;
+
+        if (0 == v4l2_negotiate_format(cache, &target, &best)) {
+            selected_format->pixelformat = best.pixelformat;
+            selected_format->width = best.width;
+            selected_format->height = best.height;
+            selected_format->timeperframe = best.timeperframe;
+            return;
+        }
 
-    if (format.type != buf_type) {
-        fprintf(stderr, "Incompatible buffer types detected\n");
-        return -1;
+        fprintf(stderr, "no format to negotiate from, using default one\n");
     }
 
-    for (i = 0; i < number_of_buffers; ++i) {
-        struct v4l2_buffer_descriptor* bd = buffer_descriptors + i;
-        size_t size;
-        void* addr;
+    for (i = 0; i < cache->count && selected_format->pixelformat == 0; ++i) {
+        const struct v4l2_caps_record* record = cache->records + i;
+        const struct v4l2_frmsizeenum* frmsizeenum = &record->u.frmsize;
 
-        if (V4L2_TYPE_IS_MULTIPLANAR(buf_type)) {
-            unsigned plane;
+        if (record->type == V4L2_CAPS_RECORD_FMTDESC) {
+            fmtdesc = &record->u.fmtdesc;
+            continue;
+        }
 
-            bd->index = i;
-            bd->nplanes = format.fmt.pix_mp.num_planes;
+        if (record->type != V4L2_CAPS_RECORD_FRMSIZE || NULL == fmtdesc)
+            continue;
 
-            for (plane = 0; plane < bd->nplanes; ++plane) {
-                if (format.fmt.pix_mp.plane_fmt[plane].sizeimage)
-                    size = format.fmt.pix_mp.plane_fmt[plane].sizeimage;
-                else
-                if (format.fmt.pix_mp.plane_fmt[plane].bytesperline)
-                    size = format.fmt.pix_mp.plane_fmt[plane].bytesperline * format.fmt.pix_mp.height;
-                else
-                    break;
+        if (requested_pixelformat ? requested_pixelformat != fmtdesc->pixelformat : flags != fmtdesc->flags)
+            continue;
 
-                addr = malloc(size);
-                if (addr == NULL)
-                    break;
+        if (V4L2_FRMSIZE_TYPE_DISCRETE == frmsizeenum->type) {
+            selected_format->pixelformat = frmsizeenum->pixel_format;
+            selected_format->width = frmsizeenum->discrete.width;
+            selected_format->height = frmsizeenum->discrete.height;
+        }
+        else
+        if (V4L2_FRMSIZE_TYPE_STEPWISE == frmsizeenum->type) {
+            selected_format->pixelformat = frmsizeenum->pixel_format;
+            selected_format->width = frmsizeenum->stepwise.min_width;
+            selected_format->height = frmsizeenum->stepwise.min_height;
+        }
+        else {
+            /* continuous frame sizes are never selected */
+        }
+    }
 
-                bd->planes[plane].addr = addr;
-                bd->planes[plane].size = size;
-                bd->planes[plane].fd = -1;
-            }
-            if (plane < bd->nplanes)
-                break;
-        } else {
-            if (format.fmt.pix.sizeimage)
-                size = format.fmt.pix.sizeimage;
-            else
-            if (format.fmt.pix.bytesperline)
-                size = format.fmt.pix.bytesperline * format.fmt.pix.height;
-            else
-                break;
+    /* whatever was asked for explicitly is tried, the driver adjusts it if needed */
+    if (requested_pixelformat && selected_format->pixelformat == 0) {
+        fprintf(stderr, "requested format is not enumerated by the device, trying anyway\n");
+        selected_format->pixelformat = requested_pixelformat;
+    }
 
-            addr = malloc(size);
-            if (addr == NULL)
-                break;
+    if (format_target.width && format_target.height) {
+        selected_format->width = format_target.width;
+        selected_format->height = format_target.height;
+    }
 
-            bd->index = i;
-            bd->nplanes = 1;
-            bd->planes[0].addr = addr;
-            bd->planes[0].size = size;
-            bd->planes[0].fd = -1;
+    if (format_target.fps > 0) {
+        /* whole numbers are passed exactly, others with a precision of 1/1000 */
+        if (format_target.fps == (uint32_t)format_target.fps) {
+            selected_format->timeperframe.numerator = 1;
+            selected_format->timeperframe.denominator = (uint32_t)format_target.fps;
+        } else {
+            selected_format->timeperframe.numerator = 1000;
+            selected_format->timeperframe.denominator = (uint32_t)(format_target.fps * 1000 + 0.5);
         }
     }
-
-    return i == number_of_buffers ? 0 /*success*/ : -1 /*failture*/;
 }
 
-static int v4l2_query_dma_buffers(int fd, int number_of_buffers, enum v4l2_buf_type buf_type)
+/* next frame goes straight into the next free slot of the segment file, called back by the capture */
+static int v4l2_prepare_buffer(void* arg, unsigned index, void** addrs)
 {
-    int i;
-    struct v4l2_format format;
-
-    memset(&format, 0, sizeof(format));
-    format.type = buf_type;
-    if (-1 == ioctl(fd, VIDIOC_G_FMT, &format)) {
-        fprintf(stderr, "VIDIOC_G_FMT failed: %s\n", strerror(errno));
-        return -1;
-    }
+    struct v4l2_device* dev = arg;
 
-    if (format.type != buf_type) {
-        fprintf(stderr, "Incompatible buffer types detected\n");
+    if (v4l2_mmap_segment_assign(&dev->writer.mmap, index, addrs)) {
+        fprintf(stderr, "v4l2_mmap_segment_assign() failed\n");
         return -1;
     }
 
-    for (i = 0; i < number_of_buffers; ++i) {
-        struct v4l2_buffer_descriptor* bd = buffer_descriptors + i;
-        size_t size;
-        void* addr;
-        int dmabuffd;
-
-        if (V4L2_TYPE_IS_MULTIPLANAR(buf_type)) {
-            unsigned plane;
+    return 0;
+}
 
-            bd->index = i;
-            bd->nplanes = format.fmt.pix_mp.num_planes;
+static int v4l2_grow_buffers(struct v4l2_device* dev)
+{
+    unsigned index;
+    bool created;
+    int status;
 
-            for (plane = 0; plane < bd->nplanes; ++plane) {
-                if (format.fmt.pix_mp.plane_fmt[plane].sizeimage)
-                    size = format.fmt.pix_mp.plane_fmt[plane].sizeimage;
-                else
-                if (format.fmt.pix_mp.plane_fmt[plane].bytesperline)
-                    size = format.fmt.pix_mp.plane_fmt[plane].bytesperline * format.fmt.pix_mp.height;
-                else
-                    break;
+    while (dev->queued < dev->low_watermark) {
+        status = v4l2_capture_grow(dev->capture, &index, &created);
+        if (status < 0) {
+            fprintf(stderr, "v4l2_capture_grow() failed\n");
+            return -1;
+        }
 
-                dmabuffd = v4l2_dma_alloc(size, &addr);
+        if (status > 0)
+            break; /* budget exhausted, storage has to catch up */
 
-                bd->planes[plane].addr = addr;
-                bd->planes[plane].size = size;
-                bd->planes[plane].fd = dmabuffd;
-            }
-            if (plane < bd->nplanes)
-                break;
-        } else {
-            if (format.fmt.pix.sizeimage)
-                size = format.fmt.pix.sizeimage;
-            else
-            if (format.fmt.pix.bytesperline)
-                size = format.fmt.pix.bytesperline * format.fmt.pix.height;
-            else
-                break;
+        if (created) {
+            unsigned total = v4l2_capture_number_of_buffers(dev->capture) - v4l2_capture_removed(dev->capture);
 
-            dmabuffd = v4l2_dma_alloc(size, &addr);
+            fprintf(stdout, "%s: %d buffer(s) queued, buffer %u added (%u in total, %.1f MiB)\n",
+                dev->filename, dev->queued, index, total, (double)total * dev->buffer_size / (1 << 20));
 
-            bd->index = i;
-            bd->nplanes = 1;
-            bd->planes[0].addr = addr;
-            bd->planes[0].size = size;
-            bd->planes[0].fd = dmabuffd;
-        }
+            /* no frame of it is published before it is dequeued */
+            if (frame_server_path && v4l2_serve_buffer(dev, index))
+                return -1;
+        } else
+        if (verbosity > 0)
+            fprintf(stdout, "%s: %d buffer(s) queued, buffer %u unparked (%u parked in total)\n",
+                dev->filename, dev->queued, index, v4l2_capture_parked(dev->capture));
     }
 
-    return i == number_of_buffers ? 0 /*success*/ : -1 /*failture*/;
-};
+    return 0;
+}
 
-static int v4l2_query_buffers(int fd, int number_of_buffers, enum v4l2_buf_type buf_type, enum v4l2_memory memory)
+static int v4l2_dequeue_frame(struct v4l2_device* dev, struct v4l2_frame* frame)
 {
-    int retval = -1;
+    int retval = -1; /* -1 marks fatal errors */
 
     do {
+        /* accounted for by v4l2_account_dequeue(), which the capture calls back */
+        struct v4l2_capture_frame borrowed;
+        unsigned plane;
         int status;
-        struct v4l2_requestbuffers requestbuffers;
 
-        memset(&requestbuffers, 0, sizeof(requestbuffers));
-        requestbuffers.count = number_of_buffers;
-        requestbuffers.type = buf_type;
-        requestbuffers.memory = memory;
+        status = v4l2_capture_borrow(dev->capture, &borrowed, 0);
+        if (status < 0)
+            break;
 
-        if (-1 == ioctl(fd, VIDIOC_REQBUFS, &requestbuffers)) {
-            fprintf(stderr, "VIDIOC_REQBUFS failed: %s\n", strerror(errno));
+        if (status > 0) {
+            retval = 2; /* no more filled buffers at the moment */
             break;
         }
 
-        fprintf(stdout,
-            "VIDIOC_REQBUFS:\n"
-            "\trequested count: %u, commited count: %u, caps: 0x%08x\n",
-            number_of_buffers, requestbuffers.count, requestbuffers.capabilities
-            );
-
-        buffer_descriptors = calloc(requestbuffers.count, sizeof(*buffer_descriptors));
-        if (NULL == buffer_descriptors) {
-            fprintf(stderr, "calloc(%u, %zu) failed\n",
-                requestbuffers.count, sizeof(*buffer_descriptors));
+        memset(frame, 0, sizeof(*frame));
+        frame->index = borrowed.index;
+        frame->sequence = borrowed.sequence;
+        frame->flags = borrowed.flags;
+        frame->timestamp = borrowed.timestamp;
+        frame->dequeued = dev->dequeued;
+        frame->borrowed = borrowed;
+
+        if (borrowed.flags & V4L2_BUF_FLAG_ERROR) {
+            fprintf(stderr, "Received erroneous frame for buffer[%u] (total: %llu)\n",
+                borrowed.index, (unsigned long long)dev->drops.erroneous);
+            /* nobody else is going to use this buffer, so give it back to the driver */
+            if (v4l2_capture_return(dev->capture, &borrowed))
+                fprintf(stderr, "v4l2_capture_return() failed\n");
+            else
+                retval = 1; /* threat this as non-fatal error */
             break;
         }
 
-        switch (memory) {
-            case V4L2_MEMORY_MMAP:
-                status = v4l2_query_mmap_buffers(fd, requestbuffers.count, buf_type);
-                break;
+        for (plane = 0; plane < borrowed.nplanes && plane < ARRAY_SIZE(frame->iov); ++plane) {
+            frame->iov[plane].iov_base = borrowed.planes[plane].addr;
+            frame->iov[plane].iov_len = borrowed.planes[plane].bytesused;
+        }
 
-            case V4L2_MEMORY_USERPTR:
-                status = v4l2_query_userptr_buffers(fd, requestbuffers.count, buf_type);
-                break;
+        /*
+         * The buffer is not re-queued here. It is owned by the caller now
+         * and goes back to the driver once its content is no longer needed.
+         */
+        retval = 0;
+    } while (0);
 
-            case V4L2_MEMORY_DMABUF:
-                status = v4l2_query_dma_buffers(fd, requestbuffers.count, buf_type);
-                break;
+    return retval;
+}
 
-            default:
-                status = -1;
-                break;
-        };
+static int v4l2_frame_filename(char* buf, size_t size, const char* directory, uint32_t fourcc, int counter)
+{
+    int n;
 
-        if (status)
-            break;
+    n = snprintf(buf, size, "%s/image%04d.%c%c%c%c",
+        directory,
+        counter,
+        (fourcc >>  0) & 0xff,
+        (fourcc >>  8) & 0xff,
+        (fourcc >> 16) & 0xff,
+        (fourcc >> 24) & 0xff
+    );
 
-        retval = requestbuffers.count;
-    } while (0);
+    if (n < 0)
+        return -1;
+    if ((size_t)n >= size)
+        return -1;
 
-    return retval;
+    return 0;
 }
 
-static int v4l2_queue_buffer(int fd, int index, enum v4l2_buf_type buf_type, enum v4l2_memory memory, int verbosity)
+static void v4l2_store_frame(const char* directory, uint32_t fourcc, const struct v4l2_iovec *iov, size_t iovcnt, int counter)
 {
-    int retval = -1;
+    char image_filename[256];
+    int fd = -1;
 
     do {
-        struct v4l2_buffer buffer;
-        struct v4l2_buffer_descriptor* bd = buffer_descriptors + index;
-        struct v4l2_plane planes[bd->nplanes];
-
-        memset(&buffer, 0, sizeof(buffer));
-        buffer.index = index;
-        buffer.type = buf_type;
-        buffer.memory = memory;
-        if (V4L2_TYPE_IS_MULTIPLANAR(buf_type)) {
-            memset(&planes, 0, sizeof(planes));
-            if (memory == V4L2_MEMORY_USERPTR) {
-                unsigned plane;
-                for (plane = 0; plane < bd->nplanes; ++plane) {
-                    planes[plane].m.userptr = (unsigned long)bd->planes[plane].addr;
-                    planes[plane].length = bd->planes[plane].size;
-                }
-            }
-            else
-            if (memory == V4L2_MEMORY_DMABUF) {
-                unsigned plane;
-                for (plane = 0; plane < bd->nplanes; ++plane)
-                    planes[plane].m.fd = bd->planes[plane].fd;
-              }
-            else {
-                /* do nothing */
-            }
+        size_t i;
 
-            buffer.length = bd->nplanes;
-            buffer.m.planes = planes;
-        } else {
-            if (memory == V4L2_MEMORY_USERPTR) {
-                buffer.m.userptr = (unsigned long)bd->planes[0].addr;
-                buffer.length = bd->planes[0].size;
-            }
-            else
-            if (memory == V4L2_MEMORY_DMABUF) {
-                buffer.m.fd = bd->planes[0].fd;
-            }
-            else {
-                /* do nothing */
-            }
-        }
+        if (v4l2_frame_filename(image_filename, sizeof(image_filename), directory, fourcc, counter))
+            break;
 
-        if (-1 == ioctl(fd, VIDIOC_QBUF, &buffer)) {
-            fprintf(stderr, "VIDIOC_QBUF[%d] failed: %s\n", index, strerror(errno));
+        fd = open(image_filename, O_WRONLY | O_CREAT | O_TRUNC, 0664);
+        if (-1 == fd) {
+            fprintf(stderr, "cannot open '%s': %s\n", image_filename, strerror(errno));
             break;
         }
 
-        if (verbosity > 0) {
-            fprintf(stdout, "VIDIOC_QBUF[%d]:\n", index);
-            v4l2_print_buffer(&buffer);
+        for (i = 0; i < iovcnt && iov[i].iov_base; ++i) {
+            if (-1 == write(fd, iov[i].iov_base, iov[i].iov_len)) {
+                fprintf(stderr, "write() failed: %s\n", strerror(errno));
+                break;
+            }
         }
-
-        retval = 0;
     } while (0);
 
-    return retval;
+    if (fd != -1)
+        close(fd);
 }
 
-static int v4l2_queue_buffers(int fd, int number_of_buffers, enum v4l2_buf_type buf_type, enum v4l2_memory memory)
+static void v4l2_writer_finish(struct v4l2_writer* w, unsigned index)
 {
-    int retval = -1;
-
-    do {
-        int i;
-        int status;
-
-        for (i = 0; i < number_of_buffers; ++i) {
-            status = v4l2_queue_buffer(fd, i, buf_type, memory, 1);
-            if (status)
-                break;
-        }
+    w->device->frames[index].store_done = v4l2_monotonic_ns();
+}
 
-        if (i < number_of_buffers)
-            break;
+/* io_uring completions are reaped by the poll hook, once all requests of a frame are done */
+static void v4l2_writer_complete(void* arg, unsigned index, int status)
+{
+    struct v4l2_writer* w = arg;
 
-        retval = 0;
-    } while (0);
+    (void)status; /* failures are already reported, the buffer is released anyway */
 
-    return retval;
+    v4l2_writer_finish(w, index);
+    v4l2_sink_complete(&w->sink, index);
 }
 
-static int v4l2_capture_frame(int fd, struct v4l2_iovec *iov, size_t iovcnt, enum v4l2_buf_type buf_type, enum v4l2_memory memory)
+static bool v4l2_writer_store(void* arg, unsigned index)
 {
-    int retval = -1; /* -1 marks fatal errors */
+    struct v4l2_writer* w = arg;
+    struct v4l2_device* dev = w->device;
+    struct v4l2_frame* frame = dev->frames + index;
 
-    do {
-        int status;
-        struct v4l2_buffer buffer;
-        struct v4l2_plane planes[VIDEO_MAX_PLANES];
-        fd_set fds;
-        struct timespec ts;
-        uint32_t index;
-        uint32_t flags;
-
-        FD_ZERO(&fds);
-        FD_SET(fd, &fds);
-
-        ts.tv_sec = SELECT_TIMEOUT_SEC;
-        ts.tv_nsec = 0;
-        status = pselect(fd+1, &fds, NULL, NULL, &ts, NULL);
-        if (-1 == status) {
-            fprintf(stderr, "pselect() failed: %s\n", strerror(errno));
-            break;
-        } else
-        if (0 == status) {
-            fprintf(stderr, "no data within %d second(s), timeout expired\n", SELECT_TIMEOUT_SEC);
-            retval = 1; /* threat this as non-fatal error */
-            break;
-        }
+    struct iovec iov[VIDEO_MAX_PLANES];
+    size_t i;
+
+    frame->store_start = v4l2_monotonic_ns();
+
+    for (i = 0; i < ARRAY_SIZE(iov); ++i) {
+        iov[i].iov_base = frame->iov[i].iov_base;
+        iov[i].iov_len = frame->iov[i].iov_len;
+    }
 
-        memset(&buffer, 0, sizeof(buffer));
-        buffer.type = buf_type;
-        buffer.memory = memory;
-        if (V4L2_TYPE_IS_MULTIPLANAR(buf_type)) {
-            memset(&planes, 0, sizeof(planes));
-            buffer.length = ARRAY_SIZE(planes);
-            buffer.m.planes = planes;
+    if (w->converting) {
+        if (v4l2_convert_check(&w->convert, iov, ARRAY_SIZE(iov))) {
+            fprintf(stderr, "frame %d is too short to be converted, it is not stored\n", frame->counter);
+            v4l2_writer_finish(w, index);
+            return true;
         }
 
-        if (-1 == ioctl(fd, VIDIOC_DQBUF, &buffer)) {
-            fprintf(stderr, "VIDIOC_DQBUF failed: %s\n", strerror(errno));
-            break;
+        if (w->striped) {
+            w->source = iov;
+            v4l2_worker_pool_run(&w->pool, v4l2_writer_convert_stripe, w, w->convert.height, w->stripe_rows);
+        } else
+            v4l2_convert_rows(&w->convert, iov, w->converted, 0, w->convert.height, w->convert.scratch);
+
+        /* storage gets the converted frame as if it were a single plane buffer */
+        iov[0].iov_base = w->converted;
+        iov[0].iov_len = w->convert.size;
+        for (i = 1; i < ARRAY_SIZE(iov); ++i) {
+            iov[i].iov_base = NULL;
+            iov[i].iov_len = 0;
         }
+    }
 
-        fprintf(stdout, "VIDIOC_DQBUF:\n");
-        v4l2_print_buffer(&buffer);
+    if (w->pretriggering && !v4l2_writer_triggered(w, frame)) {
+        struct v4l2_pretrigger_record record;
 
-        index = buffer.index;
-        flags = buffer.flags;
+        memset(&record, 0, sizeof(record));
+        record.timestamp = frame->timestamp;
+        record.captured = frame->dequeued;
+        record.counter = frame->counter;
+        record.sequence = frame->sequence;
+        record.flags = frame->flags;
 
-        memset(iov, 0, sizeof(*iov) * iovcnt);
+        /* the frame is copied, so the buffer can go back to the driver right away */
+        v4l2_pretrigger_ring_push(&w->pretrigger, &record, iov, ARRAY_SIZE(iov));
+        v4l2_writer_finish(w, index);
+        return true;
+    }
 
-        if (0 == (flags & V4L2_BUF_FLAG_ERROR)) {
-            if (V4L2_TYPE_IS_MULTIPLANAR(buf_type)) {
-                unsigned plane;
-                for (plane = 0; plane < buffer.length && plane < iovcnt; ++plane) {
-                    iov[plane].iov_base = buffer_descriptors[index].planes[plane].addr;
-                    iov[plane].iov_len = buffer.m.planes[plane].bytesused;
-                }
-            }
-            else {
-                if (iovcnt > 0) {
-                    iov[0].iov_base = buffer_descriptors[index].planes[0].addr;
-                    iov[0].iov_len = buffer.bytesused;
-                }
-            }
-        }
+    if (w->storage == V4L2_STORAGE_MODE_URING) {
+        char image_filename[V4L2_URING_SINK_FILENAME_SIZE];
 
-        status = v4l2_queue_buffer(fd, index, buf_type, memory, 0);
-        if (status) {
-            fprintf(stderr, "v4l2_queue_buffer() failed\n");
-            break;
-        }
+        if (0 == v4l2_frame_filename(image_filename, sizeof(image_filename), dev->directory, dev->selected_format.pixelformat, frame->counter) &&
+            0 == v4l2_uring_sink_store(&w->uring, index, image_filename, iov, ARRAY_SIZE(iov)))
+            return false; /* completion is reported once all requests are reaped */
+    } else
+    if (w->storage == V4L2_STORAGE_MODE_MMAP) {
+        /* the frame is already in the file, it only needs to be indexed */
+        v4l2_mmap_segment_commit(&w->mmap, index, frame->counter,
+            frame->sequence, frame->flags, frame->timestamp, iov, ARRAY_SIZE(iov));
+    } else {
+        v4l2_writer_write(w, frame->counter, frame->sequence, frame->flags, frame->timestamp, iov, ARRAY_SIZE(iov));
+    }
+
+    v4l2_writer_finish(w, index);
+    return true;
+}
+
+static unsigned v4l2_writer_poll(void* arg)
+{
+    struct v4l2_writer* w = arg;
+
+    if (w->storage != V4L2_STORAGE_MODE_URING)
+        return 0;
+
+    v4l2_uring_sink_submit(&w->uring);
+    v4l2_uring_sink_reap(&w->uring, v4l2_writer_complete, w);
+
+    /* the writer thread keeps going until all submitted frames are written out */
+    return v4l2_uring_sink_inflight(&w->uring);
+}
+
+/* file and segment storage, the frame does not have to be in a capture buffer */
+static void v4l2_writer_write(struct v4l2_writer* w, int counter, uint32_t sequence, uint32_t flags,
+    uint64_t timestamp, const struct iovec* iov, size_t iovcnt)
+{
+    if (w->storage == V4L2_STORAGE_MODE_SEGMENT) {
+        v4l2_segment_writer_append(&w->segment, counter, sequence, flags, timestamp, iov, iovcnt);
+    } else {
+        struct v4l2_iovec planes[VIDEO_MAX_PLANES];
+        size_t i;
+
+        for (i = 0; i < ARRAY_SIZE(planes); ++i) {
+            planes[i].iov_base = i < iovcnt ? iov[i].iov_base : NULL;
+            planes[i].iov_len = i < iovcnt ? iov[i].iov_len : 0;
+        }
+
+        v4l2_store_frame(w->device->directory, w->pixelformat, planes, ARRAY_SIZE(planes), counter);
+    }
+}
+
+static void v4l2_writer_flush_record(void* arg, const struct v4l2_pretrigger_record* record,
+    struct iovec* iov, size_t iovcnt)
+{
+    struct v4l2_writer* w = arg;
+
+    v4l2_writer_write(w, record->counter, record->sequence, record->flags, record->timestamp, iov, iovcnt);
+}
 
-        if (flags & V4L2_BUF_FLAG_ERROR) {
-            fprintf(stderr, "Received erroneous frame for buffer[%u]\n", index);
-            retval = 1; /* threat this as non-fatal error */
+/* tells whether the frame falls into a recording, which starts with the frames kept before the trigger */
+static bool v4l2_writer_triggered(struct v4l2_writer* w, const struct v4l2_frame* frame)
+{
+    uint64_t requests = v4l2_trigger_requests(&trigger);
+
+    if (requests != w->triggers_seen) {
+        w->triggers_seen = requests;
+        w->triggers++;
+        if (w->recording_until < frame->dequeued)
+            fprintf(stdout, "%s: triggered, storing %u frame(s) kept before frame %d\n",
+                w->device->filename, w->pretrigger.count, frame->counter);
+        v4l2_pretrigger_ring_flush(&w->pretrigger, v4l2_writer_flush_record, w);
+        w->recording_until = frame->dequeued + posttrigger_window;
+    }
+
+    if (frame->dequeued > w->recording_until)
+        return false;
+
+    w->recorded++;
+    return true;
+}
+
+static void v4l2_writer_init(struct v4l2_writer* w, struct v4l2_device* dev, enum v4l2_storage_mode storage, uint64_t max_size, uint64_t max_duration)
+{
+    w->device = dev;
+    w->storage = storage;
+    w->pixelformat = dev->selected_format.pixelformat;
+    w->converting = false;
+    w->converted = NULL;
+
+    if (convert_pixelformat) {
+        const struct v4l2_selected_format* f = &dev->selected_format;
+
+        /* threat this as non-fatal error, frames are stored as captured */
+        if (v4l2_convert_init(&w->convert, f->pixelformat, convert_pixelformat,
+                f->width, f->height, f->bytesperline, v4l2_convert_detect()))
+            fprintf(stderr, "%s: conversion of %.4s %ux%u to %.4s is not supported, frames are stored as captured\n",
+                dev->filename, (const char*)&f->pixelformat, f->width, f->height, (const char*)&convert_pixelformat);
+        else
+        if (NULL == (w->converted = malloc(w->convert.size))) {
+            fprintf(stderr, "malloc(%zu) failed\n", w->convert.size);
+            v4l2_convert_destroy(&w->convert);
+        }
+        else {
+            fprintf(stdout, "%s: frames are converted from %.4s to %.4s (%s)\n",
+                dev->filename, (const char*)&f->pixelformat, (const char*)&convert_pixelformat,
+                v4l2_convert_isa_name(w->convert.isa));
+            w->pixelformat = convert_pixelformat;
+            w->converting = true;
+        }
+    }
+
+    w->striped = false;
+    if (w->converting && convert_threads > 1)
+        v4l2_writer_start_pool(w, convert_threads);
+
+    w->pretriggering = false;
+    if (pretrigger_window) {
+        /* threat this as non-fatal error, frames are stored continuously */
+        if (v4l2_pretrigger_ring_init(&w->pretrigger, pretrigger_budget, pretrigger_window))
+            fprintf(stderr, "%s: no memory for frames before a trigger, frames are stored continuously\n", dev->filename);
+        else {
+            w->pretriggering = true;
+            w->triggers_seen = v4l2_trigger_requests(&trigger);
+            w->recording_until = 0;
+            w->triggers = 0;
+            w->recorded = 0;
+        }
+    }
+
+    v4l2_segment_writer_init(&w->segment, dev->directory,
+        w->pixelformat, dev->selected_format.width, dev->selected_format.height,
+        max_size, max_duration);
+}
+
+static void v4l2_writer_start_pool(struct v4l2_writer* w, unsigned number_of_workers)
+{
+    unsigned i;
+
+    for (i = 0; i < number_of_workers; ++i) {
+        w->scratch[i] = malloc(v4l2_convert_scratch_size(&w->convert));
+        if (NULL == w->scratch[i])
+            break;
+    }
+
+    /* threat this as non-fatal error, the writer thread converts frames on its own */
+    if (i < number_of_workers || v4l2_worker_pool_init(&w->pool, "conversion", number_of_workers,
+            writer_cpus_set ? &writer_cpus : NULL)) {
+        fprintf(stderr, "%s: conversion threads cannot be started, frames are converted by the writer thread\n",
+            w->device->filename);
+        for (i = 0; i < number_of_workers; ++i) {
+            free(w->scratch[i]);
+            w->scratch[i] = NULL;
+        }
+        return;
+    }
+
+    /* a few stripes per worker leave room for stealing, rows of YUYV and UYVY go in pairs */
+    w->stripe_rows = (w->convert.height / (4 * number_of_workers) + 1) & ~1u;
+    if (w->stripe_rows < 2)
+        w->stripe_rows = 2;
+
+    w->striped = true;
+}
+
+static void v4l2_writer_convert_stripe(void* arg, unsigned worker, unsigned first_row, unsigned last_row)
+{
+    struct v4l2_writer* w = arg;
+
+    v4l2_convert_rows(&w->convert, w->source, w->converted, first_row, last_row, w->scratch[worker]);
+}
+
+static int v4l2_writer_start(struct v4l2_writer* w, int number_of_buffers)
+{
+    enum v4l2_sink_policy policy = writer_policy;
+    int retval = -1;
+
+    if (policy != V4L2_SINK_KEEP_ALL && w->storage == V4L2_STORAGE_MODE_MMAP) {
+        /* frames are captured right into the storage, there is no skipping them */
+        fprintf(stderr, "%s: writer policy '%s' is not supported with mmap storage, every frame is stored\n",
+            w->device->filename, v4l2_sink_policy_name(policy));
+        policy = V4L2_SINK_KEEP_ALL;
+    }
+
+    do {
+        if (v4l2_sink_open(&w->sink, w->device->filename, policy, writer_max_held,
+                v4l2_writer_store, v4l2_writer_poll, w, writer_cpus_set ? &writer_cpus : NULL))
+            break;
+
+        if (w->storage == V4L2_STORAGE_MODE_URING) {
+            struct v4l2_capture_plane buffer[VIDEO_MAX_PLANES];
+            unsigned nplanes = v4l2_capture_buffer(w->device->capture, 0, buffer);
+            struct iovec planes[number_of_buffers * nplanes];
+            int i;
+            unsigned plane;
+
+            for (i = 0; i < number_of_buffers; ++i) {
+                v4l2_capture_buffer(w->device->capture, i, buffer);
+                for (plane = 0; plane < nplanes; ++plane) {
+                    planes[i * nplanes + plane].iov_base = buffer[plane].addr;
+                    planes[i * nplanes + plane].iov_len = buffer[plane].size;
+                }
+            }
+
+            if (v4l2_uring_sink_open(&w->uring, w->sink.wakeup_fd, planes, number_of_buffers, nplanes)) {
+                fprintf(stderr, "io_uring is not available, falling back to synchronous storage\n");
+                w->storage = V4L2_STORAGE_MODE_FILE;
+            } else {
+                fprintf(stdout, "io_uring storage enabled (%s buffers)\n",
+                    w->uring.fixed_buffers ? "fixed" : "regular");
+            }
+        }
+
+        if (v4l2_sink_start(&w->sink)) {
+            if (w->storage == V4L2_STORAGE_MODE_URING)
+                v4l2_uring_sink_close(&w->uring);
+            v4l2_sink_close(&w->sink);
             break;
         }
 
@@ -1513,77 +2264,1139 @@ static int v4l2_capture_frame(int fd, struct v4l2_iovec *iov, size_t iovcnt, enu
     return retval;
 }
 
-static void v4l2_store_frame(uint32_t fourcc, const struct v4l2_iovec *iov, size_t iovcnt, int counter)
+static void v4l2_writer_stop(struct v4l2_writer* w)
 {
-    char image_filename[256];
-    int fd = -1;
+    unsigned indices[VIDEO_MAX_FRAME];
+    unsigned count;
+    unsigned i;
+
+    v4l2_sink_stop(&w->sink);
+
+    if (w->storage == V4L2_STORAGE_MODE_URING)
+        v4l2_uring_sink_close(&w->uring);
+
+    if (w->storage == V4L2_STORAGE_MODE_SEGMENT)
+        v4l2_segment_writer_close(&w->segment);
+
+    if (w->pretriggering) {
+        fprintf(stdout, "%s: %llu trigger(s), %llu frame(s) stored from before and %llu after them,"
+            " %llu expired, %llu evicted for lack of memory, %u discarded at exit\n",
+            w->device->filename, (unsigned long long)w->triggers,
+            (unsigned long long)w->pretrigger.flushed, (unsigned long long)w->recorded,
+            (unsigned long long)w->pretrigger.expired, (unsigned long long)w->pretrigger.evicted,
+            w->pretrigger.count);
+        v4l2_pretrigger_ring_destroy(&w->pretrigger);
+        w->pretriggering = false;
+    }
 
-    do {
-        int n;
-        size_t i;
+    if (w->striped) {
+        unsigned i;
 
-        n = snprintf(image_filename, sizeof(image_filename), "%s/image%04d.%c%c%c%c",
-            output_directory,
-            counter,
-            (fourcc >>  0) & 0xff,
-            (fourcc >>  8) & 0xff,
-            (fourcc >> 16) & 0xff,
-            (fourcc >> 24) & 0xff
-        );
+        v4l2_worker_pool_print_stats(w->device->filename, &w->pool);
+        v4l2_worker_pool_destroy(&w->pool);
+        for (i = 0; i < ARRAY_SIZE(w->scratch); ++i) {
+            free(w->scratch[i]);
+            w->scratch[i] = NULL;
+        }
+        w->striped = false;
+    }
 
-        if (n < 0)
-            break;
-        if ((size_t)n >= sizeof(image_filename))
-            break;
+    if (w->converting) {
+        v4l2_convert_destroy(&w->convert);
+        free(w->converted);
+        w->converted = NULL;
+        w->converting = false;
+    }
 
-        fd = open(image_filename, O_WRONLY | O_CREAT | O_TRUNC, 0664);
-        if (-1 == fd) {
-            fprintf(stderr, "cannot open '%s': %s\n", image_filename, strerror(errno));
-            break;
+    /* these are not going to be queued again */
+    count = v4l2_sink_reclaim(&w->sink, indices);
+    for (i = 0; i < count; ++i)
+        v4l2_record_latency(w->device, w->device->frames + indices[i], 0);
+
+    v4l2_sink_close(&w->sink);
+}
+
+static int v4l2_release_buffer(struct v4l2_device* dev, unsigned index)
+{
+    /* the writer, the publisher or consumers of the frame server may still read the frame */
+    if (--dev->frames[index].holds > 0)
+        return 0;
+
+    /* storage keeps up again, buffers added under pressure are put aside */
+    if (v4l2_capture_number_of_buffers(dev->capture) - v4l2_capture_parked(dev->capture) >
+            (unsigned)dev->initial_buffers && dev->queued >= dev->high_watermark) {
+        int removed = v4l2_capture_park(dev->capture, &dev->frames[index].borrowed);
+        if (removed < 0) {
+            fprintf(stderr, "v4l2_capture_park() failed\n");
+            return -1;
         }
 
-        for (i = 0; i < iovcnt && iov[i].iov_base; ++i) {
-            if (-1 == write(fd, iov[i].iov_base, iov[i].iov_len)) {
-                fprintf(stderr, "write() failed: %s\n", strerror(errno));
-                break;
-            }
+        /* consumers of the frame server are not sent frames of that buffer any more */
+        if (removed && frame_server_path)
+            v4l2_frame_server_remove_buffer(&dev->server, index);
+
+        if (verbosity > 0)
+            fprintf(stdout, "%s: %d buffer(s) queued, buffer %u %s (%u parked in total)\n",
+                dev->filename, dev->queued, index, removed ? "removed" : "parked",
+                v4l2_capture_parked(dev->capture));
+
+        v4l2_record_latency(dev, dev->frames + index, 0);
+        return 0;
+    }
+
+    /* goes to the next free slot of mmap storage, see v4l2_prepare_buffer() */
+    if (v4l2_capture_return(dev->capture, &dev->frames[index].borrowed)) {
+        fprintf(stderr, "v4l2_capture_return() failed\n");
+        return -1;
+    }
+    v4l2_record_latency(dev, dev->frames + index, v4l2_monotonic_ns());
+
+    return 0;
+}
+
+static int v4l2_reclaim_buffers(struct v4l2_device* dev, struct v4l2_sink* sink)
+{
+    unsigned indices[VIDEO_MAX_FRAME];
+    unsigned count;
+    unsigned i;
+
+    count = v4l2_sink_reclaim(sink, indices);
+    for (i = 0; i < count; ++i)
+        if (v4l2_release_buffer(dev, indices[i]))
+            return -1;
+
+    return 0;
+}
+
+static uint64_t v4l2_query_frame_interval(struct v4l2_device* dev)
+{
+    struct v4l2_streamparm parm;
+    struct v4l2_fract* timeperframe;
+
+    memset(&parm, 0, sizeof(parm));
+    parm.type = dev->buf_type;
+
+    if (-1 == ioctl(dev->fd, VIDIOC_G_PARM, &parm)) {
+        fprintf(stderr, "VIDIOC_G_PARM failed: %s\n", strerror(errno));
+        return 0;
+    }
+
+    timeperframe = &parm.parm.capture.timeperframe;
+    if (!(parm.parm.capture.capability & V4L2_CAP_TIMEPERFRAME) ||
+        timeperframe->numerator == 0 || timeperframe->denominator == 0)
+        return 0;
+
+    fprintf(stdout, "frame interval: %u/%u [s]\n", timeperframe->numerator, timeperframe->denominator);
+
+    return NSEC_PER_SEC * timeperframe->numerator / timeperframe->denominator;
+}
+
+static void v4l2_set_frame_interval(struct v4l2_device* dev)
+{
+    struct v4l2_streamparm parm;
+
+    memset(&parm, 0, sizeof(parm));
+    parm.type = dev->buf_type;
+    parm.parm.capture.timeperframe = dev->selected_format.timeperframe;
+
+    /* driver picks the closest interval it supports, v4l2_query_frame_interval() reports it */
+    if (-1 == ioctl(dev->fd, VIDIOC_S_PARM, &parm))
+        fprintf(stderr, "VIDIOC_S_PARM failed: %s\n", strerror(errno)); /* threat this as non-fatal error */
+    else
+    if (!(parm.parm.capture.capability & V4L2_CAP_TIMEPERFRAME))
+        fprintf(stderr, "%s does not support setting of frame interval\n", dev->filename);
+}
+
+static int v4l2_open_device(struct v4l2_device* dev, int number_of_buffers, bool use_compressed_formats,
+    enum v4l2_storage_mode storage, uint64_t max_size, uint64_t max_duration)
+{
+    uint32_t capabilities;
+    struct v4l2_format format;
+    struct v4l2_capture_config config;
+    struct v4l2_capture_plane planes[VIDEO_MAX_PLANES];
+    unsigned nplanes;
+    unsigned plane;
+    int n;
+
+    /* every device gets its own directory, so that file names do not clash */
+    if (number_of_devices > 1)
+        n = snprintf(dev->directory, sizeof(dev->directory), "%s/cam%u", output_directory, dev->id);
+    else
+        n = snprintf(dev->directory, sizeof(dev->directory), "%s", output_directory);
+    if (n < 0 || (size_t)n >= sizeof(dev->directory)) {
+        fprintf(stderr, "output directory name is too long\n");
+        return -1;
+    }
+
+    if (number_of_devices > 1 && -1 == mkdir(dev->directory, 0775) && errno != EEXIST) {
+        fprintf(stderr, "cannot create '%s': %s\n", dev->directory, strerror(errno));
+        return -1;
+    }
+
+    /* buffers are dequeued until EAGAIN, waiting is left to the event loop */
+    dev->fd = open(dev->filename, O_RDWR | O_NONBLOCK);
+    if (-1 == dev->fd) {
+        fprintf(stderr, "cannot open '%s': %s\n", dev->filename, strerror(errno));
+        return -1;
+    }
+
+    memset(&dev->selected_format, 0, sizeof(dev->selected_format));
+
+    capabilities = v4l2_query_capabilities(dev->fd, use_compressed_formats ? V4L2_FMT_FLAG_COMPRESSED : 0, &dev->selected_format);
+    if (!(capabilities & (V4L2_CAP_VIDEO_CAPTURE | V4L2_CAP_VIDEO_CAPTURE_MPLANE)) ||
+        !(capabilities & V4L2_CAP_STREAMING)) {
+        fprintf(stderr, "%s doesn't support video capture or streaming\n", dev->filename);
+        return -1;
+    }
+
+    /*
+     * If driver supports multiplanar format (V4L2_CAP_VIDEO_CAPTURE_MPLANE),
+     * then prefer this one instead of single planar one (V4L2_CAP_VIDEO_CAPTURE)
+     */
+    dev->buf_type =
+        capabilities & V4L2_CAP_VIDEO_CAPTURE_MPLANE ?
+        V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE : V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+    if (dev->selected_format.pixelformat == 0) {
+        fprintf(stderr, "No frame format is selected for capturing\n");
+        return -1;
+    }
+
+    memset(&format, 0, sizeof(format));
+    format.type = dev->buf_type;
+    if (V4L2_TYPE_IS_MULTIPLANAR(dev->buf_type)) {
+        format.fmt.pix.pixelformat = dev->selected_format.pixelformat;
+        format.fmt.pix.width = dev->selected_format.width;
+        format.fmt.pix.height = dev->selected_format.height;
+    } else {
+        format.fmt.pix_mp.pixelformat = dev->selected_format.pixelformat;
+        format.fmt.pix_mp.width = dev->selected_format.width;
+        format.fmt.pix_mp.height = dev->selected_format.height;
+    }
+
+    if (-1 == ioctl(dev->fd, VIDIOC_TRY_FMT, &format)) {
+        fprintf(stderr, "VIDIOC_TRY_FMT failed: %s\n", strerror(errno));
+    }
+
+    fprintf(stdout, "Using following format:\n");
+    v4l2_print_format(&format);
+
+    if (-1 == ioctl(dev->fd, VIDIOC_S_FMT, &format)) {
+        fprintf(stderr, "VIDIOC_S_FMT failed: %s\n", strerror(errno));
+        return -1;
+    }
+
+    /* driver may have adjusted the format, so keep what is really used */
+    if (V4L2_TYPE_IS_MULTIPLANAR(dev->buf_type)) {
+        dev->selected_format.pixelformat = format.fmt.pix_mp.pixelformat;
+        dev->selected_format.width = format.fmt.pix_mp.width;
+        dev->selected_format.height = format.fmt.pix_mp.height;
+        dev->selected_format.bytesperline = format.fmt.pix_mp.plane_fmt[0].bytesperline;
+    } else {
+        dev->selected_format.pixelformat = format.fmt.pix.pixelformat;
+        dev->selected_format.width = format.fmt.pix.width;
+        dev->selected_format.height = format.fmt.pix.height;
+        dev->selected_format.bytesperline = format.fmt.pix.bytesperline;
+    }
+
+    if (dev->selected_format.timeperframe.numerator)
+        v4l2_set_frame_interval(dev);
+
+    dev->frame_interval = v4l2_query_frame_interval(dev);
+    if (dev->frame_interval) {
+        /* rounded up to whole milliseconds */
+        uint64_t timeout = (TIMEOUT_FRAME_INTERVALS * dev->frame_interval + 999999) / 1000000;
+        dev->timeout = timeout > INT_MAX ? INT_MAX : (int)timeout;
+    } else
+        dev->timeout = DEFAULT_TIMEOUT_MS;
+
+    v4l2_writer_init(&dev->writer, dev, storage, max_size, max_duration);
+
+    dev->numa_node = numa_node;
+    if (numa_auto) {
+        dev->numa_node = v4l2_sched_device_node(dev->filename);
+        if (dev->numa_node < 0)
+            fprintf(stderr, "NUMA node of %s is unknown, buffers are not bound\n", dev->filename);
+    }
+    if (dev->numa_node >= 0)
+        fprintf(stdout, "buffers are bound to NUMA node %d\n", dev->numa_node);
+
+    /* format is set already, the capture takes it as it is */
+    memset(&config, 0, sizeof(config));
+    config.filename = dev->filename;
+    config.memory = dev->memory;
+    config.number_of_buffers = number_of_buffers;
+    config.export_buffers = frame_server_path != NULL; /* consumers of the frame server get the buffers as dmabufs */
+    config.hugepages = hugepages;
+    config.dmabuf_source = dmabuf_source;
+    config.dmabuf_heap = dmabuf_heap;
+    config.bind_memory = dev->numa_node >= 0;
+    config.numa_node = dev->numa_node;
+    config.hugepage_stats = &dev->hugepage_stats;
+    config.buffer_budget = buffer_budget;
+    config.prepare = dev->writer.storage == V4L2_STORAGE_MODE_MMAP ? v4l2_prepare_buffer : NULL;
+    config.queued = v4l2_account_queue;
+    config.dequeued = v4l2_account_dequeue;
+    config.arg = dev;
+
+    /* the capture owns dev->fd from now on, it is closed by v4l2_capture_close() */
+    dev->capture = v4l2_capture_attach(dev->fd, &config);
+    if (NULL == dev->capture) {
+        fprintf(stderr, "v4l2_capture_attach() failed\n");
+        return -1;
+    }
+
+    dev->initial_buffers = v4l2_capture_number_of_buffers(dev->capture);
+    fprintf(stdout,
+        "VIDIOC_REQBUFS:\n"
+        "\trequested count: %d, commited count: %d\n",
+        number_of_buffers, dev->initial_buffers
+        );
+
+    if (dev->memory == V4L2_MEMORY_DMABUF) {
+        char name[NAME_MAX + 16];
+
+        fprintf(stdout, "DMABUF buffers are allocated from %s\n",
+            v4l2_capture_dmabuf_name(dev->capture, name, sizeof(name)));
+    }
+
+    /* heap buffers are allocated by the kernel, they have nothing to report */
+    if (hugepages && dev->hugepage_stats.allocations)
+        v4l2_hugepage_print_stats(dev->filename, &dev->hugepage_stats);
+
+    for (n = 0; n < dev->initial_buffers; ++n) {
+        nplanes = v4l2_capture_buffer(dev->capture, n, planes);
+        for (plane = 0; plane < nplanes; ++plane)
+            fprintf(stdout, "buffer[%d:%u]: %zu bytes at %p, fd %d\n",
+                n, plane, planes[plane].size, planes[plane].addr, planes[plane].fd);
+    }
+
+    /* buffers created later have the same planes */
+    nplanes = v4l2_capture_buffer(dev->capture, 0, planes);
+    dev->buffer_size = 0;
+    for (plane = 0; plane < nplanes; ++plane)
+        dev->buffer_size += planes[plane].size;
+
+    /* slot layout is set up once, before the first buffer is queued */
+    if (dev->writer.storage == V4L2_STORAGE_MODE_MMAP) {
+        size_t plane_sizes[VIDEO_MAX_PLANES];
+
+        for (plane = 0; plane < nplanes; ++plane)
+            plane_sizes[plane] = planes[plane].size;
+
+        if (v4l2_mmap_segment_init(&dev->writer.mmap, dev->directory,
+                dev->selected_format.pixelformat, dev->selected_format.width, dev->selected_format.height,
+                plane_sizes, nplanes, dev->writer.segment.max_size))
+            return -1;
+    }
+
+    /* room for buffers added later by v4l2_grow_buffers() */
+    dev->frames = calloc(VIDEO_MAX_FRAME, sizeof(*dev->frames));
+    if (NULL == dev->frames) {
+        fprintf(stderr, "calloc(%u, %zu) failed\n",
+            VIDEO_MAX_FRAME, sizeof(*dev->frames));
+        return -1;
+    }
+
+    dev->low_watermark = low_watermark > 0 ? low_watermark : (dev->initial_buffers + 1) / 2;
+    dev->high_watermark = high_watermark > dev->low_watermark ? high_watermark : dev->initial_buffers;
+    if (dev->high_watermark <= dev->low_watermark)
+        dev->high_watermark = dev->low_watermark + 1;
+
+    if (shm_ring_name && v4l2_create_shm_ring(dev)) {
+        fprintf(stderr, "v4l2_create_shm_ring() failed\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+static FILE* v4l2_open_aligner(uint64_t tolerance)
+{
+    char filename[PATH_MAX];
+    FILE* groups;
+    int depth = VIDEO_MAX_FRAME;
+    int i;
+    int n;
+
+    for (i = 0; i < number_of_devices; ++i) {
+        /* half of the buffers keep circulating while the others wait for their peers */
+        if (depth > (int)v4l2_capture_number_of_buffers(devices[i].capture) / 2)
+            depth = v4l2_capture_number_of_buffers(devices[i].capture) / 2;
+
+        if (devices[i].frame_interval &&
+            (tolerance == 0 || tolerance > devices[i].frame_interval / 2))
+            tolerance = devices[i].frame_interval / 2;
+    }
+
+    if (tolerance == 0)
+        tolerance = DEFAULT_ALIGN_TOLERANCE_US * 1000ULL;
+
+    n = snprintf(filename, sizeof(filename), "%s/groups.txt", output_directory);
+    if (n < 0 || (size_t)n >= sizeof(filename)) {
+        fprintf(stderr, "output directory name is too long\n");
+        return NULL;
+    }
+
+    groups = fopen(filename, "w");
+    if (NULL == groups) {
+        fprintf(stderr, "cannot open '%s': %s\n", filename, strerror(errno));
+        return NULL;
+    }
+
+    if (v4l2_aligner_init(&aligner, number_of_devices, tolerance, depth, v4l2_emit_frames, groups)) {
+        fclose(groups);
+        return NULL;
+    }
+
+    /* one line per group: frame number and timestamp [ns] of every device */
+    fprintf(groups, "#");
+    for (i = 0; i < number_of_devices; ++i)
+        fprintf(groups, " cam%d:frame cam%d:timestamp", i, i);
+    fprintf(groups, "\n");
+
+    fprintf(stdout, "aligning %d devices, tolerance: %llu [us]\n",
+        number_of_devices, (unsigned long long)(tolerance / 1000));
+
+    return groups;
+}
+
+static void v4l2_emit_frames(void* arg, const struct v4l2_aligner_entry* entries, unsigned count)
+{
+    FILE* groups = arg;
+    unsigned i;
+
+    if (count == (unsigned)number_of_devices) {
+        for (i = 0; i < count; ++i) {
+            const struct v4l2_frame* frame = devices[entries[i].stream].frames + entries[i].index;
+            fprintf(groups, "%s%d %llu", i ? " " : "", frame->counter, (unsigned long long)frame->timestamp);
         }
-    } while (0);
+        fprintf(groups, "\n");
+    }
 
-    if (fd != -1)
-        close(fd);
+    /* all frames of a group are handed over together, unmatched ones on their own */
+    for (i = 0; i < count; ++i)
+        v4l2_hand_over_frame(devices + entries[i].stream, entries[i].index);
 }
 
-static int v4l2_video_capture(int fd, int number_of_frames, enum v4l2_buf_type buf_type, enum v4l2_memory memory)
+static void v4l2_hand_over_frame(struct v4l2_device* dev, unsigned index)
 {
-    struct v4l2_iovec iov[VIDEO_MAX_PLANES];
+    /* the buffer comes back once the writer is done with it, right away if it is not taken */
+    v4l2_sink_hand_over(&dev->writer.sink, index);
+}
+
+static int v4l2_on_device_ready(void* arg, int fd, uint32_t events)
+{
+    struct v4l2_device* dev = arg;
+    struct v4l2_frame frame;
+    int dequeued = 0;
     int status;
+
+    (void)fd;
+
+    /* drain everything the driver has filled so far */
+    while (v4l2_capturing(dev)) {
+        status = v4l2_dequeue_frame(dev, &frame);
+        if (status < 0) {
+            fprintf(stderr, "v4l2_dequeue_frame() failed\n");
+            return -1;
+        }
+        else
+        if (status == 0) {
+            frame.counter = ++dev->captured;
+            v4l2_telemetry_add(&dev->telemetry.frames, 1);
+            v4l2_telemetry_add(&dev->telemetry.bytes, v4l2_frame_size(&frame));
+            dev->frames[frame.index] = frame;
+            /* held by us while it is offered around, every sink taking it holds it as well */
+            dev->frames[frame.index].holds = 1;
+            if (frame_server_path && v4l2_publish_frame(dev, &frame) > 0)
+                dev->frames[frame.index].holds++;
+            if (shm_ring_name && v4l2_offer_frame(dev, &dev->publisher, frame.index))
+                return -1;
+            if (number_of_devices > 1) {
+                /* goes to the writer thread once grouped (or found unmatchable), held until it comes back */
+                dev->frames[frame.index].holds++;
+                v4l2_aligner_push(&aligner, dev->id, frame.index, frame.timestamp);
+            } else
+            if (v4l2_offer_frame(dev, &dev->writer.sink, frame.index))
+                return -1;
+            /* our own hold, if nobody took the frame the buffer goes straight back to the driver */
+            if (v4l2_release_buffer(dev, frame.index))
+                return -1;
+        }
+        else
+        if (status == 2)
+            break;
+
+        dequeued++;
+    }
+
+    /* storage falls behind, give the driver more buffers before it runs dry */
+    if (buffer_budget && dev->queued < dev->low_watermark &&
+        v4l2_capturing(dev) && v4l2_grow_buffers(dev))
+        return -1;
+
+    if (dequeued == 0 && (events & EPOLLERR)) {
+        fprintf(stderr, "%s reported an error\n", dev->filename);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int v4l2_on_writer_completion(void* arg, int fd, uint32_t events)
+{
+    struct v4l2_device* dev = arg;
+
+    (void)fd;
+    (void)events;
+
+    return v4l2_reclaim_buffers(dev, &dev->writer.sink);
+}
+
+static int v4l2_on_frame_released(void* arg, unsigned index)
+{
+    struct v4l2_device* dev = arg;
+
+    return v4l2_release_buffer(dev, index);
+}
+
+static int v4l2_serve_buffer(struct v4l2_device* dev, unsigned index)
+{
+    struct v4l2_capture_plane planes[VIDEO_MAX_PLANES];
+    int fds[VIDEO_MAX_PLANES];
+    uint32_t sizes[VIDEO_MAX_PLANES];
+    unsigned nplanes;
+    unsigned plane;
+
+    /* mmap buffers are exported for the frame server, see v4l2_open_device() */
+    nplanes = v4l2_capture_buffer(dev->capture, index, planes);
+    for (plane = 0; plane < nplanes; ++plane) {
+        fds[plane] = planes[plane].fd;
+        sizes[plane] = planes[plane].size;
+    }
+
+    return v4l2_frame_server_add_buffer(&dev->server, index, nplanes, fds, sizes);
+}
+
+static unsigned v4l2_publish_frame(struct v4l2_device* dev, const struct v4l2_frame* frame)
+{
+    unsigned nplanes = frame->borrowed.nplanes;
+    uint32_t bytesused[VIDEO_MAX_PLANES];
+    unsigned plane;
+
+    for (plane = 0; plane < nplanes; ++plane)
+        bytesused[plane] = frame->iov[plane].iov_len;
+
+    return v4l2_frame_server_publish(&dev->server, frame->index, frame->sequence, frame->timestamp,
+        nplanes, bytesused);
+}
+
+static int v4l2_start_frame_server(struct v4l2_device* dev)
+{
+    char path[sizeof(dev->server.address.sun_path)];
+    unsigned max_held;
+    int n;
     int i;
 
-    if (-1 == ioctl(fd, VIDIOC_STREAMON, &buf_type)) {
-        fprintf(stderr, "VIDIOC_STREAMON failed: %s\n", strerror(errno));
+    if (number_of_devices > 1)
+        n = snprintf(path, sizeof(path), "%s.cam%u", frame_server_path, dev->id);
+    else
+        n = snprintf(path, sizeof(path), "%s", frame_server_path);
+    if (n < 0 || (size_t)n >= sizeof(path)) {
+        fprintf(stderr, "socket name '%s' is too long\n", frame_server_path);
+        return -1;
+    }
+
+    /* every consumer leaves at least half of the buffers to the others and to the driver */
+    max_held = dev->initial_buffers / 2 ? dev->initial_buffers / 2 : 1;
+
+    if (v4l2_frame_server_open(&dev->server, path, &dev->events, dev->selected_format.pixelformat,
+            dev->selected_format.width, dev->selected_format.height, max_held, v4l2_on_frame_released, dev))
+        return -1;
+
+    for (i = 0; i < (int)v4l2_capture_number_of_buffers(dev->capture); ++i)
+        if (v4l2_serve_buffer(dev, i)) {
+            v4l2_frame_server_close(&dev->server);
+            return -1;
+        }
+
+    fprintf(stdout, "%s: frames are served on '%s'\n", dev->filename, path);
+
+    return 0;
+}
+
+static int v4l2_create_shm_ring(struct v4l2_device* dev)
+{
+    char name[NAME_MAX + 1];
+    int n;
+
+    if (number_of_devices > 1)
+        n = snprintf(name, sizeof(name), "%s.cam%u", shm_ring_name, dev->id);
+    else
+        n = snprintf(name, sizeof(name), "%s", shm_ring_name);
+    if (n < 0 || (size_t)n >= sizeof(name)) {
+        fprintf(stderr, "shared memory name '%s' is too long\n", shm_ring_name);
         return -1;
     }
 
-    i = 0;
-    while (i < number_of_frames) {
-        status = v4l2_capture_frame(fd, iov, ARRAY_SIZE(iov), buf_type, memory);
+    /* a slot takes a frame of the largest size the driver reports */
+    if (v4l2_shm_ring_create(&dev->ring, name, shm_ring_slots, dev->buffer_size,
+            dev->selected_format.pixelformat, dev->selected_format.width, dev->selected_format.height))
+        return -1;
+
+    fprintf(stdout, "%s: frames are published to %s (%u slots, %.1f MiB)\n",
+        dev->filename, dev->ring.name, shm_ring_slots, (double)dev->ring.size / (1 << 20));
+
+    return 0;
+}
+
+static int v4l2_follow_shm_ring(const char* name)
+{
+    struct v4l2_shm_ring_reader reader;
+    struct v4l2_shm_ring_frame frame;
+    enum v4l2_shm_ring_status status;
+    uint64_t frames = 0;
+    uint64_t skipped = 0;
+    uint64_t report;
+    uint32_t sequence = 0;
+    void* data;
+
+    if (v4l2_shm_ring_attach(&reader, name))
+        return -1;
+
+    data = malloc(reader.header->slot_size);
+    if (NULL == data) {
+        fprintf(stderr, "malloc() failed\n");
+        v4l2_shm_ring_detach(&reader);
+        return -1;
+    }
+
+    fprintf(stdout, "%s: %.4s %ux%u, %u slots of %llu bytes\n", name,
+        (const char*)&reader.header->pixelformat, reader.header->width, reader.header->height,
+        reader.header->number_of_slots, (unsigned long long)reader.header->slot_size);
+
+    report = v4l2_monotonic_ns() + NSEC_PER_SEC;
+
+    do {
+        status = v4l2_shm_ring_next(&reader, data, reader.header->slot_size, &frame);
+
+        if (status == V4L2_SHM_RING_OK) {
+            /* gaps in sequence are frames which never made it to the ring, not overruns of this reader */
+            if (frames > 0 && frame.sequence - sequence > 1)
+                skipped += frame.sequence - sequence - 1;
+            sequence = frame.sequence;
+            frames++;
+        } else if (status == V4L2_SHM_RING_AGAIN)
+            usleep(1000);
+
+        if (status == V4L2_SHM_RING_CLOSED || v4l2_monotonic_ns() >= report) {
+            fprintf(stdout, "%s: %llu frame(s) read, %llu overrun, %llu not published, last sequence %u%s\n", name,
+                (unsigned long long)frames, (unsigned long long)reader.overruns, (unsigned long long)skipped,
+                sequence, status == V4L2_SHM_RING_CLOSED ? ", ring closed" : "");
+            report += NSEC_PER_SEC;
+        }
+    } while (status != V4L2_SHM_RING_CLOSED);
+
+    free(data);
+    v4l2_shm_ring_detach(&reader);
+
+    return 0;
+}
+
+static int v4l2_offer_frame(struct v4l2_device* dev, struct v4l2_sink* sink, unsigned index)
+{
+    int replaced;
+
+    if (v4l2_sink_offer(sink, index, &replaced))
+        dev->frames[index].holds++;
+
+    /* the sink gave up on an older frame it did not get to */
+    if (replaced != -1)
+        return v4l2_release_buffer(dev, replaced);
+
+    return 0;
+}
+
+static bool v4l2_publish_to_ring(void* arg, unsigned index)
+{
+    struct v4l2_device* dev = arg;
+    const struct v4l2_frame* frame = dev->frames + index;
+    struct iovec iov[VIDEO_MAX_PLANES];
+    size_t i;
+
+    for (i = 0; i < ARRAY_SIZE(iov); ++i) {
+        iov[i].iov_base = frame->iov[i].iov_base;
+        iov[i].iov_len = frame->iov[i].iov_len;
+    }
+
+    v4l2_shm_ring_publish(&dev->ring, iov, ARRAY_SIZE(iov), frame->sequence, frame->timestamp);
+
+    return true;
+}
+
+static int v4l2_on_publisher_completion(void* arg, int fd, uint32_t events)
+{
+    struct v4l2_device* dev = arg;
+
+    (void)fd;
+    (void)events;
+
+    return v4l2_reclaim_buffers(dev, &dev->publisher);
+}
+
+static int v4l2_start_publisher(struct v4l2_device* dev)
+{
+    /* copying to the ring is left to a thread of its own, so that neither capture nor storage waits for it */
+    if (v4l2_sink_open(&dev->publisher, "shm-ring", shm_ring_policy, shm_ring_max_held,
+            v4l2_publish_to_ring, NULL, dev, writer_cpus_set ? &writer_cpus : NULL))
+        return -1;
+
+    if (v4l2_sink_start(&dev->publisher)) {
+        v4l2_sink_close(&dev->publisher);
+        return -1;
+    }
+
+    if (v4l2_event_loop_add(&dev->events, dev->publisher.completion_fd, EPOLLIN, v4l2_on_publisher_completion, dev)) {
+        v4l2_sink_stop(&dev->publisher);
+        v4l2_sink_close(&dev->publisher);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int v4l2_start_capture(struct v4l2_device* dev)
+{
+    unsigned stage;
+
+    dev->captured = 0;
+    dev->deadline = dev->duration ? v4l2_monotonic_ns() + dev->duration : 0;
+    for (stage = 0; stage < V4L2_LATENCY_STAGES; ++stage)
+        v4l2_histogram_init(&dev->latency[stage]);
+
+    if (v4l2_event_loop_init(&dev->events))
+        return -1;
+
+    if (v4l2_writer_start(&dev->writer, v4l2_capture_number_of_buffers(dev->capture))) {
+        fprintf(stderr, "v4l2_writer_start() failed\n");
+        v4l2_event_loop_close(&dev->events);
+        return -1;
+    }
+
+    if (v4l2_event_loop_add(&dev->events, v4l2_capture_fd(dev->capture), EPOLLIN, v4l2_on_device_ready, dev) ||
+        v4l2_event_loop_add(&dev->events, dev->writer.sink.completion_fd, EPOLLIN, v4l2_on_writer_completion, dev)) {
+        v4l2_writer_stop(&dev->writer);
+        v4l2_event_loop_close(&dev->events);
+        return -1;
+    }
+
+    /* every capture thread watches the triggers, so that they keep working as long as any of them runs */
+    if ((pretrigger_window && v4l2_trigger_watch(&trigger, &dev->events)) ||
+        v4l2_trigger_watch(&shutdown_request, &dev->events)) {
+        v4l2_writer_stop(&dev->writer);
+        v4l2_event_loop_close(&dev->events);
+        return -1;
+    }
+
+    if (shm_ring_name && v4l2_start_publisher(dev)) {
+        fprintf(stderr, "v4l2_start_publisher() failed\n");
+        v4l2_writer_stop(&dev->writer);
+        v4l2_event_loop_close(&dev->events);
+        return -1;
+    }
+
+    if (frame_server_path && v4l2_start_frame_server(dev)) {
+        fprintf(stderr, "v4l2_start_frame_server() failed\n");
+        if (shm_ring_name) {
+            v4l2_sink_stop(&dev->publisher);
+            v4l2_sink_close(&dev->publisher);
+        }
+        v4l2_writer_stop(&dev->writer);
+        v4l2_event_loop_close(&dev->events);
+        return -1;
+    }
+
+    /* buffers are queued right before streaming starts, so slots of mmap storage are taken in order */
+    if (v4l2_capture_start(dev->capture)) {
+        fprintf(stderr, "v4l2_capture_start() failed\n");
+        if (frame_server_path)
+            v4l2_frame_server_close(&dev->server);
+        if (shm_ring_name) {
+            v4l2_sink_stop(&dev->publisher);
+            v4l2_sink_close(&dev->publisher);
+        }
+        v4l2_writer_stop(&dev->writer);
+        v4l2_event_loop_close(&dev->events);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void* v4l2_capture_thread(void* arg)
+{
+    struct v4l2_device* dev = arg;
+    struct v4l2_sched_stats start;
+    struct v4l2_sched_stats end;
+    int status;
+
+    dev->retval = 0;
+
+    v4l2_sched_apply(dev->filename, capture_cpus_set ? &capture_cpus : NULL, fifo_priority);
+    v4l2_sched_sample(&start);
+
+    while (v4l2_capturing(dev)) {
+        /* startup of the stream usually takes longer than a frame interval */
+        int timeout = dev->captured || dev->timeout > DEFAULT_TIMEOUT_MS ? dev->timeout : DEFAULT_TIMEOUT_MS;
+
+        /* a stalled device does not keep us waiting past the deadline */
+        if (dev->deadline) {
+            uint64_t now = v4l2_monotonic_ns();
+            uint64_t left = dev->deadline > now ? dev->deadline - now : 0;
+            if (left < (uint64_t)timeout * 1000000)
+                timeout = left / 1000000 + 1;
+        }
+
+        status = v4l2_event_loop_run(&dev->events, timeout);
         if (status < 0) {
-            fprintf(stderr, "v4l2_capture_frame() failed\n");
+            dev->retval = -1;
             break;
         }
         else
-        if (status == 0) {
-            v4l2_store_frame(selected_format.pixelformat, iov, ARRAY_SIZE(iov), i + 1);
-            i++;
+        if (status == 0 && v4l2_capturing(dev)) {
+            dev->drops.timeouts++;
+            v4l2_telemetry_add(&dev->telemetry.timeouts, 1);
+            fprintf(stderr, "%s: no data within %d ms, timeout expired (total: %llu)\n",
+                dev->filename, timeout, (unsigned long long)dev->drops.timeouts);
+            /* threat this as non-fatal error, but do not let a stalled device hold our buffers */
+            if (number_of_devices > 1)
+                v4l2_aligner_flush(&aligner);
         }
-        else {
-            /* do nothing (try to capture frame again) */
+    }
+
+    v4l2_sched_sample(&end);
+    v4l2_sched_diff(&dev->capture_sched, &start, &end);
+
+    return NULL;
+}
+
+static int v4l2_stop_capture(struct v4l2_device* dev)
+{
+    int retval = 0;
+
+    /* wait until all frames handed over to the writer thread are written out */
+    v4l2_writer_stop(&dev->writer);
+
+    /* ... and all frames taken by the publisher are in the ring, frames it is done with are not queued again */
+    if (shm_ring_name) {
+        v4l2_sink_stop(&dev->publisher);
+        v4l2_sink_close(&dev->publisher);
+        v4l2_sink_print_stats(dev->filename, &dev->publisher);
+        fprintf(stdout, "%s: %llu frame(s) published to %s, %llu too large for a slot\n",
+            dev->filename, (unsigned long long)dev->ring.published, dev->ring.name,
+            (unsigned long long)dev->ring.oversized);
+    }
+
+    /* frames consumers still hold are not going to be released */
+    if (frame_server_path) {
+        v4l2_frame_server_print_stats(dev->filename, &dev->server);
+        v4l2_frame_server_close(&dev->server);
+    }
+
+    v4l2_event_loop_close(&dev->events);
+
+    if (dev->starved_since) {
+        dev->drops.starved_ns += v4l2_monotonic_ns() - dev->starved_since;
+        dev->starved_since = 0;
+    }
+
+    if (v4l2_capture_stop(dev->capture))
+        retval = -1;
+
+    /* slots still held by buffers which were queued when streaming stopped are dropped */
+    if (dev->writer.storage == V4L2_STORAGE_MODE_MMAP)
+        v4l2_mmap_segment_close(&dev->writer.mmap);
+
+    return retval;
+}
+
+static int v4l2_video_capture(void)
+{
+    int retval = 0;
+    int started;
+    int running;
+    int status;
+    int i;
+
+    /* all devices are started before any frame is captured, to make their streams overlap */
+    for (started = 0; started < number_of_devices; ++started)
+        if (v4l2_start_capture(devices + started)) {
+            retval = -1;
+            break;
+        }
+
+    if (retval == 0 && telemetry_filename && v4l2_start_telemetry())
+        retval = -1;
+
+    running = 0;
+    if (retval == 0)
+        for (; running < number_of_devices; ++running) {
+            status = pthread_create(&devices[running].thread, NULL, v4l2_capture_thread, devices + running);
+            if (status) {
+                fprintf(stderr, "pthread_create() failed: %s\n", strerror(status));
+                retval = -1;
+                break;
+            }
+        }
+
+    for (i = 0; i < running; ++i) {
+        pthread_join(devices[i].thread, NULL);
+        if (devices[i].retval)
+            retval = -1;
+    }
+
+    /* frames still waiting for their peers are stored alone */
+    if (number_of_devices > 1)
+        v4l2_aligner_flush(&aligner);
+
+    for (i = 0; i < started; ++i) {
+        if (v4l2_stop_capture(devices + i))
+            retval = -1;
+        v4l2_print_latency(devices + i);
+        v4l2_print_drops(devices + i);
+        v4l2_print_scheduling(devices + i);
+    }
+
+    /* last record covers frames drained while stopping as well */
+    if (telemetry_filename)
+        v4l2_telemetry_stop(&telemetry);
+
+    if (latency_histogram_filename && started == number_of_devices)
+        if (v4l2_dump_latency(latency_histogram_filename))
+            retval = -1;
+
+    return retval;
+}
+
+static void v4l2_record_latency(struct v4l2_device* dev, const struct v4l2_frame* frame, uint64_t requeued)
+{
+    /* driver timestamps taken from any other clock cannot be compared with ours */
+    if ((frame->flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) == V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC &&
+        frame->timestamp <= frame->dequeued) {
+        v4l2_record_stage(dev, V4L2_LATENCY_DRIVER_TO_DQBUF, frame->dequeued - frame->timestamp);
+        if (frame->store_done)
+            v4l2_record_stage(dev, V4L2_LATENCY_DRIVER_TO_STORED, frame->store_done - frame->timestamp);
+    }
+
+    /* frames skipped by the writer never got to the storage */
+    if (frame->store_done == 0)
+        return;
+
+    v4l2_record_stage(dev, V4L2_LATENCY_DQBUF_TO_STORE, frame->store_start - frame->dequeued);
+    v4l2_record_stage(dev, V4L2_LATENCY_STORE, frame->store_done - frame->store_start);
+
+    if (requeued)
+        v4l2_record_stage(dev, V4L2_LATENCY_STORE_TO_QBUF, requeued - frame->store_done);
+}
+
+static void v4l2_print_latency(const struct v4l2_device* dev)
+{
+    unsigned stage;
+
+    static const char* stages[] = {
+        [V4L2_LATENCY_DRIVER_TO_DQBUF]  = "driver -> dqbuf",
+        [V4L2_LATENCY_DQBUF_TO_STORE]   = "dqbuf -> store start",
+        [V4L2_LATENCY_STORE]            = "store start -> stored",
+        [V4L2_LATENCY_STORE_TO_QBUF]    = "stored -> qbuf",
+        [V4L2_LATENCY_DRIVER_TO_STORED] = "driver -> stored",
+    };
+
+    fprintf(stdout, "%s latency [us]:\n", dev->filename);
+    fprintf(stdout, "\t%-24s %10s %10s %10s %10s %10s %10s\n",
+        "stage", "count", "p50", "p90", "p99", "p99.9", "max");
+
+    for (stage = 0; stage < V4L2_LATENCY_STAGES; ++stage) {
+        const struct v4l2_histogram* h = &dev->latency[stage];
+
+        if (h->count == 0) {
+            fprintf(stdout, "\t%-24s %10s\n", stages[stage], "-");
+            continue;
+        }
+
+        fprintf(stdout, "\t%-24s %10llu %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+            stages[stage], (unsigned long long)h->count,
+            v4l2_histogram_percentile(h, 50.0) / 1000.0,
+            v4l2_histogram_percentile(h, 90.0) / 1000.0,
+            v4l2_histogram_percentile(h, 99.0) / 1000.0,
+            v4l2_histogram_percentile(h, 99.9) / 1000.0,
+            h->max / 1000.0);
+    }
+}
+
+static int v4l2_dump_latency(const char* filename)
+{
+    FILE* file;
+    int i;
+    unsigned stage;
+    unsigned bucket;
+
+    file = fopen(filename, "w");
+    if (NULL == file) {
+        fprintf(stderr, "cannot open '%s': %s\n", filename, strerror(errno));
+        return -1;
+    }
+
+    /* non-empty buckets only, values in nanoseconds */
+    fprintf(file, "# device stage lower upper count\n");
+    for (i = 0; i < number_of_devices; ++i)
+        for (stage = 0; stage < V4L2_LATENCY_STAGES; ++stage)
+            for (bucket = 0; bucket < V4L2_HISTOGRAM_BUCKETS; ++bucket) {
+                uint64_t lower;
+                uint64_t upper;
+
+                if (devices[i].latency[stage].buckets[bucket] == 0)
+                    continue;
+
+                v4l2_histogram_bucket_range(bucket, &lower, &upper);
+                fprintf(file, "%d %u %llu %llu %llu\n", i, stage,
+                    (unsigned long long)lower, (unsigned long long)upper,
+                    (unsigned long long)devices[i].latency[stage].buckets[bucket]);
+            }
+
+    fclose(file);
+    return 0;
+}
+
+/* called back by the capture for every VIDIOC_DQBUF, see v4l2_capture_config */
+static void v4l2_account_dequeue(void* arg, const struct v4l2_buffer* buffer)
+{
+    struct v4l2_device* dev = arg;
+    struct v4l2_drop_stats* drops = &dev->drops;
+    uint64_t now = v4l2_monotonic_ns();
+
+    dev->dequeued = now;
+
+    if (verbosity > 0) {
+        fprintf(stdout, "VIDIOC_DQBUF:\n");
+        v4l2_print_buffer(buffer);
+    }
+
+    if (dev->sequence_valid) {
+        /* unsigned arithmetic copes with the counter wrapping around */
+        uint32_t gap = buffer->sequence - dev->last_sequence - 1;
+
+        if (gap && gap < (1U << 31)) {
+            drops->lost += gap;
+            v4l2_telemetry_add(&dev->telemetry.lost, gap);
+            drops->gaps++;
+            /* losses while the driver had no buffer point at storage, not at the capture thread */
+            if (dev->starved)
+                drops->lost_starved += gap;
+            fprintf(stderr, "%s: %u frame(s) lost before sequence %u (total: %llu)\n",
+                dev->filename, gap, buffer->sequence, (unsigned long long)drops->lost);
+            if (trigger_on_drop)
+                v4l2_trigger_fire(&trigger);
         }
     }
 
-    if (-1 == ioctl(fd, VIDIOC_STREAMOFF, &buf_type)) {
-        fprintf(stderr, "VIDIOC_STREAMOFF failed: %s\n", strerror(errno));
+    dev->sequence_valid = true;
+    dev->last_sequence = buffer->sequence;
+    dev->starved = false;
+
+    if (buffer->flags & V4L2_BUF_FLAG_ERROR) {
+        drops->erroneous++;
+        v4l2_telemetry_add(&dev->telemetry.erroneous, 1);
+        if (trigger_on_drop)
+            v4l2_trigger_fire(&trigger);
+    }
+
+    if (--dev->queued == 0) {
+        /* all buffers are held by us, the driver has nowhere to put the next frame */
+        dev->starved = true;
+        dev->starved_since = now;
+        drops->starvations++;
+        v4l2_telemetry_add(&dev->telemetry.starvations, 1);
+    }
+
+    atomic_store_explicit(&dev->telemetry.queued, dev->queued, memory_order_relaxed);
+}
+
+/* ... and for every VIDIOC_QBUF */
+static void v4l2_account_queue(void* arg, const struct v4l2_buffer* buffer)
+{
+    struct v4l2_device* dev = arg;
+
+    (void)buffer;
+
+    if (dev->queued++ == 0 && dev->starved_since) {
+        dev->drops.starved_ns += v4l2_monotonic_ns() - dev->starved_since;
+        dev->starved_since = 0;
+    }
+
+    atomic_store_explicit(&dev->telemetry.queued, dev->queued, memory_order_relaxed);
+}
+
+static void v4l2_print_drops(const struct v4l2_device* dev)
+{
+    const struct v4l2_drop_stats* drops = &dev->drops;
+
+    fprintf(stdout, "%s drops:\n", dev->filename);
+    fprintf(stdout, "\tframes captured     : %d\n", dev->captured);
+    fprintf(stdout, "\tframes lost         : %llu in %llu gap(s), %llu of them while driver queue was empty\n",
+        (unsigned long long)drops->lost, (unsigned long long)drops->gaps,
+        (unsigned long long)drops->lost_starved);
+    fprintf(stdout, "\terroneous frames    : %llu\n", (unsigned long long)drops->erroneous);
+    fprintf(stdout, "\tdequeue timeouts    : %llu\n", (unsigned long long)drops->timeouts);
+    fprintf(stdout, "\tdriver queue empty  : %llu time(s), %.3f ms in total\n",
+        (unsigned long long)drops->starvations, drops->starved_ns / 1e6);
+    if (dev->writer.sink.policy == V4L2_SINK_DROP_NEW)
+        fprintf(stdout, "\tskipped by writer   : %llu (while holding %u frames)\n",
+            (unsigned long long)dev->writer.sink.skipped, dev->writer.sink.max_held);
+    if (dev->writer.sink.policy == V4L2_SINK_DROP_OLD)
+        fprintf(stdout, "\treplaced for writer : %llu (by newer frames before it got to them)\n",
+            (unsigned long long)dev->writer.sink.replaced);
+    if (buffer_budget)
+        fprintf(stdout, "\tbuffers             : %u allocated (%d initially), %u parked at the end (%u of them removed)\n",
+            v4l2_capture_number_of_buffers(dev->capture) - v4l2_capture_removed(dev->capture), dev->initial_buffers,
+            v4l2_capture_parked(dev->capture), v4l2_capture_removed(dev->capture));
+}
+
+static void v4l2_print_scheduling(const struct v4l2_device* dev)
+{
+    const struct v4l2_sched_stats* threads[] = { &dev->capture_sched, &dev->writer.sink.sched };
+    const char* names[] = { "capture thread", "writer thread" };
+    size_t i;
+
+    fprintf(stdout, "%s scheduling:\n", dev->filename);
+    for (i = 0; i < sizeof(threads) / sizeof(threads[0]); ++i) {
+        const struct v4l2_sched_stats* s = threads[i];
+
+        fprintf(stdout, "\t%-20s: cpu %d, waited %.3f ms for a cpu in %llu timeslice(s) (%.3f ms on average), "
+            "%llu preemption(s), %llu voluntary switch(es)\n",
+            names[i], s->cpu, s->run_delay / 1e6, (unsigned long long)s->timeslices,
+            s->timeslices ? s->run_delay / 1e6 / s->timeslices : 0.0,
+            (unsigned long long)s->nivcsw, (unsigned long long)s->nvcsw);
+    }
+}
+
+static int v4l2_start_telemetry(void)
+{
+    int i;
+
+    if (v4l2_telemetry_init(&telemetry, telemetry_filename, telemetry_format, telemetry_interval,
+            latency_stage_keys, V4L2_LATENCY_STAGES))
+        return -1;
+
+    for (i = 0; i < number_of_devices; ++i)
+        if (v4l2_telemetry_add_source(&telemetry, devices[i].filename,
+                &devices[i].telemetry, &devices[i].writer.sink.taken)) {
+            v4l2_telemetry_stop(&telemetry);
+            return -1;
+        }
+
+    if (v4l2_telemetry_start(&telemetry)) {
+        v4l2_telemetry_stop(&telemetry);
         return -1;
     }
 
@@ -0,0 +1,295 @@
+/* SPDX-License-Identifier: MIT */
+/**
+ * @file v4l2-worker-pool.c
+ *
+ * Stripe-parallel processing of frames (see v4l2-worker-pool.h).
+ */
+
+/*===========================================================================*\
+ * system header files
+\*===========================================================================*/
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*===========================================================================*\
+ * project header files
+\*===========================================================================*/
+#include "v4l2-worker-pool.h"
+#include "v4l2-sched.h"
+
+/*===========================================================================*\
+ * preprocessor #define constants and macros
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * local type definitions
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * global object definitions
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * local function declarations
+\*===========================================================================*/
+static bool v4l2_worker_pool_take(struct v4l2_worker_pool_worker* worker, bool steal, unsigned* stripe);
+static void v4l2_worker_pool_work(struct v4l2_worker_pool* pool, struct v4l2_worker_pool_worker* worker);
+static void* v4l2_worker_pool_thread(void* arg);
+
+/*===========================================================================*\
+ * local object definitions
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * inline function definitions
+\*===========================================================================*/
+static inline uint64_t v4l2_worker_pool_range(uint32_t first, uint32_t end)
+{
+    return (uint64_t)end << 32 | first;
+}
+
+/*===========================================================================*\
+ * public function definitions
+\*===========================================================================*/
+int v4l2_worker_pool_init(struct v4l2_worker_pool* pool, const char* name, unsigned number_of_workers,
+    const cpu_set_t* cpus)
+{
+    unsigned i;
+    int status;
+
+    memset(pool, 0, sizeof(*pool));
+
+    if (number_of_workers < 1 || number_of_workers > V4L2_WORKER_POOL_MAX_WORKERS)
+        return -1;
+
+    /* every worker on a cache line of its own, stealing bounces only the lines of the victims */
+    pool->workers = aligned_alloc(_Alignof(struct v4l2_worker_pool_worker),
+        number_of_workers * sizeof(*pool->workers));
+    if (NULL == pool->workers) {
+        fprintf(stderr, "aligned_alloc() failed\n");
+        return -1;
+    }
+
+    memset(pool->workers, 0, number_of_workers * sizeof(*pool->workers));
+    pool->name = name;
+    pool->cpus = cpus;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->done, NULL);
+
+    for (i = 0; i < number_of_workers; ++i) {
+        pool->workers[i].pool = pool;
+        pool->workers[i].id = i;
+        atomic_init(&pool->workers[i].range, 0);
+    }
+
+    atomic_init(&pool->remaining, 0);
+    pool->number_of_workers = 1;
+
+    /* worker 0 is whoever calls v4l2_worker_pool_run() */
+    for (i = 1; i < number_of_workers; ++i) {
+        status = pthread_create(&pool->workers[i].thread, NULL, v4l2_worker_pool_thread, pool->workers + i);
+        if (status) {
+            fprintf(stderr, "pthread_create() failed: %s\n", strerror(status));
+            v4l2_worker_pool_destroy(pool);
+            return -1;
+        }
+        pool->number_of_workers++;
+    }
+
+    return 0;
+}
+
+void v4l2_worker_pool_destroy(struct v4l2_worker_pool* pool)
+{
+    unsigned i;
+
+    if (NULL == pool->workers)
+        return;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = true;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (i = 1; i < pool->number_of_workers; ++i)
+        pthread_join(pool->workers[i].thread, NULL);
+
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->start);
+    pthread_mutex_destroy(&pool->lock);
+
+    free(pool->workers);
+    pool->workers = NULL;
+    pool->number_of_workers = 0;
+}
+
+void v4l2_worker_pool_run(struct v4l2_worker_pool* pool, v4l2_worker_pool_stage_t stage, void* arg,
+    unsigned rows, unsigned stripe_rows)
+{
+    unsigned n = pool->number_of_workers;
+    unsigned stripes;
+    unsigned i;
+
+    if (rows == 0)
+        return;
+
+    if (stripe_rows == 0)
+        stripe_rows = rows;
+
+    stripes = (rows + stripe_rows - 1) / stripe_rows;
+
+    /* the frame is published by the ranges, whoever finds a stripe in them sees all of it */
+    pool->stage = stage;
+    pool->arg = arg;
+    pool->rows = rows;
+    pool->stripe_rows = stripe_rows;
+    atomic_store(&pool->remaining, stripes);
+
+    for (i = 0; i < n; ++i)
+        atomic_store(&pool->workers[i].range,
+            v4l2_worker_pool_range((uint64_t)i * stripes / n, (uint64_t)(i + 1) * stripes / n));
+
+    if (n > 1) {
+        pthread_mutex_lock(&pool->lock);
+        pool->generation++;
+        pthread_cond_broadcast(&pool->start);
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    v4l2_worker_pool_work(pool, pool->workers);
+
+    pthread_mutex_lock(&pool->lock);
+    while (atomic_load(&pool->remaining) > 0)
+        pthread_cond_wait(&pool->done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+
+    pool->frames++;
+}
+
+void v4l2_worker_pool_print_stats(const char* name, const struct v4l2_worker_pool* pool)
+{
+    uint64_t stripes = 0;
+    uint64_t stolen = 0;
+    uint64_t least = UINT64_MAX;
+    uint64_t most = 0;
+    unsigned i;
+
+    for (i = 0; i < pool->number_of_workers; ++i) {
+        const struct v4l2_worker_pool_worker* worker = pool->workers + i;
+
+        stripes += worker->stripes;
+        stolen += worker->stolen;
+        if (worker->stripes < least)
+            least = worker->stripes;
+        if (worker->stripes > most)
+            most = worker->stripes;
+    }
+
+    fprintf(stdout, "%s: %s: %u worker(s), %llu frame(s) in %llu stripe(s), %llu stolen, %llu to %llu stripe(s) per worker\n",
+        name, pool->name, pool->number_of_workers,
+        (unsigned long long)pool->frames, (unsigned long long)stripes, (unsigned long long)stolen,
+        (unsigned long long)(pool->number_of_workers ? least : 0), (unsigned long long)most);
+}
+
+/*===========================================================================*\
+ * local function definitions
+\*===========================================================================*/
+/* owner takes stripes from the front of its range, thieves from the back */
+static bool v4l2_worker_pool_take(struct v4l2_worker_pool_worker* worker, bool steal, unsigned* stripe)
+{
+    uint64_t range = atomic_load(&worker->range);
+    uint64_t next;
+
+    do {
+        uint32_t first = (uint32_t)range;
+        uint32_t end = (uint32_t)(range >> 32);
+
+        if (first >= end)
+            return false;
+
+        if (steal) {
+            *stripe = end - 1;
+            next = v4l2_worker_pool_range(first, end - 1);
+        } else {
+            *stripe = first;
+            next = v4l2_worker_pool_range(first + 1, end);
+        }
+    } while (!atomic_compare_exchange_weak(&worker->range, &range, next));
+
+    return true;
+}
+
+static void v4l2_worker_pool_work(struct v4l2_worker_pool* pool, struct v4l2_worker_pool_worker* worker)
+{
+    unsigned n = pool->number_of_workers;
+    unsigned victim = worker->id;
+    unsigned stripe = 0; /* set by every successful take */
+    bool stolen = false;
+
+    for (;;) {
+        unsigned first_row;
+        unsigned last_row;
+
+        if (!v4l2_worker_pool_take(pool->workers + victim, stolen, &stripe)) {
+            unsigned i;
+
+            /* own range is empty, look for the next worker with stripes left */
+            for (i = 1; i < n; ++i) {
+                victim = (worker->id + i) % n;
+                if (v4l2_worker_pool_take(pool->workers + victim, true, &stripe))
+                    break;
+            }
+
+            if (i == n)
+                return;
+
+            stolen = true;
+        }
+
+        first_row = stripe * pool->stripe_rows;
+        last_row = first_row + pool->stripe_rows;
+        if (last_row > pool->rows)
+            last_row = pool->rows;
+
+        pool->stage(pool->arg, worker->id, first_row, last_row);
+
+        worker->stripes++;
+        if (stolen)
+            worker->stolen++;
+
+        if (atomic_fetch_sub(&pool->remaining, 1) == 1) {
+            pthread_mutex_lock(&pool->lock);
+            pthread_cond_signal(&pool->done);
+            pthread_mutex_unlock(&pool->lock);
+        }
+    }
+}
+
+static void* v4l2_worker_pool_thread(void* arg)
+{
+    struct v4l2_worker_pool_worker* worker = arg;
+    struct v4l2_worker_pool* pool = worker->pool;
+    uint64_t generation = 0;
+
+    v4l2_sched_apply(pool->name, pool->cpus, 0);
+
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        while (!pool->stop && pool->generation == generation)
+            pthread_cond_wait(&pool->start, &pool->lock);
+        generation = pool->generation;
+        if (pool->stop) {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        v4l2_worker_pool_work(pool, worker);
+    }
+
+    return NULL;
+}
@@ -0,0 +1,97 @@
+/* SPDX-License-Identifier: MIT */
+/**
+ * @file v4l2-worker-pool.h
+ *
+ * Pool of threads running a stage function on row stripes of one frame at a time.
+ * Stripes are dealt out evenly to all workers up front, a worker which runs out
+ * of its own ones steals from the back of the others' ranges, so that a stripe
+ * slower than the rest (or a worker preempted) does not hold the frame back.
+ * The thread calling v4l2_worker_pool_run() takes part as worker 0 and returns
+ * once all stripes are done, hence frames come out in the order they went in.
+ */
+
+#ifndef _V4L2_WORKER_POOL_H_
+#define _V4L2_WORKER_POOL_H_
+
+/*===========================================================================*\
+ * system header files
+\*===========================================================================*/
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <pthread.h>
+
+/*===========================================================================*\
+ * project header files
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * preprocessor #define constants and macros
+\*===========================================================================*/
+#define V4L2_WORKER_POOL_MAX_WORKERS 64 /* including the thread calling v4l2_worker_pool_run() */
+
+/*===========================================================================*\
+ * global type definitions
+\*===========================================================================*/
+
+/* processes rows [first_row, last_row) of the current frame, worker tells which thread it runs on */
+typedef void (*v4l2_worker_pool_stage_t)(void* arg, unsigned worker, unsigned first_row, unsigned last_row);
+
+struct v4l2_worker_pool_worker
+{
+    _Alignas(64) _Atomic uint64_t range; /* stripes left: first one in low, end in high 32 bits */
+    struct v4l2_worker_pool* pool;
+    unsigned id;
+    pthread_t thread;
+    uint64_t stripes;                   /* done by this worker */
+    uint64_t stolen;                    /* ... out of them taken from other workers */
+};
+
+struct v4l2_worker_pool
+{
+    unsigned number_of_workers;         /* including the thread calling v4l2_worker_pool_run() */
+    struct v4l2_worker_pool_worker* workers;
+    const cpu_set_t* cpus;              /* threads of the pool run on, NULL: anywhere */
+    const char* name;
+    pthread_mutex_t lock;
+    pthread_cond_t start;               /* a frame is there to process, or stop is set */
+    pthread_cond_t done;                /* the last stripe of the frame is done */
+    uint64_t generation;                /* frames handed to the workers so far, under lock */
+    bool stop;                          /* under lock */
+    v4l2_worker_pool_stage_t stage;     /* of the current frame */
+    void* arg;
+    unsigned rows;
+    unsigned stripe_rows;
+    _Atomic unsigned remaining;         /* stripes of the current frame not done yet */
+    uint64_t frames;
+};
+
+/*===========================================================================*\
+ * global object declarations
+\*===========================================================================*/
+
+/*===========================================================================*\
+ * function forward declarations
+\*===========================================================================*/
+
+/**
+ * Starts number_of_workers - 1 threads (the caller of v4l2_worker_pool_run() being
+ * the remaining one), pinned to cpus if not NULL. Returns 0 on success, -1 on failure.
+ */
+int v4l2_worker_pool_init(struct v4l2_worker_pool* pool, const char* name, unsigned number_of_workers,
+    const cpu_set_t* cpus);
+
+void v4l2_worker_pool_destroy(struct v4l2_worker_pool* pool);
+
+/**
+ * Runs stage on all rows of a frame, in stripes of stripe_rows rows (the last one may be shorter),
+ * and returns when all of them are done. Not to be called by more than one thread at a time.
+ */
+void v4l2_worker_pool_run(struct v4l2_worker_pool* pool, v4l2_worker_pool_stage_t stage, void* arg,
+    unsigned rows, unsigned stripe_rows);
+
+/** Prints one line summary of how stripes were spread over workers */
+void v4l2_worker_pool_print_stats(const char* name, const struct v4l2_worker_pool* pool);
+
+#endif /* _V4L2_WORKER_POOL_H_ */